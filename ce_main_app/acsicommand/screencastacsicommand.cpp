@@ -38,6 +38,9 @@ void ScreencastAcsiCommand::processCommand(BYTE *command)
         case TRAN_CMD_SCREENCASTPALETTE:                    // ST sends screen buffer
             readPalette();
             break;
+        case TRAN_CMD_SENDSCREENCAST_DELTA:              // ST sends changes since previous frame
+            readScreenDelta();
+            break;
     }
 
     //>dataTrans->sendDataAndStatus();         // send all the stuff after handling, if we got any
@@ -147,3 +150,51 @@ void ScreencastAcsiCommand::readPalette()
     dataTrans->setStatus(RW_ALL_TRANSFERED);                    // when all the data was written
     
 }
+
+// Payload format is in screencastdelta.h. When the delta doesn't fit the frame we have (lost frame, CE restarted),
+// status is E_CHNG and the ST should send keyframe next time.
+void ScreencastAcsiCommand::readScreenDelta()
+{
+    BYTE iScreenmode        = cmd[5];
+    DWORD byteCount         = get24bits(cmd + 6);
+    Debug::out(LOG_DEBUG, "ScreencastAcsiCommand::processCommand TRAN_CMD_SENDSCREENCAST_DELTA screenmode %d, bytes %d", iScreenmode, byteCount);
+
+    if(iScreenmode > 2) {                                       // unknown screenmode?
+        dataTrans->setStatus(E_NOTHANDLED);
+        return;
+    }
+
+    if(byteCount > SCDELTA_MAX_PAYLOAD) {                       // more than keyframe with palette? fail!
+        Debug::out(LOG_DEBUG, "ScreencastAcsiCommand::processCommand delta too big %d", byteCount);
+        dataTrans->setStatus(EINTRN);
+        return;
+    }
+
+    DWORD transferSizeBytes = (byteCount + 15) & ~15;           // ST sends multiple of 16 bytes
+
+    if(!dataTrans->recvData(dataBuffer, transferSizeBytes)) {   // failed to get data? internal error!
+        dataTrans->setStatus(EINTRN);
+        return;
+    }
+
+    int res = deltaDecoder.apply(dataBuffer, byteCount);
+
+    if(res == SCDELTA_ERR_NOBASE) {
+        Debug::out(LOG_DEBUG, "ScreencastAcsiCommand::readScreenDelta - no base frame for delta, keyframe needed");
+        dataTrans->setStatus(E_CHNG);
+        return;
+    }
+
+    if(res != SCDELTA_OK) {
+        Debug::out(LOG_DEBUG, "ScreencastAcsiCommand::readScreenDelta - bad delta payload");
+        deltaDecoder.reset();                                   // don't build on anything sent before the broken payload
+        dataTrans->setStatus(EBADRQ);
+        return;
+    }
+
+    screencastService->setSTResolution(iScreenmode);
+
+    screencastService->setFrame(deltaDecoder.getScreen(), deltaDecoder.gotPalette() ? deltaDecoder.getPalette() : NULL);
+
+    dataTrans->setStatus(RW_ALL_TRANSFERED);                    // when all the data was written
+}
@@ -3,6 +3,7 @@
 
 #include "../acsidatatrans.h" 
 #include "service/screencastservice.h"
+#include "service/screencastdelta.h"
 
 class ScreencastAcsiCommand
 {
@@ -13,10 +14,12 @@ public:
 private:
     void readScreen();
     void readPalette();
+    void readScreenDelta();
 	DWORD get24bits(BYTE *bfr);
   	AcsiDataTrans       *dataTrans;
     ScreencastService   *screencastService;
   	BYTE    *cmd;
 	BYTE	*dataBuffer; 
+    ScreencastDeltaDecoder  deltaDecoder;       // frame made from the deltas so far
 };
 #endif                
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <time.h>
 
 #include "debug.h"
+#include "trace.h"
 #include "utils.h"
 #include "gpio.h"
 #include "acsidatatrans.h"
@@ -209,7 +210,7 @@ void AcsiDataTrans::sendDataAndStatus(bool fromRetryModule)
         // ACSI READ - send (write) data to other side, and also status
         count = sockByteCount;
 
-        Debug::out(LOG_DEBUG, "sendDataAndStatus: %d bytes status: %02x (%d)", count, status, statusWasSet);
+        TRACE(LOG_DEBUG, "sendDataAndStatus: %d bytes status: %02x (%d)", count, status, statusWasSet);
 
 //        Debug::out(LOG_ERROR, "AcsiDataTrans::sendDataAndStatus -- sending %d bytes and status %02x", count, status);
 //        Debug::out(LOG_DEBUG, "AcsiDataTrans::sendDataAndStatus -- %02x %02x %02x %02x %02x %02x %02x %02x ", buffer[0], buffer[1], buffer[2], buffer[3], buffer[4], buffer[5], buffer[6], buffer[7]);
@@ -227,35 +228,8 @@ void AcsiDataTrans::sendDataAndStatus(bool fromRetryModule)
 #endif
 	//---------------------------------------
 	if(dumpNextData) {
-		Debug::out(LOG_DEBUG, "sendDataAndStatus: %d bytes", count);
-		BYTE *src = buffer;
-
-		WORD dumpCnt = 0;
-		
-		int lines = count / 32;
-		if((count % 32) != 0) {
-			lines++;
-		}
-	
-		for(int i=0; i<lines; i++) {
-			char bfr[1024];
-			char *b = &bfr[0];
-
-			for(int j=0; j<32; j++) {
-				int val = (int) *src;
-				src++;
-				sprintf(b, "%02x ", val);
-				b += 3;
-				
-				dumpCnt++;
-				if(dumpCnt >= count) {
-					break;
-				}
-			}
-
-			Debug::out(LOG_DEBUG, "%s", bfr);
-		}
-		
+		TRACE(LOG_DEBUG, "sendDataAndStatus: %d bytes", count);
+		TRACE_BFR(LOG_DEBUG, buffer, count);
 		dumpNextData = false;
 	}
 	//---------------------------------------
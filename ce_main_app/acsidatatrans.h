@@ -43,7 +43,7 @@ class AcsiDataTrans
 {
 public:
     AcsiDataTrans();
-    ~AcsiDataTrans();
+    virtual ~AcsiDataTrans();
 
     void setCommunicationObject(CConSpi *comIn);
     void setRetryObject(RetryModule *retryModule);
@@ -67,8 +67,9 @@ public:
 
     void padDataToMul16(void);
 
-    bool recvData(BYTE *data, DWORD cnt);
-    void sendDataAndStatus(bool fromRetryModule = false);       // by default it's not a retry
+    // virtual, so these can be replaced when testing the host modules without Hans
+    virtual bool recvData(BYTE *data, DWORD cnt);
+    virtual void sendDataAndStatus(bool fromRetryModule = false);       // by default it's not a retry
     void sendDataToFd(int fd);
 
     void dumpDataOnce(void);
@@ -86,7 +87,7 @@ public:
 
     void sendStatusToHans       (BYTE statusByte);
 
-private:
+protected:
     BYTE    *buffer;
     DWORD   count;
     BYTE    status;
@@ -94,6 +95,7 @@ private:
     bool    statusWasSet;
     int     dataDirection;
 
+private:
     CConSpi     *com;
     RetryModule *retryMod;
 
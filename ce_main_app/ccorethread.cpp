@@ -1059,24 +1059,35 @@ void CCoreThread::handleSendTrack(void)
 
     int remaining   = 15000 - (4*2) - 2;        // this much bytes remain to send after the received ATN
 
-    int tr, si, spt;
-    floppyImageSilo.getParams(tr, si, spt);      // read the floppy image params
+    // get reference to current encoded image - it's never modified, so we can stream from it without copying or holding a lock
+    MfmCachedImage *encImage = floppyImageSilo.acquireCurrentImage();
+
+    int tr = 0, si = 0, spt = 0;
+    if(encImage) {
+        encImage->getParams(tr, si, spt);       // read the floppy image params
+    }
 
     Debug::out(LOG_DEBUG, "ATN_SEND_TRACK -- Franz wants: [track %d, side %d]. Current image has: [track %d, side %d, sectors/track: %d]", track, side, tr, si, spt);
 
-    BYTE *encodedTrack;
+    BYTE *encodedTrack = NULL;
     int countInTrack;
 
     if(side < 0 || side > 1 || track < 0 || track >= tr) {      // side / track out of range? use empty track
         Debug::out(LOG_ERROR, "Side / Track out of range, returning empty track. Franz wants: [track %d, side %d], but current image has only: [track %d, side %d, sectors/track: %d]", track, side, tr, si, spt);
+    } else {                                                    // side + track within range? use encoded track
+        encodedTrack = encImage->getEncodedTrack(track, side, countInTrack);
+    }
 
+    if(encodedTrack == NULL) {                                  // no track? use empty track
         encodedTrack = floppyImageSilo.getEmptyTrack();
-    } else {                                                    // side + track within range? use encoded track
-        encodedTrack = floppyImageSilo.getEncodedTrack(track, side, countInTrack);
     }
 
     conSpi->txRx(SPI_CS_FRANZ, remaining, encodedTrack, iBuf);
 
+    if(encImage) {                                              // done with streaming, release the image
+        encImage->release();
+    }
+
     // now we should do some buzzing because of floppy seek
     if(prevTrack != track) {                        // track changed?
         int trackDiff = abs(prevTrack - track);     // get how many tracks we've moved
@@ -1095,15 +1106,7 @@ void CCoreThread::handleSectorWritten(void)
     WORD remainingSize = conSpi->getRemainingLength();              // get how many data we still have
     conSpi->txRx(SPI_CS_FRANZ, remainingSize, oBuf, iBuf);          // get all the remaining data
 
-    // get the written sector, side, track number
-    int sector  = iBuf[0];
-    int track   = iBuf[1] & 0x7f;
-    int side    = (iBuf[1] & 0x80) ? 1 : 0;
-
-    Debug::out(LOG_DEBUG, "handleSectorWritten -- track %d, side %d, sector %d -- TODO!!!", track, side, sector);
-
-    // TODO:
-    // do the written sector processing
+    floppyImageSilo.sectorWritten(iBuf, remainingSize);             // decode, apply to image and re-encode track in encoder thread
 }
 
 void CCoreThread::handleRecoveryCommands(int recoveryLevel)
@@ -1175,7 +1178,7 @@ void CCoreThread::insertSpecialFloppyImage(int specialImageId)
 void CCoreThread::deleteSettingAndSetNetworkToDhcp(void)
 {
     // delete settings
-    system("rm -f /ce/settings/*");
+    Settings::resetAll();
 
     // get the network settings
     NetworkSettings ns;
@@ -1979,7 +1979,7 @@ void ConfigStream::onResetSettings(void)
 
     showMessageScreen("Reset all settings", "All settings have been reset to default.\n\rReseting your ST might be a good idea...");
 
-    system("rm -f /ce/settings/*");
+    Settings::resetAll();
     Utils::forceSync();                                     // tell system to flush the filesystem caches
 }
 
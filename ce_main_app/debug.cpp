@@ -2,13 +2,30 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 
 #include "global.h"
 #include "debug.h"
 #include "utils.h"
 
 #define LOG_FILE        "/var/log/ce.log"
+
+#define DEBUG_RING_SLOTS        1024                    // lines waiting for writer thread, must be power of 2
+#define DEBUG_RING_MASK         (DEBUG_RING_SLOTS - 1)
+#define DEBUG_LINE_SIZE         512                     // longer lines are cut
+#define DEBUG_WRITE_BATCH       (64 * 1024)             // writer thread writes at most this much at once
+#define DEBUG_WRITER_IDLE_MS    10                      // when there's nothing to write, writer thread checks again after this
+#define DEBUG_FULL_WAIT_MS      50                      // ring is full - wait this long for writer thread, then drop the line
+
 DWORD prevLogOut;
 
 extern TFlags   flags;
@@ -16,7 +33,136 @@ extern TFlags   flags;
 
 DebugVars dbgVars;
 
-char Debug::logFilePath[128];
+char           Debug::logFilePath[128];
+volatile DWORD Debug::logFilePathSeq;
+DWORD          Debug::maxLogSize = DEBUG_MAX_LOG_SIZE;
+
+static pthread_mutex_t logFileMutex = PTHREAD_MUTEX_INITIALIZER;   // only between setLogFile() calls, readers just check logFilePathSeq
+
+typedef struct {
+    volatile DWORD  sequence;           // == line number: slot is free for that line, == line number + 1: line is ready for writer
+    DWORD           ms;
+    struct timeval  tv;
+    BYTE            plain;              // just the text, without time (outBfr() rows)
+    BYTE            acsiError;          // LOG_ERROR while handling ACSI command
+    DWORD           sinceAcsiCmd;
+    DWORD           betweenAcsiCmds;
+    char            text[DEBUG_LINE_SIZE];
+} TLogLine;
+
+// lines go from any thread to writer thread through this ring - multiple producers, single consumer, without locks
+static TLogLine         logRing[DEBUG_RING_SLOTS];
+static volatile DWORD   logTail;        // next line number for Debug::out()
+static volatile DWORD   logHead;        // next line number for writer thread
+static volatile DWORD   logWritten;     // lines before this one are written to file
+static volatile DWORD   logDropped;     // lines lost because the ring was full
+static volatile DWORD   logStuckHead = (DWORD) -1;  // logHead when the last line was dropped - writer didn't move since? don't wait again
+static volatile bool    writerRunning;
+static volatile bool    writerShouldStop;
+static pthread_t        writerThread;
+static pthread_once_t   writerOnce = PTHREAD_ONCE_INIT;
+static int              wakePipe[2] = { -1, -1 };  // to wake up writer thread when the ring gets full
+
+static void wakeWriter(void)
+{
+    if(write(wakePipe[1], "w", 1) != 1) {           // pipe is full? writer will wake up anyway
+        return;
+    }
+}
+
+// returns NULL when the ring stays full - writer thread can be stuck on the log file, and logging must never hang the caller
+static TLogLine *claimLine(DWORD &lineNo)
+{
+    DWORD waitStart = 0;
+    bool  waiting   = false;
+
+    while(true) {
+        lineNo = logTail;
+        TLogLine *line = &logRing[lineNo & DEBUG_RING_MASK];
+        int diff = (int) (line->sequence - lineNo);
+
+        if(diff == 0) {                                 // slot is free? try to get it
+            if(__sync_bool_compare_and_swap(&logTail, lineNo, lineNo + 1)) {
+                return line;
+            }
+        } else if(diff < 0) {                           // ring is full? give writer thread a while, then drop the line
+            DWORD now = Utils::getCurrentMs();
+
+            if(!waiting) {
+                waiting   = true;
+                waitStart = now;
+            }
+
+            if(logHead == logStuckHead || now - waitStart > DEBUG_FULL_WAIT_MS) {
+                logStuckHead = logHead;
+                __sync_fetch_and_add(&logDropped, 1);
+                return NULL;
+            }
+
+            wakeWriter();
+            sched_yield();
+        }
+    }
+}
+
+static void publishLine(TLogLine *line, DWORD lineNo)
+{
+    __sync_synchronize();                               // line content first, then the sequence
+    line->sequence = lineNo + 1;
+
+    if(lineNo - logHead == DEBUG_RING_SLOTS / 2) {      // ring is getting full? don't let writer sleep
+        wakeWriter();
+    }
+}
+
+static int formatLine(TLogLine *line, char *out, int size, bool toConsole)
+{
+    int len;
+
+    if(line->plain) {
+        len = snprintf(out, size, "%s\n", line->text);
+    } else if(toConsole) {
+        len = snprintf(out, size, "%08d: %s\n", line->ms, line->text);
+    } else {
+        static time_t cachedSec = -1;                   // date and time changes once per second, don't convert it for each line
+        static char   cachedTime[32];
+
+        if(line->tv.tv_sec != cachedSec) {
+            struct tm tm;
+            localtime_r(&line->tv.tv_sec, &tm);
+            strftime(cachedTime, sizeof(cachedTime), "%Y-%m-%d %H:%M:%S", &tm);
+            cachedSec = line->tv.tv_sec;
+        }
+
+        DWORD diff = line->ms - prevLogOut;
+        prevLogOut = line->ms;
+
+        len = 0;
+        if(line->acsiError) {                           // it's an error, and we're debugging ACSI stuff
+            len += snprintf(out, size, "%08d %08d (%s.%06ld)\n     LOG_ERROR occurred\n     Time since beginning of ACSI command handling: %d\n     Time between this and previous ACSI command  : %d\n",
+                            line->ms, diff, cachedTime, (long) line->tv.tv_usec, line->sinceAcsiCmd, line->betweenAcsiCmds);
+        }
+
+        // CLOCK in ms, diff in ms, date/time in human readable format
+        len += snprintf(out + len, size - len, "%08d %08d (%s.%06ld)\t%s\n", line->ms, diff, cachedTime, (long) line->tv.tv_usec, line->text);
+    }
+
+    return MIN(len, size - 1);                          // snprintf() returns length which it would have without cutting
+}
+
+static void writeAll(int fd, const char *bfr, int len)
+{
+    while(len > 0) {
+        int res = write(fd, bfr, len);
+
+        if(res <= 0) {                                  // failed? nothing we can do, not even log it
+            return;
+        }
+
+        bfr += res;
+        len -= res;
+    }
+}
 
 void Debug::setOutputToConsole(void)
 {
@@ -30,7 +176,216 @@ void Debug::setDefaultLogFile(void)
 
 void Debug::setLogFile(const char *path)
 {
-    strcpy(Debug::logFilePath, path);
+    pthread_mutex_lock(&logFileMutex);
+
+    logFilePathSeq++;                                   // odd - readers will try again
+    __sync_synchronize();
+    strncpy(logFilePath, path, sizeof(logFilePath) - 1);
+    logFilePath[sizeof(logFilePath) - 1] = 0;
+    __sync_synchronize();
+    logFilePathSeq++;                                   // even again - writer thread will reopen the file
+
+    pthread_mutex_unlock(&logFileMutex);
+}
+
+// path must hold 128 chars; fails only when setLogFile() keeps changing the path (or was interrupted by signal handler calling this)
+bool Debug::copyLogFilePath(char *path)
+{
+    for(int tries=0; tries<100; tries++) {
+        DWORD seq = logFilePathSeq;
+        __sync_synchronize();
+
+        if((seq & 1) == 0) {
+            memcpy(path, logFilePath, sizeof(logFilePath));
+            path[sizeof(logFilePath) - 1] = 0;
+
+            __sync_synchronize();
+            if(logFilePathSeq == seq) {
+                return true;
+            }
+        }
+
+        sched_yield();
+    }
+
+    path[0] = 0;
+    return false;
+}
+
+const char *Debug::getLogFile(void)
+{
+    return logFilePath;
+}
+
+void Debug::setMaxLogSize(DWORD bytes)
+{
+    maxLogSize = bytes;
+}
+
+DWORD Debug::getDroppedLines(void)
+{
+    return logDropped;
+}
+
+void Debug::startWriterOnce(void)
+{
+    for(int i=0; i<DEBUG_RING_SLOTS; i++) {
+        logRing[i].sequence = i;
+    }
+
+    writerShouldStop = false;
+
+    if(pipe(wakePipe) != 0) {                           // no pipe? log the old way
+        return;
+    }
+    fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+
+    if(pthread_create(&writerThread, NULL, writerThreadCode, NULL) != 0) {     // can't start? will log the old way
+        return;
+    }
+
+    writerRunning = true;
+    atexit(Debug::stop);                                // don't lose the last lines
+}
+
+bool Debug::startWriter(void)
+{
+    pthread_once(&writerOnce, startWriterOnce);
+    return writerRunning;
+}
+
+void Debug::flush(void)
+{
+    DWORD lastLine = logTail;
+    DWORD start    = Utils::getCurrentMs();
+
+    while(writerRunning && (int) (logWritten - lastLine) < 0) {
+        if(Utils::getCurrentMs() - start > 5000) {      // writer thread stuck? don't wait forever
+            break;
+        }
+        Utils::sleepMs(1);
+    }
+}
+
+void Debug::stop(void)
+{
+    if(!writerRunning) {
+        return;
+    }
+
+    writerRunning       = false;                        // new lines will be written directly
+    writerShouldStop    = true;
+    wakeWriter();
+    pthread_join(writerThread, NULL);
+}
+
+void *Debug::writerThreadCode(void *ptr)
+{
+    static char batch[DEBUG_WRITE_BATCH];
+
+    sigset_t signals;                                   // signal handler logs too - it must not wait for this thread
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    char  openPath[128] = "";
+    DWORD openSeq       = (DWORD) -1;
+    int   fd            = -1;
+    DWORD fileSize      = 0;
+    DWORD droppedShown  = 0;
+
+    while(true) {
+        DWORD seq = logFilePathSeq;
+        char  path[128];
+
+        if(seq != openSeq && copyLogFilePath(path)) {   // log file changed (or not opened yet)? if it's being changed right now, next round
+            openSeq = seq;
+
+            if(strcmp(openPath, path) != 0) {
+                if(fd != -1) {
+                    close(fd);
+                }
+
+                strcpy(openPath, path);
+                fd = open(openPath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+                struct stat st;
+                fileSize = (fd != -1 && fstat(fd, &st) == 0) ? st.st_size : 0;
+            }
+        }
+
+        // get as many lines as fit in the batch
+        int len = 0;
+        int lines = 0;
+
+        DWORD dropped = logDropped;
+        if(dropped != droppedShown) {                   // tell that some lines are missing, right where they were lost
+            len += snprintf(batch, DEBUG_LINE_SIZE, "--- %d log lines dropped, log ring was full ---\n", (int) (dropped - droppedShown));
+            droppedShown = dropped;
+            lines++;
+        }
+
+        while(len < DEBUG_WRITE_BATCH - 2 * DEBUG_LINE_SIZE) {
+            TLogLine *line = &logRing[logHead & DEBUG_RING_MASK];
+
+            if(line->sequence != logHead + 1) {         // next line not ready yet?
+                break;
+            }
+
+            __sync_synchronize();                       // sequence first, then the line content
+            len += formatLine(line, batch + len, DEBUG_WRITE_BATCH - len, fd == -1);
+
+            __sync_synchronize();
+            line->sequence = logHead + DEBUG_RING_SLOTS;    // slot is free for the line one round later
+            logHead++;
+            lines++;
+        }
+
+        if(lines == 0) {
+            if(logHead != logTail) {                    // some thread is just storing the next line? it will be ready soon
+                sched_yield();
+                continue;
+            }
+
+            if(writerShouldStop) {                      // nothing more and should stop? done
+                break;
+            }
+
+            struct pollfd pfd;                          // wait till some lines come, or till the ring gets half full
+            pfd.fd      = wakePipe[0];
+            pfd.events  = POLLIN;
+            poll(&pfd, 1, DEBUG_WRITER_IDLE_MS);
+
+            char tmp[64];
+            while(read(wakePipe[0], tmp, sizeof(tmp)) > 0) {   // just empty the pipe
+            }
+            continue;
+        }
+
+        if(fd == -1) {                                  // can't open log file? to console then
+            writeAll(STDOUT_FILENO, batch, len);
+        } else {
+            writeAll(fd, batch, len);
+            fileSize += len;
+
+            if(fileSize > maxLogSize) {                 // too big? keep it as .1 and start new one
+                char oldPath[140];
+                snprintf(oldPath, sizeof(oldPath), "%s.1", openPath);
+
+                close(fd);
+                rename(openPath, oldPath);
+                fd          = open(openPath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+                fileSize    = 0;
+            }
+        }
+
+        logWritten = logHead;
+    }
+
+    if(fd != -1) {
+        close(fd);
+    }
+    return 0;
 }
 
 void Debug::printfLogLevelString(void)
@@ -57,18 +412,60 @@ void Debug::out(int logLevel, const char *format, ...)
     va_list args;
     va_start(args, format);
 
-    FILE *f;
+    if(g_outToConsole) {                    // should log to console? write it right away
+        printf("%08d: ", Utils::getCurrentMs());
+        vprintf(format, args);
+        printf("\n");
+
+        va_end(args);
+        return;
+    }
+
+    if(!startWriter()) {                    // no writer thread? write it directly
+        char text[DEBUG_LINE_SIZE];
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+
+        outDirect(logLevel, text);
+        return;
+    }
+
+    DWORD     lineNo;
+    TLogLine *line = claimLine(lineNo);
 
-    if(g_outToConsole) {                    // should log to console? f is null
-        f = NULL;
-    } else {                                // log to file? open the file
-        f = fopen(logFilePath, "a+t");
+    if(!line) {                             // ring full for too long? the line is lost, writer thread will tell how many
+        va_end(args);
+        return;
+    }
+
+    line->ms    = Utils::getCurrentMs();
+    line->plain = 0;
+
+    if(gettimeofday(&line->tv, NULL) < 0) {
+        memset(&line->tv, 0, sizeof(line->tv)); // failure
+    }
+
+    line->acsiError = (logLevel == LOG_ERROR && dbgVars.isInHandleAcsiCommand);
+    if(line->acsiError) {
+        line->sinceAcsiCmd      = line->ms - dbgVars.thisAcsiCmdTime;
+        line->betweenAcsiCmds   = dbgVars.thisAcsiCmdTime - dbgVars.prevAcsiCmdTime;
     }
 
+    vsnprintf(line->text, DEBUG_LINE_SIZE, format, args);
+    va_end(args);
+
+    publishLine(line, lineNo);
+}
+
+void Debug::outDirect(int logLevel, const char *line)
+{
+    char path[128];
+    copyLogFilePath(path);
+
+    FILE *f = fopen(path, "a+t");
+
     if(!f) {
-        printf("%08d: ", Utils::getCurrentMs());
-        vprintf(format, args);
-        printf("\n");
+        printf("%08d: %s\n", Utils::getCurrentMs(), line);
         return;
     }
 
@@ -92,28 +489,77 @@ void Debug::out(int logLevel, const char *format, ...)
         fprintf(f, "     Time between this and previous ACSI command  : %d\n", dbgVars.thisAcsiCmdTime - dbgVars.prevAcsiCmdTime);
     }
 
-    fprintf(f, "%08d %08d (%s)\t", now, diff, humanTime); // CLOCK in ms, diff in ms, date/time in human readable format
-
-    vfprintf(f, format, args);
-    fprintf(f, "\n");
+    fprintf(f, "%08d %08d (%s)\t%s\n", now, diff, humanTime, line); // CLOCK in ms, diff in ms, date/time in human readable format
     fclose(f);
+}
 
-    va_end(args);
+// Signal handler can interrupt a thread in the middle of Debug::out(), or the writer thread while the ring is full,
+// so it doesn't touch the ring or any lock - just one write() to the log file. The line can get before lines still in the ring.
+void Debug::outSignal(int logLevel, const char *text)
+{
+    if(logLevel > flags.logLevel) {
+        return;
+    }
+
+    char line[DEBUG_LINE_SIZE];
+    int  len = snprintf(line, sizeof(line), "%08d %08d (signal)\t%s\n", Utils::getCurrentMs(), 0, text);
+    len = MIN(len, (int) sizeof(line) - 1);
+
+    char path[128];
+    int  fd = -1;
+
+    if(!g_outToConsole && copyLogFilePath(path)) {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK, 0644);
+    }
+
+    if(fd == -1) {
+        writeAll(STDOUT_FILENO, line, len);
+        return;
+    }
+
+    writeAll(fd, line, len);
+    close(fd);
 }
 
-void Debug::outBfr(BYTE *bfr, int count)
+void Debug::outBfrLine(const char *text)
 {
-    if(flags.logLevel < LOG_DEBUG) {            // if we're not in debug log level, don't do this
+    if(!startWriter()) {                    // no writer thread? append it directly
+        char path[128];
+        copyLogFilePath(path);
+
+        FILE *f = fopen(path, "a+t");
+        if(f) {
+            fprintf(f, "%s\n", text);
+            fclose(f);
+        }
         return;
     }
 
-    FILE *f = fopen(logFilePath, "a+t");
+    DWORD     lineNo;
+    TLogLine *line = claimLine(lineNo);
 
-    if(!f) {
+    if(!line) {
         return;
     }
 
-    fprintf(f, "%08d: outBfr - %d bytes\n", Utils::getCurrentMs(), count);
+    line->ms        = Utils::getCurrentMs();
+    line->plain     = 1;
+    line->acsiError = 0;
+    strncpy(line->text, text, DEBUG_LINE_SIZE - 1);
+    line->text[DEBUG_LINE_SIZE - 1] = 0;
+
+    publishLine(line, lineNo);
+}
+
+void Debug::outBfr(BYTE *bfr, int count)
+{
+    if(flags.logLevel < LOG_DEBUG) {            // if we're not in debug log level, don't do this
+        return;
+    }
+
+    char text[128];
+    sprintf(text, "%08d: outBfr - %d bytes", Utils::getCurrentMs(), count);
+    outBfrLine(text);
 
     int i, j;
 
@@ -121,33 +567,29 @@ void Debug::outBfr(BYTE *bfr, int count)
 
     for(i=0; i<rows; i++) {
         int ofs = i * 16;
-        fprintf(f, "        ");//some indentation
+        int len = sprintf(text, "        ");    //some indentation
 
         for(j=0; j<16; j++) {
             if((ofs + j) < count) {
-                fprintf(f, "%02x ", bfr[ofs + j]);
+                len += sprintf(text + len, "%02x ", bfr[ofs + j]);
             } else {
-                fprintf(f, "   ");
+                len += sprintf(text + len, "   ");
             }
         }
 
-        fprintf(f, "| ");
+        len += sprintf(text + len, "| ");
 
         for(j=0; j<16; j++) {
             char v = bfr[ofs + j];
             v = (v >= 32 && v <= 126) ? v : '.';
 
             if((ofs + j) < count) {
-                fprintf(f, "%c", v);
+                len += sprintf(text + len, "%c", v);
             } else {
-                fprintf(f, " ");
+                len += sprintf(text + len, " ");
             }
         }
 
-        fprintf(f, "\n");
+        outBfrLine(text);
     }
-
-    //fprintf(f, "\n");
-    fclose(f);
 }
-
@@ -8,12 +8,15 @@
 #define LOG_ERROR       2       // errors       - should be always visible, even to users
 #define LOG_DEBUG       3       // debug info   - useful only to developers
 
+#define DEBUG_MAX_LOG_SIZE  (8 * 1024 * 1024)   // when log file gets bigger, it's renamed to .1 and new one is started
+
 typedef struct {
     BYTE    isInHandleAcsiCommand;
     DWORD   prevAcsiCmdTime;
-    DWORD   thisAcsiCmdTime;   
+    DWORD   thisAcsiCmdTime;
 } DebugVars;
 
+// Debug::out() just formats the line into ring buffer, log writer thread writes the lines to log file in batches.
 class Debug
 {
 public:
@@ -21,13 +24,31 @@ public:
 	static void outBfr(BYTE *bfr, int count);
 
     static void printfLogLevelString(void);
-    
+
     static void setOutputToConsole(void);
     static void setDefaultLogFile(void);
     static void setLogFile(const char *path);
-    
-private:    
-    static char logFilePath[128];
+    static const char *getLogFile(void);
+    static void setMaxLogSize(DWORD bytes);
+
+    static void flush(void);                // wait until everything logged so far is written to file
+    static void stop(void);                 // write the rest and stop the writer thread, log directly from now on
+
+    static void  outSignal(int logLevel, const char *text);     // for signal handlers - appends to log file right away, never waits
+    static DWORD getDroppedLines(void);     // lines which didn't fit in full ring
+
+private:
+    static char  logFilePath[128];
+    static volatile DWORD logFilePathSeq;   // odd while setLogFile() changes the path
+    static DWORD maxLogSize;
+
+    static bool  copyLogFilePath(char *path);
+
+    static bool  startWriter(void);
+    static void  startWriterOnce(void);
+    static void *writerThreadCode(void *ptr);
+    static void  outDirect(int logLevel, const char *line);    // old way - open, write, close
+    static void  outBfrLine(const char *text);
 };
 
 #endif
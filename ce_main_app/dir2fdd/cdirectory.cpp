@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <map>
 
 #include "cfloppy.h"
 #include "cdirentry.h"
@@ -88,7 +89,9 @@ void CDirectory::DirectoryScan(const char *pDir)
     closedir(dir);	
 }
 
-bool CDirectory::dir2fdd(char *sourceDirectory, char *fddImageName)
+static std::map<std::string, CFloppy *> dir2fddImages;         // image name -> floppy with its cluster layout, kept for next updates
+
+bool CDirectory::dir2fdd(char *sourceDirectory, char *fddImageName, std::vector<int> *touchedTracks)
 {
     Debug::out(LOG_INFO, "CDirectory::dir2fdd() -- will try to create %s from %s", fddImageName, sourceDirectory);
     
@@ -99,17 +102,53 @@ bool CDirectory::dir2fdd(char *sourceDirectory, char *fddImageName)
         Debug::out(LOG_ERROR, "CreateTreeFromDirectory failed...");
         return false;
     }
-    
-    CFloppy floppy;
-    floppy.Create(NB_HEAD,NB_SECTOR_PER_TRACK,NB_CYLINDER);
 
-    bool bOk = floppy.Fill( pDir, (char *) "CONF_FDD" );
+    std::map<std::string, CFloppy *>::iterator it = dir2fddImages.find(fddImageName);
+    bool isNew = (it == dir2fddImages.end());
+
+    CFloppy *floppy;
+    bool bOk;
+
+    if(isNew) {                                                 // first time - whole image
+        floppy = new CFloppy();
+        floppy->Create(NB_HEAD,NB_SECTOR_PER_TRACK,NB_CYLINDER);
+        bOk = floppy->Fill( pDir, (char *) "CONF_FDD" );
+    } else {                                                    // image exists - change only what differs
+        floppy = it->second;
+        bOk = floppy->Update(pDir);
+    }
+
+    std::vector<int> touched;
+    floppy->GetTouchedTracks(touched);
+
+    if (bOk && (isNew || !touched.empty())) {
+        Debug::out(LOG_INFO, "CDirectory::dir2fdd() -- Writing file %s, %d tracks changed", fddImageName, (int) touched.size());
+        bOk = floppy->WriteImage(fddImageName);
+    }
+
+    delete pDir;                                                // the floppy keeps just the cluster layout, not the tree
 
-    if (bOk) {
-        Debug::out(LOG_INFO, "CDirectory::dir2fdd() -- Writing file %s", fddImageName);
-        floppy.WriteImage(fddImageName);
+    if(isNew) {
+        if(bOk) {
+            dir2fddImages[fddImageName] = floppy;
+        } else {
+            delete floppy;
+        }
+    }
+
+    if(touchedTracks) {
+        touchedTracks->swap(touched);
     }
 
-    delete pDir;
 	return bOk;
 }
+
+void CDirectory::dir2fddForget(const char *fddImageName)
+{
+    std::map<std::string, CFloppy *>::iterator it = dir2fddImages.find(fddImageName);
+
+    if(it != dir2fddImages.end()) {
+        delete it->second;
+        dir2fddImages.erase(it);
+    }
+}
@@ -1,6 +1,8 @@
 #ifndef _CDIRECTORY_H_
 #define _CDIRECTORY_H_
 
+#include <vector>
+
 #include "cdirentry.h"
 
 class CDirectory
@@ -9,7 +11,10 @@ public:
 	CDirectory();
 	~CDirectory();
 
-    static bool dir2fdd(char *sourceDirectory, char *fddImageName);
+    // the first call for an image builds it whole, next calls rewrite only what changed in the source directory;
+    // touchedTracks (track * 2 + side) then tell which tracks need MFM encoding again
+    static bool dir2fdd(char *sourceDirectory, char *fddImageName, std::vector<int> *touchedTracks=NULL);
+    static void dir2fddForget(const char *fddImageName);   // drop what was remembered about the image, next dir2fdd() builds it whole
     CDirectory *CreateTreeFromDirectory(const char *pHostDirName);
 
     void DirectoryScan(const char *pDir);
@@ -17,7 +17,7 @@ struct	LFN
 	unsigned short	updateTime;
 	unsigned short	updateDate;
 	unsigned short	firstCluster;
-	unsigned long	fileSize;
+	DWORD			fileSize;		// 32 bit also on 64 bit hosts, entry must stay 32 bytes
 };
 
 class CDirEntry
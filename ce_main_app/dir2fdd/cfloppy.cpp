@@ -42,6 +42,9 @@ void CFloppy::Destroy()
 		delete [] m_pFat;
 		m_pFat = NULL;
 	}
+
+	m_chains.clear();
+	m_touchedTracks.clear();
 }
 
 bool CFloppy::Create(int nbSide,int nbSectorPerTrack,int nbCylinder)
@@ -80,11 +83,11 @@ bool CFloppy::Create(int nbSide,int nbSectorPerTrack,int nbCylinder)
 		int nbFsSector      = 1 + SECTOR_PER_FAT * 2 + ROOTDIR_NBSECTOR;
 		int nbDataSector    = nbSide * nbSectorPerTrack * nbCylinder - nbFsSector;
 		m_maxFatEntry       = (nbDataSector / 2);
-		m_nbFreeCluster     = m_maxFatEntry;
-		m_nextCluster       = 2;
         
 		m_pFat              = new int [m_maxFatEntry];
 		memset(m_pFat, 0, m_maxFatEntry * sizeof(int));
+
+		m_touchedTracks.assign(nbSide * nbCylinder, true);		// whole new image has to be encoded
 	}
 
 	return (NULL != m_pRawImage);
@@ -170,6 +173,7 @@ bool CFloppy::WriteImage(const char *pName)
     }
 
     delete [] pTempBuffer;
+    fclose(h);                  // otherwise the end of the image stays in stdio buffer and the file looks truncated
 
     return true;
 }
@@ -192,10 +196,145 @@ void CFloppy::LFNStrCpy(char *pDst,const char *pSrc,int len)
 	}
 }
 
-bool CFloppy::BuildDirectory(LFN *pLFN,CDirectory *pDir,int cluster,int parentCluster,int size,int level)
+int CFloppy::ClustersForEntry(CDirEntry *pEntry)
+{
+	CDirectory *pSubDir = pEntry->GetDirectory();
+
+	if (pSubDir) {
+		return (((pSubDir->GetNbEntry()+2)*32)+1023)/1024;		// nbentry+2 because of "." and ".." directory
+	}
+
+	return (pEntry->fileSize + 1023) / 1024;					// 0 bytes file has no cluster
+}
+
+int CFloppy::CountFreeClusters()
+{
+	int nbFree = 0;
+
+	for (int i=2;i<m_maxFatEntry;i++)
+	{
+		if (m_pFat[i] == 0) {
+			nbFree++;
+		}
+	}
+
+	return nbFree;
+}
+
+int CFloppy::AllocChain(int nbCluster)
+{
+	int first = 0;
+	int prev = 0;
+
+	// first fit - on empty disk this gives the same layout as filling the clusters one after another
+	for (int i=2;(i<m_maxFatEntry) && (nbCluster > 0);i++)
+	{
+		if (m_pFat[i] != 0) {
+			continue;
+		}
+
+		if (prev) {
+			m_pFat[prev] = i;
+		} else {
+			first = i;
+		}
+
+		m_pFat[i] = -1;			// end chain marker, replaced when chain continues
+		prev = i;
+		nbCluster--;
+	}
+
+	return first;
+}
+
+void CFloppy::FreeChain(const ClusterChain &chain)
+{
+	int cluster = chain.firstCluster;
+
+	for (int i=0;(i<chain.nbCluster) && (cluster >= 2) && (cluster < m_maxFatEntry);i++)
+	{
+		int next = m_pFat[cluster];
+		m_pFat[cluster] = 0;
+		cluster = next;
+	}
+}
+
+void CFloppy::WriteRaw(int offset, const unsigned char *pData, int size)
+{
+	// only sectors with different content are written, and their tracks marked for encoding
+	for (int pos=0;pos<size;pos+=512)
+	{
+		int len = (size - pos) < 512 ? (size - pos) : 512;
+
+		if (memcmp(m_pRawImage + offset + pos, pData + pos, len) == 0) {
+			continue;
+		}
+
+		memcpy(m_pRawImage + offset + pos, pData + pos, len);
+
+		int track = ((offset + pos) / 512) / m_nbSectorPerTrack;
+		m_touchedTracks[track] = true;
+	}
+}
+
+void CFloppy::WriteChain(const ClusterChain &chain, const unsigned char *pData, int size)
+{
+	unsigned char block[1024];
+	int cluster = chain.firstCluster;
+
+	for (int i=0;i<chain.nbCluster;i++)
+	{
+		int len = (size - i*1024) < 1024 ? (size - i*1024) : 1024;
+
+		memcpy(block, pData + i*1024, len);
+		memset(block + len, 0xe5, 1024 - len);					// rest of last cluster looks like unused space
+
+		WriteRaw(GetRawAd(cluster) - m_pRawImage, block, 1024);
+		cluster = m_pFat[cluster];
+	}
+}
+
+bool CFloppy::PlanDirectory(CDirectory *pDir, std::vector<CDirEntry *> &toAllocate, int &nbNeeded)
+{
+	CDirEntry *pEntry = pDir->GetFirstEntry();
+	while (pEntry)
+	{
+		int nbCluster = ClustersForEntry(pEntry);
+
+		if (nbCluster > 0)
+		{
+			std::map<std::string, ClusterChain>::iterator it = m_chains.find(pEntry->GetHostName());
+
+			if ((it != m_chains.end()) && (it->second.nbCluster == nbCluster) && !it->second.used)
+			{
+				it->second.used = true;							// same size as before - keep the clusters
+			}
+			else
+			{
+				toAllocate.push_back(pEntry);					// new or resized - needs new clusters
+				nbNeeded += nbCluster;
+			}
+		}
+
+		CDirectory *pSubDir = pEntry->GetDirectory();
+		if (pSubDir && !PlanDirectory(pSubDir, toAllocate, nbNeeded)) {
+			return false;
+		}
+
+		pEntry = pEntry->GetNext();
+	}
+
+	return true;
+}
+
+bool CFloppy::WriteDirectory(CDirectory *pDir,const ClusterChain *pChain,int parentCluster)
 {
-	// clear the directory file
-	memset(pLFN,0,size);
+	// root dir (no chain) is special: there is a reserved space after boot and fats
+	int cluster	= pChain ? pChain->firstCluster : 0;
+	int size	= pChain ? pChain->nbCluster * 1024 : ROOTDIR_NBSECTOR * 512;
+
+	std::vector<unsigned char> dirData(size, 0);
+	LFN *pLFN = (LFN *) &dirData[0];
 
 	if (cluster > 0)
 	{
@@ -203,7 +342,7 @@ bool CFloppy::BuildDirectory(LFN *pLFN,CDirectory *pDir,int cluster,int parentCl
 		memset(pLFN,0,sizeof(LFN));
 		pLFN->attrib = 0x10;			// directory
 		memset(pLFN->sName,0x20,8+3);
-		strcpy(pLFN->sName,".");
+		pLFN->sName[0] = '.';
 		pLFN->firstCluster = cluster;
 		pLFN++;
 
@@ -211,98 +350,66 @@ bool CFloppy::BuildDirectory(LFN *pLFN,CDirectory *pDir,int cluster,int parentCl
 		memset(pLFN,0,sizeof(LFN));
 		pLFN->attrib = 0x10;			// directory
 		memset(pLFN->sName,0x20,8+3);
-		strcpy(pLFN->sName,"..");
+		pLFN->sName[0] = '.';
+		pLFN->sName[1] = '.';
 		pLFN->firstCluster = parentCluster;
 		pLFN++;
-
 	}
 
 	CDirEntry *pEntry = pDir->GetFirstEntry();
 	while (pEntry)
 	{
-		CDirectory *pSubDir = pEntry->GetDirectory();			
-		if (pSubDir)
-		{
-			// reserve space for directory
-			int nbCluster = (((pSubDir->GetNbEntry()+2)*32)+1023)/1024;		// nbentry+2 because of "." and ".." directory
-
-			if (nbCluster > m_nbFreeCluster)
-			{
-				Debug::out(LOG_ERROR, "CFloppy::BuildDirectory: ERROR - No more space on the disk.");
-				return false;
-			}
+		int firstCluster = 0;					// 0 byte file use "0" as first cluster
 
-			int SubDirCluster = m_nextCluster;
-
-			pEntry->LFN_Create(pLFN,SubDirCluster);
-
-			for (int i=0;i<nbCluster-1;i++) {
-				m_pFat[SubDirCluster+i] = SubDirCluster+i+1;
-            }
-
-			m_pFat[SubDirCluster+nbCluster-1] = -1;		// end chain marker
+		std::map<std::string, ClusterChain>::iterator it = m_chains.find(pEntry->GetHostName());
+		if (it != m_chains.end()) {
+			firstCluster = it->second.firstCluster;
+		}
 
-			m_nextCluster += nbCluster;
-			m_nbFreeCluster -= nbCluster;
+		pEntry->LFN_Create(pLFN,firstCluster);
 
-			if (!BuildDirectory((LFN*)GetRawAd(SubDirCluster),pSubDir,SubDirCluster,cluster,nbCluster*1024,level+1))
+		CDirectory *pSubDir = pEntry->GetDirectory();
+		if (pSubDir)
+		{
+			if (!WriteDirectory(pSubDir,&it->second,cluster))
 				return false;
-
 		}
-		else
+		else if (it != m_chains.end())
 		{
-			// create file entry
-			int nbCluster = (pEntry->fileSize + 1023) / 1024;
-
-			if (nbCluster > 0)
+			if (!pEntry->m_pFileData)
 			{
-				if (nbCluster > m_nbFreeCluster)
-				{
-					Debug::out(LOG_ERROR, "CFloppy::BuildDirectory - ERROR: No more space on the disk.");
-					return false;
-				}
-
-				int fileCluster = m_nextCluster;
-				pEntry->LFN_Create(pLFN,fileCluster);
-
-				if ( pEntry->fileSize >= 0 ) {
-					memcpy( GetRawAd(fileCluster), pEntry->m_pFileData, pEntry->fileSize );
-				} else {
-					Debug::out(LOG_ERROR, "CFloppy::BuildDirectory: - ERROR: Could not load host file %s",pEntry->GetHostName());
-					return false;
-				}
-
-				for (int i=0;i<nbCluster-1;i++) {
-					m_pFat[fileCluster+i] = fileCluster+i+1;
-                }
-
-				m_pFat[fileCluster+nbCluster-1] = -1;		// end chain marker
-			} else {                                        // special case for 0 bytes files !!
-				pEntry->LFN_Create(pLFN,0);				    // 0 byte file use "0" as first cluster
+				Debug::out(LOG_ERROR, "CFloppy::WriteDirectory - ERROR: Could not load host file %s",pEntry->GetHostName());
+				return false;
 			}
-            
-			m_nextCluster += nbCluster;
-			m_nbFreeCluster -= nbCluster;
+
+			WriteChain(it->second, (const unsigned char *) pEntry->m_pFileData, pEntry->fileSize);
 		}
 
 		pLFN++;
 		pEntry = pEntry->GetNext();
 	}
+
+	if (pChain) {
+		WriteChain(*pChain, &dirData[0], size);
+	} else {
+		WriteRaw(512 * (1+2*SECTOR_PER_FAT), &dirData[0], size);
+	}
+
 	return true;
 }
 
 void CFloppy::FAT_Flush()
 {
-	unsigned char *pFat = m_pRawImage + 512;
-	memset(pFat,0,SECTOR_PER_FAT*512);
+	unsigned char fat[SECTOR_PER_FAT*512*2];
+	memset(fat,0,SECTOR_PER_FAT*512);
 
 /*    
-	pFat[0] = 0xf7;
-	pFat[1] = 0xff;
-	pFat[2] = 0xff;
+	fat[0] = 0xf7;
+	fat[1] = 0xff;
+	fat[2] = 0xff;
 */
 
-	unsigned char *p = pFat + 3;
+	unsigned char *p = fat + 3;
 
 	for (int i=2;i<m_maxFatEntry;i+=2)
 	{
@@ -320,27 +427,93 @@ void CFloppy::FAT_Flush()
 	}
 
 	// duplicate second fat
-	memcpy(pFat + SECTOR_PER_FAT*512,pFat,SECTOR_PER_FAT*512);
+	memcpy(fat + SECTOR_PER_FAT*512,fat,SECTOR_PER_FAT*512);
+
+	WriteRaw(512, fat, SECTOR_PER_FAT*512*2);
 }
 
 bool CFloppy::Fill(CDirectory *pRoot, char *floppyName)
 {
     strcpy(this->floppyName, floppyName);
 
+	return Update(pRoot);
+}
+
+bool CFloppy::Update(CDirectory *pRoot)
+{
 	if ((pRoot->GetNbEntry()+1) > MAX_ROOT_ENTRY)
 	{
-		Debug::out(LOG_ERROR, "CFloppy::Fill - ERROR: Too much files in root directory (%d > %d)\n", pRoot->GetNbEntry(), MAX_ROOT_ENTRY);
+		Debug::out(LOG_ERROR, "CFloppy::Update - ERROR: Too much files in root directory (%d > %d)\n", pRoot->GetNbEntry(), MAX_ROOT_ENTRY);
+		return false;
+	}
+
+	// find out which entries can stay in their clusters and which need new ones
+	std::map<std::string, ClusterChain>::iterator it;
+	for (it = m_chains.begin(); it != m_chains.end(); ++it) {
+		it->second.used = false;
+	}
+
+	std::vector<CDirEntry *> toAllocate;
+	int nbNeeded = 0;
+	PlanDirectory(pRoot, toAllocate, nbNeeded);
+
+	int nbFree = CountFreeClusters();
+	for (it = m_chains.begin(); it != m_chains.end(); ++it)
+	{
+		if (!it->second.used) {
+			nbFree += it->second.nbCluster;				// will be released
+		}
+	}
+
+	if (nbNeeded > nbFree)								// fail before anything in the image is changed
+	{
+		Debug::out(LOG_ERROR, "CFloppy::Update - ERROR: No more space on the disk (%d clusters needed, %d free).", nbNeeded, nbFree);
 		return false;
 	}
 
-	LFN *pLFN = (LFN*)(m_pRawImage + 512 * (1+2*SECTOR_PER_FAT));
+	// release clusters of removed and resized entries, then allocate clusters for new and resized entries
+	for (it = m_chains.begin(); it != m_chains.end(); )
+	{
+		if (it->second.used) {
+			++it;
+			continue;
+		}
+
+		FreeChain(it->second);
+		m_chains.erase(it++);
+	}
+
+	for (size_t i=0;i<toAllocate.size();i++)
+	{
+		ClusterChain chain;
+		chain.nbCluster		= ClustersForEntry(toAllocate[i]);
+		chain.firstCluster	= AllocChain(chain.nbCluster);
+		chain.used			= true;
+
+		m_chains[toAllocate[i]->GetHostName()] = chain;
+	}
+
+	m_pRoot = pRoot;
 
-	// Root dir is special: there is a reserved space after boot and fats
-	if (BuildDirectory(pLFN,pRoot,0,0,ROOTDIR_NBSECTOR * 512,0)) {
-		return true;
+	if (!WriteDirectory(pRoot,NULL,0)) {
+		return false;
 	}
 
-	return false;
+	FAT_Flush();
+	return true;
+}
+
+void CFloppy::GetTouchedTracks(std::vector<int> &tracks)
+{
+	tracks.clear();
+
+	for (size_t i=0;i<m_touchedTracks.size();i++)
+	{
+		if (m_touchedTracks[i]) {
+			tracks.push_back(i);
+			m_touchedTracks[i] = false;
+		}
+	}
 }
 
 int CFloppy::ComputeRLE(unsigned char *p,unsigned char data,int todo)
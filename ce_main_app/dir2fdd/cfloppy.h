@@ -1,6 +1,10 @@
 #ifndef _CFLOPPY_H_
 #define _CFLOPPY_H_
 
+#include <map>
+#include <string>
+#include <vector>
+
 #include "cdirentry.h"
 
 //--------------- Disk geometry ----------------------------------------
@@ -22,6 +26,14 @@ struct MSAHEADER
     unsigned short  EndTrack;
 };
 
+// clusters allocated to one host file or directory
+struct ClusterChain
+{
+	int		firstCluster;
+	int		nbCluster;
+	bool	used;				// still present in the source tree (only valid during Update())
+};
+
 class CFloppy
 {
 public:
@@ -32,12 +44,26 @@ public:
 	void			Destroy();
 
 	bool			Fill(CDirectory *pRoot, char *floppyName);
+	bool			Update(CDirectory *pRoot);					// bring the image in sync with the (changed) tree, rewrite only sectors which differ
 	bool			WriteImage(const char *pName);
 
+	// tracks (cylinder * nbSide + side) which were written since the last call, these need to be encoded again
+	void			GetTouchedTracks(std::vector<int> &tracks);
+
+	const unsigned char	*GetRawImage() const	{ return m_pRawImage; }
+	int					GetRawSize() const		{ return m_rawSize; }
+
 private:
 
 	void			FAT_Flush();
-	bool			BuildDirectory(LFN *pLFN,CDirectory *pDir,int cluster,int parentCluster,int size,int level);
+	bool			PlanDirectory(CDirectory *pDir, std::vector<CDirEntry *> &toAllocate, int &nbNeeded);
+	bool			WriteDirectory(CDirectory *pDir,const ClusterChain *pChain,int parentCluster);
+	void			WriteChain(const ClusterChain &chain, const unsigned char *pData, int size);
+	void			WriteRaw(int offset, const unsigned char *pData, int size);
+	int				ClustersForEntry(CDirEntry *pEntry);
+	int				AllocChain(int nbCluster);
+	void			FreeChain(const ClusterChain &chain);
+	int				CountFreeClusters();
 	unsigned char *	GetRawAd(int cluster);
 	void			w8(int offset,unsigned char d)		{ m_pRawImage[offset] = d; }
 	void			w16(int offset,unsigned short d)	{ m_pRawImage[offset] = d&0xff; m_pRawImage[offset+1] = (d>>8); }
@@ -54,12 +80,13 @@ private:
 	CDirectory		*	m_pRoot;
 	unsigned char	*	m_pRawImage;
 
-	int					m_nbFreeCluster;
-	int					m_nextCluster;
 	int					m_maxFatEntry;
 	int					m_nbFatEntry;
 	int				*	m_pFat;
 
+	std::map<std::string, ClusterChain>	m_chains;		// host path -> clusters it occupies in the image
+	std::vector<bool>					m_touchedTracks;
+
     char            floppyName[16];
 
 };
@@ -7,6 +7,7 @@
 
 FloppyImage::FloppyImage()
 {
+    fajl            = NULL;
 	openFlag        = false;
     params.isInit   = false;
 
@@ -30,8 +31,11 @@ void FloppyImage::close()
         return;
     }
 
-    fclose(fajl);
-    fajl = NULL;
+    if(fajl) {                          // opened from memory doesn't have a file
+        fclose(fajl);
+        fajl = NULL;
+    }
+
     openFlag = false;
     params.isInit = false;
 
@@ -59,14 +63,14 @@ bool FloppyImage::getParams(int &tracks, int &sides, int &sectorsPerTrack)
     return true;
 }
 
-bool FloppyImage::readSector(int track, int side, int sectorNo, BYTE *buffer)
+int FloppyImage::sectorOffset(int track, int side, int sectorNo)
 {
     if(!openFlag) {                                             // not open?
-        return false;
+        return -1;
     }
 
     if(sectorNo < 1 || sectorNo > params.sectorsPerTrack) {     // sector # out of range?
-        return false;
+        return -1;
     }
 
     int offset   = track    * (params.sidesNo * params.sectorsPerTrack);    // move to the right track
@@ -74,10 +78,37 @@ bool FloppyImage::readSector(int track, int side, int sectorNo, BYTE *buffer)
     offset      += (sectorNo - 1);                                          // and move a little to the right sector
     offset       = offset * 512;                                            // calculate ofsset in bytes
 
+    if(offset < 0 || (offset + 512) > image.size) {                         // sector outside of image?
+        return -1;
+    }
+
+    return offset;
+}
+
+bool FloppyImage::readSector(int track, int side, int sectorNo, BYTE *buffer)
+{
+    int offset = sectorOffset(track, side, sectorNo);
+
+    if(offset < 0) {                                            // bad sector position?
+        return false;
+    }
+
     memcpy(buffer, &image.data[offset], 512);
     return true;
 }
 
+bool FloppyImage::writeSector(int track, int side, int sectorNo, BYTE *buffer)
+{
+    int offset = sectorOffset(track, side, sectorNo);
+
+    if(offset < 0) {                                            // bad sector position?
+        return false;
+    }
+
+    memcpy(&image.data[offset], buffer, 512);                   // just modify the image in memory, saveImage() writes it to file
+    return true;
+}
+
 const char *FloppyImage::getFileName(void)
 {
     return currentFileName.c_str();
@@ -100,6 +131,25 @@ bool FloppyImage::open(const char *fileName)
     return openFlag;
 }
 
+bool FloppyImage::openFromMemory(const char *fileName, BYTE *data, int size)
+{
+    close();
+
+    currentFileName = fileName;
+
+    fajl        = NULL;                 // no file behind this image
+    image.data  = data;                 // just take the data, no copying
+    image.size  = size;
+    openFlag    = true;
+
+    return true;
+}
+
+bool FloppyImage::isInMemoryOnly(void)
+{
+    return (openFlag && fajl == NULL);  // opened, but not from file (e.g. from ZIP file), so can't be saved
+}
+
 bool FloppyImage::loadImageIntoMemory(void)
 {
     if(image.data != NULL) {
@@ -19,13 +19,17 @@ public:
     const char *getFileName(void);
 
     virtual bool open(const char *fileName);
+    virtual bool openFromMemory(const char *fileName, BYTE *data, int size);    // data must be malloc()ed, the image then owns it
     virtual void close();
+    bool isInMemoryOnly(void);
     virtual bool getParams(int &tracks, int &sides, int &sectorsPerTrack);
     virtual bool readSector(int track, int side, int sectorNo, BYTE *buffer);
+    virtual bool writeSector(int track, int side, int sectorNo, BYTE *buffer);
     virtual bool saveImage() = 0;
 
 protected:
     virtual bool loadImageIntoMemory(void);
+    int  sectorOffset(int track, int side, int sectorNo);
 
     struct {
         int tracksNo;
@@ -1,17 +1,15 @@
 // vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
 #include <string.h>
 #include <stdlib.h>
-#include <sys/types.h>
-#include <dirent.h>
 
 #include "floppyimagefactory.h"
 #include "floppyimagest.h"
 #include "floppyimagemsa.h"
+#include "zipfile.h"
 #include "../debug.h"
 
 FloppyImage *FloppyImageFactory::getImage(const char *fileName)
 {
-    FloppyImage *img = NULL;
     const char *ext = strrchr(fileName, '.');     // find last '.'
 
     if(ext == NULL) {                       // last '.' not found? fail
@@ -22,43 +20,36 @@ FloppyImage *FloppyImageFactory::getImage(const char *fileName)
 
     //--------------
     // if it's a ZIP file, chek if it contains an supported floppy image
-    char fileNameInZip[256];
-    memset(fileNameInZip, 0, sizeof(fileNameInZip));
-
     if(strcasecmp(ext, "zip") == 0) {       // if it's a ZIP file
         Debug::out(LOG_DEBUG, "FloppyImageFactory -- file %s is a ZIP file, will search for supported image inside", fileName);
 
-                                            // decompress the ZIP file and search for floppy image inside, return path to first valid image
-        bool foundValidImage = handleZIPedImage(fileName, fileNameInZip);
+        std::string nameInZip;
+        BYTE *data;
+        int size;
+                                            // decompress the floppy image from ZIP file straight to memory
+        bool foundValidImage = handleZIPedImage(fileName, nameInZip, data, size);
 
         if(!foundValidImage) {              // image not found in ZIP file, fail
             Debug::out(LOG_DEBUG, "FloppyImageFactory -- ZIP file %s doesn't contain supported image inside", fileName);
             return NULL;
         }
 
-        Debug::out(LOG_DEBUG, "FloppyImageFactory -- ZIP file %s contains image: %s", fileName, fileNameInZip);
+        Debug::out(LOG_DEBUG, "FloppyImageFactory -- ZIP file %s contains image: %s", fileName, nameInZip.c_str());
 
-        fileName    = fileNameInZip;            // now the filename contains path to image extracted from ZIP file
-        ext         = strrchr(fileName, '.');   // find last '.'
+        std::string pathInZip = std::string(fileName) + "/" + nameInZip;      // not a real path, just for identification of the image
+        FloppyImage *img = createImageForExtension(pathInZip.c_str());
 
-        if(ext == NULL) {                       // last '.' not found? fail
+        if(!img) {
+            free(data);
             return NULL;
         }
 
-        ext++;
+        img->openFromMemory(pathInZip.c_str(), data, size);     // the image now owns the data
+        return img;
     }
 
     //--------------
-    if(strcasecmp(ext, "msa") == 0) {   // msa image?
-        Debug::out(LOG_DEBUG, "FloppyImageFactory -- using MSA image on %s", fileName);
-        img = new FloppyImageMsa();
-
-    } else if(strcasecmp(ext, "st") == 0) {    // st image?
-        Debug::out(LOG_DEBUG, "FloppyImageFactory -- using ST image on %s", fileName);
-        img = new FloppyImageSt();
-    } else {
-        Debug::out(LOG_DEBUG, "FloppyImageFactory -- Image file %s type %s not supported", fileName, ext);
-    }
+    FloppyImage *img = createImageForExtension(fileName);
 
     if(img) {
         img->open(fileName);            // open the new image
@@ -66,70 +57,93 @@ FloppyImage *FloppyImageFactory::getImage(const char *fileName)
     return img;                        // unknown extension?
 }
 
-bool FloppyImageFactory::handleZIPedImage(const char *inZipFilePath, char *outImageFilePath)
+FloppyImage *FloppyImageFactory::createImageForExtension(const char *fileName)
 {
-    outImageFilePath[0] = 0;                        // out path doesn't contain anything yet
+    const char *ext = strrchr(fileName, '.');     // find last '.'
 
-    system("rm    -rf /tmp/zipedfloppy");           // delete this dir, if it exists
-    system("mkdir -p  /tmp/zipedfloppy");           // create that dir
+    if(ext == NULL) {                       // last '.' not found? fail
+        return NULL;
+    }
 
-    char unzipCommand[512];
-    sprintf(unzipCommand, "unzip -o '%s' -d /tmp/zipedfloppy > /dev/null 2> /dev/null", inZipFilePath);
-    system(unzipCommand);                           // unzip the downloaded ZIP file into that tmp directory
+    ext++;                                  // move beyond '.'
 
-    // find the first usable floppy image
-    DIR *dir = opendir("/tmp/zipedfloppy");         // try to open the dir
+    if(strcasecmp(ext, "msa") == 0) {   // msa image?
+        Debug::out(LOG_DEBUG, "FloppyImageFactory -- using MSA image on %s", fileName);
+        return new FloppyImageMsa();
+    }
+
+    if(strcasecmp(ext, "st") == 0) {    // st image?
+        Debug::out(LOG_DEBUG, "FloppyImageFactory -- using ST image on %s", fileName);
+        return new FloppyImageSt();
+    }
+
+    Debug::out(LOG_DEBUG, "FloppyImageFactory -- Image file %s type %s not supported", fileName, ext);
+    return NULL;
+}
 
-    if(dir == NULL) {                               // not found?
-        Debug::out(LOG_DEBUG, "FloppyImageFactory::handleZIPedImage -- opendir() failed");
+bool FloppyImageFactory::isImageFileName(const std::string &name)
+{
+    if(name.empty() || name[name.size() - 1] == '/') {     // empty or directory? not an image
         return false;
     }
 
-    bool found          = false;
-    struct dirent *de   = NULL;
+    if(name.compare(0, 9, "__MACOSX/") == 0) {              // Mac OS resource forks dir? skip it
+        return false;
+    }
 
-    const char *pExt = NULL;
+    size_t slash = name.rfind('/');
+    std::string file = (slash == std::string::npos) ? name : name.substr(slash + 1);
 
-    while(1) {                                      // avoid buffer overflow
-        de = readdir(dir);                          // read the next directory entry
+    if(file.size() < 3 || file.compare(0, 2, "._") == 0) {  // too short, or Mac OS resource fork? skip it
+        return false;
+    }
 
-        if(de == NULL) {                            // no more entries?
-            break;
-        }
+    size_t dot = file.rfind('.');                           // find last '.'
+    if(dot == std::string::npos) {                          // last '.' not found? skip it
+        return false;
+    }
 
-        if(de->d_type != DT_REG) {                  // not a file? skip it
-            continue;
-        }
+    const char *pExt = file.c_str() + dot + 1;              // move beyond '.'
+    return (strcasecmp(pExt, "st") == 0 || strcasecmp(pExt, "msa") == 0);  // the extension of the file is valid for a floppy image?
+}
+
+bool FloppyImageFactory::handleZIPedImage(const char *inZipFilePath, std::string &outImageName, BYTE *&outData, int &outSize)
+{
+    outImageName.clear();                           // out name doesn't contain anything yet
+    outData = NULL;
+    outSize = 0;
 
-        int fileNameLen = strlen(de->d_name);       // get length of filename
+    ZipFile zip;
 
-        if(fileNameLen < 3) {                       // if it's too short, skip it
-            continue;
-        }
+    if(!zip.open(inZipFilePath)) {                  // not a valid ZIP file?
+        Debug::out(LOG_DEBUG, "FloppyImageFactory::handleZIPedImage -- failed to open ZIP file");
+        return false;
+    }
 
-        pExt = strrchr(de->d_name, '.');            // find last '.'
+    // multi-disk archives usually have the disks named in order (DISK1.ST, DISK2.ST or A.ST, B.ST), so use the one which sorts first
+    int found = -1;
 
-        if(pExt == NULL) {                          // last '.' not found? skip it
+    for(int i=0; i<zip.getEntryCount(); i++) {
+        const TZipEntry *entry = zip.getEntry(i);
+
+        if(entry->uncompressedSize == 0 || !isImageFileName(entry->name)) {     // not a floppy image? skip it
             continue;
         }
-        pExt++;                                     // move beyond '.'
 
-        if(strcasecmp(pExt, "st") == 0 || strcasecmp(pExt, "msa") == 0) {  // the extension of the file is valid for a floppy image?
-            found = true;
-            break;
+        if(found < 0 || strcasecmp(entry->name.c_str(), zip.getEntry(found)->name.c_str()) < 0) {
+            found = i;
         }
     }
 
-    closedir(dir);                                  // close the dir
-
-    if(!found) {                                    // not found? return with a fail
+    if(found < 0) {                                 // not found? return with a fail
         return false;
     }
 
-    // construct path to unZIPed image
-    strcpy(outImageFilePath, "/tmp/zipedfloppy/");
-    strcat(outImageFilePath, de->d_name);
+    if(!zip.extract(found, outData, outSize)) {     // decompress it to memory
+        Debug::out(LOG_DEBUG, "FloppyImageFactory::handleZIPedImage -- failed to extract %s", zip.getEntry(found)->name.c_str());
+        return false;
+    }
 
+    outImageName = zip.getEntry(found)->name;
     return true;
 }
-
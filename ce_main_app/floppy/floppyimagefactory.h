@@ -2,6 +2,8 @@
 #ifndef FLOPPYIMAGEFACTORY_H
 #define FLOPPYIMAGEFACTORY_H
 
+#include <string>
+
 #include "floppyimage.h"
 
 class FloppyImageFactory
@@ -13,7 +15,9 @@ private:
     static void toLowerCase(char *orig, char *lower);
     static char lowerCase(char in);
 
-    static bool handleZIPedImage(const char *inZipFilePath, char *outImageFilePath);
+    static bool handleZIPedImage(const char *inZipFilePath, std::string &outImageName, BYTE *&outData, int &outSize);
+    static bool isImageFileName(const std::string &name);
+    static FloppyImage *createImageForExtension(const char *fileName);
 };
 
 #endif // FLOPPYIMAGEFACTORY_H
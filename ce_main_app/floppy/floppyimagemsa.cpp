@@ -19,14 +19,10 @@ bool FloppyImageMsa::open(const char *fileName)
     fread(&trackStart,  2,1,fajl);      Utils::SWAPWORD(trackStart);
     fread(&trackEnd,    2,1,fajl);      Utils::SWAPWORD(trackEnd);
 
-    if(id != 0x0e0f) {          // MSA ID mismatch?
+    if(!setParams(id, spt, sides, trackStart, trackEnd)) {     // MSA ID mismatch?
         close();
         return false;
     }
-    params.tracksNo         = trackEnd - trackStart + 1;
-    params.sidesNo          = sides + 1;
-    params.sectorsPerTrack  = spt;
-    params.isInit           = true;
 
     if(!loadImageIntoMemory()) {        // load the whole image in memory to avoid later disk access
         close();
@@ -39,11 +35,56 @@ bool FloppyImageMsa::open(const char *fileName)
     return true;
 }
 
+bool FloppyImageMsa::openFromMemory(const char *fileName, BYTE *data, int size)
+{
+    FloppyImage::openFromMemory(fileName, data, size);      // data contain whole MSA file
+
+    if(size < 10) {                     // not even the header?
+        close();
+        return false;
+    }
+
+    // read header - big endian WORDs
+    WORD id         = (((WORD) data[0]) << 8) | data[1];
+    WORD spt        = (((WORD) data[2]) << 8) | data[3];
+    WORD sides      = (((WORD) data[4]) << 8) | data[5];
+    WORD trackStart = (((WORD) data[6]) << 8) | data[7];
+    WORD trackEnd   = (((WORD) data[8]) << 8) | data[9];
+
+    if(!setParams(id, spt, sides, trackStart, trackEnd) || !uncompressImage()) {
+        close();
+        return false;
+    }
+
+    Debug::out(LOG_DEBUG, "MSA Image opened from memory: %s", fileName);
+    Debug::out(LOG_DEBUG, "MSA Image params - %d tracks, %d sides, %d sectors per track", params.tracksNo, params.sidesNo, params.sectorsPerTrack);
+
+    return true;
+}
+
+bool FloppyImageMsa::setParams(WORD id, WORD spt, WORD sides, WORD trackStart, WORD trackEnd)
+{
+    if(id != 0x0e0f) {          // MSA ID mismatch?
+        return false;
+    }
+
+    params.tracksNo         = trackEnd - trackStart + 1;
+    params.sidesNo          = sides + 1;
+    params.sectorsPerTrack  = spt;
+    params.isInit           = true;
+    return true;
+}
+
 bool FloppyImageMsa::loadImageIntoMemory(void)
 {
     if(!FloppyImage::loadImageIntoMemory())
         return false;
 
+    return uncompressImage();
+}
+
+bool FloppyImageMsa::uncompressImage(void)
+{
 	long imageSize = 0;
     BYTE *pDiskBuffer = MSA_UnCompress(image.data, &imageSize);
 
@@ -61,7 +102,22 @@ bool FloppyImageMsa::loadImageIntoMemory(void)
 
 bool FloppyImageMsa::saveImage()
 {
-	return MSA_WriteDisk("A_019_output.MSA", image.data, image.size);
+    if(!isOpen() || image.data == NULL) {       // nothing to save?
+        return false;
+    }
+
+    if(isInMemoryOnly()) {                      // no file to save to?
+        Debug::out(LOG_DEBUG, "FloppyImageMsa::saveImage - %s is only in memory, not saving", getFileName());
+        return false;
+    }
+
+    bool res = MSA_WriteDisk(getFileName(), image.data, image.size);     // compress the image back to MSA and write it to the file it was opened from
+
+    if(!res) {
+        Debug::out(LOG_ERROR, "FloppyImageMsa::saveImage - failed to save %s", getFileName());
+    }
+
+    return res;
 }
 
 
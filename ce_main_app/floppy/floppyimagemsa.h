@@ -9,17 +9,22 @@ class FloppyImageMsa: public FloppyImage
 {
 public:
     virtual bool open(const char *fileName);
-    virtual bool save(const char *fileName);
+    virtual bool openFromMemory(const char *fileName, BYTE *data, int size);
+    virtual bool saveImage();
 
 protected:
     virtual bool loadImageIntoMemory(void);
+
+private:
+    bool setParams(WORD id, WORD spt, WORD sides, WORD trackStart, WORD trackEnd);
+    bool uncompressImage(void);
 };
 
 class MockFloppyImageMsa: public FloppyImageMsa
 {
 public:
     MOCK_METHOD1(open, bool (const char *fileName));
-    MOCK_METHOD1(save, bool (const char *fileName));
+    MOCK_METHOD0(saveImage, bool ());
     MOCK_METHOD0(loadImageIntoMemory, bool ());
 
 };
@@ -21,6 +21,18 @@ bool FloppyImageSt::open(const char *fileName)
     return true;
 }
 
+bool FloppyImageSt::openFromMemory(const char *fileName, BYTE *data, int size)
+{
+    FloppyImage::openFromMemory(fileName, data, size);      // ST image is just raw sectors, so the data is the image
+
+    calcParams();                       // calculate the params of this floppy
+
+    Debug::out(LOG_DEBUG, "ST Image opened from memory: %s", fileName);
+    Debug::out(LOG_DEBUG, "ST Image params - %d tracks, %d sides, %d sectors per track", params.tracksNo, params.sidesNo, params.sectorsPerTrack);
+
+    return true;
+}
+
 bool FloppyImageSt::calcParams(void)
 {
     params.isInit = false;
@@ -65,6 +77,30 @@ bool FloppyImageSt::calcParams(void)
 
 bool FloppyImageSt::saveImage()
 {
-    //TODO
+    if(!isOpen() || image.data == NULL) {       // nothing to save?
+        return false;
+    }
+
+    if(isInMemoryOnly()) {                      // no file to save to?
+        Debug::out(LOG_DEBUG, "FloppyImageSt::saveImage - %s is only in memory, not saving", getFileName());
+        return false;
+    }
+
+    FILE *f = fopen(getFileName(), "wb");       // ST image is just the raw sectors, so just write them all
+
+    if(!f) {
+        Debug::out(LOG_ERROR, "FloppyImageSt::saveImage - failed to open file %s", getFileName());
+        return false;
+    }
+
+    int written = fwrite(image.data, 1, image.size, f);
+    fclose(f);
+
+    if(written != image.size) {
+        Debug::out(LOG_ERROR, "FloppyImageSt::saveImage - failed to write file %s", getFileName());
+        return false;
+    }
+
+    Debug::out(LOG_DEBUG, "FloppyImageSt::saveImage - saved %s", getFileName());
     return true;
 }
@@ -11,6 +11,7 @@ class FloppyImageSt: public FloppyImage
 {
 public:
     virtual bool open(const char *fileName);
+    virtual bool openFromMemory(const char *fileName, BYTE *data, int size);
     virtual bool saveImage();
 private:
     bool calcParams(void);
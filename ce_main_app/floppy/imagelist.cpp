@@ -2,10 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <ctype.h>
+
 #include <string>
 #include <algorithm>
+#include <iterator>
 
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "imagelist.h"
 #include "../utils.h"
@@ -14,7 +18,8 @@
 
 ImageList::ImageList(void)
 {
-    isLoaded = false;
+    isLoaded        = false;
+    loadedModTime   = 0;
 }
 
 bool ImageList::exists(void)
@@ -48,10 +53,30 @@ bool ImageList::exists(void)
 
 bool ImageList::loadList(void)
 {
+    return loadList(IMAGELIST_LOCAL);
+}
+
+bool ImageList::loadList(const char *path)
+{
+    struct stat attr;
+    if(stat(path, &attr) != 0) {                        // file not there?
+        vectorOfImages.clear();
+        vectorOfGames.clear();
+        vectorOfResults.clear();
+        wordIndex.clear();
+        isLoaded = false;
+        return false;
+    }
+
+    if(isLoaded && loadedPath == path && loadedModTime == attr.st_mtime) {     // this list is already loaded and indexed? nothing to do
+        return true;
+    }
+
     vectorOfImages.clear();
+    vectorOfResults.clear();
     isLoaded = false;
 
-    FILE *f = fopen(IMAGELIST_LOCAL, "rt");             // open file
+    FILE *f = fopen(path, "rt");                        // open file
 
     if(!f) {
         return false;
@@ -70,151 +95,276 @@ bool ImageList::loadList(void)
         if(c == NULL) {                                 // didn't read anything?
             continue;
         }
-        
-        char *tok;
-        tok = strtok(tmp, ",");                         // init strtok by passing pointer to string
 
-        if(tok == NULL) {
+        if(!parseLine(tmp, li)) {                       // bad line or no games in this image? skip it
             continue;
         }
 
-        li.url = tok;                                   // store URL
+        vectorOfImages.push_back(li);                   // store it in vector
+    }    
 
-        std::string path, file;
-        Utils::splitFilenameFromPath(li.url, path, file);
-        li.imageName = file;                            // also store only image name (without URL)
+    fclose(f);
 
-        tok = strtok(NULL, ",");                        // get next token - checksum
+    buildIndex();                                       // index the games once, searches then only look into the index
 
-        if(tok == NULL) {
-            continue;
-        }
+    loadedPath      = path;
+    loadedModTime   = attr.st_mtime;
+    isLoaded        = true;
+
+    Debug::out(LOG_DEBUG, "ImageList::loadList - %d images, %d games, %d words in index", (int) vectorOfImages.size(), (int) vectorOfGames.size(), (int) wordIndex.size());
+    return true;
+}
+
+bool ImageList::parseLine(char *line, ImageListItem &li)
+{
+    // line format: url,0xchecksum,game1,game2,...
+    char *comma = strchr(line, ',');
+
+    if(comma == NULL) {
+        return false;
+    }
+
+    li.url.assign(line, comma - line);                  // store URL
+
+    std::string path, file;
+    Utils::splitFilenameFromPath(li.url, path, file);
+    li.imageName = file;                                // also store only image name (without URL)
+
+    int checksum;
+    if(sscanf(comma + 1, "0x%x", &checksum) != 1) {     // get the checksum
+        return false;
+    }
+
+    li.checksum = checksum;                             // store checksum
+
+    char *games = strchr(comma + 1, ',');               // games string starts after the next coma
+
+    if(games == NULL) {
+        return false;
+    }
 
-        int checksum, res;
-        res = sscanf(tok, "0x%x", &checksum);           // get the checksum
+    games++;
+
+    int len = strlen(games);
+    while(len > 0 && (games[len - 1] == '\n' || games[len - 1] == '\r')) {     // remove line ending
+        len--;
+    }
+
+    if(len == 0) {                                      // nothing in this image? skip it
+        return false;
+    }
+
+    li.games.assign(games, len);                                                        // store games
+    std::transform(li.games.begin(), li.games.end(), li.games.begin(), ::tolower);      // convert them to lowercase
+    li.marked = false;
+
+    return true;
+}
 
-        if(res != 1) {
+void ImageList::splitToWords(const std::string &str, std::vector<std::string> &words)
+{
+    words.clear();
+
+    std::string word;
+    int len = str.length();
+
+    for(int i=0; i<=len; i++) {
+        char c = (i < len) ? str[i] : 0;
+
+        if(isalnum((unsigned char) c)) {                // letter or digit? part of word
+            word += (char) tolower((unsigned char) c);
             continue;
         }
 
-        li.checksum = checksum;                         // store checksum
+        if(!word.empty()) {                             // anything else ends the word
+            words.push_back(word);
+            word.clear();
+        }
+    }
+}
+
+void ImageList::buildIndex(void)
+{
+    vectorOfGames.clear();
+    wordIndex.clear();
+
+    std::vector<std::string> games;
+    std::vector<std::string> words;
+    ImageListGame g;
 
-        while(1) {                                      // now move beyond checksum by looking for 0 as string terminator
-            if(*tok == 0) {     
-                break;
+    for(int i=0; i<(int) vectorOfImages.size(); i++) {
+        games.clear();
+        Utils::splitString(vectorOfImages[i].games, ',', games);   // split the games string to single games
+
+        for(size_t j=0; j<games.size(); j++) {
+            if(games[j].empty()) {
+                continue;
             }
-            tok++;
-        }
 
-        tok++;                                          // tok now points to the start of games string
-    
-        if(*tok == 0) {                                 // nothing in this image? skip it
-            continue;
-        }
+            g.game          = games[j];
+            g.imageIndex    = i;
 
-        li.games = tok;                                                                     // store games
-        std::transform(li.games.begin(), li.games.end(), li.games.begin(), ::tolower);      // convert them to lowercase
-        li.marked = false;
+            int gameIndex = vectorOfGames.size();
+            vectorOfGames.push_back(g);
 
-        vectorOfImages.push_back(li);                   // store it in vector
-    }    
+            splitToWords(g.game, words);
 
-    fclose(f);
+            for(size_t k=0; k<words.size(); k++) {
+                std::vector<int> &postings = wordIndex[words[k]];
 
-    isLoaded = true;
-    return true;
+                if(postings.empty() || postings.back() != gameIndex) {     // games are added in order, so this keeps postings sorted and unique
+                    postings.push_back(gameIndex);
+                }
+            }
+        }
+    }
 }
 
-void ImageList::search(char *part)
+void ImageList::findWordPrefix(const std::string &prefix, std::vector<int> &gameIndices)
 {
-    std::string sPart = part;
-    std::transform(sPart.begin(), sPart.end(), sPart.begin(), ::tolower);                   // convert to lowercase
+    gameIndices.clear();
 
-    vectorOfResults.clear();                                        // clear results
+    std::map<std::string, std::vector<int> >::iterator it;
+    int wordsFound = 0;
 
-    int cnt = vectorOfImages.size();
+    // all the words starting with prefix are next to each other in the map, starting at lower_bound(prefix)
+    for(it = wordIndex.lower_bound(prefix); it != wordIndex.end(); ++it) {
+        if(it->first.compare(0, prefix.length(), prefix) != 0) {   // not starting with prefix? we're past all the matching words
+            break;
+        }
 
-    // if not loaded, or the list is empty
-    if(!isLoaded || cnt < 1) {                                      
-        return;
+        gameIndices.insert(gameIndices.end(), it->second.begin(), it->second.end());
+        wordsFound++;
     }
 
-    // if search string is too short
-    bool searchTooShort = false;
-    if(strlen(part) < 2) {                                          
-        searchTooShort = true;
+    if(wordsFound > 1) {                                // merged postings of more words? sort them and remove duplicates
+        std::sort(gameIndices.begin(), gameIndices.end());
+        gameIndices.erase(std::unique(gameIndices.begin(), gameIndices.end()), gameIndices.end());
     }
+}
 
-    // go through the list of images, copy the right ones
-    for(int i=0; i<cnt; i++) {
-        std::string &games = vectorOfImages[i].games;       
-        std::string game;
-        SearchResult sr;                                            
+typedef struct {
+    int         score;
+    int         length;
+    int         gameIndex;
+} RankedGame;
 
-        if(searchTooShort) {
-            sr.game         = games;                                // store stuff in search result structure
-            sr.imageIndex   = i;
+static bool rankedGameLess(const RankedGame &a, const RankedGame &b)
+{
+    if(a.score != b.score) {                            // better score first
+        return a.score > b.score;
+    }
 
-            vectorOfResults.push_back(sr);                          // store search result in vector
-            continue;                                               // skip searching of the games string
-        }
+    if(a.length != b.length) {                          // then shorter names, as those match the query more closely
+        return a.length < b.length;
+    }
 
-        size_t pos = 0;                                             // start searching from start
-        while(1) {
-            pos = games.find(sPart, pos);                           // search for part in games
+    return a.gameIndex < b.gameIndex;                   // then keep the order from the list
+}
+
+static int scoreGame(const std::vector<std::string> &gameWords, const std::vector<std::string> &queryWords)
+{
+    int score = 0;
+
+    for(size_t i=0; i<queryWords.size(); i++) {
+        int best = 0;
 
-            if(pos == std::string::npos) {                          // not found? quit this
+        for(size_t j=0; j<gameWords.size(); j++) {
+            if(gameWords[j] == queryWords[i]) {         // whole word match
+                best = 2;
                 break;
             }
 
-            getSingleGame(games, game, pos);                        // extract single game from list of games
+            if(gameWords[j].compare(0, queryWords[i].length(), queryWords[i]) == 0) {  // prefix match
+                best = 1;
+            }
+        }
 
-            sr.game         = game;                                 // store stuff in search result structure
-            sr.imageIndex   = i;
+        score += best;
+    }
 
-            vectorOfResults.push_back(sr);                          // store search result in vector
+    if(!gameWords.empty() && gameWords[0].compare(0, queryWords[0].length(), queryWords[0]) == 0) {  // game name starts with the query
+        score += 4;
+    }
 
-            pos++;                                                  // move to next char
-        }
+    if(gameWords == queryWords) {                       // game name is exactly the query
+        score += 8;
     }
+
+    return score;
 }
 
-void ImageList::getSingleGame(std::string &games, std::string &game, size_t pos)
+void ImageList::search(const char *part)
 {
-    int len = games.length();
+    vectorOfResults.clear();                                        // clear results
+
+    int cnt = vectorOfImages.size();
 
-    if(len <= 0) {
-        game = "";
+    // if not loaded, or the list is empty
+    if(!isLoaded || cnt < 1) {                                      
         return;
     }
 
-    int i;
-    size_t start    = 0;
-    size_t end      = (len - 1);
+    SearchResult sr;
 
-    for(i=pos; i>0; i--) {                                                      // find starting coma
-        if(games[i] == ',') {
-            start = i + 1;                                                      // store position without that coma
-            break;
+    // if search string is too short, return all the images
+    if(strlen(part) < IMAGELIST_MIN_SEARCH_LEN) {
+        for(int i=0; i<cnt; i++) {
+            sr.gameIndex    = -1;
+            sr.imageIndex   = i;
+            vectorOfResults.push_back(sr);
         }
+        return;
     }
 
-    for(i=pos; i<len; i++) {                                                    // find ending coma
-        if(games[i] == ',') {
-            end = i - 1;                                                        // store position without that coma
-            break;
+    std::vector<std::string> queryWords;
+    splitToWords(part, queryWords);
+
+    if(queryWords.empty()) {                                        // nothing to search for
+        return;
+    }
+
+    // every query word is a prefix of some word in game name, intersect the games found for each query word
+    std::vector<int> matches, wordMatches, intersection;
+
+    for(size_t i=0; i<queryWords.size(); i++) {
+        findWordPrefix(queryWords[i], wordMatches);
+
+        if(i == 0) {
+            matches.swap(wordMatches);
+        } else {
+            intersection.clear();
+            std::set_intersection(matches.begin(), matches.end(), wordMatches.begin(), wordMatches.end(), std::back_inserter(intersection));
+            matches.swap(intersection);
+        }
+
+        if(matches.empty()) {                                       // nothing left? no need to look further
+            return;
         }
     }
 
-    if(start >= (size_t) len) {                                                 // if start would be out of range, fix it
-        start = len - 1;
+    // rank the matching games
+    std::vector<RankedGame> ranked(matches.size());
+    std::vector<std::string> gameWords;
+
+    for(size_t i=0; i<matches.size(); i++) {
+        ImageListGame &g = vectorOfGames[matches[i]];
+        splitToWords(g.game, gameWords);
+
+        ranked[i].score     = scoreGame(gameWords, queryWords);
+        ranked[i].length    = g.game.length();
+        ranked[i].gameIndex = matches[i];
     }
-    
-    if(end >= (size_t) len) {                                                   // if end would be out of range, fix it
-        end = len - 1;
+
+    std::sort(ranked.begin(), ranked.end(), rankedGameLess);
+
+    // store only indices, the result lines are created when a page of results is requested
+    vectorOfResults.resize(ranked.size());
+
+    for(size_t i=0; i<ranked.size(); i++) {
+        vectorOfResults[i].gameIndex    = ranked[i].gameIndex;
+        vectorOfResults[i].imageIndex   = vectorOfGames[ranked[i].gameIndex].imageIndex;
     }
-    
-    game = games.substr(start, (end - start + 1));                              // get only the single game
 }
 
 void ImageList::getResultByIndex(int index, char *bfr)
@@ -247,7 +397,10 @@ void ImageList::getResultByIndex(int index, char *bfr)
     int imgNameLen = strlen(bfr);
     int lenOfRest = 67 - imgNameLen;
 
-    strncpy(bfr + imgNameLen, vectorOfResults[index].game.c_str(), lenOfRest);  // copy in the name of game
+    int gameIndex = vectorOfResults[index].gameIndex;
+    const std::string &game = (gameIndex < 0) ? vectorOfImages[imageIndex].games : vectorOfGames[gameIndex].game;
+
+    strncpy(bfr + imgNameLen, game.c_str(), lenOfRest);                         // copy in the name of game
 }
 
 void ImageList::markImage(int index)
@@ -296,7 +449,10 @@ void ImageList::refreshList(void)
 {
     unlink(IMAGELIST_LOCAL);                // delete current image list
 
-    vectorOfImages.clear();                 // remove the loaded list from memory
+    vectorOfImages.clear();                 // remove the loaded list and its index from memory
+    vectorOfGames.clear();
+    vectorOfResults.clear();
+    wordIndex.clear();
     isLoaded = false;
 
     exists();                               // this should now start the new image list download
@@ -4,12 +4,15 @@
 #include <map>
 #include <string>
 #include <vector>
+#include <time.h>
 
 #define IMAGELIST_URL       "http://joo.kie.sk/cosmosex/update/imagelist.csv"
 #define IMAGELIST_LOCAL_DIR "/ce/app/"
 #define IMAGELIST_LOCAL     "/ce/app/imagelist.csv"
 #define IMAGE_DOWNLOAD_DIR  "/tmp/"
 
+#define IMAGELIST_MIN_SEARCH_LEN    2       // shorter search strings just list all the images
+
 typedef struct {
     std::string imageName;
     std::string url;
@@ -19,7 +22,12 @@ typedef struct {
 } ImageListItem;
 
 typedef struct {
-    std::string game;
+    std::string game;                       // single game name, lowercase
+    int         imageIndex;                 // index of image in vectorOfImages
+} ImageListGame;
+
+typedef struct {
+    int         gameIndex;                  // index of game in vectorOfGames, or -1 if the result is the whole image
     int         imageIndex;
 } SearchResult;
 
@@ -30,8 +38,9 @@ public:
 
     bool exists(void);
     bool loadList(void);
+    bool loadList(const char *path);
 
-    void search(char *part);
+    void search(const char *part);
 
     int  getSearchResultsCount(void);
     void getResultByIndex(int index, char *bfr);
@@ -41,12 +50,21 @@ public:
 
 private:
     std::vector<ImageListItem>      vectorOfImages;
+    std::vector<ImageListGame>      vectorOfGames;
     std::vector<SearchResult>       vectorOfResults;
 
-    bool isLoaded;
+    // inverted index: lowercase word -> sorted indices of games (in vectorOfGames) containing that word
+    std::map<std::string, std::vector<int> >    wordIndex;
 
-    void getSingleGame(std::string &games, std::string &game, size_t pos);
+    bool    isLoaded;
+    std::string loadedPath;
+    time_t  loadedModTime;
+
+    bool parseLine(char *line, ImageListItem &li);
+    void buildIndex(void);
+    void findWordPrefix(const std::string &prefix, std::vector<int> &gameIndices);
+
+    static void splitToWords(const std::string &str, std::vector<std::string> &words);
 };
 
 #endif
-
@@ -8,6 +8,7 @@
 #include <errno.h>
 
 #include <signal.h>
+#include <time.h>
 
 #include "../utils.h"
 #include "../debug.h"
@@ -15,13 +16,17 @@
 #include "acsidatatrans.h"
 #include "imagesilo.h"
 #include "floppysetup.h"
+#include "../dir2fdd/cdirectory.h"
 #include "../display/displaythread.h"
 
 #define EMPTY_TRACK_SIZE (15000)
 
 pthread_mutex_t ImageSilo::floppyEncodeQueueMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t ImageSilo::floppyEncodeQueueNotEmpty = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t ImageSilo::encodedImagePublishMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ImageSilo::slotImageMutex = PTHREAD_MUTEX_INITIALIZER;
 std::queue<EncodeRequest> ImageSilo::encodeQueue;
+std::vector<SiloSlot *> ImageSilo::dirtySlots;
 volatile bool ImageSilo::shouldStop = false;
 
 SiloSlotSimple  ImageSilo::floppyImages[3];
@@ -33,7 +38,9 @@ volatile bool ImageSilo::floppyEncodingRunning = false;
 
 void ImageSilo::addEncodeRequest(EncodeRequest &er)
 {
-    floppyEncodingRunning = true;
+    if(er.type == ENCODE_REQ_IMAGE) {                       // only whole image encoding makes the image not ready
+        floppyEncodingRunning = true;
+    }
 
     pthread_mutex_lock(&floppyEncodeQueueMutex);            // try to lock the mutex
     encodeQueue.push(er);                                    // add this to queue
@@ -51,64 +58,327 @@ void ImageSilo::stop(void)
 
 void ImageSilo::run(void)
 {
-    MfmCachedImage      encImage;
-
     floppyEncodingRunning = false;
 
     while(!shouldStop) {
         pthread_mutex_lock(&floppyEncodeQueueMutex);        // lock the mutex
 
         while(encodeQueue.size() == 0 && !shouldStop) {
-            pthread_cond_wait(&floppyEncodeQueueNotEmpty, &floppyEncodeQueueMutex);
+            if(dirtySlots.empty()) {                        // no written image waiting to be saved? wait for next request
+                pthread_cond_wait(&floppyEncodeQueueNotEmpty, &floppyEncodeQueueMutex);
+                continue;
+            }
+
+            // some image waits to be saved, so don't wait for next request forever
+            struct timespec timeout;
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_sec += 1;
+
+            if(pthread_cond_timedwait(&floppyEncodeQueueNotEmpty, &floppyEncodeQueueMutex, &timeout) == ETIMEDOUT) {
+                break;
+            }
         }
         if(shouldStop) {
             pthread_mutex_unlock(&floppyEncodeQueueMutex);        // unlock the mutex
             break;
         }
 
-        floppyEncodingRunning = true;
+        if(encodeQueue.size() == 0) {                       // woken up by timeout? just save images if it's time to do so
+            pthread_mutex_unlock(&floppyEncodeQueueMutex);
+
+            pthread_mutex_lock(&slotImageMutex);
+            saveDirtyImages(false);
+            pthread_mutex_unlock(&slotImageMutex);
+            continue;
+        }
 
         EncodeRequest er = encodeQueue.front();                // get the 'oldest' element from queue
         encodeQueue.pop();                                    // and remove it form queue
-        pthread_mutex_unlock(&floppyEncodeQueueMutex);        // unlock the mutex
 
-        // try to open the image
-        FloppyImage *image = FloppyImageFactory::getImage(er.filename.c_str());
+        if(er.type == ENCODE_REQ_SECTOR_WRITTEN) {
+            // take also all the other written sectors for this slot, so the tracks are re-encoded and published only once
+            std::vector<EncodeRequest> writes;
+            writes.push_back(er);
+
+            while(encodeQueue.size() > 0 && encodeQueue.front().type == ENCODE_REQ_SECTOR_WRITTEN && encodeQueue.front().slot == er.slot) {
+                writes.push_back(encodeQueue.front());
+                encodeQueue.pop();
+            }
+            pthread_mutex_unlock(&floppyEncodeQueueMutex);        // unlock the mutex
+
+            pthread_mutex_lock(&slotImageMutex);
+            processWriteRequests(er.slot, writes);
+        } else if(er.type == ENCODE_REQ_TRACKS_CHANGED) {
+            pthread_mutex_unlock(&floppyEncodeQueueMutex);        // unlock the mutex
+
+            pthread_mutex_lock(&slotImageMutex);
+            processTracksChanged(er);
+        } else {
+            floppyEncodingRunning = true;
+            pthread_mutex_unlock(&floppyEncodeQueueMutex);        // unlock the mutex
+
+            pthread_mutex_lock(&slotImageMutex);
+            processEncodeRequest(er);
+            floppyEncodingRunning = false;
+        }
+
+        saveDirtyImages(false);                             // save images which weren't written for a while
+        pthread_mutex_unlock(&slotImageMutex);
+    }
+
+    pthread_mutex_lock(&slotImageMutex);
+    saveDirtyImages(true);                                  // terminating, save everything that was written
+    pthread_mutex_unlock(&slotImageMutex);
+    floppyEncodingRunning = false;
+}
+
+void ImageSilo::processEncodeRequest(EncodeRequest &er)
+{
+    closeSlotImage(er.slot);                                // if some image was in this slot, save it if needed and close it
+
+    // try to open the image
+    FloppyImage *image = FloppyImageFactory::getImage(er.filename.c_str());
+
+    if(!image) {
+        return;
+    }
+
+    if(!image->isOpen()) {
+        Debug::out(LOG_DEBUG, "Encoding of image %s failed - image is not open", image->getFileName());
+        delete image;
+        return;
+    }
+
+    DWORD start, end;
+
+    // encode image - convert it from file to preprocessed stream for Franz
+    start = Utils::getCurrentMs();
 
-        if(image) {
-            if(image->isOpen()) {
-                DWORD start, end;
+    Debug::out(LOG_DEBUG, "Encoding image: %s", image->getFileName());
+    MfmCachedImage *encImage = new MfmCachedImage();    // always encode into new image, the published ones are never modified
+    encImage->encodeAndCacheImage(image, true);
+
+    end = Utils::getCurrentMs();
+    Debug::out(LOG_DEBUG, "Encoding of image %s done, took %d ms", image->getFileName(), (int) (end - start));
+
+    if(!sigintReceived) {                               // encoding not interrupted? hand it over to core thread - just swaps pointer, no copying
+        publishEncodedImage(er.slot, encImage);
+    }
 
-                // encode image - convert it from file to preprocessed stream for Franz
-                start = Utils::getCurrentMs();
+    encImage->release();                                // we don't need our reference anymore
 
-                Debug::out(LOG_DEBUG, "Encoding image: %s", image->getFileName());
-                encImage.encodeAndCacheImage(image, true);
+    // keep the image open, so the written sectors could be applied to it
+    er.slot->image          = image;
+    er.slot->writeBackPath  = image->isInMemoryOnly() ? "" : er.writeBackPath;                  // image extracted from ZIP file can't be written back
+}
+
+void ImageSilo::processWriteRequests(SiloSlot *slot, std::vector<EncodeRequest> &writes)
+{
+    if(!slot->image) {                                      // no image in this slot? can't write
+        Debug::out(LOG_DEBUG, "ImageSilo::processWriteRequests -- no image to write to, ignoring %d written sectors", (int) writes.size());
+        return;
+    }
 
-                end = Utils::getCurrentMs();
-                Debug::out(LOG_DEBUG, "Encoding of image %s done, took %d ms", image->getFileName(), (int) (end - start));
+    MfmDecoder  decoder;
+    BYTE        sectorData[512];
+    bool        trackChanged[MAX_TRACKS];
+    bool        anyChanged = false;
 
-                //----------------
-                // copy the image from encode thread to main thread
-                start = Utils::getCurrentMs();
+    memset(trackChanged, 0, sizeof(trackChanged));
 
-                pthread_mutex_lock(&floppyEncodeQueueMutex);        // lock the mutex
-                er.encImg->copyFromOther(encImage);                    // this is not thread safe as it copies data from one thread to another
-                pthread_mutex_unlock(&floppyEncodeQueueMutex);        // unlock the mutex
+    for(size_t i=0; i<writes.size(); i++) {
+        EncodeRequest &wr = writes[i];
 
-                end = Utils::getCurrentMs();
-                Debug::out(LOG_DEBUG, "Copying between threads took %d ms", (int) (end - start));
-            } else {
-                Debug::out(LOG_DEBUG, "Encoding of image %s failed - image is not open", image->getFileName());
+        if(wr.mfmData.size() == 0 || !decoder.decodeSector(&wr.mfmData[0], wr.mfmData.size(), sectorData)) {     // couldn't get valid sector data?
+            Debug::out(LOG_ERROR, "ImageSilo::processWriteRequests -- failed to decode sector - track %d, side %d, sector %d", wr.track, wr.side, wr.sector);
+            continue;
+        }
+
+        if(!slot->image->writeSector(wr.track, wr.side, wr.sector, sectorData)) {
+            Debug::out(LOG_ERROR, "ImageSilo::processWriteRequests -- failed to write sector - track %d, side %d, sector %d", wr.track, wr.side, wr.sector);
+            continue;
+        }
+
+        int index = wr.track * 2 + wr.side;
+        if(index >= 0 && index < MAX_TRACKS) {
+            trackChanged[index] = true;
+            anyChanged          = true;
+        }
+    }
+
+    if(!anyChanged) {
+        return;
+    }
+
+    // the published image can't be changed, so re-encode the changed tracks in a copy of it and publish the copy
+    MfmCachedImage *oldImage = acquireEncodedImage(slot);
+
+    if(oldImage) {
+        MfmCachedImage *newImage = oldImage->createCopy();
+        oldImage->release();
+
+        for(int i=0; i<MAX_TRACKS; i++) {
+            if(trackChanged[i]) {
+                newImage->encodeAndCacheTrack(slot->image, i / 2, i % 2);
             }
-            delete image;
-            image = NULL;
         }
 
-        floppyEncodingRunning = false;
+        publishEncodedImage(slot, newImage);
+        newImage->release();
     }
 
-    floppyEncodingRunning = false;
+    // mark the image for saving, the saving will happen later
+    slot->lastWriteTime = Utils::getCurrentMs();
+
+    if(!slot->imageDirty) {
+        slot->imageDirty = true;
+        dirtySlots.push_back(slot);
+    }
+}
+
+void ImageSilo::saveDirtyImages(bool force)
+{
+    DWORD now = Utils::getCurrentMs();
+
+    for(size_t i=0; i<dirtySlots.size(); ) {
+        SiloSlot *slot = dirtySlots[i];
+
+        if(!force && (now - slot->lastWriteTime) < WRITE_BEHIND_DELAY_MS) {   // written recently? more writes might come, save it later
+            i++;
+            continue;
+        }
+
+        dirtySlots.erase(dirtySlots.begin() + i);
+        slot->imageDirty = false;
+
+        if(!slot->image) {
+            continue;
+        }
+
+        DWORD start = Utils::getCurrentMs();
+        bool res = slot->image->saveImage();
+
+        if(res && !slot->writeBackPath.empty()) {           // got the original image somewhere else? update it too
+            std::string src = slot->image->getFileName();
+            res = Utils::copyFile(src, slot->writeBackPath);
+        }
+
+        Debug::out(LOG_DEBUG, "ImageSilo::saveDirtyImages -- saving %s %s, took %d ms", slot->image->getFileName(), res ? "succeeded" : "failed", (int) (Utils::getCurrentMs() - start));
+    }
+}
+
+void ImageSilo::initSlot(SiloSlot *slot)
+{
+    slot->encImage      = NULL;
+    slot->newContent    = false;
+    slot->image         = NULL;
+    slot->imageDirty    = false;
+    slot->lastWriteTime = 0;
+}
+
+void ImageSilo::processTracksChanged(EncodeRequest &er)
+{
+    MfmCachedImage *oldImage = acquireEncodedImage(er.slot);
+
+    if(!oldImage || !er.slot->image) {                      // nothing encoded in this slot yet? encode it whole
+        if(oldImage) {
+            oldImage->release();
+        }
+
+        processEncodeRequest(er);
+        return;
+    }
+
+    FloppyImage *image = FloppyImageFactory::getImage(er.filename.c_str());
+
+    if(!image || !image->isOpen()) {
+        Debug::out(LOG_ERROR, "ImageSilo::processTracksChanged -- failed to open %s", er.filename.c_str());
+        delete image;
+        oldImage->release();
+        return;
+    }
+
+    // the file content is what counts now - sectors written by ST and not saved yet would overwrite it
+    dropDirtySlot(er.slot);
+    delete er.slot->image;
+    er.slot->image = image;
+
+    // the published image can't be changed, so re-encode the changed tracks in a copy of it and publish the copy
+    MfmCachedImage *newImage = oldImage->createCopy();
+    oldImage->release();
+
+    for(size_t i=0; i<er.tracks.size(); i++) {
+        int t = er.tracks[i];
+
+        if(t >= 0 && t < MAX_TRACKS) {
+            newImage->encodeAndCacheTrack(image, t / 2, t % 2);
+        }
+    }
+
+    Debug::out(LOG_DEBUG, "ImageSilo::processTracksChanged -- %s: re-encoded %d tracks", er.filename.c_str(), (int) er.tracks.size());
+
+    publishEncodedImage(er.slot, newImage);
+    newImage->release();
+}
+
+void ImageSilo::dropDirtySlot(SiloSlot *slot)
+{
+    for(size_t i=0; i<dirtySlots.size(); i++) {
+        if(dirtySlots[i] == slot) {
+            dirtySlots.erase(dirtySlots.begin() + i);
+            break;
+        }
+    }
+
+    slot->imageDirty = false;
+}
+
+void ImageSilo::closeSlotImage(SiloSlot *slot)
+{
+    if(slot->imageDirty) {                                  // got unsaved writes? save them now
+        for(size_t i=0; i<dirtySlots.size(); i++) {
+            if(dirtySlots[i] == slot) {                     // move it to the front of list and save just this one
+                dirtySlots.erase(dirtySlots.begin() + i);
+                break;
+            }
+        }
+
+        dirtySlots.insert(dirtySlots.begin(), slot);
+        slot->lastWriteTime = Utils::getCurrentMs() - WRITE_BEHIND_DELAY_MS;     // make it old enough to be saved now
+        saveDirtyImages(false);
+    }
+
+    delete slot->image;
+    slot->image = NULL;
+    slot->writeBackPath.clear();
+}
+
+void ImageSilo::publishEncodedImage(SiloSlot *slot, MfmCachedImage *encImage)
+{
+    encImage->addRef();                                     // the slot will hold one reference
+
+    pthread_mutex_lock(&encodedImagePublishMutex);          // lock only for the pointer swap
+    MfmCachedImage *oldImage = slot->encImage;
+    slot->encImage      = encImage;
+    slot->newContent    = true;                             // we got new content!
+    pthread_mutex_unlock(&encodedImagePublishMutex);
+
+    if(oldImage) {                                          // release the old image outside of lock, it gets deleted when the last user releases it
+        oldImage->release();
+    }
+}
+
+MfmCachedImage *ImageSilo::acquireEncodedImage(SiloSlot *slot)
+{
+    pthread_mutex_lock(&encodedImagePublishMutex);          // lock only for the pointer read and reference increment
+    MfmCachedImage *encImage = slot->encImage;
+
+    if(encImage) {
+        encImage->addRef();
+    }
+    pthread_mutex_unlock(&encodedImagePublishMutex);
+
+    return encImage;
 }
 
 void *floppyEncodeThreadCode(void *ptr)
@@ -138,6 +408,7 @@ ImageSilo::ImageSilo()
     //-----------
     // init slots
     for(int i=0; i<4; i++) {
+        initSlot(&slots[i]);
         clearSlot(i);
     }
 
@@ -154,9 +425,10 @@ ImageSilo::ImageSilo()
 
         EncodeRequest er;
 
+        er.type         = ENCODE_REQ_IMAGE;
         er.slotIndex    = EMPTY_IMAGE_SLOT;
         er.filename        = EMPTY_IMAGE_PATH;
-        er.encImg        = &slots[EMPTY_IMAGE_SLOT].encImage;
+        er.slot            = &slots[EMPTY_IMAGE_SLOT];
 
         addEncodeRequest(er);
 
@@ -171,6 +443,20 @@ ImageSilo::ImageSilo()
 ImageSilo::~ImageSilo()
 {
     delete []emptyTrack;
+
+    for(int i=0; i<4; i++) {                    // release the encoded images
+        pthread_mutex_lock(&encodedImagePublishMutex);
+        MfmCachedImage *encImage = slots[i].encImage;
+        slots[i].encImage = NULL;
+        pthread_mutex_unlock(&encodedImagePublishMutex);
+
+        if(encImage) {
+            encImage->release();
+        }
+
+        delete slots[i].image;                  // encoder thread doesn't run anymore, so close the images here
+        slots[i].image = NULL;
+    }
 }
 
 BYTE *ImageSilo::getEmptyTrack(void)
@@ -268,9 +554,11 @@ void ImageSilo::add(int positionIndex, std::string &filename, std::string &hostD
     // create and add floppy encode request
     EncodeRequest er;
 
+    er.type         = ENCODE_REQ_IMAGE;
     er.slotIndex    = positionIndex;
     er.filename        = hostDestPath;
-    er.encImg        = &slots[positionIndex].encImage;
+    er.writeBackPath   = hostSrcPath;
+    er.slot            = &slots[positionIndex];
 
     addEncodeRequest(er);
 
@@ -331,6 +619,11 @@ void ImageSilo::remove(int index)                   // remove image at specified
         return;
     }
 
+    // save the sectors written to it till now and close it, otherwise a pending save would bring the file back
+    pthread_mutex_lock(&slotImageMutex);
+    closeSlotImage(&slots[index]);
+    pthread_mutex_unlock(&slotImageMutex);
+
     // delete the file from /tmp
     unlink(slots[index].hostDestPath.c_str());
 
@@ -340,6 +633,37 @@ void ImageSilo::remove(int index)                   // remove image at specified
     saveSettings();
 }
 
+bool ImageSilo::refreshFromDirectory(int index, const char *sourceDirectory)
+{
+    if(index < 0 || index > 2 || slots[index].hostDestPath.empty()) {
+        return false;
+    }
+
+    // the encoder thread must not save ST writes into the file while dir2fdd rewrites it, and not after that either
+    std::vector<int> tracks;
+
+    pthread_mutex_lock(&slotImageMutex);
+    dropDirtySlot(&slots[index]);
+    bool res = CDirectory::dir2fdd((char *) sourceDirectory, (char *) slots[index].hostDestPath.c_str(), &tracks);
+    pthread_mutex_unlock(&slotImageMutex);
+
+    if(!res || tracks.empty()) {                    // failed, or nothing changed - nothing to encode
+        return res;
+    }
+
+    EncodeRequest er;
+
+    er.type             = ENCODE_REQ_TRACKS_CHANGED;
+    er.slotIndex        = index;
+    er.filename         = slots[index].hostDestPath;
+    er.writeBackPath    = slots[index].hostSrcPath;
+    er.slot             = &slots[index];
+    er.tracks           = tracks;
+
+    addEncodeRequest(er);
+    return true;
+}
+
 void ImageSilo::dumpStringsToBuffer(BYTE *bfr)      // copy the strings to buffer
 {
     memset(bfr, 0, 512);
@@ -384,7 +708,7 @@ void ImageSilo::setCurrentSlot(int index)
         floppyImageSelected = -1;
     }
 
-    slots[currentSlot].encImage.newContent = false;     // current slot content not changed
+    slots[currentSlot].newContent = false;              // current slot content not changed
 
     // set the floppy line on display
     char tmp[32];
@@ -406,20 +730,75 @@ int ImageSilo::getCurrentSlot(void)
     return currentSlot;
 }
 
-BYTE *ImageSilo::getEncodedTrack(int track, int side, int &bytesInBuffer)
+MfmCachedImage *ImageSilo::acquireCurrentImage(void)
 {
-    BYTE *pTrack;
+    return acquireEncodedImage(&slots[currentSlot]);     // get image from current slot, caller must release() it
+}
 
-    pthread_mutex_lock(&floppyEncodeQueueMutex);                                        // lock the mutex
-    pTrack = slots[currentSlot].encImage.getEncodedTrack(track, side, bytesInBuffer);    // get data from current slot
-    pthread_mutex_unlock(&floppyEncodeQueueMutex);                                        // unlock the mutex
+void ImageSilo::sectorWritten(BYTE *franzData, int franzCount)
+{
+    if(currentSlot == EMPTY_IMAGE_SLOT) {               // no image inserted? nowhere to write
+        return;
+    }
+
+    // the decoding and re-encoding is done in encoder thread, so just pass the data there
+    EncodeRequest er;
 
-    return pTrack;
+    if(!parseWrittenSector(franzData, franzCount, er)) {
+        return;
+    }
+
+    er.slotIndex    = currentSlot;
+    er.slot         = &slots[currentSlot];
+
+    addEncodeRequest(er);
+}
+
+bool ImageSilo::parseWrittenSector(BYTE *franzData, int franzCount, EncodeRequest &er)
+{
+    if(franzCount < 2) {
+        return false;
+    }
+
+    // get the written sector, side, track number
+    er.type     = ENCODE_REQ_SECTOR_WRITTEN;
+    er.sector   = franzData[0];
+    er.track    = franzData[1] & 0x7f;
+    er.side     = (franzData[1] & 0x80) ? 1 : 0;
+
+    Debug::out(LOG_DEBUG, "ImageSilo::parseWrittenSector -- track %d, side %d, sector %d", er.track, er.side, er.sector);
+
+    // the rest are WORDs with MFM times (first time in highest bits), terminated by zero WORD,
+    // but they came as low byte first, so swap them to get the times in order for MfmDecoder
+    er.mfmData.clear();
+    er.mfmData.reserve(franzCount);
+
+    for(int i=2; (i + 1) < franzCount; i += 2) {
+        if(franzData[i] == 0 && franzData[i + 1] == 0) {    // terminating zero WORD? done
+            break;
+        }
+
+        er.mfmData.push_back(franzData[i + 1]);
+        er.mfmData.push_back(franzData[i]);
+    }
+
+    return true;
 }
 
 bool ImageSilo::getParams(int &tracks, int &sides, int &sectorsPerTrack)
 {
-    return slots[currentSlot].encImage.getParams(tracks, sides, sectorsPerTrack);
+    MfmCachedImage *encImage = acquireCurrentImage();
+
+    if(!encImage) {                                     // nothing encoded in this slot yet
+        tracks          = 0;
+        sides           = 0;
+        sectorsPerTrack = 0;
+        return false;
+    }
+
+    bool res = encImage->getParams(tracks, sides, sectorsPerTrack);
+    encImage->release();
+    return res;
 }
 
 bool ImageSilo::containsImage(const char *filename)    // check if image with this filename exists in silo
@@ -437,8 +816,8 @@ bool ImageSilo::containsImage(const char *filename)    // check if image with th
 
 bool ImageSilo::currentSlotHasNewContent(void)
 {
-    if(slots[currentSlot].encImage.newContent) {            // if the current slot has new content
-        slots[currentSlot].encImage.newContent = false;     // set flag to false
+    if(slots[currentSlot].newContent) {                     // if the current slot has new content
+        slots[currentSlot].newContent = false;              // set flag to false
         return true;                                        // return that the content is new
     }
 
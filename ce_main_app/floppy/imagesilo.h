@@ -6,6 +6,7 @@
 
 #include <string>
 #include <queue>
+#include <vector>
 
 #include "../datatypes.h"
 #include "../settingsreloadproxy.h"
@@ -17,6 +18,9 @@
 #define EMPTY_IMAGE_SLOT        3
 #define EMPTY_IMAGE_PATH        "/tmp/emptyimage.st"
 
+// written sectors are saved to image file only after no other sector was written for this long - one file update per burst of writes
+#define WRITE_BEHIND_DELAY_MS   1500
+
 //-------------------------------------------
 // these globals here are just for status report
 typedef struct
@@ -32,14 +36,34 @@ typedef struct
     std::string     atariSrcPath;   // from where the file was uploaded:   C:\gamez\bla.st
     std::string     hostSrcPath;    // for translated disk, host path:     /mnt/sda/gamez/bla.st
 
-    MfmCachedImage  encImage;
+    MfmCachedImage  *encImage;      // encoded image, published by encoder thread - use ImageSilo::acquireEncodedImage() to get it
+    volatile bool   newContent;     // set when a new encoded image was published to this slot
+
+    // following members are used by the encoder thread, other threads touch them only with slotImageMutex locked
+    FloppyImage     *image;         // the opened image, kept in memory so written sectors could be applied to it
+    std::string     writeBackPath;  // where the original image is, it's updated after saving the image (empty if nowhere)
+    bool            imageDirty;     // image has written sectors which were not saved to file yet
+    DWORD           lastWriteTime;  // when the last sector was written, used for coalescing of writes to file
 } SiloSlot;
 
+#define ENCODE_REQ_IMAGE            0   // open the image and encode it whole
+#define ENCODE_REQ_SECTOR_WRITTEN   1   // ST has written a sector - apply it to the image and re-encode the track
+#define ENCODE_REQ_TRACKS_CHANGED   2   // image file was rewritten on host (e.g. by dir2fdd) - re-read it and re-encode just the changed tracks
+
 typedef struct
 {
+    int                type;                    // one of ENCODE_REQ_* values
     int                slotIndex;                // number of slot for which this is done
     std::string        filename;                // file name and path where the image is located
-    MfmCachedImage    *encImg;                // pointer to where this image should be stored after encoding
+    std::string        writeBackPath;           // for ENCODE_REQ_IMAGE - where the original image is located (e.g. on translated disk)
+    SiloSlot          *slot;                    // pointer to slot where this image should be published after encoding
+
+    int                track;                   // for ENCODE_REQ_SECTOR_WRITTEN - position of written sector
+    int                side;
+    int                sector;
+    std::vector<BYTE>  mfmData;                 // for ENCODE_REQ_SECTOR_WRITTEN - written MFM stream as received from Franz
+
+    std::vector<int>   tracks;                  // for ENCODE_REQ_TRACKS_CHANGED - changed tracks as track * 2 + side
 } EncodeRequest;
 
 void *floppyEncodeThreadCode(void *ptr);
@@ -60,13 +84,15 @@ public:
     BYTE getSlotBitmap(void);
     void setCurrentSlot(int index);
     int  getCurrentSlot(void);
-    BYTE *getEncodedTrack(int track, int side, int &bytesInBuffer);
+    MfmCachedImage *acquireCurrentImage(void);
+    void sectorWritten(BYTE *franzData, int franzCount);
     bool getParams(int &tracks, int &sides, int &sectorsPerTrack);
     BYTE *getEmptyTrack(void);
 
     void add(int positionIndex, std::string &filename, std::string &hostDestPath, std::string &atariSrcPath, std::string &hostSrcPath, bool saveToSettings);
     void swap(int index);
     void remove(int index);
+    bool refreshFromDirectory(int index, const char *sourceDirectory);     // slot holds image made by dir2fdd - sync it with the directory
 
     bool containsImage(const char *filename);
     bool currentSlotHasNewContent(void);
@@ -79,7 +105,21 @@ public:
     static SiloSlotSimple * getFloppyImageSimple(int index);
     static bool getFloppyEncodingRunning(void);
 
+    // publishing and getting of the encoded image without copying - the returned image must be released by caller
+    static void publishEncodedImage(SiloSlot *slot, MfmCachedImage *encImage);
+    static MfmCachedImage *acquireEncodedImage(SiloSlot *slot);
+
+    // these are called from the encoder thread, they are public so they could be tested without the thread
+    static bool parseWrittenSector(BYTE *franzData, int franzCount, EncodeRequest &er);
+    static void processEncodeRequest(EncodeRequest &er);
+    static void processWriteRequests(SiloSlot *slot, std::vector<EncodeRequest> &writes);
+    static void processTracksChanged(EncodeRequest &er);
+    static void saveDirtyImages(bool force);
+    static void initSlot(SiloSlot *slot);
+    static void closeSlotImage(SiloSlot *slot);
+
 private:
+    static void dropDirtySlot(SiloSlot *slot);
     void clearSlot(int index);
     static void addEncodeRequest(EncodeRequest &er);
 
@@ -91,7 +131,10 @@ private:
 
     static pthread_mutex_t floppyEncodeQueueMutex;
     static pthread_cond_t floppyEncodeQueueNotEmpty;
+    static pthread_mutex_t encodedImagePublishMutex;
+    static pthread_mutex_t slotImageMutex;
     static std::queue<EncodeRequest> encodeQueue;
+    static std::vector<SiloSlot *> dirtySlots;
     static volatile bool shouldStop;
 
     static volatile bool floppyEncodingRunning;
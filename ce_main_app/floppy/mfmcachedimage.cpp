@@ -16,7 +16,10 @@ FILE *f;
 
 MfmCachedImage::MfmCachedImage()
 {
-    gotImage = false;
+    refCount        = 1;        // the creator holds the first reference
+    gotImage        = false;
+    bufferOfBytes   = false;
+    trackData   = NULL;
     initTracks();
 
     #ifdef DUMPTOFILE
@@ -28,8 +31,6 @@ MfmCachedImage::MfmCachedImage()
 	params.spt		= 0;
     
     CRC = 0;
-    
-    newContent = false;         // no new content (yet)
 }
 
 MfmCachedImage::~MfmCachedImage()
@@ -47,9 +48,9 @@ MfmCachedImage::~MfmCachedImage()
 // If true, swap bytes, don't append zeros. If false, no swapping, but append zeros.
 void MfmCachedImage::encodeAndCacheImage(FloppyImage *img, bool bufferOfBytes)
 {
-    if(gotImage) {                  // got some older image? delete it from memory
-        deleteCachedImage();
-    }
+    this->bufferOfBytes = bufferOfBytes;        // store it for re-encoding of single tracks
+
+    deleteCachedImage();            // got some older image? delete it from memory
 
     if(!img->isOpen()) {            // image file not open? quit
         return;
@@ -65,6 +66,9 @@ void MfmCachedImage::encodeAndCacheImage(FloppyImage *img, bool bufferOfBytes)
 	
     BYTE buffer[20480];
     int bytesStored;
+
+    trackData = new BYTE[MAX_TRACKS * MFM_TRACK_SIZE];                      // allocate all the tracks at once -- one block instead of one allocation per track
+    memset(trackData, 0, MAX_TRACKS * MFM_TRACK_SIZE);                      // set everything to 0
 	
 	DWORD after50ms = Utils::getEndTime(50);								// this will help to add pauses at least every 50 ms to allow other threads to do stuff
 
@@ -92,19 +96,7 @@ void MfmCachedImage::encodeAndCacheImage(FloppyImage *img, bool bufferOfBytes)
                 continue;
             }
 
-            tracks[index].bytesInStream = bytesStored;                      // store the data count
-            tracks[index].mfmStream     = new BYTE[15000];                  // allocate memory -- we're transfering 15'000 bytes, so allocate this much
-
-            memset(tracks[index].mfmStream, 0, 15000);                      // set other to 0
-            memcpy(tracks[index].mfmStream, buffer, bytesStored);           // copy the memory block
-
-            if(bufferOfBytes) {                                            // if not working on buffer of bytes, swap BYTEs in WORD
-                for(int i=0; i<15000; i += 2) {
-                    BYTE tmp                        = tracks[index].mfmStream[i + 0];
-                    tracks[index].mfmStream[i + 0]  = tracks[index].mfmStream[i + 1];
-                    tracks[index].mfmStream[i + 1]  = tmp;
-                }
-            }
+            storeTrack(index, buffer, bytesStored);
 
             #ifdef DUMPTOFILE
             if(f) {
@@ -114,10 +106,69 @@ void MfmCachedImage::encodeAndCacheImage(FloppyImage *img, bool bufferOfBytes)
         }
     }
 
-    newContent  = true;      // we got new content!
     gotImage    = true;
 }
 
+void MfmCachedImage::storeTrack(int index, BYTE *buffer, int bytesStored)
+{
+    tracks[index].bytesInStream = bytesStored;                          // store the data count
+    tracks[index].mfmStream     = trackData + (index * MFM_TRACK_SIZE); // point to this track in the big block
+
+    memset(tracks[index].mfmStream, 0, MFM_TRACK_SIZE);                 // set other to 0
+    memcpy(tracks[index].mfmStream, buffer, bytesStored);               // copy the memory block
+
+    if(bufferOfBytes) {                                                 // if not working on buffer of bytes, swap BYTEs in WORD
+        for(int i=0; i<MFM_TRACK_SIZE; i += 2) {
+            BYTE tmp                        = tracks[index].mfmStream[i + 0];
+            tracks[index].mfmStream[i + 0]  = tracks[index].mfmStream[i + 1];
+            tracks[index].mfmStream[i + 1]  = tmp;
+        }
+    }
+}
+
+MfmCachedImage *MfmCachedImage::createCopy(void)
+{
+    MfmCachedImage *copy = new MfmCachedImage();
+
+    copy->params        = params;
+    copy->bufferOfBytes = bufferOfBytes;
+
+    if(!gotImage) {                                                     // nothing encoded? return empty copy
+        return copy;
+    }
+
+    copy->trackData = new BYTE[MAX_TRACKS * MFM_TRACK_SIZE];
+    memcpy(copy->trackData, trackData, MAX_TRACKS * MFM_TRACK_SIZE);    // single copy of the whole contiguous block
+
+    for(int i=0; i<MAX_TRACKS; i++) {                                   // point the tracks to the same places in the copied block
+        if(tracks[i].mfmStream != NULL) {
+            copy->tracks[i].mfmStream       = copy->trackData + (i * MFM_TRACK_SIZE);
+            copy->tracks[i].bytesInStream   = tracks[i].bytesInStream;
+        }
+    }
+
+    copy->gotImage = true;
+    return copy;
+}
+
+void MfmCachedImage::encodeAndCacheTrack(FloppyImage *img, int track, int side)
+{
+    if(!gotImage || !img->isOpen()) {                                   // no encoded image or no source image? quit
+        return;
+    }
+
+    int index = track * 2 + side;
+    if(track < 0 || track >= params.tracks || side < 0 || side >= params.sides || index >= MAX_TRACKS) {   // out of bounds?
+        return;
+    }
+
+    BYTE buffer[20480];
+    int bytesStored;
+
+    encodeSingleTrack(img, side, track, params.spt, buffer, bytesStored, bufferOfBytes);
+    storeTrack(index, buffer, bytesStored);
+}
+
 void MfmCachedImage::encodeSingleTrack(FloppyImage *img, int side, int track, int sectorsPerTrack, BYTE *buffer, int &bytesStored, bool bufferOfBytes)
 {
     int countInSect, countInTrack=0;
@@ -152,16 +203,10 @@ void MfmCachedImage::encodeSingleTrack(FloppyImage *img, int side, int track, in
 
 void MfmCachedImage::deleteCachedImage(void)
 {
-    if(!gotImage) {
-        return;
-    }
-
-    for(int i=0; i<MAX_TRACKS; i++) {
-        delete []tracks[i].mfmStream;
+    initTracks();               // tracks just point inside trackData, so just forget them
 
-        tracks[i].bytesInStream = 0;
-        tracks[i].mfmStream     = NULL;
-    }
+    delete []trackData;
+    trackData = NULL;
 
     gotImage = false;
 }
@@ -196,56 +241,16 @@ void MfmCachedImage::initTracks(void)
     }
 }
 
-void MfmCachedImage::copyFromOther(MfmCachedImage &other)
+void MfmCachedImage::addRef(void)
 {
-	initTracks();
-	
-	DWORD after50ms = Utils::getEndTime(50);							// this will help to add pauses at least every 50 ms to allow other threads to do stuff
-	
-	other.getParams(params.tracks, params.sides, params.spt);			// get the params from other image
-	gotImage = true;													// and mark that we got the image
-	
-    for(int side=0; side<2; side++) {									// copy both sides
-		for(int track=0; track<params.tracks; track++) {				// copy all the tracks
-			if(Utils::getCurrentMs() > after50ms) {						// if at least 50 ms passed since start or previous pause, add a small pause so other threads could do stuff
-				Utils::sleepMs(5);
-				after50ms = Utils::getEndTime(50);
-			}
+    __sync_fetch_and_add(&refCount, 1);
+}
 
-   			if(sigintReceived) {                                        // app terminated? quit
-                return;
-            }
-            
-			int bytesInBuffer;
-			BYTE *src = other.getEncodedTrack(track, side, bytesInBuffer);	// get pointer to source track
-	
-			int index = track * 2 + side;
-			if(index >= MAX_TRACKS) {                                   // index out of bounds?
-				continue;
-			}
-			
-			TCachedTrack *dest = &tracks[index];						// get pointer to destination track
-
-			if(src == NULL) {											// skip this empty SOURCE track
-				if(dest->mfmStream != NULL) {
-					memset(dest->mfmStream, 0, 15000);					// ....but clear it
-					dest->bytesInStream = 0;
-				}
-				
-				continue;
-			}
-			
-			if(dest->mfmStream == NULL) {								// destination not allocated? 
-				dest->mfmStream = new BYTE[15000];						// allocate memory -- we're transferring 15'000 bytes, so allocate this much
-				memset(dest->mfmStream, 0, 15000);						// set other to 0
-			}
-			
-			memcpy(dest->mfmStream, src, bytesInBuffer);				// copy data and copy the data count
-			dest->bytesInStream = bytesInBuffer;
-		}
+void MfmCachedImage::release(void)
+{
+    if(__sync_sub_and_fetch(&refCount, 1) == 0) {      // this was the last reference? delete it
+        delete this;
     }
-    
-    newContent  = true;      // we got new content!
 }
 
 bool MfmCachedImage::createMfmStream(FloppyImage *img, int side, int track, int sector, BYTE *buffer, int &count)
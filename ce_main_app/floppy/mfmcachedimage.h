@@ -6,6 +6,9 @@
 // maximum 2 sides, 85 tracks per side
 #define MAX_TRACKS      (2 * 85)
 
+// we're transfering 15'000 bytes per track to Franz, so each track occupies this much
+#define MFM_TRACK_SIZE  15000
+
 typedef struct {
     int     track;
     int     side;
@@ -14,26 +17,35 @@ typedef struct {
     int     bytesInStream;
 } TCachedTrack;
 
+// The encoded image is created and encoded by the encoder thread, and once encoded, it's never modified again.
+// It's then shared between threads by reference counting - the creator holds the first reference,
+// every other user calls addRef() / release(), and the last release() deletes the object.
 class MfmCachedImage
 {
 public:
     MfmCachedImage();
-    virtual ~MfmCachedImage();
 
     // bufferOfBytes -- the datas are transfered as WORDs, but are they stored as bytes?
     // If true, swap bytes, don't append zeros. If false, no swapping, but append zeros.
     void encodeAndCacheImage(FloppyImage *img, bool bufferOfBytes=false);
     void deleteCachedImage(void);
+
+    // for incremental re-encoding after sector write: copy the encoded image, then re-encode just the changed track in the copy
+    MfmCachedImage *createCopy(void);
+    void encodeAndCacheTrack(FloppyImage *img, int track, int side);
     
 	BYTE *getEncodedTrack(int track, int side, int &bytesInBuffer);
 	bool getParams(int &tracks, int &sides, int &sectorsPerTrack);
 
-	void copyFromOther(MfmCachedImage &other);
-	
-    bool newContent;
-    
+    void addRef(void);
+    void release(void);
+
 private:
+    virtual ~MfmCachedImage();                  // use release() instead of delete
+
+    volatile int refCount;
     bool gotImage;
+    bool bufferOfBytes;
 
 	struct {
 		int tracks;
@@ -42,9 +54,11 @@ private:
 	} params;
 	
     TCachedTrack tracks[MAX_TRACKS];
+    BYTE                *trackData;             // one contiguous block for all the tracks, tracks[].mfmStream point inside of it
     WORD                CRC;
 
     void initTracks(void);
+    void storeTrack(int index, BYTE *buffer, int bytesStored);
     void encodeSingleTrack(FloppyImage *img, int side, int track, int sectorsPerTrack,  BYTE *buffer, int &bytesStored, bool bufferOfBytes=false);
 
     void appendCurrentSectorCommand(int track, int side, int sector, BYTE *buffer, int &count);
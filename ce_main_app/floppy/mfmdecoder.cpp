@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "mfmdecoder.h"
 #include "../debug.h"
 
@@ -50,6 +52,65 @@ void MfmDecoder::decodeStream(BYTE *inStream, int inCount, BYTE *outData, int &o
     outCount = index;                           // and store the count of data decoded
 }
 
+bool MfmDecoder::decodeSector(BYTE *inStream, int inCount, BYTE *sectorData)
+{
+    // each input byte holds 4 MFM times, which is at most 4 decoded bits, so decoded data will never be longer than input
+    BYTE *outData = new BYTE[inCount + 16];
+    int   outCount;
+
+    patCount = 0;                               // start decoding from clean state
+    bitCount = 0;
+    byte     = 0;
+
+    decodeStream(inStream, inCount, outData, outCount);
+
+    bool found = false;
+
+    // the written sector is: gap, 3x A1 mark, FB (data address mark), 512 bytes of data, 2 bytes of CRC
+    for(int i=0; i<(outCount - 1 - 512 - 2); i++) {
+        if(outData[i] != 0xa1 || outData[i + 1] != 0xfb) {     // not the last A1 mark followed by data address mark? skip it
+            continue;
+        }
+
+        BYTE *data  = &outData[i + 2];
+        WORD crcIs  = (((WORD) data[512]) << 8) | ((WORD) data[513]);
+
+        BYTE crcData[4 + 512];                  // CRC is calculated from 3x A1, FB and the data
+        crcData[0] = 0xa1;
+        crcData[1] = 0xa1;
+        crcData[2] = 0xa1;
+        crcData[3] = 0xfb;
+        memcpy(crcData + 4, data, 512);
+
+        WORD crcShouldBe = calcCrc(crcData, 4 + 512);
+
+        if(crcIs != crcShouldBe) {              // CRC mismatch? try to find another data mark
+            Debug::out(LOG_DEBUG, "MfmDecoder::decodeSector -- CRC mismatch: %04x != %04x", crcIs, crcShouldBe);
+            continue;
+        }
+
+        memcpy(sectorData, data, 512);
+        found = true;
+        break;
+    }
+
+    delete []outData;
+    return found;
+}
+
+WORD MfmDecoder::calcCrc(BYTE *data, int count)
+{
+    WORD crc = 0xffff;
+
+    for(int j=0; j<count; j++) {
+        for(int i=0; i<8; i++) {
+            crc = ((crc << 1) ^ ((((crc >> 8) ^ (data[j] << i)) & 0x0080) ? 0x1021 : 0));
+        }
+    }
+
+    return crc;
+}
+
 void MfmDecoder::appendEncodedByte(BYTE val)
 {
     for(int i=0; i<4; i++) {
@@ -81,7 +142,10 @@ void MfmDecoder::appendEncodedByte(BYTE val)
             appendToSync(8);
             break;
 
-        default: 
+        case 0:                                 // no time here - Franz didn't fill the whole WORD, skip it
+            break;
+
+        default:
             Debug::out(LOG_ERROR, "appendEncodedByte -- something is wrong...");
             break;
         }
@@ -11,11 +11,15 @@ public:
 
     void decodeStream(BYTE *inStream, int inCount, BYTE *outData, int &outCount);
 
+    // decode the stream of written sector, find the data record in it and check CRC, returns true if got valid 512 bytes of sector data
+    bool decodeSector(BYTE *inStream, int inCount, BYTE *sectorData);
+
 private:
     void addNormalBit(BYTE bit);
     void appendPatternBit(BYTE bit);
     void appendEncodedByte(BYTE val);
     bool appendToSync(WORD val);
+    WORD calcCrc(BYTE *data, int count);
 
     BYTE    *decoded;
     int     index;
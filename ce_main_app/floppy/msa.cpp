@@ -378,12 +378,12 @@ bool MSA_WriteDisk(const char *pszFileName, Uint8 *pBuffer, int ImageSize)
 			if (nCompressedBytes < nBytesPerTrack)
 			{
 				// Yes, store size
-				Utils::storeWord(pMSABuffer, nCompressedBytes);
+				Utils::storeWord((Uint8 *)pMSADataLength, nCompressedBytes);
 			}
 			else
 			{
 				// No, just store uncompressed track
-				Utils::storeWord(pMSABuffer, nBytesPerTrack);
+				Utils::storeWord((Uint8 *)pMSADataLength, nBytesPerTrack);
 				pMSABuffer = ((Uint8 *)pMSADataLength) + 2;
 				pImageBuffer = pBuffer + (nBytesPerTrack*Side) + ((nBytesPerTrack*nSides)*Track);
 				memcpy(pMSABuffer,pImageBuffer, nBytesPerTrack);
@@ -395,8 +395,7 @@ bool MSA_WriteDisk(const char *pszFileName, Uint8 *pBuffer, int ImageSize)
 	// And save to file!
 	nRet = File_Save(pszFileName,pMSAImageBuffer, pMSABuffer-pMSAImageBuffer);
 
-	// don't free memory -- it will be freed in close();
-	//free(pMSAImageBuffer); 
+	free(pMSAImageBuffer);                      // the compressed image is only a workspace, the caller keeps its own buffer
 
 	return nRet;
 }
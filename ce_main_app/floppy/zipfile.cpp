@@ -0,0 +1,244 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "zipfile.h"
+#include "../debug.h"
+
+#define ZIP_SIG_LOCAL_HEADER    0x04034b50
+#define ZIP_SIG_CENTRAL_DIR     0x02014b50
+#define ZIP_SIG_END_OF_CD       0x06054b50
+
+#define ZIP_LOCAL_HEADER_SIZE   30
+#define ZIP_CENTRAL_DIR_SIZE    46
+#define ZIP_END_OF_CD_SIZE      22
+
+#define ZIP_METHOD_STORED       0
+#define ZIP_METHOD_DEFLATED     8
+
+#define ZIP_MAX_SIZE            (16 * 1024 * 1024)      // floppy images are small, so don't load anything huge
+
+ZipFile::ZipFile()
+{
+    zipData = NULL;
+    zipSize = 0;
+}
+
+ZipFile::~ZipFile()
+{
+    close();
+}
+
+void ZipFile::close(void)
+{
+    free(zipData);
+    zipData = NULL;
+    zipSize = 0;
+
+    entries.clear();
+}
+
+bool ZipFile::open(const char *fileName)
+{
+    close();
+
+    FILE *f = fopen(fileName, "rb");
+
+    if(!f) {
+        Debug::out(LOG_DEBUG, "ZipFile::open -- failed to open %s", fileName);
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);              // get the file size
+    int size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if(size < ZIP_END_OF_CD_SIZE || size > ZIP_MAX_SIZE) {
+        Debug::out(LOG_DEBUG, "ZipFile::open -- file %s has bad size: %d", fileName, size);
+        fclose(f);
+        return false;
+    }
+
+    zipData = (BYTE *) malloc(size);    // the whole ZIP file is read at once, the entries are then decompressed from memory
+    int res = fread(zipData, 1, size, f);
+    fclose(f);
+
+    if(res != size) {
+        Debug::out(LOG_DEBUG, "ZipFile::open -- failed to read %s", fileName);
+        close();
+        return false;
+    }
+
+    zipSize = size;
+
+    if(!readCentralDirectory()) {
+        Debug::out(LOG_DEBUG, "ZipFile::open -- %s is not a valid ZIP file", fileName);
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+int ZipFile::findEndOfCentralDirectory(void)
+{
+    // the end of central directory record is at the end of file, followed by comment of up to 64 kB
+    int lowest = zipSize - ZIP_END_OF_CD_SIZE - 0xffff;
+    if(lowest < 0) {
+        lowest = 0;
+    }
+
+    for(int i = zipSize - ZIP_END_OF_CD_SIZE; i >= lowest; i--) {
+        if(getDwordLE(zipData + i) == ZIP_SIG_END_OF_CD) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+bool ZipFile::readCentralDirectory(void)
+{
+    int eocd = findEndOfCentralDirectory();
+
+    if(eocd < 0) {
+        return false;
+    }
+
+    int   entryCount    = getWordLE (zipData + eocd + 10);
+    DWORD cdSize        = getDwordLE(zipData + eocd + 12);
+    DWORD cdOffset      = getDwordLE(zipData + eocd + 16);
+
+    if(cdOffset > (DWORD) zipSize || cdSize > (DWORD) zipSize - cdOffset) {   // central directory outside of file?
+        return false;
+    }
+
+    BYTE *p   = zipData + cdOffset;
+    BYTE *end = p + cdSize;
+
+    for(int i=0; i<entryCount; i++) {
+        if((p + ZIP_CENTRAL_DIR_SIZE) > end || getDwordLE(p) != ZIP_SIG_CENTRAL_DIR) {
+            return false;
+        }
+
+        WORD nameLen    = getWordLE(p + 28);
+        WORD extraLen   = getWordLE(p + 30);
+        WORD commentLen = getWordLE(p + 32);
+
+        if((p + ZIP_CENTRAL_DIR_SIZE + nameLen) > end) {
+            return false;
+        }
+
+        TZipEntry entry;
+        entry.encrypted         = (getWordLE(p + 8) & 1) != 0;
+        entry.method            = getWordLE (p + 10);
+        entry.crc               = getDwordLE(p + 16);
+        entry.compressedSize    = getDwordLE(p + 20);
+        entry.uncompressedSize  = getDwordLE(p + 24);
+        entry.localHeaderOffset = getDwordLE(p + 42);
+        entry.name.assign((const char *) (p + ZIP_CENTRAL_DIR_SIZE), nameLen);
+
+        entries.push_back(entry);
+
+        p += ZIP_CENTRAL_DIR_SIZE + nameLen + extraLen + commentLen;
+    }
+
+    return true;
+}
+
+int ZipFile::getEntryCount(void)
+{
+    return entries.size();
+}
+
+const TZipEntry *ZipFile::getEntry(int index)
+{
+    if(index < 0 || index >= (int) entries.size()) {
+        return NULL;
+    }
+
+    return &entries[index];
+}
+
+bool ZipFile::extract(int index, BYTE *&data, int &size)
+{
+    data = NULL;
+    size = 0;
+
+    const TZipEntry *entry = getEntry(index);
+
+    if(!entry || entry->encrypted || entry->uncompressedSize > ZIP_MAX_SIZE) {   // no such entry, or can't extract it?
+        return false;
+    }
+
+    // the data follows the local header, which might have different extra field than the central directory entry
+    DWORD hdr = entry->localHeaderOffset;
+
+    if(hdr > (DWORD) (zipSize - ZIP_LOCAL_HEADER_SIZE) || getDwordLE(zipData + hdr) != ZIP_SIG_LOCAL_HEADER) {
+        return false;
+    }
+
+    DWORD dataOffset = hdr + ZIP_LOCAL_HEADER_SIZE + getWordLE(zipData + hdr + 26) + getWordLE(zipData + hdr + 28);
+
+    if(dataOffset > (DWORD) zipSize || entry->compressedSize > (DWORD) zipSize - dataOffset) {    // data outside of file?
+        return false;
+    }
+
+    BYTE *out = (BYTE *) malloc(entry->uncompressedSize + 1);    // +1 so we won't malloc(0)
+    bool  res = false;
+
+    if(entry->method == ZIP_METHOD_STORED) {
+        if(entry->compressedSize == entry->uncompressedSize) {
+            memcpy(out, zipData + dataOffset, entry->uncompressedSize);
+            res = true;
+        }
+    } else if(entry->method == ZIP_METHOD_DEFLATED) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+
+        if(inflateInit2(&zs, -MAX_WBITS) == Z_OK) {                 // negative window bits: raw deflate data without zlib header
+            zs.next_in      = zipData + dataOffset;
+            zs.avail_in     = entry->compressedSize;
+            zs.next_out     = out;
+            zs.avail_out    = entry->uncompressedSize;
+
+            int zres = inflate(&zs, Z_FINISH);
+            res = (zres == Z_STREAM_END && zs.total_out == entry->uncompressedSize);
+
+            inflateEnd(&zs);
+        }
+    } else {
+        Debug::out(LOG_DEBUG, "ZipFile::extract -- unsupported compression method %d of %s", entry->method, entry->name.c_str());
+    }
+
+    if(res) {                                                       // got the data? verify it
+        DWORD crc = crc32(0L, Z_NULL, 0);
+        crc = crc32(crc, out, entry->uncompressedSize);
+
+        if(crc != entry->crc) {
+            Debug::out(LOG_DEBUG, "ZipFile::extract -- CRC mismatch on %s", entry->name.c_str());
+            res = false;
+        }
+    }
+
+    if(!res) {
+        free(out);
+        return false;
+    }
+
+    data = out;
+    size = entry->uncompressedSize;
+    return true;
+}
+
+WORD ZipFile::getWordLE(BYTE *p)
+{
+    return ((WORD) p[0]) | (((WORD) p[1]) << 8);
+}
+
+DWORD ZipFile::getDwordLE(BYTE *p)
+{
+    return ((DWORD) p[0]) | (((DWORD) p[1]) << 8) | (((DWORD) p[2]) << 16) | (((DWORD) p[3]) << 24);
+}
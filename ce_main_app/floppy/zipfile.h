@@ -0,0 +1,49 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#ifndef ZIPFILE_H
+#define ZIPFILE_H
+
+#include <string>
+#include <vector>
+
+#include "../datatypes.h"
+
+typedef struct {
+    std::string name;               // file name with path inside of ZIP file
+    int         method;             // 0: stored, 8: deflated
+    DWORD       crc;
+    DWORD       compressedSize;
+    DWORD       uncompressedSize;
+    DWORD       localHeaderOffset;
+    bool        encrypted;
+} TZipEntry;
+
+// Reads ZIP files in memory using zlib, so we don't have to run unzip and extract the files to disk.
+class ZipFile
+{
+public:
+    ZipFile();
+    ~ZipFile();
+
+    bool open(const char *fileName);
+    void close(void);
+
+    int              getEntryCount(void);
+    const TZipEntry *getEntry(int index);
+
+    // extract the entry to malloc()ed buffer, the caller is responsible for freeing it
+    bool extract(int index, BYTE *&data, int &size);
+
+private:
+    BYTE *zipData;
+    int   zipSize;
+
+    std::vector<TZipEntry> entries;
+
+    bool readCentralDirectory(void);
+    int  findEndOfCentralDirectory(void);
+
+    static WORD  getWordLE(BYTE *p);
+    static DWORD getDwordLE(BYTE *p);
+};
+
+#endif // ZIPFILE_H
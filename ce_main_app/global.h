@@ -55,6 +55,7 @@
 #define TRAN_CMD_SENDSCREENCAST     2
 #define TRAN_CMD_SCREENCASTPALETTE  3
 #define TRAN_CMD_SCREENSHOT_CONFIG  4
+#define TRAN_CMD_SENDSCREENCAST_DELTA   5       // screen as keyframe or changes since previous frame, see service/screencastdelta.h
 // ...other commands are just function codes from gemdos.h
 
 
@@ -94,6 +95,7 @@ typedef struct {
     bool ikbdLogs;              // if set to true, will generate ikbd logs file
     bool fakeOldApp;            // if set to true, will always return old app version, so you can test app installation over and over
     bool display;               // if set to true, show string on front display, if possible
+    bool slowTests;             // if set to true, run the slow tests and benchmarks (not run on normal start), then quit
 
     bool gotHansFwVersion;
     bool gotFranzFwVersion;
@@ -3,6 +3,7 @@
 #define _IKBD_H_
 
 #include <termios.h>
+#include <sys/select.h>
 #include <linux/joystick.h>
 
 #include <bitset>
@@ -11,6 +12,9 @@
 #include "cyclicbuff.h"
 #include "keybjoys.h"
 #include "keytranslator.h"
+#include "ikbdoutput.h"
+#include "ikbdlatency.h"
+#include "ikbdrecord.h"
 
 //#define SPYIKBD
 
@@ -37,6 +41,9 @@ typedef struct {
     #define UARTFILE            "/dev/serial0"
 #endif
 
+#define IKBD_EVENT_BATCH    64          // input events read from device at once
+#define IKBD_REL_MAX        127         // relative mouse packet holds signed 8-bit deltas
+
 #define UARTMARK_STCMD      0xAA
 #define UARTMARK_KEYBDATA   0xBB
 
@@ -84,6 +91,18 @@ public:
 
     void processReceivedCommands(bool skipKeyboardTranslation);
 
+    // one round of ikbd thread: wait for input (and extraFd), then process what came and send what can be sent
+    int  waitForInput(int extraFd, fd_set &readfds);
+    void processInput(fd_set &readfds, bool clientConnected);
+
+    void setRecording(bool enabled);        // record to IKBDREC_FILE
+    bool startRecording(const char *path);
+    void stopRecording(void);
+
+    void processOutput(void);               // writes queued packets and coalesced mouse motion when the line to ST can take them
+    int  getOutputWaitUs(void);             // -1 if no output waits, otherwise how long till processOutput() can send more
+    void getOutputStats(TIkbdOutStats &st);
+
     int     fdUart;
 
 private:
@@ -139,6 +158,21 @@ private:
         BYTE deltaY;
     } keycodeMouse;
 
+    // relative motion is summed until the end of input frame (SYN_REPORT) and sent as one packet when the
+    // previous bytes went out, so fast mice don't flood the 7812.5 baud line with packets which arrive late
+    struct {
+        int     dx, dy;
+        bool    frameDone;                  // got SYN_REPORT after the motion, so it can be sent
+        int     source;                     // where the oldest unsent motion came from and when - for latency stats
+        DWORD   sourceUs;
+    } pendingMotion;
+
+    IkbdOutput      output;
+    IkbdRecorder    recorder;
+
+    int             inputSource;            // INTYPE_* of the events being processed now, -1 if none
+    DWORD           inputSourceUs;          // when they were read
+
     DWORD           lastVDevMouseEventTime;
 
     int             joystickMode;
@@ -166,12 +200,18 @@ private:
     void fillStCommandsLengthTable(void);
 
     void processFoundDev(const char *linkName, const char *fullPath);
+    void processDeviceInput(int index, bool clientConnected);
+    void setInputSource(int source, DWORD readUs);
 
     void resetInternalIkbdVars(void);
     void sendJoyButtonsInMouseMode(void);
     void sendJoyState(int joyNumber, int dirTotal);
     void sendBothJoyReport(void);
-    void sendMousePosRelative(int fd, BYTE buttons, BYTE xRel, BYTE yRel);
+    void sendMousePosRelative(int fd, BYTE buttons, BYTE xRel, BYTE yRel, int outClass=IKBDOUT_KEY);
+    bool relMouseMotionWanted(void);
+    void sendMouseMotionPacket(int outClass);
+    void sendPendingMouseMotion(void);
+    void flushMouseMotion(void);
     void sendMousePosAbsolute(int fd, BYTE absButtons);
     void fixAbsMousePos(void);
 
@@ -189,7 +229,7 @@ private:
     void handleKeyAsKeybJoy  (bool pcNotSt, int joyNumber, int pcKey, bool keyDown);
     bool handleHotkeys(int pcKey, bool pressed, bool skipKeyboardTranslation);
 
-    int fdWrite(int fd, BYTE *bfr, int cnt);
+    int fdWrite(int fd, BYTE *bfr, int cnt, int outClass=IKBDOUT_KEY, int tag=0, BYTE keepMask=0);
 
     void toggleKeyboardExclusiveAccess(void);
     void grabExclusiveAccess(int fd);
@@ -38,11 +38,7 @@ void *ikbdThreadCode(void *ptr)
 {
     struct termios    termiosStruct;
     Ikbd ikbd;
-    int max_fd;
-    int fd;
     fd_set readfds;
-    /*struct timeval timeout;*/
-    int i;
     int inotifyFd;
     int wd1, wd2, wd3;
     ssize_t res;
@@ -81,26 +77,7 @@ void *ikbdThreadCode(void *ptr)
             ikbd.loadSettings();
         }
 
-        max_fd = -1;
-        FD_ZERO(&readfds);
-        for(i = 0; i < 6; i++) {                                       // go through the input devices
-            fd = ikbd.getFdByIndex(i);
-            if(fd >= 0) {
-                FD_SET(fd, &readfds);
-                if(fd > max_fd) max_fd = fd;
-            }
-        }
-        if(ikbd.fdUart >= 0) {
-            FD_SET(ikbd.fdUart, &readfds);
-            if(ikbd.fdUart > max_fd) max_fd = ikbd.fdUart;
-        }
-        if(inotifyFd >= 0) {
-            FD_SET(inotifyFd, &readfds);
-            if(inotifyFd > max_fd) max_fd = inotifyFd;
-        }
-        //memset(&timeout, 0, sizeof(timeout));
-        //timeout.tv_sec = 3;
-        if(select(max_fd + 1, &readfds, NULL, NULL, NULL/*&timeout*/) < 0) {
+        if(ikbd.waitForInput(inotifyFd, readfds) < 0) {
             if(errno == EINTR) {
                 continue;   // a signal was delivered
             } else {
@@ -137,61 +114,10 @@ void *ikbdThreadCode(void *ptr)
             }
         }
 
-        bool clientConnected = ((Utils::getCurrentMs() - shared.configStream.acsi->getLastCmdTimestamp()) <= 2000);
+        ikbd.setRecording(flags.ikbdLogs);                              // with IKBD logs also record what goes in and out, for replay
 
-        if(ikbd.fdUart >= 0 && FD_ISSET(ikbd.fdUart, &readfds)) {
-            // process the incomming data from original keyboard and from ST
-            ikbd.processReceivedCommands(clientConnected);
-        }
-
-        // process events from attached input devices
-        struct input_event  ev;
-        struct js_event     js;
-
-        for(i = 0; i < 6; i++) {                                        // go through the input devices
-            fd = ikbd.getFdByIndex(i);
-
-            if(fd >= 0 && FD_ISSET(fd, &readfds)) {
-                switch(i) {
-                case INTYPE_MOUSE:
-                case INTYPE_KEYBOARD: // for keyboard and mouse
-                case INTYPE_VDEVMOUSE:
-                case INTYPE_VDEVKEYBOARD: // for virtual mouse and keyboard
-                    res = read(ikbd.getFdByIndex(i), &ev, sizeof(input_event));
-                    break;
-                case INTYPE_JOYSTICK1:
-                case INTYPE_JOYSTICK2: // for joysticks
-                    res = read(ikbd.getFdByIndex(i), &js, sizeof(js_event));
-                    break;
-                }
-                if(res < 0) {                                           // on error, skip the rest
-                    if(errno == ENODEV) {                               // if device was removed, deinit it
-                        ikbd.deinitDev(i);
-                    } else {
-                        logDebugAndIkbd(LOG_ERROR, "ikbdThreadCode() read(%d) : %s", fd, strerror(errno));
-                    }
-                } else if( res==0 ) {                                           // on error, skip the rest
-                    logDebugAndIkbd(LOG_ERROR, "ikbdThreadCode() read(%d) returned 0 (EOF) closing %d", fd, i);
-                    ikbd.deinitDev(i);
-                } else {
-                    switch(i) {
-                    case INTYPE_VDEVMOUSE:
-                        ikbd.markVirtualMouseEvenTime();                // first mark the event time
-                    case INTYPE_MOUSE:
-                        ikbd.processMouse(&ev);                         // then process the event
-                        break;
-                    case INTYPE_KEYBOARD:
-                    case INTYPE_VDEVKEYBOARD:
-                        ikbd.processKeyboard(&ev, clientConnected);
-                        break;
-                    case INTYPE_JOYSTICK1:
-                    case INTYPE_JOYSTICK2:
-                        ikbd.processJoystick(&js, i - INTYPE_JOYSTICK1);
-                        break;
-                    }
-                }
-            }
-        }
+        bool clientConnected = ((Utils::getCurrentMs() - shared.configStream.acsi->getLastCmdTimestamp()) <= 2000);
+        ikbd.processInput(readfds, clientConnected);
     }
 
     if(inotifyFd >= 0) {
@@ -203,6 +129,169 @@ void *ikbdThreadCode(void *ptr)
     return 0;
 }
 
+// waits till some input device, UART or extraFd (-1 if none) has data, or till queued output can be sent
+int Ikbd::waitForInput(int extraFd, fd_set &readfds)
+{
+    int max_fd = -1;
+    FD_ZERO(&readfds);
+
+    for(int i = 0; i < 6; i++) {                                        // go through the input devices
+        int fd = getFdByIndex(i);
+        if(fd >= 0) {
+            FD_SET(fd, &readfds);
+            if(fd > max_fd) max_fd = fd;
+        }
+    }
+    if(fdUart >= 0) {
+        FD_SET(fdUart, &readfds);
+        if(fdUart > max_fd) max_fd = fdUart;
+    }
+    if(extraFd >= 0) {
+        FD_SET(extraFd, &readfds);
+        if(extraFd > max_fd) max_fd = extraFd;
+    }
+
+    // while some output waits for the UART, wake up when it can be sent
+    struct timeval timeout, *pTimeout = NULL;
+    int waitUs = getOutputWaitUs();
+    if(waitUs >= 0) {
+        timeout.tv_sec  = waitUs / 1000000;
+        timeout.tv_usec = waitUs % 1000000;
+        pTimeout = &timeout;
+    }
+
+    int res = select(max_fd + 1, &readfds, NULL, NULL, pTimeout);
+
+    if(res <= 0) {                                                      // on timeout nothing is set, on error the set is undefined
+        FD_ZERO(&readfds);
+    }
+
+    return res;
+}
+
+void Ikbd::processInput(fd_set &readfds, bool clientConnected)
+{
+    if(fdUart >= 0 && FD_ISSET(fdUart, &readfds)) {
+        // process the incomming data from original keyboard and from ST
+        processReceivedCommands(clientConnected);
+    }
+
+    for(int i = 0; i < 6; i++) {                                        // go through the input devices
+        int fd = getFdByIndex(i);
+
+        if(fd >= 0 && FD_ISSET(fd, &readfds)) {
+            processDeviceInput(i, clientConnected);
+        }
+    }
+
+    processOutput();                                                    // queued packets and motion of complete frames, if UART is free
+}
+
+// process events from attached input device - read all the events which are waiting, not just one per select()
+void Ikbd::processDeviceInput(int i, bool clientConnected)
+{
+    struct input_event  ev[IKBD_EVENT_BATCH];
+    struct js_event     js[IKBD_EVENT_BATCH];
+    int                 evSize = sizeof(input_event);
+    ssize_t             res;
+
+    int fd = getFdByIndex(i);
+
+    switch(i) {
+    case INTYPE_JOYSTICK1:
+    case INTYPE_JOYSTICK2: // for joysticks
+        res    = read(fd, js, sizeof(js));
+        evSize = sizeof(js_event);
+        break;
+    default:               // for keyboard and mouse, virtual mouse and keyboard
+        res    = read(fd, ev, sizeof(ev));
+        break;
+    }
+
+    if(res < 0) {                                           // on error, skip the rest
+        if(errno == ENODEV) {                               // if device was removed, deinit it
+            deinitDev(i);
+        } else if(errno != EAGAIN) {
+            logDebugAndIkbd(LOG_ERROR, "ikbdThreadCode() read(%d) : %s", fd, strerror(errno));
+        }
+        return;
+    }
+
+    if(res == 0) {                                          // on error, skip the rest
+        logDebugAndIkbd(LOG_ERROR, "ikbdThreadCode() read(%d) returned 0 (EOF) closing %d", fd, i);
+        deinitDev(i);
+        return;
+    }
+
+    int count = res / evSize;                               // devices return only whole events
+
+    if(IkbdRecorder::isInputEventKind(i)) {                 // input_event differs between 32 and 64 bit, store it in fixed layout
+        recorder.addInputEvents(i, ev, count);
+    } else {
+        recorder.add(i, js, count * evSize);
+    }
+    setInputSource(i, Utils::getCurrentUs());               // packets made from these events get this time for latency stats
+
+    if(i == INTYPE_VDEVMOUSE) {
+        markVirtualMouseEvenTime();                         // first mark the event time
+    }
+
+    for(int e = 0; e < count; e++) {
+        switch(i) {
+        case INTYPE_VDEVMOUSE:
+        case INTYPE_MOUSE:
+            processMouse(&ev[e]);                           // then process the event
+            break;
+        case INTYPE_KEYBOARD:
+        case INTYPE_VDEVKEYBOARD:
+            processKeyboard(&ev[e], clientConnected);
+            break;
+        case INTYPE_JOYSTICK1:
+        case INTYPE_JOYSTICK2:
+            processJoystick(&js[e], i - INTYPE_JOYSTICK1);
+            break;
+        }
+    }
+
+    setInputSource(-1, 0);
+}
+
+void Ikbd::setInputSource(int source, DWORD readUs)
+{
+    inputSource   = source;
+    inputSourceUs = readUs;
+    output.setSource(source, readUs);
+}
+
+void Ikbd::setRecording(bool enabled)
+{
+    if(enabled == recorder.isRecording()) {
+        return;
+    }
+
+    if(enabled) {
+        startRecording(IKBDREC_FILE);
+    } else {
+        recorder.stop();
+    }
+}
+
+bool Ikbd::startRecording(const char *path)
+{
+    bool good = recorder.start(path);
+
+    if(!good) {
+        logDebugAndIkbd(LOG_ERROR, "Ikbd::startRecording - can't create %s", path);
+    }
+
+    return good;
+}
+
+void Ikbd::stopRecording(void)
+{
+    recorder.stop();
+}
+
 Ikbd::Ikbd()
 {
     loadSettings();
@@ -217,6 +306,11 @@ Ikbd::Ikbd()
     fdUart      = -1;
     mouseBtnNow = 0;
 
+    inputSource   = -1;
+    inputSourceUs = 0;
+    output.setLatency(&ikbdLatency);
+    output.setRecorder(&recorder);
+
     // init uart RX cyclic buffers
     cbStCommands.init();
     cbKeyboardData.init();
@@ -277,6 +371,12 @@ void Ikbd::resetInternalIkbdVars(void)
     keycodeMouse.deltaX    = 0;
     keycodeMouse.deltaY    = 0;
 
+    pendingMotion.dx        = 0;
+    pendingMotion.dy        = 0;
+    pendingMotion.frameDone = false;
+    pendingMotion.source    = -1;
+    pendingMotion.sourceUs  = 0;
+
     joystickMode    = JOYMODE_EVENT;
     joystickState   = EnabledInMouseMode;
 
@@ -343,7 +443,7 @@ int Ikbd::serialSetup(termios *ts)
     return fd;
 }
 
-int Ikbd::fdWrite(int fd, BYTE *bfr, int cnt)
+int Ikbd::fdWrite(int fd, BYTE *bfr, int cnt, int outClass, int tag, BYTE keepMask)
 {
 #if !defined(IKBDSPY)
     if(flags.ikbdLogs) {
@@ -366,8 +466,37 @@ int Ikbd::fdWrite(int fd, BYTE *bfr, int cnt)
         return cnt;
     }
 
-    int res = write(fd, bfr, cnt);                  // send content
-    return res;
+    output.add(outClass, bfr, cnt, tag, keepMask);  // queue it, goes out now if the line is free, otherwise from processOutput()
+    output.service(fd);
+    return cnt;
+}
+
+void Ikbd::processOutput(void)
+{
+    if(fdUart == -1) {
+        return;
+    }
+
+    output.service(fdUart);
+    sendPendingMouseMotion();
+}
+
+int Ikbd::getOutputWaitUs(void)
+{
+    if(fdUart == -1) {
+        return -1;
+    }
+
+    if(pendingMotion.frameDone) {                   // motion waits till the line is free, queued packets go before it
+        return output.getIdleWaitUs();
+    }
+
+    return output.getWaitUs();
+}
+
+void Ikbd::getOutputStats(TIkbdOutStats &st)
+{
+    output.getStats(st);
 }
 
 void ikbdLog(const char *format, ...)
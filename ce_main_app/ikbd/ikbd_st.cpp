@@ -25,6 +25,8 @@ void Ikbd::processReceivedCommands(bool skipKeyboardTranslation)
     int res = read(fdUart, pBfr, 127);                          // try to read data from uart
 
     if(res > 0) {                                               // if some data arrived, add it
+        recorder.add(IKBDREC_UART_IN, pBfr, res);
+
         if(gotHalfPair) {                                       // if got half pair from previous read, use it and unmark that we got it
             bfr[0]      = halfPairData;
             gotHalfPair = false;
@@ -666,7 +668,7 @@ void Ikbd::sendJoyState(int joyNumber, int dirTotal)
 
     bfr[1] = dirTotal;
 
-    res = fdWrite(fdUart, bfr, 2); 
+    res = fdWrite(fdUart, bfr, 2, IKBDOUT_STATE, bfr[0], JOYDIR_BUTTON);       // queued older state of this joy is replaced
 
     if(res < 0) {
         logDebugAndIkbd(LOG_ERROR, "write to uart (0) failed, errno: %d", errno);
@@ -773,7 +775,7 @@ void Ikbd::sendMousePosAbsolute(int fd, BYTE absButtons)
 	}
 }
 
-void Ikbd::sendMousePosRelative(int fd, BYTE buttons, BYTE xRel, BYTE yRel)
+void Ikbd::sendMousePosRelative(int fd, BYTE buttons, BYTE xRel, BYTE yRel, int outClass)
 {
     if(fd == -1) {                      // no UART open? quit
         return;
@@ -799,13 +801,80 @@ void Ikbd::sendMousePosRelative(int fd, BYTE buttons, BYTE xRel, BYTE yRel)
 	bfr[1] = xRel;
     bfr[2] = yRelVal;
 	
-	int res = fdWrite(fd, bfr, 3); 
+	int res = fdWrite(fd, bfr, 3, outClass); 
 
 	if(res < 0) {
 		logDebugAndIkbd(LOG_ERROR, "sendMousePosRelative failed, errno: %d", errno);
 	}
 }
 
+static int clampMouseRel(int value)
+{
+    if(value >  IKBD_REL_MAX) return  IKBD_REL_MAX;
+    if(value < -IKBD_REL_MAX) return -IKBD_REL_MAX;     // not -128, so inverting Y can't overflow
+    return value;
+}
+
+// false if relative packets wouldn't be sent now - then the pending motion is dropped, so it won't jump later
+bool Ikbd::relMouseMotionWanted(void)
+{
+    if(fdUart != -1 && mouseEnabled && mouseMode == MOUSEMODE_REL) {
+        return true;
+    }
+
+    pendingMotion.dx        = 0;
+    pendingMotion.dy        = 0;
+    pendingMotion.frameDone = false;
+    return false;
+}
+
+// one packet with as much of the pending motion as fits, the rest stays pending for the next packet
+void Ikbd::sendMouseMotionPacket(int outClass)
+{
+    int dx = clampMouseRel(pendingMotion.dx);
+    int dy = clampMouseRel(pendingMotion.dy);
+
+    pendingMotion.dx -= dx;
+    pendingMotion.dy -= dy;
+
+    if(pendingMotion.dx == 0 && pendingMotion.dy == 0) {
+        pendingMotion.frameDone = false;
+    }
+
+    output.setSource(pendingMotion.source, pendingMotion.sourceUs);     // may be sent later than the events were processed
+    sendMousePosRelative(fdUart, mouseBtnNow, (BYTE) dx, (BYTE) dy, outClass);
+    output.setSource(inputSource, inputSourceUs);
+}
+
+void Ikbd::sendPendingMouseMotion(void)
+{
+    if(!relMouseMotionWanted()) {
+        return;
+    }
+
+    if(!pendingMotion.frameDone) {                      // nothing to send or frame not complete yet
+        return;
+    }
+
+    if(!output.lineIdle()) {                            // keys or previous bytes still waiting, more motion can come meanwhile
+        return;
+    }
+
+    sendMouseMotionPacket(IKBDOUT_MOTION);
+}
+
+// before button change - send all the pending motion now, so the click happens where the user clicked
+void Ikbd::flushMouseMotion(void)
+{
+    if(!relMouseMotionWanted()) {
+        return;
+    }
+
+    while(pendingMotion.dx != 0 || pendingMotion.dy != 0) {
+        sendMouseMotionPacket(IKBDOUT_KEY);             // queued with the click, so motion can't overtake it or the other way
+    }
+}
+
 bool Ikbd::handleStKeyAsKeybJoy(BYTE val)
 {
     bool keyDown    = ((val & 0x80) == 0);      // if highest bit is zero, it's key down event
@@ -364,21 +364,35 @@ void Ikbd::processMouse(input_event *ev)
                 sendMousePosAbsolute(fdUart, absButtons);
             }
         } else {                                                // for relative mouse mode
+            flushMouseMotion();                                 // motion before the click goes with the old buttons
             sendMousePosRelative(fdUart, mouseBtnNow, 0, 0);    // send them to ST
         }
         return;
     }
 
+    if(ev->type == EV_SYN && ev->code == SYN_REPORT) {          // end of frame - the summed motion can go now
+        if(pendingMotion.dx != 0 || pendingMotion.dy != 0) {
+            pendingMotion.frameDone = true;
+            sendPendingMouseMotion();
+        }
+        return;
+    }
+
     if(ev->type == EV_REL) {
         statuses.ikbdUsb.aliveTime = Utils::getCurrentMs();
         statuses.ikbdUsb.aliveSign = ALIVE_MOUSEVENT;
 
+        if(pendingMotion.dx == 0 && pendingMotion.dy == 0) {   // first unsent motion - its packet's latency counts from now
+            pendingMotion.source   = inputSource;
+            pendingMotion.sourceUs = inputSourceUs;
+        }
+
         if(ev->code == REL_X) {
             // update absolute position
             absMouse.x += ev->value;
             fixAbsMousePos();
 
-            sendMousePosRelative(fdUart, mouseBtnNow, ev->value, 0);    // send movement to ST
+            pendingMotion.dx += ev->value;                      // sent on SYN_REPORT
         }
 
         if(ev->code == REL_Y) {
@@ -390,7 +404,7 @@ void Ikbd::processMouse(input_event *ev)
             }
             fixAbsMousePos();
 
-            sendMousePosRelative(fdUart, mouseBtnNow, 0, ev->value);    // send movement to ST
+            pendingMotion.dy += ev->value;                      // sent on SYN_REPORT
         }
 
         //--------------------------
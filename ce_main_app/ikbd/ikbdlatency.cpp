@@ -0,0 +1,104 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#include <stdio.h>
+#include <string.h>
+
+#include "utils.h"
+#include "ikbdlatency.h"
+
+IkbdLatency ikbdLatency;
+
+static const char *sourceNames[IKBDLAT_SOURCES] = { "mouse", "keyboard", "joystick 1", "joystick 2", "web mouse", "web keyboard" };
+
+IkbdLatency::IkbdLatency()
+{
+    reset();
+}
+
+void IkbdLatency::add(int source, DWORD latencyUs)
+{
+    if(source < 0 || source >= IKBDLAT_SOURCES) {
+        return;
+    }
+
+    TIkbdLatHistogram &h = hist[source];
+
+    int i = 0;
+    while(i < (IKBDLAT_BUCKETS - 1) && latencyUs >= ((DWORD) IKBDLAT_FIRST_US << i)) {
+        i++;
+    }
+
+    h.bucket[i]++;
+    h.count++;
+    h.sumUs += latencyUs;
+
+    if(latencyUs > h.maxUs) {
+        h.maxUs = latencyUs;
+    }
+}
+
+void IkbdLatency::reset(void)
+{
+    memset(hist, 0, sizeof(hist));
+}
+
+void IkbdLatency::get(int source, TIkbdLatHistogram &h)
+{
+    if(source < 0 || source >= IKBDLAT_SOURCES) {
+        memset(&h, 0, sizeof(h));
+        return;
+    }
+
+    h = hist[source];
+}
+
+DWORD IkbdLatency::percentileUs(const TIkbdLatHistogram &h, int percent)
+{
+    if(h.count == 0) {
+        return 0;
+    }
+
+    DWORD wanted = (((unsigned long long) h.count * percent) + 99) / 100;    // this many must be at or below
+    DWORD sum    = 0;
+
+    for(int i=0; i<(IKBDLAT_BUCKETS - 1); i++) {
+        sum += h.bucket[i];
+
+        if(sum >= wanted) {
+            return MIN((DWORD) IKBDLAT_FIRST_US << i, h.maxUs);
+        }
+    }
+
+    return h.maxUs;
+}
+
+void IkbdLatency::toText(std::string &text)
+{
+    char line[256];
+
+    text = "IKBD latency - from reading input event till its packet was written to UART\n";
+
+    for(int s=0; s<IKBDLAT_SOURCES; s++) {
+        TIkbdLatHistogram h = hist[s];                  // copy - ikbd thread can change it meanwhile
+
+        if(h.count == 0) {
+            continue;
+        }
+
+        sprintf(line, "\n%s: %u packets, avg %u us, 50%% < %u us, 99%% < %u us, max %u us\n", sourceNames[s], h.count,
+                (DWORD) (h.sumUs / h.count), percentileUs(h, 50), percentileUs(h, 99), h.maxUs);
+        text += line;
+
+        for(int i=0; i<IKBDLAT_BUCKETS; i++) {
+            if(h.bucket[i] == 0) {
+                continue;
+            }
+
+            if(i < (IKBDLAT_BUCKETS - 1)) {
+                sprintf(line, "    < %6u us: %u\n", (DWORD) IKBDLAT_FIRST_US << i, h.bucket[i]);
+            } else {
+                sprintf(line, "   >= %6u us: %u\n", (DWORD) IKBDLAT_FIRST_US << (i - 1), h.bucket[i]);
+            }
+            text += line;
+        }
+    }
+}
@@ -0,0 +1,41 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#ifndef _IKBDLATENCY_H_
+#define _IKBDLATENCY_H_
+
+#include <string>
+
+#include "datatypes.h"
+#include "ikbd_defs.h"
+
+#define IKBDLAT_SOURCES     (INTYPE_MAX + 1)    // INTYPE_* - where the event came from
+#define IKBDLAT_BUCKETS     14                  // bucket i holds latencies below IKBDLAT_FIRST_US << i, the last one the rest
+#define IKBDLAT_FIRST_US    125
+
+typedef struct {
+    DWORD               count;
+    DWORD               bucket[IKBDLAT_BUCKETS];
+    DWORD               maxUs;
+    unsigned long long  sumUs;
+} TIkbdLatHistogram;
+
+// Time from reading input event from device till the last byte of the IKBD packet made from it was written to UART,
+// one histogram per input type. Written by ikbd thread, read by web UI - a torn counter there doesn't matter.
+class IkbdLatency
+{
+public:
+    IkbdLatency();
+
+    void add(int source, DWORD latencyUs);
+    void reset(void);
+    void get(int source, TIkbdLatHistogram &h);
+    void toText(std::string &text);
+
+    static DWORD percentileUs(const TIkbdLatHistogram &h, int percent);     // upper bound of the bucket where it is (or max)
+
+private:
+    TIkbdLatHistogram hist[IKBDLAT_SOURCES];
+};
+
+extern IkbdLatency ikbdLatency;
+
+#endif
@@ -0,0 +1,213 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "debug.h"
+#include "utils.h"
+
+#include "ikbd.h"
+#include "ikbdoutput.h"
+#include "ikbdlatency.h"
+#include "ikbdrecord.h"
+
+IkbdOutput::IkbdOutput()
+{
+    lineFreeAtUs = Utils::getCurrentUs();
+    resetStats();
+
+    curSource   = -1;
+    curSourceUs = 0;
+    latency     = NULL;
+    recorder    = NULL;
+}
+
+void IkbdOutput::setSource(int source, DWORD sourceUs)
+{
+    curSource   = source;
+    curSourceUs = sourceUs;
+}
+
+void IkbdOutput::setLatency(IkbdLatency *lat)
+{
+    latency = lat;
+}
+
+void IkbdOutput::setRecorder(IkbdRecorder *rec)
+{
+    recorder = rec;
+}
+
+void IkbdOutput::add(int outClass, const BYTE *data, int len, int tag, BYTE keepMask)
+{
+    if(outClass != IKBDOUT_KEY && replaceQueued(outClass, data, len, tag, keepMask)) {
+        return;
+    }
+
+    while(len > 0) {                                    // longer data (keyboard pass-through) is split, the order stays
+        TIkbdOutPacket p;
+        p.len       = MIN(len, IKBDOUT_MAX_PACKET);
+        p.sent      = 0;
+        p.tag       = tag;
+        p.keepMask  = keepMask;
+        p.queuedUs  = Utils::getCurrentUs();
+        p.source    = curSource;
+        p.sourceUs  = curSourceUs;
+        memcpy(p.data, data, p.len);
+
+        queue[outClass].push_back(p);
+
+        data += p.len;
+        len  -= p.len;
+
+        stats.queued[outClass]++;
+        stats.depth [outClass]++;
+        if(stats.depth[outClass] > stats.maxDepth[outClass]) {
+            stats.maxDepth[outClass] = stats.depth[outClass];
+        }
+    }
+}
+
+// the newest queued packet with the same tag gets the new value, if it's not being sent and buttons in it are the same
+bool IkbdOutput::replaceQueued(int outClass, const BYTE *data, int len, int tag, BYTE keepMask)
+{
+    std::deque<TIkbdOutPacket> &q = queue[outClass];
+
+    for(int i=q.size() - 1; i >= 0; i--) {
+        TIkbdOutPacket &p = q[i];
+
+        if(p.tag != tag) {
+            continue;
+        }
+
+        if(p.sent != 0 || p.len != len || p.data[0] != data[0]) {
+            return false;
+        }
+
+        for(int j=1; j<len; j++) {
+            if((p.data[j] & keepMask) != (data[j] & keepMask)) {    // button changed - both states must go out, in order
+                return false;
+            }
+        }
+
+        memcpy(p.data, data, len);                      // source stays - latency is counted from the oldest event waiting
+        stats.replaced[outClass]++;
+        return true;
+    }
+
+    return false;
+}
+
+int IkbdOutput::pickClass(void)
+{
+    for(int c=0; c<IKBDOUT_CLASSES; c++) {              // partly written packet first, its bytes must stay together
+        if(!queue[c].empty() && queue[c].front().sent != 0) {
+            return c;
+        }
+    }
+
+    for(int c=0; c<IKBDOUT_CLASSES; c++) {
+        if(!queue[c].empty()) {
+            return c;
+        }
+    }
+
+    return -1;
+}
+
+int IkbdOutput::service(int fd)
+{
+    while(true) {
+        int c = pickClass();
+
+        if(c < 0) {                                     // nothing to send
+            return -1;
+        }
+
+        DWORD now    = Utils::getCurrentUs();
+        int   waitUs = (int) (lineFreeAtUs - now) - IKBDOUT_LEAD_US;
+
+        if(waitUs > 0) {                                // line still busy with previous packets
+            return waitUs;
+        }
+
+        TIkbdOutPacket &p = queue[c].front();
+        int res = write(fd, p.data + p.sent, p.len - p.sent);
+
+        if(res < 0) {
+            if(errno == EAGAIN || errno == EINTR) {     // kernel buffer full, try after one more byte went out
+                lineFreeAtUs = now + IKBDOUT_LEAD_US + IKBD_BYTE_US;
+                return IKBD_BYTE_US;
+            }
+
+            logDebugAndIkbd(LOG_ERROR, "IkbdOutput::service - write failed, errno: %d", errno);
+            stats.writeErrors++;
+            res = p.len - p.sent;                       // drop the packet, or we would try it forever
+        } else {
+            if((int) (lineFreeAtUs - now) < 0) {        // line was idle
+                lineFreeAtUs = now;
+            }
+            lineFreeAtUs    += res * IKBD_BYTE_US;
+            stats.bytesSent += res;
+
+            if(recorder) {
+                recorder->add(IKBDREC_UART_OUT, p.data + p.sent, res);
+            }
+        }
+
+        p.sent += res;
+
+        if(p.sent < p.len) {                            // rest of packet goes next, nothing can get between
+            continue;
+        }
+
+        DWORD waitedUs = now - p.queuedUs;
+        if(waitedUs > stats.maxWaitUs[c]) {
+            stats.maxWaitUs[c] = waitedUs;
+        }
+
+        if(latency && p.source >= 0) {
+            latency->add(p.source, Utils::getCurrentUs() - p.sourceUs);
+        }
+
+        stats.sent [c]++;
+        stats.depth[c]--;
+        queue[c].pop_front();
+    }
+}
+
+int IkbdOutput::getWaitUs(void)
+{
+    if(pickClass() < 0) {
+        return -1;
+    }
+
+    return getIdleWaitUs();
+}
+
+bool IkbdOutput::lineIdle(void)
+{
+    return pickClass() < 0 && getIdleWaitUs() == 0;
+}
+
+int IkbdOutput::getIdleWaitUs(void)
+{
+    int waitUs = (int) (lineFreeAtUs - Utils::getCurrentUs()) - IKBDOUT_LEAD_US;
+    return (waitUs > 0) ? waitUs : 0;
+}
+
+void IkbdOutput::getStats(TIkbdOutStats &st)
+{
+    st = stats;
+}
+
+void IkbdOutput::resetStats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+
+    for(int c=0; c<IKBDOUT_CLASSES; c++) {              // packets which wait now are still counted
+        stats.depth[c] = queue[c].size();
+    }
+}
@@ -0,0 +1,80 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#ifndef _IKBDOUTPUT_H_
+#define _IKBDOUTPUT_H_
+
+#include <deque>
+
+#include "datatypes.h"
+
+class IkbdLatency;
+class IkbdRecorder;
+
+#define IKBD_BYTE_US        1280            // one byte (10 bits) on ST side of IKBD line at 7812.5 baud
+#define IKBDOUT_LEAD_US     IKBD_BYTE_US    // next packet is written this long before the line gets free, so it doesn't go idle
+#define IKBDOUT_MAX_PACKET  8               // the longest IKBD packet (status report)
+
+// output classes, lower number goes first
+#define IKBDOUT_KEY         0               // keys, mouse buttons, replies to ST commands - in order, never dropped
+#define IKBDOUT_STATE       1               // joystick state - replaces queued state with the same tag, unless buttons differ
+#define IKBDOUT_MOTION      2               // mouse motion - replaces queued motion with the same tag
+#define IKBDOUT_CLASSES     3
+
+typedef struct {
+    BYTE    data[IKBDOUT_MAX_PACKET];
+    BYTE    len;
+    BYTE    sent;                           // bytes already written - packet which is started is never replaced
+    int     tag;
+    BYTE    keepMask;                       // bits in data[1..] which must match for replacing (buttons)
+    DWORD   queuedUs;
+    int     source;                         // INTYPE_* of the input event which caused it, -1 for others
+    DWORD   sourceUs;                       // when that event was read
+} TIkbdOutPacket;
+
+typedef struct {
+    DWORD   queued      [IKBDOUT_CLASSES];  // packets added
+    DWORD   sent        [IKBDOUT_CLASSES];  // packets written
+    DWORD   replaced    [IKBDOUT_CLASSES];  // queued packets replaced by newer value before they were written
+    int     depth       [IKBDOUT_CLASSES];  // packets waiting now
+    int     maxDepth    [IKBDOUT_CLASSES];
+    DWORD   maxWaitUs   [IKBDOUT_CLASSES];  // longest time from add() till the packet was written
+    DWORD   bytesSent;
+    DWORD   writeErrors;
+} TIkbdOutStats;
+
+// Owns the UART to ST. The line moves only ~780 bytes/s, so the packets are queued and written one at a time when
+// the previous ones should be out (estimated from link rate), and the queue picks key presses first, then the latest
+// joystick state, then mouse motion. Called only from the ikbd thread.
+class IkbdOutput
+{
+public:
+    IkbdOutput();
+
+    void setSource(int source, DWORD sourceUs);     // input event for which the following add()s are done, -1 if none
+    void setLatency(IkbdLatency *lat);              // latency of packets made from input events goes there
+    void setRecorder(IkbdRecorder *rec);            // written bytes go there
+
+    void add(int outClass, const BYTE *data, int len, int tag=0, BYTE keepMask=0);
+    int  service(int fd);                   // write what the line can take now, returns us till next write or -1 if nothing waits
+
+    int  getWaitUs(void);                   // us till service() can write next packet, -1 if nothing waits
+    bool lineIdle(void);                    // nothing queued and the line (almost) free - good time to build motion packet
+    int  getIdleWaitUs(void);               // us till the line is (almost) free
+
+    void getStats(TIkbdOutStats &st);
+    void resetStats(void);
+
+private:
+    std::deque<TIkbdOutPacket> queue[IKBDOUT_CLASSES];
+    DWORD           lineFreeAtUs;           // estimated time when the bytes written so far leave the line
+    TIkbdOutStats   stats;
+
+    int             curSource;
+    DWORD           curSourceUs;
+    IkbdLatency     *latency;
+    IkbdRecorder    *recorder;
+
+    bool replaceQueued(int outClass, const BYTE *data, int len, int tag, BYTE keepMask);
+    int  pickClass(void);
+};
+
+#endif
@@ -0,0 +1,176 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#include <stdio.h>
+#include <string.h>
+
+#include "utils.h"
+#include "ikbd_defs.h"
+#include "ikbdrecord.h"
+
+IkbdRecorder::IkbdRecorder()
+{
+    f           = NULL;
+    startUs     = 0;
+    lastFlushUs = 0;
+    fileSize    = 0;
+    maxSize     = IKBDREC_MAX_SIZE;
+}
+
+IkbdRecorder::~IkbdRecorder()
+{
+    stop();
+}
+
+bool IkbdRecorder::start(const char *path)
+{
+    stop();
+
+    f = fopen(path, "wb");
+
+    if(!f) {
+        return false;
+    }
+
+    fwrite(IKBDREC_MAGIC, 1, 8, f);
+    this->path  = path;
+    startUs     = Utils::getCurrentUs();
+    lastFlushUs = 0;
+    fileSize    = 8;
+    return true;
+}
+
+void IkbdRecorder::setMaxSize(DWORD bytes)
+{
+    maxSize = bytes;
+}
+
+// too big? keep it as .1 and go on in a new file - times in it go on from the start of the whole recording
+void IkbdRecorder::rotate(void)
+{
+    fclose(f);
+
+    std::string oldPath = path + ".1";
+    rename(path.c_str(), oldPath.c_str());
+
+    f = fopen(path.c_str(), "wb");
+
+    if(f) {
+        fwrite(IKBDREC_MAGIC, 1, 8, f);
+    }
+
+    fileSize = 8;
+}
+
+bool IkbdRecorder::isInputEventKind(BYTE kind)
+{
+    return (kind == INTYPE_MOUSE || kind == INTYPE_KEYBOARD || kind == INTYPE_VDEVMOUSE || kind == INTYPE_VDEVKEYBOARD);
+}
+
+void IkbdRecorder::stop(void)
+{
+    if(f) {
+        fclose(f);
+        f = NULL;
+    }
+}
+
+bool IkbdRecorder::isRecording(void)
+{
+    return (f != NULL);
+}
+
+void IkbdRecorder::add(BYTE kind, const void *data, int length)
+{
+    if(!f || length <= 0) {
+        return;
+    }
+
+    TIkbdRecordHeader hdr;
+    hdr.us       = Utils::getCurrentUs() - startUs;
+    hdr.kind     = kind;
+    hdr.reserved = 0;
+    hdr.length   = length;
+
+    fwrite(&hdr, 1, sizeof(hdr), f);                // buffered by stdio, written to card in bigger blocks...
+    fwrite(data, 1, length, f);
+    fileSize += sizeof(hdr) + length;
+
+    if(fileSize >= maxSize) {
+        rotate();
+    } else if(hdr.us - lastFlushUs >= 1000000) {    // ...but at least once per second, so it can be downloaded while recording
+        fflush(f);
+        lastFlushUs = hdr.us;
+    }
+}
+
+void IkbdRecorder::addInputEvents(BYTE kind, const struct input_event *ev, int count)
+{
+    if(!f || count <= 0) {
+        return;
+    }
+
+    std::vector<TIkbdRecordEvent> events(count);
+
+    for(int i=0; i<count; i++) {
+        events[i].sec   = ev[i].time.tv_sec;
+        events[i].usec  = ev[i].time.tv_usec;
+        events[i].type  = ev[i].type;
+        events[i].code  = ev[i].code;
+        events[i].value = ev[i].value;
+    }
+
+    add(kind, &events[0], count * sizeof(TIkbdRecordEvent));
+}
+
+bool IkbdRecorder::load(const char *path, std::vector<TIkbdRecord> &records)
+{
+    records.clear();
+
+    FILE *fl = fopen(path, "rb");
+
+    if(!fl) {
+        return false;
+    }
+
+    char magic[8];
+    if(fread(magic, 1, 8, fl) != 8 || memcmp(magic, IKBDREC_MAGIC, 8) != 0) {
+        fclose(fl);
+        return false;
+    }
+
+    TIkbdRecordHeader hdr;
+
+    while(fread(&hdr, 1, sizeof(hdr), fl) == sizeof(hdr)) {
+        TIkbdRecord rec;
+        rec.us   = hdr.us;
+        rec.kind = hdr.kind;
+        rec.data.resize(hdr.length);
+
+        if(hdr.length > 0 && fread(&rec.data[0], 1, hdr.length, fl) != hdr.length) {     // cut at the end - recording was still running
+            break;
+        }
+
+        if(isInputEventKind(rec.kind)) {            // fixed layout in file -> input_event of this machine
+            int count = hdr.length / sizeof(TIkbdRecordEvent);
+            const TIkbdRecordEvent *re = (const TIkbdRecordEvent *) &rec.data[0];
+
+            std::vector<BYTE> native(count * sizeof(struct input_event));
+            struct input_event *ev = (struct input_event *) (count > 0 ? &native[0] : NULL);
+
+            for(int i=0; i<count; i++) {
+                memset(&ev[i], 0, sizeof(ev[i]));
+                ev[i].time.tv_sec   = re[i].sec;
+                ev[i].time.tv_usec  = re[i].usec;
+                ev[i].type          = re[i].type;
+                ev[i].code          = re[i].code;
+                ev[i].value         = (int) re[i].value;
+            }
+
+            rec.data.swap(native);
+        }
+
+        records.push_back(rec);
+    }
+
+    fclose(fl);
+    return true;
+}
@@ -0,0 +1,73 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#ifndef _IKBDRECORD_H_
+#define _IKBDRECORD_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <linux/input.h>
+
+#include "datatypes.h"
+
+#define IKBDREC_FILE        "/var/log/ikbd_record.bin"      // written while IKBD logs are enabled
+#define IKBDREC_MAGIC       "CEIKBDR2"
+#define IKBDREC_MAX_SIZE    (16 * 1024 * 1024)              // when recording gets bigger, it's renamed to .1 and new one is started
+
+// record kinds - INTYPE_* for events read from input device (input_event or js_event array), or these
+#define IKBDREC_UART_IN     0x80            // bytes read from UART (ST commands and original keyboard, in pairs with marks)
+#define IKBDREC_UART_OUT    0x81            // bytes written to UART
+
+// file: IKBDREC_MAGIC, then records - header, then 'length' bytes of data. Little endian, as written on RPi.
+// struct input_event has different size on 32 and 64 bit machines, so in the file its events are TIkbdRecordEvent,
+// and load() turns them back to input_event of the machine which replays them. js_event is the same everywhere.
+typedef struct {
+    DWORD   us;                             // since the start of recording
+    BYTE    kind;
+    BYTE    reserved;
+    WORD    length;
+} TIkbdRecordHeader;
+
+typedef struct {
+    DWORD   sec;
+    DWORD   usec;
+    WORD    type;
+    WORD    code;
+    DWORD   value;
+} TIkbdRecordEvent;
+
+typedef struct {
+    DWORD               us;
+    BYTE                kind;
+    std::vector<BYTE>   data;               // in memory input_event array (of this machine), js_event array or UART bytes
+} TIkbdRecord;
+
+// Records what went in and out of the ikbd thread, so input lag complaints can be replayed on any Linux box.
+class IkbdRecorder
+{
+public:
+    IkbdRecorder();
+    ~IkbdRecorder();
+
+    bool start(const char *path);
+    void stop(void);
+    bool isRecording(void);
+    void setMaxSize(DWORD bytes);
+
+    void add(BYTE kind, const void *data, int length);
+    void addInputEvents(BYTE kind, const struct input_event *ev, int count);
+
+    static bool load(const char *path, std::vector<TIkbdRecord> &records);
+    static bool isInputEventKind(BYTE kind);
+
+private:
+    FILE        *f;
+    std::string path;
+    DWORD       startUs;
+    DWORD       lastFlushUs;
+    DWORD       fileSize;
+    DWORD       maxSize;
+
+    void rotate(void);
+};
+
+#endif
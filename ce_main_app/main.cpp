@@ -8,7 +8,19 @@
 #include <queue>
 #include <pty.h>
 #include <sys/file.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <ctype.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <malloc.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <zlib.h>
 
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
@@ -19,6 +31,7 @@
 #include "ccorethread.h"
 #include "gpio.h"
 #include "debug.h"
+#include "trace.h"
 #include "mounter.h"
 #include "downloader.h"
 #include "ikbd/ikbd.h"
@@ -29,6 +42,22 @@
 #include "display/displaythread.h"
 #include "floppy/imagesilo.h"
 #include "floppy/floppyimagemsa.h"
+#include "floppy/floppyimagest.h"
+#include "floppy/floppysetup.h"
+#include "floppy/floppyimagefactory.h"
+#include "floppy/msa.h"
+#include "floppy/imagelist.h"
+#include "dir2fdd/cfloppy.h"
+#include "dir2fdd/cdirectory.h"
+#include "network/netadapter.h"
+#include "network/netadapter_commands.h"
+#include "network/sting.h"
+#include "network/readwrapper.h"
+#include "network/sendwrapper.h"
+#include "network/bufferpool.h"
+#include "network/icmpwrapper.h"
+#include "network/resolver.h"
+#include "acsidatatrans.h"
 
 #include "webserver/webserver.h"
 #include "webserver/api/apimodule.h"
@@ -37,6 +66,12 @@
 #include "service/virtualmouseservice.h"
 #include "service/configservice.h"
 #include "service/screencastservice.h"
+#include "service/screencastdelta.h"
+#include "service/screencastimage.h"
+#include "acsicommand/screencastacsicommand.h"
+#include "webserver/websocket.h"
+#include "webserver/screencaststream.h"
+#include "translated/gemdos_errno.h"
 
 #define PIDFILE "/var/run/cosmosex.pid"
 
@@ -192,7 +227,4691 @@ TEST(floppyDisk, openNotExisting)
         EXPECT_EQ(false, retVal);
     }
 
+typedef struct {
+    SiloSlot        slot;
+    volatile bool   done;
+    DWORD           encodeUs;                                   // the shortest of the re-encodes
+} ReencodeTest;
 
+static void *reencodeThreadCode(void *ptr)
+    {
+        ReencodeTest *rt = (ReencodeTest *) ptr;
+
+        FloppyImageSt img;
+        img.open("/tmp/silotest.st");
+
+        for(int i=0; i<3; i++) {                                // re-encode the image few times, publish each
+            DWORD start = Utils::getCurrentUs();
+
+            MfmCachedImage *encImage = new MfmCachedImage();
+            encImage->encodeAndCacheImage(&img, true);
+            ImageSilo::publishEncodedImage(&rt->slot, encImage);
+            encImage->release();
+
+            DWORD duration = Utils::getCurrentUs() - start;
+            if(i == 0 || duration < rt->encodeUs) {
+                rt->encodeUs = duration;
+            }
+        }
+
+        rt->done = true;
+        return 0;
+    }
+
+TEST(imageSiloSlow, trackRequestsDontBlockDuringReencode)
+    {
+        ASSERT_EQ(true, FloppySetup::createNewImage("/tmp/silotest.st"));
+
+        ReencodeTest rt;
+        rt.slot.encImage    = NULL;
+        rt.slot.newContent  = false;
+        rt.done             = false;
+        rt.encodeUs         = 0;
+
+        pthread_t encThread;
+        pthread_create(&encThread, NULL, reencodeThreadCode, &rt);
+
+        BYTE  txBuffer[MFM_TRACK_SIZE];
+        DWORD maxDuration = 0;
+        int   served = 0, slow = 0;
+
+        while(!rt.done) {                                       // serve track requests like the core thread does, while the encoder runs
+            DWORD start = Utils::getCurrentUs();
+
+            MfmCachedImage *encImage = ImageSilo::acquireEncodedImage(&rt.slot);
+
+            if(encImage) {
+                int bytesInBuffer;
+                BYTE *track = encImage->getEncodedTrack(served % 80, served & 1, bytesInBuffer);
+                EXPECT_TRUE(track != NULL);
+
+                if(track) {
+                    memcpy(txBuffer, track, MFM_TRACK_SIZE);    // simulate the transfer to Franz
+                }
+                encImage->release();
+                served++;
+            }
+
+            DWORD duration = Utils::getCurrentUs() - start;
+            if(duration > maxDuration) {
+                maxDuration = duration;
+            }
+
+            if(duration > 1000) {                               // longer than 1 ms? the thread was probably preempted by the encoder
+                slow++;
+            }
+        }
+
+        pthread_join(encThread, NULL);
+
+        printf("imageSilo: served %d track requests during re-encode (%d us each), %d took over 1 ms, longest took %d us\n", served, (int) rt.encodeUs, slow, (int) maxDuration);
+        EXPECT_GT(served, 0);
+        EXPECT_LE(slow * 1000, served);                         // at most 0.1% of requests may be delayed by scheduling...
+        EXPECT_LT(maxDuration, rt.encodeUs / 4);                // ...but never by waiting for the whole encode / copy to finish
+
+        MfmCachedImage *encImage = ImageSilo::acquireEncodedImage(&rt.slot);
+        ASSERT_TRUE(encImage != NULL);
+        encImage->release();                                    // our reference
+        encImage->release();                                    // slot's reference
+
+        unlink("/tmp/silotest.st");
+    }
+
+
+static bool findSectorInStream(BYTE *stream, int count, int track, int side, int sector, int &start, int &end)
+    {
+        start = -1;
+        end   = count;
+
+        for(int i=0; i<(count - 3); i++) {                      // sector starts after CMD_CURRENT_SECTOR mark, ends at the next mark
+            if(stream[i] != CMD_CURRENT_SECTOR) {
+                continue;
+            }
+
+            if(start >= 0) {
+                end = i;
+                break;
+            }
+
+            if(stream[i + 1] == side && stream[i + 2] == track && stream[i + 3] == sector) {
+                start = i + 4;
+                i += 3;
+            }
+        }
+
+        return (start >= 0);
+    }
+
+static void simulateFranzWrite(FloppyImage *img, int track, int side, int sector, std::vector<BYTE> &franzData)
+    {
+        // encode the image with the new sector content, then take just that sector from the stream - that's what FDC writes and Franz captures
+        MfmCachedImage *encImage = new MfmCachedImage();
+        encImage->encodeAndCacheImage(img, false);
+
+        int count, start, end;
+        BYTE *stream = encImage->getEncodedTrack(track, side, count);
+        findSectorInStream(stream, count, track, side, sector, start, end);
+
+        // Franz sends sector #, side + track #, then WORDs of MFM times low byte first, terminated by zero WORD
+        franzData.clear();
+        franzData.push_back(sector);
+        franzData.push_back(track | (side ? 0x80 : 0));
+
+        for(int i=start; (i + 1) < end; i += 2) {
+            franzData.push_back(stream[i + 1]);
+            franzData.push_back(stream[i]);
+        }
+
+        franzData.push_back(0);
+        franzData.push_back(0);
+
+        encImage->release();
+    }
+
+TEST(imageSiloSlow, sectorWriteReencodesTrackAndSavesFile)
+    {
+        ASSERT_EQ(true, FloppySetup::createNewImage("/tmp/writetest.st"));
+        ASSERT_EQ(true, FloppySetup::createNewImage("/tmp/writesrc.st"));
+
+        SiloSlot slot;
+        ImageSilo::initSlot(&slot);
+
+        EncodeRequest er;
+        er.type     = ENCODE_REQ_IMAGE;
+        er.filename = "/tmp/writetest.st";
+        er.slot     = &slot;
+        ImageSilo::processEncodeRequest(er);
+
+        // write two sectors on different tracks through simulated Franz
+        FloppyImageSt src;
+        src.open("/tmp/writesrc.st");
+
+        BYTE sectorA[512], sectorB[512];
+        for(int i=0; i<512; i++) {
+            sectorA[i] = (BYTE) (i * 7 + 3);
+            sectorB[i] = (BYTE) (255 - i);
+        }
+        src.writeSector(10, 1, 3, sectorA);
+        src.writeSector(79, 0, 9, sectorB);
+
+        std::vector<EncodeRequest> writes;
+        std::vector<BYTE> franzData;
+
+        EncodeRequest wr;
+        simulateFranzWrite(&src, 10, 1, 3, franzData);
+        ASSERT_EQ(true, ImageSilo::parseWrittenSector(&franzData[0], franzData.size(), wr));
+        writes.push_back(wr);
+
+        simulateFranzWrite(&src, 79, 0, 9, franzData);
+        ASSERT_EQ(true, ImageSilo::parseWrittenSector(&franzData[0], franzData.size(), wr));
+        writes.push_back(wr);
+
+        ImageSilo::processWriteRequests(&slot, writes);
+
+        // the next read of the track should return the new data
+        MfmCachedImage *encImage = ImageSilo::acquireEncodedImage(&slot);
+        ASSERT_TRUE(encImage != NULL);
+
+        int count, start, end;
+        BYTE track[MFM_TRACK_SIZE], readBack[512];
+        memcpy(track, encImage->getEncodedTrack(10, 1, count), MFM_TRACK_SIZE);
+        encImage->release();
+
+        for(int i=0; i<MFM_TRACK_SIZE; i += 2) {                // image for Franz has swapped bytes, swap them back
+            BYTE tmp = track[i]; track[i] = track[i + 1]; track[i + 1] = tmp;
+        }
+
+        ASSERT_EQ(true, findSectorInStream(track, count, 10, 1, 3, start, end));
+        MfmDecoder decoder;
+        ASSERT_EQ(true, decoder.decodeSector(track + start, end - start, readBack));
+        EXPECT_EQ(0, memcmp(readBack, sectorA, 512));
+
+        // the file is written only after a while, so a burst of writes is saved at once
+        FloppyImageSt onDisk;
+        ImageSilo::saveDirtyImages(false);
+        onDisk.open("/tmp/writetest.st");
+        onDisk.readSector(10, 1, 3, readBack);
+        EXPECT_NE(0, memcmp(readBack, sectorA, 512));
+        onDisk.close();
+
+        ImageSilo::saveDirtyImages(true);
+        onDisk.open("/tmp/writetest.st");
+        onDisk.readSector(10, 1, 3, readBack);
+        EXPECT_EQ(0, memcmp(readBack, sectorA, 512));
+        onDisk.readSector(79, 0, 9, readBack);
+        EXPECT_EQ(0, memcmp(readBack, sectorB, 512));
+        onDisk.close();
+
+        ImageSilo::closeSlotImage(&slot);
+        encImage = ImageSilo::acquireEncodedImage(&slot);
+        encImage->release();                                    // our reference
+        encImage->release();                                    // slot's reference
+
+        unlink("/tmp/writetest.st");
+        unlink("/tmp/writesrc.st");
+    }
+
+static void createTestImage(const char *path, BYTE seed)
+    {
+        FloppySetup::createNewImage(path);
+
+        FloppyImageSt img;
+        img.open(path);
+
+        BYTE data[512];
+        for(int sector=1; sector<=9; sector++) {                // fill some tracks with pattern unique for this image
+            for(int i=0; i<512; i++) {
+                data[i] = (BYTE) (seed + sector + i);
+            }
+
+            img.writeSector(0, 1, sector, data);
+            img.writeSector(40, 0, sector, data);
+        }
+
+        img.saveImage();
+    }
+
+static bool imagesAreEqual(FloppyImage *a, FloppyImage *b)
+    {
+        int tracksA, sidesA, sptA, tracksB, sidesB, sptB;
+        a->getParams(tracksA, sidesA, sptA);
+        b->getParams(tracksB, sidesB, sptB);
+
+        if(tracksA != tracksB || sidesA != sidesB || sptA != sptB) {
+            return false;
+        }
+
+        BYTE sectorA[512], sectorB[512];
+        for(int t=0; t<tracksA; t++) {
+            for(int s=0; s<sidesA; s++) {
+                for(int sect=1; sect<=sptA; sect++) {
+                    if(!a->readSector(t, s, sect, sectorA) || !b->readSector(t, s, sect, sectorB) || memcmp(sectorA, sectorB, 512) != 0) {
+                        return false;
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+
+TEST(floppyImageFactorySlow, zippedImagesMatchPlainImages)
+    {
+        system("rm -rf /tmp/ziptest && mkdir -p /tmp/ziptest/__MACOSX");
+        createTestImage("/tmp/ziptest/disk1.st", 1);
+        createTestImage("/tmp/ziptest/disk2.st", 2);
+
+        static BYTE stData[80 * 2 * 9 * 512];                   // also create MSA version of disk1
+        FILE *f = fopen("/tmp/ziptest/disk1.st", "rb");
+        ASSERT_TRUE(f != NULL);
+        int stSize = fread(stData, 1, sizeof(stData), f);
+        fclose(f);
+        MSA_WriteDisk("/tmp/ziptest/disk1.msa", stData, stSize);
+
+        system("cp /tmp/ziptest/disk2.st /tmp/ziptest/__MACOSX/._disk0.st && echo readme > /tmp/ziptest/readme.txt");
+        system("cd /tmp/ziptest && zip -q -9 st.zip disk1.st && zip -q -0 stored.zip disk1.st && zip -q msa.zip disk1.msa");
+        system("cd /tmp/ziptest && zip -q multi.zip readme.txt __MACOSX/._disk0.st disk2.st disk1.st");
+
+        FloppyImage *plain = FloppyImageFactory::getImage("/tmp/ziptest/disk1.st");
+        ASSERT_TRUE(plain != NULL);
+
+        const char *zips[4] = {"/tmp/ziptest/st.zip", "/tmp/ziptest/stored.zip", "/tmp/ziptest/msa.zip", "/tmp/ziptest/multi.zip"};
+
+        for(int i=0; i<4; i++) {                                // every ZIP should give the same image as disk1.st
+            FloppyImage *zipped = FloppyImageFactory::getImage(zips[i]);
+            ASSERT_TRUE(zipped != NULL) << zips[i];
+            EXPECT_TRUE(zipped->isOpen()) << zips[i];
+            EXPECT_TRUE(zipped->isInMemoryOnly()) << zips[i];
+            EXPECT_TRUE(imagesAreEqual(plain, zipped)) << zips[i];
+            EXPECT_FALSE(zipped->saveImage()) << zips[i];       // can't save back to ZIP
+            delete zipped;
+        }
+
+        // insert latency - in-memory extraction vs. the old way of running unzip and loading the extracted file
+        const int count = 20;
+        DWORD start = Utils::getCurrentUs();
+        for(int i=0; i<count; i++) {
+            delete FloppyImageFactory::getImage("/tmp/ziptest/st.zip");
+        }
+        DWORD inMemory = (Utils::getCurrentUs() - start) / count;
+
+        start = Utils::getCurrentUs();
+        for(int i=0; i<count; i++) {
+            system("rm -rf /tmp/zipedfloppy && mkdir -p /tmp/zipedfloppy && unzip -o /tmp/ziptest/st.zip -d /tmp/zipedfloppy > /dev/null 2> /dev/null");
+            delete FloppyImageFactory::getImage("/tmp/zipedfloppy/disk1.st");
+        }
+        DWORD withUnzip = (Utils::getCurrentUs() - start) / count;
+
+        printf("floppyImageFactory: opening zipped image took %d us in memory, %d us with unzip\n", (int) inMemory, (int) withUnzip);
+
+        delete plain;
+        system("rm -rf /tmp/ziptest /tmp/zipedfloppy");
+    }
+
+
+static bool gameMatchesQuery(const std::string &game, const char *query)
+    {
+        // brute force check - every query word must be a prefix of some word of the game
+        std::vector<std::string> gameWords, queryWords;
+        std::string w;
+
+        for(int pass=0; pass<2; pass++) {
+            std::string str = (pass == 0) ? game : query;
+            std::vector<std::string> &words = (pass == 0) ? gameWords : queryWords;
+
+            for(size_t i=0; i<=str.length(); i++) {
+                if(i < str.length() && isalnum((unsigned char) str[i])) {
+                    w += tolower(str[i]);
+                } else if(!w.empty()) {
+                    words.push_back(w);
+                    w.clear();
+                }
+            }
+        }
+
+        for(size_t i=0; i<queryWords.size(); i++) {
+            bool found = false;
+            for(size_t j=0; j<gameWords.size(); j++) {
+                if(gameWords[j].compare(0, queryWords[i].length(), queryWords[i]) == 0) {
+                    found = true;
+                    break;
+                }
+            }
+
+            if(!found) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+TEST(imageListSlow, indexedSearchRanksAndPages)
+    {
+        const char *words[16] = {"super", "mega", "space", "dungeon", "quest", "racer", "ninja", "castle",
+                                 "dragon", "star", "wars", "knight", "pinball", "soccer", "tennis", "chess"};
+
+        // generate list of 50000 images, each with 1 to 3 games of 2 or 3 words
+        std::vector<std::string> allGames;
+        FILE *f = fopen("/tmp/imagelisttest.csv", "wt");
+        ASSERT_TRUE(f != NULL);
+        fprintf(f, "version 1\n");
+
+        DWORD rnd = 12345;
+        for(int i=0; i<50000; i++) {
+            fprintf(f, "http://server/images/img%05d.st,0x%04x", i, i);
+
+            int games = 1 + (i % 3);
+            for(int j=0; j<games; j++) {
+                std::string game;
+                int wordCount = 2 + (j % 2);
+
+                for(int k=0; k<wordCount; k++) {
+                    rnd = rnd * 1103515245 + 12345;
+                    game += (k == 0) ? "" : " ";
+                    game += words[(rnd >> 16) % 16];
+                }
+
+                if(i == 777 && j == 0) {                                    // few known games to check ranking on
+                    game = "Tetris";
+                } else if(i == 778 && j == 0) {
+                    game = "Super Tetris";
+                } else if(i == 779 && j == 0) {
+                    game = "Tetris 2: The Return";
+                }
+
+                fprintf(f, ",%s", game.c_str());
+                allGames.push_back(game);
+            }
+            fprintf(f, "\n");
+        }
+        fclose(f);
+
+        ImageList list;
+        DWORD start = Utils::getCurrentUs();
+        ASSERT_TRUE(list.loadList("/tmp/imagelisttest.csv"));
+        DWORD loadTime = Utils::getCurrentUs() - start;
+
+        char bfr[68];
+
+        // exact name goes first, then name starting with the query, then name containing it
+        list.search("TETRIS");
+        ASSERT_EQ(3, list.getSearchResultsCount());
+        list.getResultByIndex(0, bfr);
+        EXPECT_STREQ("img00777.st  - tetris", bfr);
+        list.getResultByIndex(1, bfr);
+        EXPECT_STREQ("img00779.st  - tetris 2: the return", bfr);
+        list.getResultByIndex(2, bfr);
+        EXPECT_STREQ("img00778.st  - super tetris", bfr);
+
+        list.search("sup tet");                                             // prefix of more words
+        ASSERT_EQ(1, list.getSearchResultsCount());
+        list.getResultByIndex(0, bfr);
+        EXPECT_STREQ("img00778.st  - super tetris", bfr);
+
+        list.search("x");                                                   // too short - all images listed
+        EXPECT_EQ(50000, list.getSearchResultsCount());
+
+        list.search("nosuchgame");
+        EXPECT_EQ(0, list.getSearchResultsCount());
+
+        // result counts match brute force search, index can be used to get any page
+        const char *queries[5] = {"dragon", "sta", "ninja cas", "pinball soccer chess", "wars star"};
+        for(int q=0; q<5; q++) {
+            int expected = 0;
+            for(size_t i=0; i<allGames.size(); i++) {
+                if(gameMatchesQuery(allGames[i], queries[q])) {
+                    expected++;
+                }
+            }
+
+            list.search(queries[q]);
+            EXPECT_EQ(expected, list.getSearchResultsCount()) << queries[q];
+
+            int lastPage = (list.getSearchResultsCount() - 1) / 15;
+            list.getResultByIndex(lastPage * 15, bfr);                      // first item of last page
+            EXPECT_TRUE(strlen(bfr) > 0) << queries[q];
+        }
+
+        // query latency
+        const int count = 200;
+        start = Utils::getCurrentUs();
+        for(int i=0; i<count; i++) {
+            list.search(queries[i % 5]);
+        }
+        DWORD avgSearch = (Utils::getCurrentUs() - start) / count;
+
+        start = Utils::getCurrentUs();
+        for(int i=0; i<count; i++) {
+            list.search("tetris");
+        }
+        DWORD avgRare = (Utils::getCurrentUs() - start) / count;
+
+        start = Utils::getCurrentUs();
+        ASSERT_TRUE(list.loadList("/tmp/imagelisttest.csv"));               // unchanged file is not loaded and indexed again
+        DWORD reloadTime = Utils::getCurrentUs() - start;
+
+        printf("imageList: 50000 images loaded and indexed in %d ms, reload %d us, search %d us (common words), %d us (rare word)\n",
+               (int) (loadTime / 1000), (int) reloadTime, (int) avgSearch, (int) avgRare);
+
+        unlink("/tmp/imagelisttest.csv");
+    }
+
+static int fat12Next(const unsigned char *raw, int cluster)
+    {
+        const unsigned char *fat = raw + 512;
+        int off = (cluster * 3) / 2;
+
+        if(cluster & 1) {
+            return (fat[off] >> 4) | (fat[off + 1] << 4);
+        }
+
+        return fat[off] | ((fat[off + 1] & 0x0f) << 8);
+    }
+
+static void fat12ReadChain(const unsigned char *raw, int cluster, std::string &data, std::vector<int> &clusterUse)
+    {
+        data.clear();
+
+        while(cluster >= 2 && cluster < (int) clusterUse.size()) {
+            clusterUse[cluster]++;
+            data.append((const char *) raw + 512 * (1 + 2 * SECTOR_PER_FAT + ROOTDIR_NBSECTOR) + 1024 * (cluster - 2), 1024);
+            cluster = fat12Next(raw, cluster);
+        }
+    }
+
+static void fat12ReadTree(const unsigned char *raw, const std::string &dir, const std::string &path, std::map<std::string, std::string> &files, std::vector<int> &clusterUse)
+    {
+        // walk the directory like TOS would, collect name, attributes, date and content of every entry
+        for(size_t pos=0; pos + 32 <= dir.length(); pos += 32) {
+            const unsigned char *e = (const unsigned char *) dir.data() + pos;
+
+            if(e[0] == 0 || e[0] == '.') {                              // empty entry, or . and ..
+                continue;
+            }
+
+            std::string name = path + "/" + std::string((const char *) e, 11);
+            int cluster = e[26] | (e[27] << 8);
+            int size    = e[28] | (e[29] << 8) | (e[30] << 16) | (e[31] << 24);
+
+            std::string content;
+            fat12ReadChain(raw, cluster, content, clusterUse);
+
+            files[name] = std::string((const char *) e + 11, 1) + std::string((const char *) e + 22, 4);    // attribute, time and date
+
+            if(e[11] & 0x10) {
+                fat12ReadTree(raw, content, name, files, clusterUse);
+            } else {
+                files[name] += content.substr(0, size);
+            }
+        }
+    }
+
+static bool fat12Equal(const unsigned char *rawA, const unsigned char *rawB)
+    {
+        // compare content of two images, also check that no cluster is used twice and FAT holds no lost clusters
+        std::map<std::string, std::string> files[2];
+        const unsigned char *raws[2] = {rawA, rawB};
+        int maxCluster = (80 * 2 * 9 - 1 - 2 * SECTOR_PER_FAT - ROOTDIR_NBSECTOR) / 2;
+
+        for(int i=0; i<2; i++) {
+            std::vector<int> clusterUse(maxCluster, 0);
+            std::string root((const char *) raws[i] + 512 * (1 + 2 * SECTOR_PER_FAT), ROOTDIR_NBSECTOR * 512);
+            fat12ReadTree(raws[i], root, "", files[i], clusterUse);
+
+            for(int c=2; c<maxCluster; c++) {
+                bool allocated = fat12Next(raws[i], c) != 0;
+
+                if(clusterUse[c] > 1 || allocated != (clusterUse[c] == 1)) {
+                    return false;
+                }
+            }
+        }
+
+        return files[0] == files[1];
+    }
+
+static void writeTestFile(const char *path, int size, char fill)
+    {
+        std::string data(size, fill);
+        FILE *f = fopen(path, "wb");
+        fwrite(data.data(), 1, size, f);
+        fclose(f);
+    }
+
+static bool updateAndCompare(CFloppy &incremental, CDirectory *&tree, const char *src, std::vector<int> &touched)
+    {
+        // update incremental image to new directory content, and check it against image made from scratch
+        std::vector<unsigned char> before(incremental.GetRawImage(), incremental.GetRawImage() + incremental.GetRawSize());
+
+        CDirectory *newTree = new CDirectory();
+        newTree->DirectoryScan(src);
+
+        if(!incremental.Update(newTree)) {
+            return false;
+        }
+
+        delete tree;
+        tree = newTree;
+
+        incremental.GetTouchedTracks(touched);
+
+        for(int i=0; i<incremental.GetRawSize(); i++) {                // every changed byte must be in a reported track
+            if(before[i] != incremental.GetRawImage()[i] && std::find(touched.begin(), touched.end(), i / (9 * 512)) == touched.end()) {
+                return false;
+            }
+        }
+
+        CDirectory *scratchTree = new CDirectory();
+        scratchTree->DirectoryScan(src);
+
+        CFloppy scratch;
+        scratch.Create(NB_HEAD, NB_SECTOR_PER_TRACK, NB_CYLINDER);
+        bool ok = scratch.Fill(scratchTree, (char *) "TEST");
+
+        delete scratchTree;
+        return ok && fat12Equal(incremental.GetRawImage(), scratch.GetRawImage());
+    }
+
+TEST(dir2fddSlow, incrementalUpdateMatchesFullBuild)
+    {
+        system("rm -rf /tmp/dir2fdd && mkdir -p /tmp/dir2fdd/sub/deep");
+        writeTestFile("/tmp/dir2fdd/a.txt",          3000, 'a');
+        writeTestFile("/tmp/dir2fdd/b.prg",          10,   'b');
+        writeTestFile("/tmp/dir2fdd/empty.txt",      0,    'e');
+        writeTestFile("/tmp/dir2fdd/sub/c.dat",      5000, 'c');
+        writeTestFile("/tmp/dir2fdd/sub/deep/d.txt", 100,  'd');
+
+        CDirectory *tree = new CDirectory();
+        tree->DirectoryScan("/tmp/dir2fdd");
+
+        CFloppy floppy;
+        floppy.Create(NB_HEAD, NB_SECTOR_PER_TRACK, NB_CYLINDER);
+        ASSERT_TRUE(floppy.Fill(tree, (char *) "TEST"));
+
+        std::vector<int> touched;
+        floppy.GetTouchedTracks(touched);
+        EXPECT_EQ(NB_CYLINDER * NB_HEAD, (int) touched.size());         // new image - everything
+
+        ASSERT_TRUE(updateAndCompare(floppy, tree, "/tmp/dir2fdd", touched));
+        EXPECT_EQ(0, (int) touched.size());                             // nothing changed - nothing written
+
+        writeTestFile("/tmp/dir2fdd/sub/c.dat", 5000, 'C');            // modify file, same size
+        ASSERT_TRUE(updateAndCompare(floppy, tree, "/tmp/dir2fdd", touched));
+        EXPECT_LT(0, (int) touched.size());
+        EXPECT_GE(3, (int) touched.size());                             // file clusters (and directory entry if date changed)
+
+        writeTestFile("/tmp/dir2fdd/a.txt", 9000, 'A');                // grow, add, delete
+        writeTestFile("/tmp/dir2fdd/sub/new.bin", 2500, 'n');
+        writeTestFile("/tmp/dir2fdd/empty.txt", 1, 'E');
+        unlink("/tmp/dir2fdd/b.prg");
+        ASSERT_TRUE(updateAndCompare(floppy, tree, "/tmp/dir2fdd", touched));
+        EXPECT_GT(NB_CYLINDER * NB_HEAD / 4, (int) touched.size());
+
+        system("rm -rf /tmp/dir2fdd/sub/deep");                         // remove dir, shrink file, add more files
+        writeTestFile("/tmp/dir2fdd/a.txt", 500, 'x');
+        for(int i=0; i<20; i++) {
+            char name[64];
+            sprintf(name, "/tmp/dir2fdd/sub/f%d.txt", i);
+            writeTestFile(name, 100 * i, 'a' + i);
+        }
+        ASSERT_TRUE(updateAndCompare(floppy, tree, "/tmp/dir2fdd", touched));
+
+        writeTestFile("/tmp/dir2fdd/huge.bin", 800 * 1024, 'h');       // doesn't fit - image stays as it was
+        std::vector<unsigned char> before(floppy.GetRawImage(), floppy.GetRawImage() + floppy.GetRawSize());
+        CDirectory *hugeTree = new CDirectory();
+        hugeTree->DirectoryScan("/tmp/dir2fdd");
+        EXPECT_FALSE(floppy.Update(hugeTree));
+        EXPECT_TRUE(memcmp(&before[0], floppy.GetRawImage(), floppy.GetRawSize()) == 0);
+        delete hugeTree;
+
+        delete tree;
+        system("rm -rf /tmp/dir2fdd");
+    }
+
+static bool encodedImageMatchesFile(MfmCachedImage *encImage, FloppyImage *img)
+    {
+        MfmDecoder decoder;
+        BYTE track[MFM_TRACK_SIZE], decoded[512], expected[512];
+
+        for(int t=0; t<NB_CYLINDER; t++) {
+            for(int side=0; side<NB_HEAD; side++) {
+                int count, start, end;
+                memcpy(track, encImage->getEncodedTrack(t, side, count), MFM_TRACK_SIZE);
+
+                for(int i=0; i<MFM_TRACK_SIZE; i += 2) {        // image for Franz has swapped bytes, swap them back
+                    BYTE tmp = track[i]; track[i] = track[i + 1]; track[i + 1] = tmp;
+                }
+
+                for(int sector=1; sector<=NB_SECTOR_PER_TRACK; sector++) {
+                    if(!findSectorInStream(track, count, t, side, sector, start, end) || !decoder.decodeSector(track + start, end - start, decoded)) {
+                        return false;
+                    }
+
+                    if(!img->readSector(t, side, sector, expected) || memcmp(decoded, expected, 512) != 0) {
+                        return false;
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+
+TEST(dir2fddSlow, changedTracksAreReencodedInSilo)
+    {
+        system("rm -rf /tmp/dir2fddsilo && mkdir -p /tmp/dir2fddsilo/sub");
+        writeTestFile("/tmp/dir2fddsilo/a.txt",     3000, 'a');
+        writeTestFile("/tmp/dir2fddsilo/sub/c.dat", 5000, 'c');
+
+        std::vector<int> touched;
+        ASSERT_TRUE(CDirectory::dir2fdd((char *) "/tmp/dir2fddsilo", (char *) "/tmp/dir2fddsilo.msa", &touched));
+        EXPECT_EQ(NB_CYLINDER * NB_HEAD, (int) touched.size());        // new image - everything
+
+        SiloSlot slot;
+        ImageSilo::initSlot(&slot);
+
+        EncodeRequest er;
+        er.type     = ENCODE_REQ_IMAGE;
+        er.filename = "/tmp/dir2fddsilo.msa";
+        er.slot     = &slot;
+        ImageSilo::processEncodeRequest(er);
+
+        ASSERT_TRUE(CDirectory::dir2fdd((char *) "/tmp/dir2fddsilo", (char *) "/tmp/dir2fddsilo.msa", &touched));
+        EXPECT_EQ(0, (int) touched.size());                             // nothing changed
+
+        writeTestFile("/tmp/dir2fddsilo/sub/c.dat", 5000, 'C');         // change one file and add another one
+        writeTestFile("/tmp/dir2fddsilo/new.prg",   700,  'n');
+        ASSERT_TRUE(CDirectory::dir2fdd((char *) "/tmp/dir2fddsilo", (char *) "/tmp/dir2fddsilo.msa", &touched));
+        EXPECT_LT(0, (int) touched.size());
+        EXPECT_GT(10, (int) touched.size());
+
+        er.type   = ENCODE_REQ_TRACKS_CHANGED;
+        er.tracks = touched;
+        ImageSilo::processTracksChanged(er);
+
+        // just the changed tracks were encoded again, but every sector must read as in the new file
+        FloppyImage *whole = FloppyImageFactory::getImage("/tmp/dir2fddsilo.msa");
+        ASSERT_TRUE(whole != NULL);
+
+        MfmCachedImage *encImage = ImageSilo::acquireEncodedImage(&slot);
+        ASSERT_TRUE(encImage != NULL);
+        EXPECT_TRUE(encodedImageMatchesFile(encImage, whole));
+        encImage->release();
+        delete whole;
+
+        ImageSilo::closeSlotImage(&slot);
+        encImage = ImageSilo::acquireEncodedImage(&slot);
+        encImage->release();                                    // our reference
+        encImage->release();                                    // slot's reference
+
+        CDirectory::dir2fddForget("/tmp/dir2fddsilo.msa");
+        unlink("/tmp/dir2fddsilo.msa");
+        system("rm -rf /tmp/dir2fddsilo");
+    }
+
+class FakeDataTrans: public AcsiDataTrans
+{
+public:
+    std::vector<BYTE> dataFromSt;                                       // what the ST will send on recvData()
+    std::vector<BYTE> dataToSt;                                         // what was sent to ST on last sendDataAndStatus()
+    BYTE              statusToSt;
+
+    virtual bool recvData(BYTE *data, DWORD cnt) {
+        dataDirection = DATA_DIRECTION_WRITE;
+
+        memset(data, 0, cnt);
+        memcpy(data, &dataFromSt[0], MIN(cnt, dataFromSt.size()));
+        return true;
+    }
+
+    virtual void sendDataAndStatus(bool fromRetryModule = false) {
+        dataToSt.assign(buffer, buffer + count);
+        statusToSt = status;
+    }
+};
+
+static BYTE netCommand(NetAdapter &na, FakeDataTrans &dt, BYTE netCmd, BYTE arg1=0, WORD arg23=0, BYTE arg4=0, BYTE arg5=0)
+    {
+        BYTE cmd[ACSI_CMD_SIZE];
+        memset(cmd, 0, ACSI_CMD_SIZE);
+        cmd[1] = 'C';
+        cmd[2] = 'E';
+        cmd[3] = HOSTMOD_NETWORK_ADAPTER;
+        cmd[4] = netCmd;
+        cmd[5] = arg1;
+        Utils::storeWord(cmd + 6, arg23);
+        cmd[8] = arg4;
+        cmd[9] = arg5;
+
+        na.processCommand(cmd);
+        return dt.statusToSt;
+    }
+
+static BYTE netOpen(NetAdapter &na, FakeDataTrans &dt, bool tcpNotUdp, DWORD remoteHost, WORD remotePort)
+    {
+        dt.dataFromSt.assign(512, 0);
+        Utils::storeDword(&dt.dataFromSt[0], remoteHost);
+        Utils::storeWord (&dt.dataFromSt[4], remotePort);
+        Utils::storeWord (&dt.dataFromSt[8], 1500);                     // buff_size
+
+        return netCommand(na, dt, tcpNotUdp ? NET_CMD_TCP_OPEN : NET_CMD_UDP_OPEN);
+    }
+
+static int netListenSocket(bool tcpNotUdp, WORD &port)
+    {
+        int fd = socket(AF_INET, tcpNotUdp ? SOCK_STREAM : SOCK_DGRAM, 0);
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family         = AF_INET;
+        addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        addr.sin_port           = 0;
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+
+        if(tcpNotUdp) {
+            listen(fd, 64);
+        }
+
+        socklen_t len = sizeof(addr);
+        getsockname(fd, (struct sockaddr *) &addr, &len);
+        port = ntohs(addr.sin_port);
+        return fd;
+    }
+
+static DWORD netUpdateInfo(NetAdapter &na, FakeDataTrans &dt)
+    {
+        DWORD start = Utils::getCurrentUs();
+        netCommand(na, dt, NET_CMD_CN_UPDATE_INFO);
+        return Utils::getCurrentUs() - start;
+    }
+
+static bool netWaitForBytes(NetAdapter &na, FakeDataTrans &dt, int connections, DWORD bytesEach)
+    {
+        // wait until network thread receives the data for all connections
+        for(int loop=0; loop<200; loop++) {
+            netUpdateInfo(na, dt);
+
+            int ready = 0;
+            for(int i=0; i<connections; i++) {
+                if(Utils::getDword(&dt.dataToSt[i * 4]) == bytesEach) {
+                    ready++;
+                }
+            }
+
+            if(ready == connections) {
+                return true;
+            }
+
+            Utils::sleepMs(10);
+        }
+
+        return false;
+    }
+
+static DWORD netMedianUpdateInfo(NetAdapter &na, FakeDataTrans &dt)
+    {
+        std::vector<DWORD> times;
+        for(int i=0; i<2001; i++) {
+            times.push_back(netUpdateInfo(na, dt));
+        }
+
+        std::sort(times.begin(), times.end());
+        return times[times.size() / 2];
+    }
+
+TEST(netAdapterSlow, updateInfoLatencyDoesNotDependOnConnectionCount)
+    {
+        NetAdapter na;
+        FakeDataTrans dt;
+        na.setAcsiDataTrans(&dt);
+
+        WORD tcpPort, udpPort;
+        int tcpServer = netListenSocket(true,  tcpPort);
+        int udpServer = netListenSocket(false, udpPort);
+
+        BYTE data[100];
+        memset(data, 0x55, sizeof(data));
+
+        // single TCP connection with some data waiting
+        std::vector<int> clients;
+        BYTE handle = netOpen(na, dt, true, INADDR_LOOPBACK, tcpPort);
+        ASSERT_TRUE(network_handleIsValid(handle));
+        clients.push_back(accept(tcpServer, NULL, NULL));
+        ASSERT_EQ(100, write(clients[0], data, 100));
+        ASSERT_TRUE(netWaitForBytes(na, dt, 1, 100));
+        EXPECT_EQ(TESTABLISH, dt.dataToSt[NET_HANDLES_COUNT * 4]);
+
+        DWORD oneConnection = netMedianUpdateInfo(na, dt);
+
+        // 16 TCP and 16 UDP connections, all with data waiting
+        for(int i=1; i<16; i++) {
+            BYTE h = netOpen(na, dt, true, INADDR_LOOPBACK, tcpPort);
+            ASSERT_TRUE(network_handleIsValid(h));
+            clients.push_back(accept(tcpServer, NULL, NULL));
+            ASSERT_EQ(100, write(clients[i], data, 100));
+        }
+
+        for(int i=16; i<NET_HANDLES_COUNT; i++) {
+            BYTE h = netOpen(na, dt, false, INADDR_LOOPBACK, udpPort);
+            ASSERT_TRUE(network_handleIsValid(h));
+        }
+
+        netUpdateInfo(na, dt);
+        for(int i=16; i<NET_HANDLES_COUNT; i++) {                       // send datagram to local port of each UDP connection
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family         = AF_INET;
+            addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+            addr.sin_port           = htons(Utils::getWord(&dt.dataToSt[NET_HANDLES_COUNT * 5 + i * 2]));
+            ASSERT_EQ(100, sendto(udpServer, data, 100, 0, (struct sockaddr *) &addr, sizeof(addr)));
+        }
+
+        ASSERT_TRUE(netWaitForBytes(na, dt, NET_HANDLES_COUNT, 100));
+
+        DWORD allConnections = netMedianUpdateInfo(na, dt);
+
+        printf("netAdapter: conUpdateInfo() median latency %d us with 1 connection, %d us with %d connections\n", (int) oneConnection, (int) allConnections, NET_HANDLES_COUNT);
+        EXPECT_GE(oneConnection * 3 + 10, allConnections);
+
+        // remote close - connection stays open until ST reads the data
+        close(clients[0]);
+        Utils::sleepMs(50);
+        netUpdateInfo(na, dt);
+        EXPECT_EQ(TESTABLISH, dt.dataToSt[NET_HANDLES_COUNT * 4]);
+
+        EXPECT_EQ(E_NORMAL, netCommand(na, dt, NET_CMD_CNGET_BLOCK, handle, 100));
+        EXPECT_EQ(0, memcmp(&dt.dataToSt[0], data, 100));
+
+        netUpdateInfo(na, dt);
+        EXPECT_EQ(TCLOSED, dt.dataToSt[NET_HANDLES_COUNT * 4]);
+
+        for(size_t i=1; i<clients.size(); i++) {
+            close(clients[i]);
+        }
+        close(tcpServer);
+        close(udpServer);
+    }
+
+// remote sides fill the socket buffers, then ST reads it all - network thread receives all the time, but nothing else needs CPU
+TEST(netAdapterSlow, updateInfoLatencyDuringBulkReceive)
+    {
+        NetAdapter na;
+        FakeDataTrans dt;
+        na.setAcsiDataTrans(&dt);
+
+        WORD port;
+        int tcpServer = netListenSocket(true, port);
+
+        std::vector<BYTE> handles;
+        std::vector<int>  clients;
+        BYTE  bfr[64 * 1024];
+        DWORD sent = 0;
+        memset(bfr, 0x55, sizeof(bfr));
+
+        for(int i=0; i<16; i++) {
+            BYTE handle = netOpen(na, dt, true, INADDR_LOOPBACK, port);
+            ASSERT_TRUE(network_handleIsValid(handle));
+            handles.push_back(handle);
+
+            int fd = accept(tcpServer, NULL, NULL);
+            int sndBuf = 4 * 1024 * 1024;
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+            clients.push_back(fd);
+        }
+
+        for(int round=0; round<100; round++) {                          // whatever the sockets take
+            for(size_t i=0; i<clients.size(); i++) {
+                int res = send(clients[i], bfr, sizeof(bfr), MSG_DONTWAIT | MSG_NOSIGNAL);
+                if(res > 0) {
+                    sent += res;
+                }
+            }
+        }
+
+        // ST reads it all; its commands come at random points of network thread's work, and must not wait for much of it
+        std::vector<DWORD> times;
+        DWORD received = 0;
+        DWORD start    = Utils::getCurrentMs();
+
+        while(received < sent && Utils::getCurrentMs() - start < 5000) {
+            for(size_t i=0; i<handles.size(); i++) {
+                netCommand(na, dt, NET_CMD_CN_UPDATE_INFO);
+                DWORD waiting = Utils::getDword(&dt.dataToSt[network_handleToSlot(handles[i]) * 4]);
+                WORD  length  = MIN(waiting, (DWORD) 60000);
+
+                if(length > 0 && netCommand(na, dt, NET_CMD_CNGET_BLOCK, handles[i], length) == E_NORMAL) {
+                    received += length;
+                }
+            }
+
+            usleep(100 + (times.size() % 7) * 50);
+            times.push_back(netUpdateInfo(na, dt));
+        }
+
+        std::sort(times.begin(), times.end());
+        DWORD median = times[times.size() / 2];
+        DWORD p99    = times[(times.size() * 99) / 100];
+
+        printf("netAdapter: %d of %d MB received by 16 connections, conUpdateInfo() meanwhile - median %d us, 99th percentile %d us, max %d us\n",
+               (int) (received >> 20), (int) (sent >> 20), (int) median, (int) p99, (int) times.back());
+
+        EXPECT_EQ(sent, received);
+        EXPECT_GT((DWORD) 500, p99);                                    // waits for one receive step at most, not for receiving from all the sockets
+
+        for(size_t i=0; i<clients.size(); i++) {
+            close(clients[i]);
+        }
+        close(tcpServer);
+    }
+
+typedef struct {                                                        // connection info as ST driver keeps it
+    DWORD   bytes;
+    DWORD   remoteHost;
+    WORD    localPort;
+    WORD    remotePort;
+    BYTE    status;
+} TStConInfo;
+
+static int netFullUpdate(NetAdapter &na, FakeDataTrans &dt, TStConInfo *table)
+    {
+        netCommand(na, dt, NET_CMD_CN_UPDATE_INFO);
+        BYTE *d = &dt.dataToSt[0];
+
+        for(int i=0; i<NET_HANDLES_COUNT; i++) {
+            table[i].bytes      = Utils::getDword(d + i * 4);
+            table[i].status     = d[NET_HANDLES_COUNT * 4 + i];
+            table[i].localPort  = Utils::getWord (d + NET_HANDLES_COUNT * 5 + i * 2);
+            table[i].remoteHost = Utils::getDword(d + NET_HANDLES_COUNT * 7 + i * 4);
+            table[i].remotePort = Utils::getWord (d + NET_HANDLES_COUNT * 11 + i * 2);
+        }
+
+        return dt.dataToSt.size();
+    }
+
+static int netDeltaUpdate(NetAdapter &na, FakeDataTrans &dt, DWORD &generation, TStConInfo *table)
+    {
+        netCommand(na, dt, NET_CMD_CN_UPDATE_INFO_DELTA, generation >> 24, (generation >> 8) & 0xffff, generation & 0xff);
+        BYTE *d = &dt.dataToSt[0];
+
+        generation = Utils::getDword(d);
+
+        for(int i=0; i<d[4]; i++) {                                     // apply changed connections
+            BYTE *e = d + 16 + i * 15;
+            TStConInfo *ci = &table[e[0]];
+
+            ci->status      = e[1];
+            ci->bytes       = Utils::getDword(e + 2);
+            ci->remoteHost  = Utils::getDword(e + 6);
+            ci->localPort   = Utils::getWord (e + 10);
+            ci->remotePort  = Utils::getWord (e + 12);
+        }
+
+        return dt.dataToSt.size();
+    }
+
+static int netDifferentConInfos(TStConInfo *a, TStConInfo *b)
+    {
+        int diffs = 0;
+        for(int i=0; i<NET_HANDLES_COUNT; i++) {
+            if(a[i].bytes != b[i].bytes || a[i].status != b[i].status || a[i].localPort != b[i].localPort ||
+               a[i].remoteHost != b[i].remoteHost || a[i].remotePort != b[i].remotePort) {
+                diffs++;
+            }
+        }
+        return diffs;
+    }
+
+TEST(netAdapterSlow, deltaUpdateInfoSendsOnlyChangedConnections)
+    {
+        NetAdapter na;
+        FakeDataTrans dt;
+        na.setAcsiDataTrans(&dt);
+
+        WORD tcpPort, udpPort;
+        int tcpServer = netListenSocket(true,  tcpPort);
+        int udpServer = netListenSocket(false, udpPort);
+
+        std::vector<int> clients;
+        for(int i=0; i<16; i++) {
+            BYTE h = netOpen(na, dt, true, INADDR_LOOPBACK, tcpPort);
+            ASSERT_TRUE(network_handleIsValid(h));
+            clients.push_back(accept(tcpServer, NULL, NULL));
+        }
+
+        for(int i=16; i<NET_HANDLES_COUNT; i++) {
+            BYTE h = netOpen(na, dt, false, INADDR_LOOPBACK, udpPort);
+            ASSERT_TRUE(network_handleIsValid(h));
+        }
+        Utils::sleepMs(20);                                             // let the network thread finish the connects
+
+        TStConInfo delta[NET_HANDLES_COUNT], full[NET_HANDLES_COUNT];
+        memset(delta, 0, sizeof(delta));
+        DWORD generation = 0;
+
+        netDeltaUpdate(na, dt, generation, delta);                      // ST without generation gets everything
+        EXPECT_EQ(NET_HANDLES_COUNT, dt.dataToSt[4]);
+        EXPECT_NE(0, dt.dataToSt[5]);
+        EXPECT_NE(0, (int) generation);
+
+        BYTE data[32];
+        memset(data, 0x55, sizeof(data));
+
+        for(int busy=0; busy<2; busy++) {
+            int fullBytes = 0, deltaBytes = 0, polls = 0;
+            DWORD start = Utils::getCurrentMs();
+
+            while(Utils::getCurrentMs() - start < 500) {                // simulated polling loop
+                if(busy) {                                              // busy - some data arrives on 4 connections between polls
+                    for(int j=0; j<4; j++) {
+                        ASSERT_EQ(32, write(clients[(polls + j) % clients.size()], data, 32));
+                    }
+                }
+
+                deltaBytes  += netDeltaUpdate(na, dt, generation, delta);
+                fullBytes   += netFullUpdate (na, dt, full);
+                polls++;
+
+                Utils::sleepMs(2);
+            }
+
+            DWORD duration = Utils::getCurrentMs() - start;
+
+            Utils::sleepMs(20);                                         // nothing changes now, so both should give the same
+            netDeltaUpdate(na, dt, generation, delta);
+            netFullUpdate (na, dt, full);
+            EXPECT_EQ(0, netDifferentConInfos(delta, full));
+
+            printf("netAdapter: %s connections, %d polls - full update %d bytes/s, delta update %d bytes/s\n", busy ? "busy" : "idle", polls,
+                   (int) (fullBytes * 1000LL / duration), (int) (deltaBytes * 1000LL / duration));
+
+            EXPECT_GT(fullBytes, deltaBytes * (busy ? 2 : 10));
+        }
+
+        // generation from other session (e.g. before restart) gets everything again
+        generation ^= 0x80000000;
+        netDeltaUpdate(na, dt, generation, delta);
+        EXPECT_EQ(NET_HANDLES_COUNT, dt.dataToSt[4]);
+        EXPECT_NE(0, dt.dataToSt[5]);
+
+        for(size_t i=0; i<clients.size(); i++) {
+            close(clients[i]);
+        }
+        close(tcpServer);
+        close(udpServer);
+    }
+
+typedef struct {                                                        // remote side of upload test - reads and checks the data
+    int             fd;
+    volatile bool   shouldRead;
+    volatile DWORD  bytes;
+    volatile int    badBytes;
+} TUploadSink;
+
+static void *uploadSinkThreadCode(void *ptr)
+    {
+        TUploadSink *sink = (TUploadSink *) ptr;
+        BYTE bfr[64 * 1024];
+
+        while(1) {
+            if(!sink->shouldRead) {                                     // remote app is busy, doesn't read
+                Utils::sleepMs(1);
+                continue;
+            }
+
+            int res = read(sink->fd, bfr, sizeof(bfr));
+            if(res <= 0) {                                              // closed
+                break;
+            }
+
+            for(int i=0; i<res; i++) {
+                if(bfr[i] != (BYTE) ((sink->bytes + i) % 251)) {
+                    sink->badBytes++;
+                }
+            }
+            sink->bytes += res;
+        }
+
+        return 0;
+    }
+
+static BYTE netSendBlock(NetAdapter &na, FakeDataTrans &dt, BYTE handle, DWORD offset, WORD length)
+    {
+        dt.dataFromSt.resize(length);
+        for(int i=0; i<length; i++) {                                   // data which sink can check
+            dt.dataFromSt[i] = (BYTE) ((offset + i) % 251);
+        }
+
+        return netCommand(na, dt, NET_CMD_TCP_SEND, handle, length);
+    }
+
+TEST(netAdapterSlow, tcpUploadIsQueuedAndPaced)
+    {
+        NetAdapter na;
+        FakeDataTrans dt;
+        na.setAcsiDataTrans(&dt);
+
+        WORD port;
+        int tcpServer = netListenSocket(true, port);
+        BYTE handle = netOpen(na, dt, true, INADDR_LOOPBACK, port);
+        ASSERT_TRUE(network_handleIsValid(handle));
+        int slot = network_handleToSlot(handle);
+
+        TUploadSink sink;
+        sink.fd         = accept(tcpServer, NULL, NULL);
+        sink.shouldRead = false;
+        sink.bytes      = 0;
+        sink.badBytes   = 0;
+        Utils::sleepMs(20);                                             // let the network thread finish the connect
+
+        pthread_t sinkThread;
+        pthread_create(&sinkThread, NULL, uploadSinkThreadCode, &sink);
+
+        const WORD blockSize = 16 * 1024;
+        const int  queuedKbOffset = NET_HANDLES_COUNT * 13 + 8;         // position of send buffer info in NET_CMD_CN_UPDATE_INFO reply
+
+        // remote side doesn't read - socket fills up, then send buffer, then ST gets E_OBUFFULL and nothing is lost
+        DWORD accepted = 0;
+        while(accepted < 16 * 1024 * 1024) {
+            BYTE res = netSendBlock(na, dt, handle, accepted, blockSize);
+            if(res == (BYTE) E_OBUFFULL) {
+                break;
+            }
+            ASSERT_EQ(E_NORMAL, res);
+            accepted += blockSize;
+        }
+
+        netCommand(na, dt, NET_CMD_CN_UPDATE_INFO);
+        int queuedKb = dt.dataToSt[queuedKbOffset + slot];
+        printf("netAdapter: stalled remote side - %d kB accepted, %d kB of that waits in send buffer\n", (int) (accepted / 1024), queuedKb);
+
+        EXPECT_GT(queuedKb * 1024 + blockSize, NET_SEND_BUFFER_SIZE);   // send buffer is (almost) full
+        EXPECT_GE(NET_SEND_BUFFER_SIZE, queuedKb * 1024);
+
+        // remote side reads now - simulated ST sends as fast as it can, on E_OBUFFULL it waits for the send buffer to drain
+        sink.shouldRead = true;
+
+        int   fullCount = 0;
+        DWORD start     = Utils::getCurrentMs();
+
+        while(Utils::getCurrentMs() - start < 1000) {
+            BYTE res = netSendBlock(na, dt, handle, accepted, blockSize);
+
+            if(res == E_NORMAL) {
+                accepted += blockSize;
+                continue;
+            }
+
+            ASSERT_EQ((BYTE) E_OBUFFULL, res);
+            fullCount++;
+
+            do {                                                        // like the driver - don't send until there's space
+                Utils::sleepMs(1);
+                netCommand(na, dt, NET_CMD_CN_UPDATE_INFO);
+            } while(dt.dataToSt[queuedKbOffset + slot] * 1024 + blockSize > NET_SEND_BUFFER_SIZE);
+        }
+
+        DWORD duration = Utils::getCurrentMs() - start;
+
+        // remote side stalls again and ST closes with full send buffer - close returns right away, network thread writes the rest
+        sink.shouldRead = false;
+        Utils::sleepMs(10);
+
+        while(netSendBlock(na, dt, handle, accepted, blockSize) == E_NORMAL) {
+            accepted += blockSize;
+        }
+
+        dt.dataFromSt.assign(512, 0);
+        Utils::storeWord(&dt.dataFromSt[0], handle);
+
+        DWORD closeStart = Utils::getCurrentUs();
+        netCommand(na, dt, NET_CMD_TCP_CLOSE);
+        DWORD closeUs = Utils::getCurrentUs() - closeStart;
+
+        EXPECT_LT(closeUs, (DWORD) 50000);                              // doesn't wait for the remote side
+        EXPECT_TRUE(network_handleIsValid(netOpen(na, dt, true, INADDR_LOOPBACK, port)));  // slot is free again at once
+        close(accept(tcpServer, NULL, NULL));
+
+        sink.shouldRead = true;
+        pthread_join(sinkThread, NULL);
+
+        printf("netAdapter: upload %d MB/s, %d times send buffer was full, close with full send buffer took %d us\n",
+               (int) (((unsigned long long) accepted * 1000) / duration / (1024 * 1024)), fullCount, (int) closeUs);
+
+        EXPECT_EQ(accepted, sink.bytes);                                // everything accepted got to remote side, in right order
+        EXPECT_EQ(0, sink.badBytes);
+
+        close(sink.fd);
+        close(tcpServer);
+    }
+
+static BYTE netClose(NetAdapter &na, FakeDataTrans &dt, BYTE handle)
+    {
+        dt.dataFromSt.assign(512, 0);
+        Utils::storeWord(&dt.dataFromSt[0], handle);
+        return netCommand(na, dt, NET_CMD_TCP_CLOSE);
+    }
+
+TEST(netAdapterSlow, connectionTableGrowsOnDemand)
+    {
+        NetAdapter na;
+        FakeDataTrans dt;
+        na.setAcsiDataTrans(&dt);
+
+        WORD port;
+        int tcpServer = netListenSocket(true, port);
+
+        BufferPool::freeUnused();
+        DWORD poolBefore = BufferPool::getBytesAllocated();
+
+        // open and close thousands of connections, each receives a bit of data
+        BYTE data[100];
+        memset(data, 0x55, sizeof(data));
+
+        BufferPool::resetPeak();
+        DWORD openUs = 0;
+        const int cycles = 3000;
+
+        for(int i=0; i<cycles; i++) {
+            DWORD start = Utils::getCurrentUs();
+            BYTE handle = netOpen(na, dt, true, INADDR_LOOPBACK, port);
+            openUs += Utils::getCurrentUs() - start;
+
+            ASSERT_TRUE(network_handleIsValid(handle));
+            int client = accept(tcpServer, NULL, NULL);
+            ASSERT_EQ(100, write(client, data, 100));
+            ASSERT_TRUE(netWaitForBytes(na, dt, 1, 100));
+            ASSERT_EQ(E_NORMAL, netCommand(na, dt, NET_CMD_CNGET_BLOCK, handle, 100));
+
+            netClose(na, dt, handle);
+            close(client);
+        }
+
+        DWORD churnPeak = BufferPool::getBytesPeak() - poolBefore;
+        printf("netAdapter: %d connections opened and closed - open %d us on average, peak of connection buffers %d kB\n", cycles, (int) (openUs / cycles), (int) (churnPeak / 1024));
+        EXPECT_GE((DWORD) 2 * READWRAPPER_TCP_RING, churnPeak);        // closed connections don't hold any buffers
+
+        // more connections than fit in NET_CMD_CN_UPDATE_INFO - table grows up to the limit, then open fails
+        std::vector<BYTE> handles;
+        std::vector<int>  clients;
+
+        // driver which didn't tell how many handles it knows gets only the first NET_HANDLES_COUNT of them
+        for(int i=0; i<NET_HANDLES_COUNT; i++) {
+            BYTE handle = netOpen(na, dt, true, INADDR_LOOPBACK, port);
+            ASSERT_TRUE(network_handleIsValid(handle));
+            EXPECT_GT(NET_STARTING_HANDLE + NET_HANDLES_COUNT, (int) handle);
+            clients.push_back(accept(tcpServer, NULL, NULL));
+        }
+        EXPECT_EQ((BYTE) E_CONNECTFAIL, netOpen(na, dt, true, INADDR_LOOPBACK, port));
+
+        netCommand(na, dt, NET_CMD_IDENTIFY, NET_MAX_HANDLES);         // new driver - closes everything and allows all handles
+        for(size_t i=0; i<clients.size(); i++) {
+            close(clients[i]);
+        }
+        clients.clear();
+
+        BufferPool::resetPeak();
+        DWORD start = Utils::getCurrentUs();
+
+        for(int i=0; i<NET_MAX_HANDLES; i++) {
+            BYTE handle = netOpen(na, dt, true, INADDR_LOOPBACK, port);
+            ASSERT_TRUE(network_handleIsValid(handle));
+            EXPECT_TRUE(std::find(handles.begin(), handles.end(), handle) == handles.end());
+
+            handles.push_back(handle);
+            clients.push_back(accept(tcpServer, NULL, NULL));
+        }
+
+        DWORD fillUs = Utils::getCurrentUs() - start;
+        EXPECT_EQ((BYTE) E_CONNECTFAIL, netOpen(na, dt, true, INADDR_LOOPBACK, port));
+
+        Utils::sleepMs(20);                                             // let the network thread finish the connects
+
+        // highest handle works for sending and receiving
+        BYTE lastHandle = handles.back();
+        EXPECT_EQ(NET_STARTING_HANDLE + NET_MAX_HANDLES - 1, lastHandle);
+
+        dt.dataFromSt.assign(data, data + 100);
+        EXPECT_EQ(E_NORMAL, netCommand(na, dt, NET_CMD_TCP_SEND, lastHandle, 100));
+
+        BYTE received[100];
+        EXPECT_EQ(100, read(clients.back(), received, 100));
+        EXPECT_EQ(0, memcmp(received, data, 100));
+
+        ASSERT_EQ(100, write(clients.back(), data, 100));
+        Utils::sleepMs(20);
+        EXPECT_EQ(E_NORMAL, netCommand(na, dt, NET_CMD_CNGET_BLOCK, lastHandle, 100));
+        EXPECT_EQ(0, memcmp(&dt.dataToSt[0], data, 100));
+
+        // delta update of all connections doesn't fit in one sector, ST gets it in more calls
+        DWORD generation    = 0;
+        int   entries       = 0;
+        int   calls         = 0;
+        bool  gotLast       = false;
+
+        do {
+            netCommand(na, dt, NET_CMD_CN_UPDATE_INFO_DELTA, generation >> 24, (generation >> 8) & 0xffff, generation & 0xff);
+            ASSERT_GE(512, (int) dt.dataToSt.size());
+
+            generation = Utils::getDword(&dt.dataToSt[0]);
+            for(int i=0; i<dt.dataToSt[4]; i++) {
+                BYTE *e = &dt.dataToSt[16 + i * 15];
+                if(e[0] == network_handleToSlot(lastHandle)) {
+                    gotLast = true;
+                    EXPECT_EQ(TESTABLISH, e[1]);
+                }
+            }
+
+            entries += dt.dataToSt[4];
+            calls++;
+        } while(dt.dataToSt[6] && calls < 10);
+
+        EXPECT_EQ(NET_MAX_HANDLES, entries);
+        EXPECT_EQ((NET_MAX_HANDLES + NET_DELTA_MAX_ENTRIES - 1) / NET_DELTA_MAX_ENTRIES, calls);
+        EXPECT_TRUE(gotLast);
+
+        for(size_t i=0; i<handles.size(); i++) {
+            netClose(na, dt, handles[i]);
+            close(clients[i]);
+        }
+
+        printf("netAdapter: %d connections opened in %d us, peak of connection buffers %d kB\n", NET_MAX_HANDLES, (int) fillUs, (int) ((BufferPool::getBytesPeak() - poolBefore) / 1024));
+
+        // buffers of closed connections went back to pool
+        BufferPool::freeUnused();
+        EXPECT_EQ(poolBefore, BufferPool::getBytesAllocated());
+
+        close(tcpServer);
+    }
+
+static DWORD tcpSegmentsIn(int fd)
+    {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        memset(&info, 0, sizeof(info));
+        getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+        return info.tcpi_segs_in;
+    }
+
+static bool sinkWaitForBytes(TUploadSink &sink, DWORD bytes, int timeoutMs)
+    {
+        DWORD start = Utils::getCurrentMs();
+        while(sink.bytes < bytes) {
+            if((int) (Utils::getCurrentMs() - start) > timeoutMs) {
+                return false;
+            }
+            Utils::sleepMs(1);
+        }
+        return true;
+    }
+
+TEST(netAdapterSlow, smallWritesAreCoalesced)
+    {
+        const int writes = 100000;
+
+        WORD port;
+        int tcpServer = netListenSocket(true, port);
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family         = AF_INET;
+        addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        addr.sin_port           = htons(port);
+
+        // without coalescing - each 1 byte write goes to socket right away, like it was before
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT_EQ(0, connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+
+        TUploadSink sink;
+        sink.fd         = accept(tcpServer, NULL, NULL);
+        sink.shouldRead = true;
+        sink.bytes      = 0;
+        sink.badBytes   = 0;
+
+        pthread_t sinkThread;
+        pthread_create(&sinkThread, NULL, uploadSinkThreadCode, &sink);
+
+        SendWrapper sw;
+        sw.init(fd);
+
+        DWORD segsBefore = tcpSegmentsIn(sink.fd);
+        DWORD start      = Utils::getCurrentUs();
+
+        for(int i=0; i<writes; i++) {
+            BYTE b = i % 251;
+            ASSERT_EQ(E_NORMAL, sw.send(&b, 1, true));
+        }
+        sw.flushBeforeClose(1000);
+
+        ASSERT_TRUE(sinkWaitForBytes(sink, writes, 2000));
+        DWORD plainUs   = Utils::getCurrentUs() - start;
+        DWORD plainSegs = tcpSegmentsIn(sink.fd) - segsBefore;
+
+        close(fd);
+        pthread_join(sinkThread, NULL);
+        close(sink.fd);
+        EXPECT_EQ(0, sink.badBytes);
+
+        // through NetAdapter with default coalescing - the last held back write is flushed by network thread
+        NetAdapter na;
+        FakeDataTrans dt;
+        na.setAcsiDataTrans(&dt);
+
+        BYTE handle = netOpen(na, dt, true, INADDR_LOOPBACK, port);
+        ASSERT_TRUE(network_handleIsValid(handle));
+
+        sink.fd     = accept(tcpServer, NULL, NULL);
+        sink.bytes  = 0;
+        Utils::sleepMs(20);                                             // let the network thread finish the connect
+        pthread_create(&sinkThread, NULL, uploadSinkThreadCode, &sink);
+
+        segsBefore  = tcpSegmentsIn(sink.fd);
+        start       = Utils::getCurrentUs();
+
+        for(int i=0; i<writes; i++) {
+            ASSERT_EQ(E_NORMAL, netSendBlock(na, dt, handle, i, 1));
+        }
+
+        ASSERT_TRUE(sinkWaitForBytes(sink, writes, 2000));
+        DWORD coalescedUs   = Utils::getCurrentUs() - start;
+        DWORD coalescedSegs = tcpSegmentsIn(sink.fd) - segsBefore;
+
+        printf("sendWrapper: %d x 1 byte writes - immediate: %d segments in %d us, coalesced: %d segments in %d us (including ST commands)\n",
+               writes, (int) plainSegs, (int) plainUs, (int) coalescedSegs, (int) coalescedUs);
+
+        EXPECT_GT(plainSegs, coalescedSegs * 10);
+
+        // after a pause a small write goes out right away, and ST checking the state flushes the held back write
+        Utils::sleepMs(20);
+        ASSERT_EQ(E_NORMAL, netSendBlock(na, dt, handle, writes, 1));
+        ASSERT_EQ(E_NORMAL, netSendBlock(na, dt, handle, writes + 1, 1));
+        netCommand(na, dt, NET_CMD_CN_UPDATE_INFO);
+        EXPECT_TRUE(sinkWaitForBytes(sink, writes + 2, 2));             // sooner than the flush delay
+
+        netClose(na, dt, handle);
+        pthread_join(sinkThread, NULL);
+        EXPECT_EQ(0, sink.badBytes);
+
+        close(sink.fd);
+        close(tcpServer);
+    }
+
+static DWORD netLinesAvailable(NetAdapter &na, FakeDataTrans &dt)
+    {
+        netUpdateInfo(na, dt);
+        return Utils::getDword(&dt.dataToSt[NET_HANDLES_COUNT * 13 + 4]);  // after all the per-connection info and ICMP count
+    }
+
+TEST(netAdapterSlow, getStringReads10000LinesWithoutRescanning)
+    {
+        NetAdapter na;
+        FakeDataTrans dt;
+        na.setAcsiDataTrans(&dt);
+
+        WORD tcpPort;
+        int tcpServer = netListenSocket(true, tcpPort);
+
+        BYTE handle = netOpen(na, dt, true, INADDR_LOOPBACK, tcpPort);
+        ASSERT_TRUE(network_handleIsValid(handle));
+        int client = accept(tcpServer, NULL, NULL);
+
+        const int lineCount = 10000;
+        std::string stream;
+        char line[64];
+        for(int i=0; i<lineCount; i++) {
+            sprintf(line, "line %05d of CNgets benchmark\r\n", i);
+            stream += line;
+        }
+
+        EXPECT_EQ(0, netLinesAvailable(na, dt) & 1);                    // no CNgets() yet, so no delimiter known
+
+        // send the stream in 64 kB chunks (which split the lines), then read lines until no complete line is left
+        size_t sent = 0, consumed = 0;
+        int linesRead = 0, badLines = 0, noData = 0;
+        DWORD getsTime = 0;
+
+        while(sent < stream.size()) {
+            size_t chunk = MIN(stream.size() - sent, (size_t) (64 * 1024));
+            ASSERT_EQ((int) chunk, write(client, stream.data() + sent, chunk));
+            sent += chunk;
+            ASSERT_TRUE(netWaitForBytes(na, dt, 1, sent - consumed));
+
+            while(true) {
+                DWORD start = Utils::getCurrentUs();
+                BYTE res = netCommand(na, dt, NET_CMD_CNGETS, handle, 255, '\n', 0);
+                getsTime += Utils::getCurrentUs() - start;
+
+                if(res != E_NORMAL) {
+                    EXPECT_EQ((BYTE) E_NODATA, res);
+                    noData++;
+                    break;
+                }
+
+                sprintf(line, "line %05d of CNgets benchmark\r", linesRead);
+                if(strcmp((const char *) &dt.dataToSt[0], line) != 0) {
+                    badLines++;
+                }
+
+                consumed += strlen(line) + 1;
+                linesRead++;
+
+                if(linesRead == 1) {                                    // now the delimiter is known and there are more lines waiting
+                    EXPECT_EQ(1, netLinesAvailable(na, dt) & 1);
+                }
+            }
+        }
+
+        printf("netAdapter: read %d lines through CNgets in %d us (%d polls without complete line)\n", linesRead, (int) getsTime, noData);
+
+        EXPECT_EQ(lineCount, linesRead);
+        EXPECT_EQ(0, badLines);
+        EXPECT_EQ(0, netLinesAvailable(na, dt) & 1);
+
+        // slow link - 32 kB line arrives in 128 byte pieces, ST polls CNgets while waiting for the rest
+        std::string longLine(32 * 1024, 'x');
+        DWORD pollTime  = 0;
+        int   polls     = 0;
+
+        for(size_t pos=0; pos<longLine.size(); pos += 128) {
+            ASSERT_EQ(128, write(client, longLine.data() + pos, 128));
+
+            for(int loop=0; loop<200; loop++) {
+                DWORD start = Utils::getCurrentUs();
+                BYTE res = netCommand(na, dt, NET_CMD_CNGETS, handle, 0xffff, '\n', 0);
+                pollTime += Utils::getCurrentUs() - start;
+                polls++;
+                ASSERT_EQ((BYTE) E_NODATA, res);
+
+                netUpdateInfo(na, dt);
+                if(Utils::getDword(&dt.dataToSt[0]) == pos + 128) {         // this piece arrived? send next one
+                    break;
+                }
+                Utils::sleepMs(1);
+            }
+        }
+
+        ASSERT_EQ(1, write(client, "\n", 1));
+        ASSERT_TRUE(netWaitForBytes(na, dt, 1, longLine.size() + 1));
+        EXPECT_EQ(E_NORMAL, netCommand(na, dt, NET_CMD_CNGETS, handle, 0xffff, '\n', 0));
+        EXPECT_EQ(longLine.size(), strlen((const char *) &dt.dataToSt[0]));
+
+        printf("netAdapter: %d CNgets polls while 32 kB line was arriving took %d us\n", polls, (int) pollTime);
+
+        // partial line is not reported, until its delimiter arrives
+        ASSERT_EQ(7, write(client, "partial", 7));
+        ASSERT_TRUE(netWaitForBytes(na, dt, 1, 7));
+        EXPECT_EQ(0, netLinesAvailable(na, dt) & 1);
+        EXPECT_EQ((BYTE) E_NODATA, netCommand(na, dt, NET_CMD_CNGETS, handle, 255, '\n', 0));
+
+        ASSERT_EQ(1, write(client, "\n", 1));
+        ASSERT_TRUE(netWaitForBytes(na, dt, 1, 8));
+        EXPECT_EQ(1, netLinesAvailable(na, dt) & 1);
+        EXPECT_EQ((BYTE) E_BIGBUF, netCommand(na, dt, NET_CMD_CNGETS, handle, 5, '\n', 0));
+        EXPECT_EQ(E_NORMAL, netCommand(na, dt, NET_CMD_CNGETS, handle, 255, '\n', 0));
+        EXPECT_STREQ("partial", (const char *) &dt.dataToSt[0]);
+
+        close(client);
+        close(tcpServer);
+    }
+
+typedef struct {
+    int             fd;
+    WORD            port;
+    DWORD           delayMs;                                            // pretend slow upstream server
+    volatile bool   shouldStop;
+
+    pthread_mutex_t             mutex;
+    std::map<std::string, int>  queries;                                // how many times each name was asked
+} TStubDns;
+
+static int stubDnsAddRecord(BYTE *bfr, int pos, WORD namePtr, WORD type, DWORD ttl, const BYTE *rdata, WORD rdlen)
+    {
+        Utils::storeWord (bfr + pos,      0xc000 | namePtr);            // compressed name
+        Utils::storeWord (bfr + pos + 2,  type);
+        Utils::storeWord (bfr + pos + 4,  1);                           // class IN
+        Utils::storeDword(bfr + pos + 6,  ttl);
+        Utils::storeWord (bfr + pos + 10, rdlen);
+        memcpy(bfr + pos + 12, rdata, rdlen);
+        return pos + 12 + rdlen;
+    }
+
+static void *stubDnsThreadCode(void *ptr)
+    {
+        // answers: cached.test, dedup.test - A 10.1.2.3 (TTL 300), short.test - A (TTL 1),
+        // alias.test - CNAME real.test (TTL 300), A (TTL 120), everything else - NXDOMAIN with SOA minimum 60
+        TStubDns *dns = (TStubDns *) ptr;
+        BYTE q[512], r[512];
+
+        while(!dns->shouldStop) {
+            struct pollfd pfd;
+            pfd.fd      = dns->fd;
+            pfd.events  = POLLIN;
+            if(poll(&pfd, 1, 50) <= 0) {
+                continue;
+            }
+
+            struct sockaddr_in from;
+            socklen_t fromLen = sizeof(from);
+            int len = recvfrom(dns->fd, q, sizeof(q), 0, (struct sockaddr *) &from, &fromLen);
+            if(len < 17) {
+                continue;
+            }
+
+            std::string name;                                           // question name starts after 12 bytes of header
+            int pos = 12;
+            while(pos < len && q[pos] != 0) {
+                if(!name.empty()) {
+                    name += '.';
+                }
+                name.append((const char *) &q[pos + 1], q[pos]);
+                pos += q[pos] + 1;
+            }
+            int qEnd = pos + 5;                                         // zero, QTYPE, QCLASS
+
+            pthread_mutex_lock(&dns->mutex);
+            dns->queries[name]++;
+            pthread_mutex_unlock(&dns->mutex);
+
+            Utils::sleepMs(dns->delayMs);
+
+            memcpy(r, q, qEnd);
+            r[2] = 0x81;                                                // response, recursion desired
+            r[3] = 0x80;                                                // recursion available, NOERROR
+            memset(r + 6, 0, 6);                                        // no answers yet
+
+            BYTE ip[4] = { 10, 1, 2, 3 };
+            int rp = qEnd;
+
+            if(name == "cached.test" || name == "dedup.test" || name == "short.test") {
+                rp = stubDnsAddRecord(r, rp, 12, 1, (name == "short.test") ? 1 : 300, ip, 4);
+                Utils::storeWord(r + 6, 1);
+            } else if(name == "alias.test") {
+                BYTE cname[] = { 4, 'r', 'e', 'a', 'l', 4, 't', 'e', 's', 't', 0 };
+                rp = stubDnsAddRecord(r, rp, 12, 5, 300, cname, sizeof(cname));
+                rp = stubDnsAddRecord(r, rp, rp - sizeof(cname), 1, 120, ip, 4);
+                Utils::storeWord(r + 6, 2);
+            } else {
+                BYTE soa[22];
+                memset(soa, 0, sizeof(soa));                            // root MNAME and RNAME, serial, refresh, retry, expire
+                Utils::storeDword(soa + 18, 60);                        // minimum
+                rp = stubDnsAddRecord(r, rp, 12, 6, 600, soa, sizeof(soa));
+                Utils::storeWord(r + 8, 1);
+                r[3] |= 3;                                              // NXDOMAIN
+            }
+
+            sendto(dns->fd, r, rp, 0, (struct sockaddr *) &from, fromLen);
+        }
+
+        return NULL;
+    }
+
+static int stubDnsQueries(TStubDns &dns, const char *name)
+    {
+        pthread_mutex_lock(&dns.mutex);
+        int count = dns.queries[name];
+        pthread_mutex_unlock(&dns.mutex);
+        return count;
+    }
+
+static DWORD resolveAndWait(ResolverRequest &resolver, const char *name, Tresolv &result)
+    {
+        DWORD start = Utils::getCurrentUs();
+        int index   = resolver.addRequest(name);
+
+        for(int loop=0; loop<10000 && !resolver.checkAndhandleSlot(index); loop++) {
+            usleep(200);
+        }
+
+        DWORD duration = Utils::getCurrentUs() - start;
+        result = resolver.requests[index];
+        resolver.clearSlot(index);
+        return duration;
+    }
+
+TEST(resolverSlow, cachesAnswersAndSharesLookups)
+    {
+        TStubDns dns;
+        dns.fd          = netListenSocket(false, dns.port);
+        dns.delayMs     = 20;
+        dns.shouldStop  = false;
+        pthread_mutex_init(&dns.mutex, NULL);
+
+        pthread_t dnsThread;
+        pthread_create(&dnsThread, NULL, stubDnsThreadCode, &dns);
+
+        ResolverRequest *resolver = new ResolverRequest();
+        resolver->setNameServer(INADDR_LOOPBACK, dns.port);
+
+        Tresolv r;
+        BYTE ip[4] = { 10, 1, 2, 3 };
+
+        // first lookup goes to server, second (different case, trailing dot) comes from cache
+        DWORD uncached = resolveAndWait(*resolver, "cached.test", r);
+        EXPECT_EQ(1, r.count);
+        EXPECT_EQ(0, memcmp(r.data, ip, 4));
+        EXPECT_STREQ("cached.test", r.canonName);
+
+        DWORD cached = resolveAndWait(*resolver, "Cached.TEST.", r);
+        EXPECT_EQ(1, r.count);
+        EXPECT_EQ(0, memcmp(r.data, ip, 4));
+        EXPECT_EQ(1, stubDnsQueries(dns, "cached.test"));
+
+        printf("resolver: uncached name resolved in %d us, cached name in %d us\n", (int) uncached, (int) cached);
+        EXPECT_LE(20000, (int) uncached);
+        EXPECT_GT(uncached, cached);
+
+        // CNAME - canonical name is the owner of A record
+        resolveAndWait(*resolver, "alias.test", r);
+        EXPECT_EQ(1, r.count);
+        EXPECT_STREQ("real.test", r.canonName);
+
+        // requests for the same name while lookup is running share that lookup
+        int indexes[5];
+        for(int i=0; i<5; i++) {
+            indexes[i] = resolver->addRequest("dedup.test");
+        }
+
+        for(int i=0; i<5; i++) {
+            for(int loop=0; loop<10000 && !resolver->checkAndhandleSlot(indexes[i]); loop++) {
+                usleep(200);
+            }
+            EXPECT_EQ(1, resolver->requests[indexes[i]].count);
+            resolver->clearSlot(indexes[i]);
+        }
+        EXPECT_EQ(1, stubDnsQueries(dns, "dedup.test"));
+
+        // answer is used only for its TTL
+        resolveAndWait(*resolver, "short.test", r);
+        resolveAndWait(*resolver, "short.test", r);
+        EXPECT_EQ(1, stubDnsQueries(dns, "short.test"));
+
+        Utils::sleepMs(1100);
+        resolveAndWait(*resolver, "short.test", r);
+        EXPECT_EQ(1, r.count);
+        EXPECT_EQ(2, stubDnsQueries(dns, "short.test"));
+
+        // names from /etc/hosts don't go to DNS
+        resolveAndWait(*resolver, "localhost", r);
+        EXPECT_LE(1, r.count);
+        EXPECT_EQ(0, stubDnsQueries(dns, "localhost"));
+
+        // not existing name is cached too
+        resolveAndWait(*resolver, "missing.test", r);
+        EXPECT_EQ(0, r.count);
+        EXPECT_EQ(EAI_NONAME, r.error);
+
+        resolveAndWait(*resolver, "missing.test", r);
+        EXPECT_EQ(0, r.count);
+        EXPECT_EQ(1, stubDnsQueries(dns, "missing.test"));
+
+        delete resolver;
+
+        dns.shouldStop = true;
+        pthread_join(dnsThread, NULL);
+        pthread_mutex_destroy(&dns.mutex);
+        close(dns.fd);
+    }
+
+static size_t heapInUse(void)
+    {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+        return mallinfo2().uordblks;
+#else
+        return mallinfo().uordblks;
+#endif
+    }
+
+TEST(readWrapperSlow, smallDatagramFloodWithoutAllocations)
+    {
+        WORD port;
+        int rxFd = netListenSocket(false, port);
+        int txFd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family         = AF_INET;
+        addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        addr.sin_port           = htons(port);
+        ASSERT_EQ(0, connect(txFd, (struct sockaddr *) &addr, sizeof(addr)));
+
+        ReadWrapper *rw = new ReadWrapper();
+        rw->init(rxFd, UDP, 1500);
+        RecvBatch batch(READWRAPPER_MAX_DGRAM);
+
+        const int total = 50000;
+        const int burst = 100;                                          // small enough not to overflow socket receive buffer
+
+        BYTE dgram[64], ndb[1500];
+        memset(dgram, 0xaa, sizeof(dgram));
+
+        DWORD  rwTime       = 0;
+        size_t heapGrowth   = 0;
+        int    received     = 0;
+        int    badDgrams    = 0;
+
+        for(int sent=0; sent<total; sent += burst) {
+            for(int i=0; i<burst; i++) {
+                Utils::storeDword(dgram, sent + i);                     // sequence number
+                send(txFd, dgram, sizeof(dgram), 0);
+            }
+
+            size_t heapBefore = heapInUse();
+            DWORD start = Utils::getCurrentUs();
+            rw->receive(batch);
+            rwTime += Utils::getCurrentUs() - start;
+
+            size_t heapQueued = heapInUse();                            // heap used while the burst is queued
+            if(heapQueued > heapBefore) {
+                heapGrowth = std::max(heapGrowth, heapQueued - heapBefore);
+            }
+
+            start = Utils::getCurrentUs();
+            while(rw->getCount() > 0) {
+                int size = rw->getNdb(ndb);
+
+                if(size != sizeof(dgram) || Utils::getDword(ndb) != (DWORD) received || ndb[63] != 0xaa) {
+                    badDgrams++;
+                }
+                received++;
+            }
+            rwTime += Utils::getCurrentUs() - start;
+        }
+
+        DWORD pps = (DWORD) (((unsigned long long) received * 1000000) / std::max(rwTime, (DWORD) 1));
+        printf("readWrapper: %d x 64 byte datagrams in %d us, %d packets/s, heap grew by %d bytes per %d queued datagrams\n", received, (int) rwTime, (int) pps, (int) heapGrowth, burst);
+
+        EXPECT_EQ(total, received);
+        EXPECT_EQ(0, badDgrams);
+        EXPECT_EQ(0, rw->getCount());
+        EXPECT_GT((size_t) burst * 16, heapGrowth);                     // no heap object per datagram
+
+        delete rw;
+        close(txFd);
+        close(rxFd);
+    }
+
+static DWORD threadCpuUs(void)
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_THREAD, &usage);
+        return usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+    }
+
+TEST(readWrapperSlow, udpFloodIsReceivedInBatches)
+    {
+        WORD port;
+        int rxFd = netListenSocket(false, port);
+        int txFd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        int rcvBuf = 4 * 1024 * 1024;                                   // hold the whole burst in socket (capped by rmem_max)
+        setsockopt(rxFd, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(rcvBuf));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family         = AF_INET;
+        addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+        addr.sin_port           = htons(port);
+        ASSERT_EQ(0, connect(txFd, (struct sockaddr *) &addr, sizeof(addr)));
+
+        ReadWrapper *rw = new ReadWrapper();
+        rw->init(rxFd, UDP, 1500);
+        RecvBatch batch(READWRAPPER_MAX_DGRAM);
+
+        const int rounds = 300;
+        const int burst  = 200;                                         // NTP or game packets - small datagrams in bursts
+
+        BYTE dgram[48], ndb[1500];
+        memset(dgram, 0x5a, sizeof(dgram));
+
+        DWORD singleCpu = 0, batchCpu = 0, singleTime = 0, batchTime = 0;
+        int   singleCount = 0, batchCount = 0, badDgrams = 0;
+
+        for(int r=0; r<rounds; r++) {
+            bool batched = (r & 1) != 0;                                // alternate both ways, so both see the same conditions
+
+            for(int i=0; i<burst; i++) {
+                Utils::storeDword(dgram, i);
+                send(txFd, dgram, sizeof(dgram), 0);
+            }
+
+            DWORD cpu   = threadCpuUs();
+            DWORD start = Utils::getCurrentUs();
+            int   got   = 0;
+
+            if(batched) {                                               // current way - recvmmsg() into batch, then copy to ring
+                rw->receive(batch);
+            } else {                                                    // previous way - one recvmsg() per datagram
+                struct sockaddr_in from;
+                socklen_t fromLen = sizeof(from);
+
+                while(recvfrom(rxFd, ndb, sizeof(ndb), MSG_DONTWAIT, (struct sockaddr *) &from, &fromLen) > 0) {
+                    got++;
+                }
+            }
+
+            DWORD time = Utils::getCurrentUs() - start;
+            cpu = threadCpuUs() - cpu;
+
+            if(batched) {                                               // check what got into ring - not measured, same for both ways
+                while(rw->getCount() > 0) {
+                    int size = rw->getNdb(ndb);
+                    if(size != sizeof(dgram) || Utils::getDword(ndb) != (DWORD) got) {
+                        badDgrams++;
+                    }
+                    got++;
+                }
+
+                batchTime += time; batchCpu += cpu; batchCount += got;
+            } else {
+                singleTime += time; singleCpu += cpu; singleCount += got;
+            }
+        }
+
+        DWORD singlePps = (DWORD) (((unsigned long long) singleCount * 1000000) / std::max(singleTime, (DWORD) 1));
+        DWORD batchPps  = (DWORD) (((unsigned long long) batchCount  * 1000000) / std::max(batchTime,  (DWORD) 1));
+
+        printf("readWrapper: recvmsg() per datagram - %d datagrams/s, %d us CPU for %d datagrams\n", (int) singlePps, (int) singleCpu, singleCount);
+        printf("readWrapper: recvmmsg() batches     - %d datagrams/s, %d us CPU for %d datagrams, %d syscalls\n", (int) batchPps, (int) batchCpu, batchCount, (int) batch.getCallCount());
+
+        EXPECT_EQ(rounds * burst / 2, singleCount);
+        EXPECT_EQ(rounds * burst / 2, batchCount);
+        EXPECT_EQ(0, badDgrams);
+        EXPECT_GE((DWORD) (batchCount / 16), batch.getCallCount());     // many datagrams per syscall
+
+        delete rw;
+        close(txFd);
+        close(rxFd);
+    }
+
+TEST(icmpWrapperSlow, keepsNewestDgramsInArrivalOrder)
+    {
+        IcmpWrapper icmp;
+        BYTE ping[16];
+        memset(ping, 0, sizeof(ping));
+
+        const int count = MAX_STING_DGRAMS + 8;                         // more than fits, oldest have to go
+        for(int i=0; i<count; i++) {
+            Utils::storeWord(ping,     0x1234);                         // id
+            Utils::storeWord(ping + 2, i);                              // sequence
+
+            if(icmp.send(INADDR_LOOPBACK, ICMP_ECHO, 0, sizeof(ping), ping) != E_NORMAL) {
+                printf("icmpWrapper: can't send ping, ICMP sockets not allowed here\n");
+                return;
+            }
+        }
+
+        struct pollfd pfd;
+        pfd.fd      = icmp.getFd();
+        pfd.events  = POLLIN;
+
+        DWORD start = Utils::getCurrentMs();
+        while(Utils::getCurrentMs() - start < 500) {                    // wait for the replies to arrive
+            poll(&pfd, 1, 50);
+            icmp.receiveAll();
+
+            if(icmp.calcHowManyDatagramsFitIntoBuffer(64 * 1024) == MAX_STING_DGRAMS) {
+                Utils::sleepMs(50);                                     // give the rest time to arrive and push out the oldest
+                icmp.receiveAll();
+                break;
+            }
+        }
+
+        ASSERT_EQ(MAX_STING_DGRAMS, icmp.calcHowManyDatagramsFitIntoBuffer(64 * 1024));
+
+        DWORD bytes = 0;
+        int   seq   = count - MAX_STING_DGRAMS;                         // the oldest replies were thrown away
+
+        TStingDgram *d;
+        while((d = icmp.getOldest()) != NULL) {
+            EXPECT_EQ(ICMP_ECHOREPLY, d->data[48]);
+            EXPECT_EQ(seq, Utils::getWord(d->data + 54));
+            bytes += d->count;
+            seq++;
+
+            icmp.removeOldest();
+            EXPECT_EQ(bytes + icmp.calcDataByteCountTotal(), (DWORD) (MAX_STING_DGRAMS * (48 + 8 + 12)));
+        }
+
+        EXPECT_EQ(count, seq);
+        EXPECT_EQ(0, (int) icmp.calcDataByteCountTotal());
+        icmp.closeAndClean();
+    }
+
+#define LOGTEST_THREADS     4
+#define LOGTEST_LINES       50000
+
+static volatile DWORD logTestCpuUs[LOGTEST_THREADS];
+
+static void *logFloodThreadCode(void *ptr)
+    {
+        int thread = (int) (long) ptr;
+
+        DWORD start = threadCpuUs();
+        for(int i=0; i<LOGTEST_LINES; i++) {
+            Debug::out(LOG_DEBUG, "logTest thread %d line %d - typical debug line, with some %s and a number %d END", thread, i, "text", i * 3);
+        }
+        logTestCpuUs[thread] = threadCpuUs() - start;
+
+        return 0;
+    }
+
+TEST(debugSlow, asyncLoggerKeepsAllLinesWhole)
+    {
+        const char *path    = "/tmp/ce_logtest.log";
+        std::string oldPath = Debug::getLogFile();
+        int oldLevel        = flags.logLevel;
+
+        unlink(path);
+        Debug::flush();
+        Debug::setLogFile(path);
+        Debug::setMaxLogSize(256 * 1024 * 1024);                        // no rotation here
+        flags.logLevel = LOG_DEBUG;
+
+        // several threads log at once
+        DWORD start = Utils::getCurrentUs();
+
+        pthread_t threads[LOGTEST_THREADS];
+        for(long i=0; i<LOGTEST_THREADS; i++) {
+            pthread_create(&threads[i], NULL, logFloodThreadCode, (void *) i);
+        }
+        for(int i=0; i<LOGTEST_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        DWORD loggedUs = Utils::getCurrentUs() - start;
+        Debug::flush();
+        DWORD writtenUs = Utils::getCurrentUs() - start;
+
+        DWORD cpuUs = 0;
+        for(int i=0; i<LOGTEST_THREADS; i++) {
+            cpuUs += logTestCpuUs[i];
+        }
+
+        const int total = LOGTEST_THREADS * LOGTEST_LINES;
+        printf("debug: %d threads logged %d lines - %d ns CPU per Debug::out() call, %d lines/s, all written in %d ms\n", LOGTEST_THREADS, total,
+               (int) ((cpuUs * 1000ULL) / total), (int) ((total * 1000000ULL) / loggedUs), (int) (writtenUs / 1000));
+
+        // every line is there once, and whole
+        std::vector<BYTE> seen(total, 0);
+        int bad = 0, lines = 0;
+
+        FILE *f = fopen(path, "rt");
+        ASSERT_TRUE(f != NULL);
+
+        char line[1024];
+        while(fgets(line, sizeof(line), f)) {
+            int thread, no, ms, diff;
+            const char *msg = strchr(line, '\t');
+
+            if(sscanf(line, "%d %d (", &ms, &diff) != 2 || msg == NULL || sscanf(msg + 1, "logTest thread %d line %d", &thread, &no) != 2 ||
+               thread < 0 || thread >= LOGTEST_THREADS || no < 0 || no >= LOGTEST_LINES || strstr(line, " END\n") == NULL) {
+                bad++;
+                continue;
+            }
+
+            seen[thread * LOGTEST_LINES + no]++;
+            lines++;
+        }
+        fclose(f);
+
+        EXPECT_EQ(0, bad);
+        EXPECT_EQ(total, lines);
+        EXPECT_EQ(total, (int) std::count(seen.begin(), seen.end(), 1));
+
+        // log file is rotated when it gets too big
+        Debug::setMaxLogSize(64 * 1024);
+        for(int i=0; i<5000; i++) {
+            Debug::out(LOG_DEBUG, "logTest rotation line %d END", i);
+        }
+        Debug::flush();
+
+        struct stat st, stOld;
+        std::string oldLog = std::string(path) + ".1";
+        ASSERT_EQ(0, stat(path, &st));
+        ASSERT_EQ(0, stat(oldLog.c_str(), &stOld));
+        EXPECT_GE(128 * 1024, (int) st.st_size);                        // max size + one batch of lines
+        EXPECT_GE(128 * 1024, (int) stOld.st_size);
+
+        flags.logLevel = oldLevel;
+        Debug::setMaxLogSize(DEBUG_MAX_LOG_SIZE);
+        Debug::setLogFile(oldPath.c_str());
+
+        unlink(path);
+        unlink(oldLog.c_str());
+    }
+
+static void *fifoDrainThreadCode(void *ptr)
+    {
+        int fd = open((const char *) ptr, O_RDONLY);                   // lets the log writer thread open the fifo too
+        if(fd != -1) {
+            char bfr[4096];
+            while(read(fd, bfr, sizeof(bfr)) > 0) {                     // till writer thread closes it
+            }
+            close(fd);
+        }
+        return NULL;
+    }
+
+TEST(debugSlow, fullRingDropsLinesAndSignalLogsDirectly)
+    {
+        const char *fifoPath = "/tmp/ce_logtest.fifo";
+        const char *path     = "/tmp/ce_logtest_signal.log";
+        std::string oldPath  = Debug::getLogFile();
+        int oldLevel         = flags.logLevel;
+
+        unlink(fifoPath);
+        unlink(path);
+        ASSERT_EQ(0, mkfifo(fifoPath, 0644));
+
+        Debug::flush();
+        flags.logLevel = LOG_DEBUG;
+
+        // writer thread hangs in open() of the fifo till somebody reads it - logging must not hang with it
+        Debug::setLogFile(fifoPath);
+        DWORD droppedBefore = Debug::getDroppedLines();
+        DWORD start         = Utils::getCurrentMs();
+
+        for(int i=0; i<3000; i++) {
+            Debug::out(LOG_DEBUG, "logTest stuck writer line %d", i);
+        }
+
+        DWORD took = Utils::getCurrentMs() - start;
+        EXPECT_GT(1000, (int) took);                                    // waited once for the writer, then just dropped
+        EXPECT_LE((DWORD) 3000 - 1024, Debug::getDroppedLines() - droppedBefore);
+
+        // what signal handler logs goes to the file right away
+        Debug::setLogFile(path);
+        Debug::outSignal(LOG_DEBUG, "logTest from signal");
+
+        FILE *f = fopen(path, "rt");
+        ASSERT_TRUE(f != NULL);
+        char line[1024];
+        ASSERT_TRUE(fgets(line, sizeof(line), f) != NULL);
+        fclose(f);
+        EXPECT_TRUE(strstr(line, "logTest from signal\n") != NULL);
+
+        // let the writer thread go on, it will move to the new file then
+        pthread_t drain;
+        pthread_create(&drain, NULL, fifoDrainThreadCode, (void *) fifoPath);
+        Debug::flush();
+        pthread_join(drain, NULL);
+
+        flags.logLevel = oldLevel;
+        Debug::setLogFile(oldPath.c_str());
+
+        unlink(fifoPath);
+        unlink(path);
+    }
+
+#define TRACETEST_EVENTS    100000
+
+TEST(traceSlow, ringIsDumpedAndCheaperThanDebugOut)
+    {
+        const char *dumpPath = "/tmp/ce_tracetest.bin";
+        const char *logPath  = "/tmp/ce_tracetest.log";
+        std::string oldPath  = Debug::getLogFile();
+        int oldLevel         = flags.logLevel;
+
+        // levels above TRACE_LEVEL are not even compiled in
+        Trace::clear();
+        TRACE(TRACE_LEVEL + 1, "traceTest this is never stored %d", 1);
+        ASSERT_TRUE(Trace::dump(dumpPath));
+
+        TTraceDumpHeader hdr;
+        FILE *f = fopen(dumpPath, "rb");
+        ASSERT_TRUE(f != NULL);
+        ASSERT_EQ(1, (int) fread(&hdr, sizeof(hdr), 1, f));
+        fclose(f);
+        EXPECT_EQ(0, memcmp(hdr.magic, TRACE_MAGIC, 8));
+        EXPECT_EQ(0, (int) hdr.eventCount);
+
+        // per-event cost - the same line through Debug::out() and through TRACE()
+        unlink(logPath);
+        Debug::flush();
+        Debug::setLogFile(logPath);
+        flags.logLevel = LOG_DEBUG;
+
+        DWORD start = threadCpuUs();
+        for(int i=0; i<TRACETEST_EVENTS; i++) {
+            Debug::out(LOG_DEBUG, "traceTest event %d of %s, value %08x", i, "loop", i * 7);
+        }
+        DWORD debugUs = threadCpuUs() - start;
+        Debug::flush();
+
+        start = threadCpuUs();
+        for(int i=0; i<TRACETEST_EVENTS; i++) {
+            TRACE(LOG_DEBUG, "traceTest event %d of %s, value %08x", i, TRACE_STR("loop"), i * 7);
+        }
+        DWORD traceUs = threadCpuUs() - start;
+
+        BYTE bfr[40];
+        for(int i=0; i<40; i++) {
+            bfr[i] = 'A' + i;
+        }
+        TRACE_BFR(LOG_DEBUG, bfr, 40);
+
+        int debugNs = (int) ((debugUs * 1000ULL) / TRACETEST_EVENTS);
+        int traceNs = (int) ((traceUs * 1000ULL) / TRACETEST_EVENTS);
+        printf("trace: %d ns CPU per Debug::out() call, %d ns CPU per TRACE() event\n", debugNs, traceNs);
+        EXPECT_LT(traceNs, debugNs);
+
+        // dump has the format table and the newest TRACE_RING_EVENTS events, oldest first
+        ASSERT_TRUE(Trace::dump(dumpPath));
+
+        f = fopen(dumpPath, "rb");
+        ASSERT_TRUE(f != NULL);
+        ASSERT_EQ(1, (int) fread(&hdr, sizeof(hdr), 1, f));
+        EXPECT_EQ(TRACE_RING_EVENTS, (int) hdr.eventCount);
+
+        std::vector<std::string> formats(hdr.formatCount);
+        for(DWORD i=0; i<hdr.formatCount; i++) {
+            WORD id, len;
+            BYTE entry[6];
+            ASSERT_EQ(1, (int) fread(entry, 6, 1, f));
+            memcpy(&id,  &entry[0], 2);
+            memcpy(&len, &entry[4], 2);
+            ASSERT_LT(id, hdr.formatCount);
+
+            formats[id].resize(len);
+            if(len > 0) {
+                ASSERT_EQ(1, (int) fread(&formats[id][0], len, 1, f));
+            }
+        }
+
+        std::vector<TTraceEvent> events(hdr.eventCount);
+        ASSERT_EQ(hdr.eventCount, fread(&events[0], sizeof(TTraceEvent), hdr.eventCount, f));
+        fclose(f);
+
+        int loopEvents = TRACE_RING_EVENTS - 4;                         // the last 4 are the TRACE_BFR() header and 3 rows
+        int bad = 0;
+        for(int i=0; i<loopEvents; i++) {
+            TTraceEvent &ev = events[i];
+            DWORD no = TRACETEST_EVENTS - loopEvents + i;
+
+            if(formats[ev.formatId] != "traceTest event %d of %s, value %08x" || ev.argCount != 3 ||
+               ev.args[0] != no || formats[ev.args[1]] != "loop" || ev.args[2] != no * 7) {
+                bad++;
+            }
+        }
+        EXPECT_EQ(0, bad);
+
+        EXPECT_EQ("outBfr - %d bytes", formats[events[loopEvents].formatId]);
+        EXPECT_EQ(40, (int) events[loopEvents].args[0]);
+        EXPECT_EQ(TRACE_FMT_BFR_ROW, (int) events[loopEvents + 3].formatId);
+        EXPECT_EQ(8, (int) events[loopEvents + 3].argCount);
+        EXPECT_EQ(0, memcmp(events[loopEvents + 3].args, bfr + 32, 8));
+
+        flags.logLevel = oldLevel;
+        Debug::setLogFile(oldPath.c_str());
+        unlink(logPath);
+        unlink(dumpPath);
+    }
+
+#define SETTINGSTEST_DIR    "/tmp/ce_settingstest"
+#define SETTINGSTEST_GETS   100000
+
+class SettingsTestUser: public ISettingsUser
+{
+public:
+    SettingsTestUser() { reloads = 0; lastType = 0; removeItself = false; }
+
+    void reloadSettings(int type) {
+        reloads++;
+        lastType = type;
+
+        if(removeItself) {
+            Settings::removeChangeListener(this);
+        }
+    }
+
+    int  reloads;
+    int  lastType;
+    bool removeItself;
+};
+
+static void settingsTestWriteFile(const char *key, const char *content)
+    {
+        std::string path = std::string(SETTINGSTEST_DIR) + "/" + key;
+        FILE *f = fopen(path.c_str(), "w");
+        fputs(content, f);
+        fclose(f);
+    }
+
+static std::string settingsTestReadFile(const char *name)
+    {
+        std::string path = std::string(SETTINGSTEST_DIR) + "/" + name;
+        std::string content;
+        FILE *f = fopen(path.c_str(), "r");
+
+        if(f) {
+            char bfr[4096];
+            size_t len = fread(bfr, 1, sizeof(bfr), f);
+            content.assign(bfr, len);
+            fclose(f);
+        }
+
+        return content;
+    }
+
+static int settingsTestOldGetInt(const char *key, int defValue)       // what Settings::getInt() did before the store
+    {
+        std::string path = std::string(SETTINGSTEST_DIR) + "/" + key;
+        FILE *f = fopen(path.c_str(), "r");
+        if(!f) {
+            return defValue;
+        }
+
+        int val;
+        int res = fscanf(f, "%d", &val);
+        fclose(f);
+
+        return (res == 1) ? val : defValue;
+    }
+
+TEST(settingsSlow, storeIsMigratedAndWrittenInBatches)
+    {
+        system("rm -rf " SETTINGSTEST_DIR);
+        mkdir(SETTINGSTEST_DIR, 0775);
+
+        // per-key files of the older versions
+        settingsTestWriteFile("ACSI_DEVTYPE_0",       "2\n");
+        settingsTestWriteFile("SHARED_ADDRESS",       "192.168.1.10");
+        settingsTestWriteFile("DRIVELETTER_FIRST",    "D");
+        settingsTestWriteFile("HW_VERSION",           "3\n");
+
+        Settings::setDirectory(SETTINGSTEST_DIR);
+        Settings s;
+
+        EXPECT_EQ(2, s.getInt("ACSI_DEVTYPE_0", 0));
+        EXPECT_STREQ("192.168.1.10", s.getString("SHARED_ADDRESS", ""));
+        EXPECT_EQ('D', s.getChar("DRIVELETTER_FIRST", 'C'));
+        EXPECT_EQ(3, s.getInt("HW_VERSION", 1));
+        EXPECT_EQ(7, s.getInt("NO_SUCH_KEY", 7));
+
+        Settings::flush();
+        // ce_preinit parses the store on its own (ce_preinit/settings.cpp) - this format has to stay the same
+        EXPECT_NE(std::string::npos, settingsTestReadFile("settings.store").find("ACSI_DEVTYPE_0=2\\n\n"));
+
+        // migrated per-key files are gone once the store is written, so they can't come back - exported ones stay
+        EXPECT_EQ("", settingsTestReadFile("ACSI_DEVTYPE_0"));
+        EXPECT_EQ("", settingsTestReadFile("SHARED_ADDRESS"));
+        EXPECT_EQ("3\n", settingsTestReadFile("HW_VERSION"));
+
+        // getInt() latency - per-key file vs memory
+        settingsTestWriteFile("ACSI_DEVTYPE_0", "2\n");                // how the older versions read it
+        int sum = 0;
+        DWORD start = Utils::getCurrentUs();
+        for(int i=0; i<SETTINGSTEST_GETS; i++) {
+            sum += settingsTestOldGetInt("ACSI_DEVTYPE_0", 0);
+        }
+        DWORD fileUs = Utils::getCurrentUs() - start;
+
+        start = Utils::getCurrentUs();
+        for(int i=0; i<SETTINGSTEST_GETS; i++) {
+            sum += s.getInt("ACSI_DEVTYPE_0", 0);
+        }
+        DWORD storeUs = Utils::getCurrentUs() - start;
+
+        EXPECT_EQ(2 * 2 * SETTINGSTEST_GETS, sum);
+        printf("settings: getInt() from per-key file %d ns, from store %d ns\n",
+               (int) ((fileUs * 1000ULL) / SETTINGSTEST_GETS), (int) ((storeUs * 1000ULL) / SETTINGSTEST_GETS));
+        EXPECT_LT(storeUs * 5, fileUs);
+
+        // changes are written later by writer thread, all at once
+        SettingsTestUser user;
+        Settings::addChangeListener("NET_", &user, SETTINGSUSER_SHARED);
+
+        s.setInt("NET_MAX_CONNECTIONS",   10);
+        s.setInt("NET_SEND_COALESCE_MS",  3);
+        s.setInt("OTHER_KEY",             1);
+        EXPECT_EQ(10, s.getInt("NET_MAX_CONNECTIONS", 0));
+        EXPECT_EQ(std::string::npos, settingsTestReadFile("settings.store").find("NET_MAX_CONNECTIONS"));
+
+        for(int i=0; i<50 && user.reloads == 0; i++) {
+            Utils::sleepMs(SETTINGS_FLUSH_DELAY_MS / 10);
+        }
+        Utils::sleepMs(SETTINGS_FLUSH_DELAY_MS / 10);
+
+        std::string store = settingsTestReadFile("settings.store");
+        EXPECT_NE(std::string::npos, store.find("NET_MAX_CONNECTIONS=10\\n\n"));
+        EXPECT_NE(std::string::npos, store.find("OTHER_KEY=1\\n\n"));
+        EXPECT_EQ(1, user.reloads);                                     // once for the batch
+        EXPECT_EQ(SETTINGSUSER_SHARED, user.lastType);
+
+        s.setInt("NET_MAX_CONNECTIONS",   10);                          // no change
+        s.setInt("OTHER_KEY",             2);                           // not its key
+        Settings::flush();
+        EXPECT_EQ(1, user.reloads);
+
+        Settings::removeChangeListener(&user);
+
+        // listeners are called without the listener lock - one can even remove itself
+        SettingsTestUser selfRemoving;
+        selfRemoving.removeItself = true;
+        Settings::addChangeListener("NET_", &selfRemoving, SETTINGSUSER_NONE);
+
+        s.setInt("NET_MAX_CONNECTIONS", 11);
+        Settings::flush();
+        s.setInt("NET_MAX_CONNECTIONS", 12);
+        Settings::flush();
+        EXPECT_EQ(1, selfRemoving.reloads);
+
+        // exported keys are also in per-key files
+        s.setInt("HW_VERSION", 4);
+        Settings::flush();
+        EXPECT_EQ("4\n", settingsTestReadFile("HW_VERSION"));
+
+        // after restart the values come from the store, not from the old per-key files
+        unlink(SETTINGSTEST_DIR "/ACSI_DEVTYPE_0");
+        Settings::setDirectory(SETTINGSTEST_DIR);
+        EXPECT_EQ(2, s.getInt("ACSI_DEVTYPE_0", 0));
+        EXPECT_EQ(2, s.getInt("OTHER_KEY", 0));
+
+        // reset deletes everything
+        Settings::resetAll();
+        EXPECT_EQ(0, s.getInt("OTHER_KEY", 0));
+        EXPECT_EQ("", settingsTestReadFile("settings.store"));
+
+        Settings::setDirectory("/ce/settings");
+        system("rm -rf " SETTINGSTEST_DIR);
+    }
+
+TEST(settingsSlow, storeSurvivesCrashWhileWriting)
+    {
+        system("rm -rf " SETTINGSTEST_DIR);
+        mkdir(SETTINGSTEST_DIR, 0775);
+        Settings::setDirectory(SETTINGSTEST_DIR);
+
+        Settings s;
+        char key[32];
+        int prevGen = 0, tmpLeft = 0;
+
+        for(int round=0; round<20; round++) {
+            Settings::flush();
+
+            pid_t child = fork();
+
+            if(child == 0) {                                            // child: write new generation of all the keys, again and again
+                int gen = s.getInt("CRASH_GEN", 0);
+
+                while(true) {
+                    gen++;
+                    for(int k=0; k<50; k++) {
+                        sprintf(key, "CRASH_KEY_%d", k);
+                        s.setInt(key, gen);
+                    }
+                    s.setInt("CRASH_GEN", gen);
+                    Settings::flush();
+                }
+            }
+
+            Utils::sleepMs(5 + (round * 7) % 40);                       // kill it at some random point of writing
+            kill(child, SIGKILL);
+            waitpid(child, NULL, 0);
+
+            struct stat st;
+            if(stat(SETTINGSTEST_DIR "/settings.store.tmp", &st) == 0) {
+                tmpLeft++;
+            }
+
+            Settings::setDirectory(SETTINGSTEST_DIR);                   // like restart after the crash
+            int gen = s.getInt("CRASH_GEN", 0);                         // killed before the first flush? then generation 0
+
+            int bad = 0;
+            for(int k=0; k<50; k++) {
+                sprintf(key, "CRASH_KEY_%d", k);
+                bad += (s.getInt(key, 0) != gen);
+            }
+
+            EXPECT_EQ(0, bad);                                          // the whole generation, never a mix
+            EXPECT_LE(prevGen, gen);
+            prevGen = gen;
+        }
+
+        printf("settings: 20 crashes while writing, %d left temp file, last generation %d\n", tmpLeft, prevGen);
+        EXPECT_LT(0, prevGen);
+
+        // cut store (e.g. broken card) is not loaded half
+        std::string store = settingsTestReadFile("settings.store");
+        settingsTestWriteFile("settings.store", store.substr(0, store.size() / 2).c_str());
+        Settings::setDirectory(SETTINGSTEST_DIR);
+        EXPECT_EQ(-1, s.getInt("CRASH_GEN", -1));
+
+        Settings::setDirectory("/ce/settings");
+        system("rm -rf " SETTINGSTEST_DIR);
+    }
+
+//--------------------------------------------------------
+// loopback STiNG harness - NET_CMD_* sequences like the ST driver issues them, against local servers
+
+#define LOOP_ECHO       1                                               // loop server sends back what it got
+#define LOOP_SINK       2                                               // loop server just counts what it got
+#define LOOP_SOURCE     3                                               // loop server sends sourceBytes to each client, then closes it
+
+typedef struct {
+    bool            tcpNotUdp;
+    int             mode;
+    DWORD           sourceBytes;
+    int             fd;                                                 // listening TCP socket or UDP socket
+    WORD            port;
+    volatile bool   shouldStop;
+    volatile DWORD  bytesIn;
+    pthread_t       thread;
+} TLoopServer;
+
+static void *loopServerThreadCode(void *ptr)
+    {
+        TLoopServer *srv = (TLoopServer *) ptr;
+
+        std::vector<int>    clients;
+        std::vector<DWORD>  sent;
+        BYTE bfr[64 * 1024];
+
+        while(!srv->shouldStop) {
+            std::vector<struct pollfd> pfds(1 + clients.size());
+            pfds[0].fd      = srv->fd;
+            pfds[0].events  = POLLIN;
+
+            for(size_t i=0; i<clients.size(); i++) {
+                pfds[1 + i].fd      = clients[i];
+                pfds[1 + i].events  = POLLIN | ((srv->mode == LOOP_SOURCE && sent[i] < srv->sourceBytes) ? POLLOUT : 0);
+            }
+
+            if(poll(&pfds[0], pfds.size(), 10) <= 0) {
+                continue;
+            }
+
+            for(size_t i=0; i<clients.size(); i++) {
+                short ev = pfds[1 + i].revents;
+
+                if((ev & POLLOUT) != 0) {                               // source - send more of the pattern
+                    int len = MIN(sizeof(bfr), srv->sourceBytes - sent[i]);
+                    for(int j=0; j<len; j++) {
+                        bfr[j] = (BYTE) ((sent[i] + j) % 251);
+                    }
+
+                    int res = send(clients[i], bfr, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+                    if(res > 0) {
+                        sent[i] += res;
+                    }
+
+                    if(sent[i] == srv->sourceBytes) {                   // all sent? close it, ST should still get all the data
+                        close(clients[i]);
+                        clients[i] = -1;
+                        continue;
+                    }
+                }
+
+                if((ev & (POLLIN | POLLHUP | POLLERR)) != 0) {
+                    int res = read(clients[i], bfr, sizeof(bfr));
+
+                    if(res <= 0) {                                      // closed by ST
+                        close(clients[i]);
+                        clients[i] = -1;
+                        continue;
+                    }
+
+                    srv->bytesIn += res;
+
+                    if(srv->mode == LOOP_ECHO && write(clients[i], bfr, res) != res) {
+                        printf("loopServer: echo failed\n");
+                    }
+                }
+            }
+
+            for(int i=clients.size() - 1; i>=0; i--) {                 // forget closed clients
+                if(clients[i] == -1) {
+                    clients.erase(clients.begin() + i);
+                    sent.erase(sent.begin() + i);
+                }
+            }
+
+            if((pfds[0].revents & POLLIN) == 0) {
+                continue;
+            }
+
+            if(srv->tcpNotUdp) {                                        // TCP - new client
+                int fd = accept(srv->fd, NULL, NULL);
+                if(fd != -1) {
+                    clients.push_back(fd);
+                    sent.push_back(0);
+                }
+                continue;
+            }
+
+            struct sockaddr_in from;                                    // UDP - datagram
+            socklen_t fromLen = sizeof(from);
+            int res = recvfrom(srv->fd, bfr, sizeof(bfr), 0, (struct sockaddr *) &from, &fromLen);
+
+            if(res > 0) {
+                srv->bytesIn += res;
+
+                if(srv->mode == LOOP_ECHO) {
+                    sendto(srv->fd, bfr, res, 0, (struct sockaddr *) &from, fromLen);
+                }
+            }
+        }
+
+        for(size_t i=0; i<clients.size(); i++) {
+            close(clients[i]);
+        }
+        return 0;
+    }
+
+static void loopServerStart(TLoopServer &srv, bool tcpNotUdp, int mode, DWORD sourceBytes=0)
+    {
+        srv.tcpNotUdp   = tcpNotUdp;
+        srv.mode        = mode;
+        srv.sourceBytes = sourceBytes;
+        srv.fd          = netListenSocket(tcpNotUdp, srv.port);
+        srv.shouldStop  = false;
+        srv.bytesIn     = 0;
+        pthread_create(&srv.thread, NULL, loopServerThreadCode, &srv);
+    }
+
+static void loopServerStop(TLoopServer &srv)
+    {
+        srv.shouldStop = true;
+        pthread_join(srv.thread, NULL);
+        close(srv.fd);
+    }
+
+static void printLatency(const char *what, std::vector<DWORD> &times)
+    {
+        std::sort(times.begin(), times.end());
+        printf("stingHarness: %s - median %d us, 99th percentile %d us, max %d us\n", what,
+               (int) times[times.size() / 2], (int) times[(times.size() * 99) / 100], (int) times.back());
+    }
+
+class FakeStingDriver                                                   // does what cosmosex_fakesting does for STiNG applications
+{
+public:
+    NetAdapter      na;
+    FakeDataTrans   dt;
+    DWORD           icmpBytes;
+
+    FakeStingDriver(void) {
+        na.setAcsiDataTrans(&dt);
+        memset(conInfo, 0, sizeof(conInfo));
+        generation  = 0;
+        icmpBytes   = 0;
+
+        netCommand(na, dt, NET_CMD_IDENTIFY, NET_MAX_HANDLES);         // driver starts with identify, telling how many handles it knows
+    }
+
+    BYTE open(bool tcpNotUdp, WORD port) {                              // TCP_open() / UDP_open() to local server
+        return netOpen(na, dt, tcpNotUdp, INADDR_LOOPBACK, port);
+    }
+
+    BYTE close(BYTE handle) {
+        return netClose(na, dt, handle);
+    }
+
+    BYTE send(BYTE handle, bool tcpNotUdp, const BYTE *data, WORD length) {
+        dt.dataFromSt.assign(data, data + length);
+        return netCommand(na, dt, tcpNotUdp ? NET_CMD_TCP_SEND : NET_CMD_UDP_SEND, handle, length);
+    }
+
+    void update(void) {                                                 // CNbyte_count() - get connection info changes
+        do {
+            netDeltaUpdate(na, dt, generation, conInfo);
+            icmpBytes = Utils::getDword(&dt.dataToSt[8]);
+        } while(dt.dataToSt[6]);                                        // more changes than fit in one sector?
+    }
+
+    DWORD bytesToRead(BYTE handle) {
+        return conInfo[network_handleToSlot(handle)].bytes;
+    }
+
+    bool waitForBytes(BYTE handle, DWORD bytes, int timeoutMs) {        // application polling CNbyte_count()
+        DWORD start = Utils::getCurrentMs();
+
+        while(true) {
+            update();
+            if(bytesToRead(handle) >= bytes) {
+                return true;
+            }
+
+            if((int) (Utils::getCurrentMs() - start) > timeoutMs) {
+                return false;
+            }
+            sched_yield();
+        }
+    }
+
+    BYTE getBlock(BYTE handle, BYTE *data, WORD length) {               // CNget_block()
+        BYTE res = netCommand(na, dt, NET_CMD_CNGET_BLOCK, handle, length);
+        if(res == E_NORMAL) {
+            memcpy(data, &dt.dataToSt[0], length);
+        }
+        return res;
+    }
+
+    int getNdb(BYTE handle, BYTE *data) {                               // CNget_NDB() - size first, then the data
+        netCommand(na, dt, NET_CMD_CNGET_NDB, handle, 0x0000);
+        int size = Utils::getDword(&dt.dataToSt[0]);
+
+        if(size > 0) {
+            netCommand(na, dt, NET_CMD_CNGET_NDB, handle, 0x0100);
+            memcpy(data, &dt.dataToSt[0], size);
+        }
+        return size;
+    }
+
+    bool resolve(const char *name, DWORD &ip, int timeoutMs) {          // resolve() - start, then poll for result
+        dt.dataFromSt.assign(512, 0);
+        strcpy((char *) &dt.dataFromSt[0], name);
+        BYTE index = netCommand(na, dt, NET_CMD_RESOLVE);
+
+        DWORD start = Utils::getCurrentMs();
+        while(netCommand(na, dt, NET_CMD_RESOLVE_GET_RESPONSE, index) == RES_DIDNT_FINISH_YET) {
+            if((int) (Utils::getCurrentMs() - start) > timeoutMs) {
+                return false;
+            }
+            Utils::sleepMs(1);
+        }
+
+        if(dt.statusToSt != E_NORMAL || dt.dataToSt[256] == 0) {      // failed or no address?
+            return false;
+        }
+
+        ip = Utils::getDword(&dt.dataToSt[258]);
+        return true;
+    }
+
+    BYTE ping(DWORD ip, WORD id, WORD sequence) {                       // ICMP_send() of echo request
+        BYTE cmd[ACSI_CMD_SIZE];
+        memset(cmd, 0, ACSI_CMD_SIZE);
+        cmd[1] = 'C';
+        cmd[2] = 'E';
+        cmd[3] = HOSTMOD_NETWORK_ADAPTER;
+        cmd[4] = NET_CMD_ICMP_SEND_EVEN;
+        Utils::storeDword(cmd + 5, ip);
+        cmd[9] = ICMP_ECHO << 3;
+        Utils::storeWord(cmd + 10, 16);
+
+        dt.dataFromSt.assign(16, 0);
+        Utils::storeWord(&dt.dataFromSt[0], id);
+        Utils::storeWord(&dt.dataFromSt[2], sequence);
+
+        na.processCommand(cmd);
+        return dt.statusToSt;
+    }
+
+    int getPingReplies(std::vector<WORD> &sequences) {                  // ICMP datagrams for handler, returns their count
+        if(netCommand(na, dt, NET_CMD_ICMP_GET_DGRAMS, 8) != E_NORMAL) {
+            return 0;
+        }
+
+        int count = 0;
+        int pos   = 0;
+        while(true) {
+            WORD size = Utils::getWord(&dt.dataToSt[pos]);
+            if(size == 0) {
+                break;
+            }
+
+            BYTE *d = &dt.dataToSt[pos + 2];
+            if(d[48] == ICMP_ECHOREPLY) {
+                sequences.push_back(Utils::getWord(d + 54));
+            }
+
+            pos += 2 + size;
+            count++;
+        }
+        return count;
+    }
+
+private:
+    TStConInfo  conInfo[NET_MAX_HANDLES];
+    DWORD       generation;
+};
+
+TEST(stingHarnessSlow, bulkTcpThroughput)
+    {
+        FakeStingDriver st;
+        const DWORD total       = 32 * 1024 * 1024;
+        const WORD  blockSize   = 16 * 1024;
+
+        std::vector<BYTE> block(blockSize);
+
+        // upload - TCP_send() of 16 kB blocks, when the send buffer is full the application tries again a bit later
+        TLoopServer sink;
+        loopServerStart(sink, true, LOOP_SINK);
+
+        BYTE handle = st.open(true, sink.port);
+        ASSERT_TRUE(network_handleIsValid(handle));
+        ASSERT_TRUE(st.waitForBytes(handle, 0, 100));
+
+        DWORD start = Utils::getCurrentUs();
+        DWORD sent  = 0;
+        int   full  = 0;
+
+        while(sent < total) {
+            BYTE res = st.send(handle, true, &block[0], blockSize);
+
+            if(res == (BYTE) E_OBUFFULL) {
+                full++;
+                sched_yield();
+                continue;
+            }
+
+            ASSERT_EQ(E_NORMAL, res);
+            sent += blockSize;
+        }
+
+        while(sink.bytesIn < total && Utils::getCurrentUs() - start < 10000000) {
+            Utils::sleepMs(1);
+        }
+
+        DWORD uploadUs = Utils::getCurrentUs() - start;
+        EXPECT_EQ(total, sink.bytesIn);
+
+        st.close(handle);
+        loopServerStop(sink);
+
+        // download - poll CNbyte_count(), read what is there by CNget_block() of up to 16 kB
+        TLoopServer source;
+        loopServerStart(source, true, LOOP_SOURCE, total);
+
+        handle = st.open(true, source.port);
+        ASSERT_TRUE(network_handleIsValid(handle));
+
+        start = Utils::getCurrentUs();
+        DWORD received  = 0;
+        int   badBytes  = 0;
+
+        while(received < total) {
+            ASSERT_TRUE(st.waitForBytes(handle, 1, 2000));
+
+            WORD len = MIN(st.bytesToRead(handle), blockSize);
+            ASSERT_EQ(E_NORMAL, st.getBlock(handle, &block[0], len));
+
+            for(int i=0; i<len; i++) {
+                if(block[i] != (BYTE) ((received + i) % 251)) {
+                    badBytes++;
+                }
+            }
+            received += len;
+        }
+
+        DWORD downloadUs = Utils::getCurrentUs() - start;
+        EXPECT_EQ(0, badBytes);
+
+        st.close(handle);
+        loopServerStop(source);
+
+        printf("stingHarness: bulk TCP of %d MB - upload %d MB/s (%d times send buffer full), download %d MB/s\n", (int) (total >> 20),
+               (int) (((unsigned long long) total * 1000000 / uploadUs) >> 20), full, (int) (((unsigned long long) total * 1000000 / downloadUs) >> 20));
+    }
+
+TEST(stingHarnessSlow, smallUdpPackets)
+    {
+        FakeStingDriver st;
+        TLoopServer echo;
+        loopServerStart(echo, false, LOOP_ECHO);
+
+        BYTE handle = st.open(false, echo.port);
+        ASSERT_TRUE(network_handleIsValid(handle));
+
+        // ping-pong of 64 byte datagrams - UDP_send(), poll CNbyte_count(), CNget_NDB()
+        const int packets = 5000;
+        BYTE data[64], reply[2048];
+        std::vector<DWORD> times;
+
+        DWORD start = Utils::getCurrentUs();
+
+        for(int i=0; i<packets; i++) {
+            memset(data, i, sizeof(data));
+
+            DWORD sendTime = Utils::getCurrentUs();
+            ASSERT_EQ(E_NORMAL, st.send(handle, false, data, sizeof(data)));
+            ASSERT_TRUE(st.waitForBytes(handle, sizeof(data), 1000));
+            ASSERT_EQ((int) sizeof(data), st.getNdb(handle, reply));
+            times.push_back(Utils::getCurrentUs() - sendTime);
+
+            ASSERT_EQ(0, memcmp(data, reply, sizeof(data)));
+        }
+
+        DWORD duration = Utils::getCurrentUs() - start;
+
+        // burst of datagrams, then the application reads them all
+        const int burst = 64;
+        for(int i=0; i<burst; i++) {
+            ASSERT_EQ(E_NORMAL, st.send(handle, false, data, sizeof(data)));
+        }
+
+        int got = 0;
+        while(got < burst && st.waitForBytes(handle, 1, 200)) {
+            while(st.getNdb(handle, reply) > 0) {
+                got++;
+            }
+        }
+        EXPECT_EQ(burst, got);
+
+        st.close(handle);
+        loopServerStop(echo);
+
+        printf("stingHarness: %d UDP round trips of %d bytes - %d packets/s\n", packets, (int) sizeof(data), (int) ((2ULL * packets * 1000000) / duration));
+        printLatency("UDP round trip", times);
+    }
+
+TEST(stingHarnessSlow, manyConcurrentConnections)
+    {
+        FakeStingDriver st;
+        TLoopServer echo;
+        loopServerStart(echo, true, LOOP_ECHO);
+
+        const int connections = 100;
+        std::vector<BYTE> handles;
+
+        DWORD start = Utils::getCurrentUs();
+        for(int i=0; i<connections; i++) {
+            BYTE handle = st.open(true, echo.port);
+            ASSERT_TRUE(network_handleIsValid(handle));
+            handles.push_back(handle);
+        }
+        DWORD openUs = Utils::getCurrentUs() - start;
+
+        for(int i=0; i<connections; i++) {                              // wait till all are connected
+            ASSERT_TRUE(st.waitForBytes(handles[i], 0, 1000));
+        }
+
+        // each round every connection sends a 100 byte request and reads the echo
+        const int rounds = 50;
+        BYTE data[100], reply[100];
+        std::vector<DWORD> times;
+
+        start = Utils::getCurrentUs();
+
+        for(int r=0; r<rounds; r++) {
+            DWORD roundStart = Utils::getCurrentUs();
+
+            for(int i=0; i<connections; i++) {
+                memset(data, r + i, sizeof(data));
+                ASSERT_EQ(E_NORMAL, st.send(handles[i], true, data, sizeof(data)));
+            }
+
+            for(int i=0; i<connections; i++) {
+                ASSERT_TRUE(st.waitForBytes(handles[i], sizeof(data), 1000));
+                ASSERT_EQ(E_NORMAL, st.getBlock(handles[i], reply, sizeof(reply)));
+
+                memset(data, r + i, sizeof(data));
+                ASSERT_EQ(0, memcmp(data, reply, sizeof(data)));
+            }
+
+            times.push_back(Utils::getCurrentUs() - roundStart);
+        }
+
+        DWORD duration = Utils::getCurrentUs() - start;
+
+        for(int i=0; i<connections; i++) {
+            st.close(handles[i]);
+        }
+        loopServerStop(echo);
+
+        printf("stingHarness: %d TCP connections opened in %d us, %d echo requests/s\n", connections, (int) openUs, (int) ((1000000ULL * rounds * connections) / duration));
+        printLatency("round of requests on all connections", times);
+    }
+
+TEST(stingHarnessSlow, resolveAndPing)
+    {
+        FakeStingDriver st;
+
+        DWORD start = Utils::getCurrentUs(), ip = 0;
+        ASSERT_TRUE(st.resolve("localhost", ip, 2000));
+        DWORD resolveUs = Utils::getCurrentUs() - start;
+        EXPECT_EQ((DWORD) INADDR_LOOPBACK, ip);
+
+        start = Utils::getCurrentUs();
+        ASSERT_TRUE(st.resolve("localhost", ip, 2000));
+        DWORD cachedUs = Utils::getCurrentUs() - start;
+
+        printf("stingHarness: resolve() of localhost %d us, again %d us\n", (int) resolveUs, (int) cachedUs);
+
+        // ping - ICMP_send(), poll for ICMP data, get the replies
+        const int pings = 200;
+        std::vector<DWORD> times;
+
+        for(int i=0; i<pings; i++) {
+            DWORD sendTime = Utils::getCurrentUs();
+
+            if(st.ping(INADDR_LOOPBACK, 0x1234, i) != E_NORMAL) {
+                printf("stingHarness: can't send ping, ICMP sockets not allowed here\n");
+                return;
+            }
+
+            std::vector<WORD> sequences;
+            while(sequences.empty() && Utils::getCurrentUs() - sendTime < 1000000) {
+                st.update();
+                if(st.icmpBytes > 0) {
+                    st.getPingReplies(sequences);
+                } else {
+                    sched_yield();
+                }
+            }
+
+            ASSERT_EQ(1, (int) sequences.size());
+            EXPECT_EQ(i, sequences[0]);
+            times.push_back(Utils::getCurrentUs() - sendTime);
+        }
+
+        printLatency("ping of localhost", times);
+    }
+
+//--------------------------------------------------------
+// IKBD mouse - events from fast mouse are coalesced into packets which the 7812.5 baud line can carry
+
+#define IKBDTEST_DIR    "/tmp/ce_ikbdtest"
+
+typedef struct {
+    DWORD   time;                                                       // us since the start of the test
+    int     cumX, cumY;                                                 // motion sent / received so far, including this
+    int     buttons;
+} TMouseTestPoint;
+
+static void ikbdTestEvent(Ikbd &ikbd, int type, int code, int value)
+    {
+        input_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.type  = type;
+        ev.code  = code;
+        ev.value = value;
+        ikbd.processMouse(&ev);
+    }
+
+// reads the packets written to 'UART' so far, converts them to cumulative motion
+static void ikbdTestReadPackets(int fd, std::vector<BYTE> &rest, DWORD now, std::vector<TMouseTestPoint> &out, int &badHeaders)
+    {
+        BYTE bfr[256];
+        int res;
+
+        while((res = read(fd, bfr, sizeof(bfr))) > 0) {
+            rest.insert(rest.end(), bfr, bfr + res);
+        }
+
+        while(rest.size() >= 3) {
+            if((rest[0] & 0xfc) != 0xf8) {
+                badHeaders++;
+            }
+
+            TMouseTestPoint p;
+            p.time    = now;
+            p.cumX    = (out.empty() ? 0 : out.back().cumX) + (signed char) rest[1];
+            p.cumY    = (out.empty() ? 0 : out.back().cumY) + (signed char) rest[2];
+            p.buttons = rest[0] & 3;
+            out.push_back(p);
+
+            rest.erase(rest.begin(), rest.begin() + 3);
+        }
+    }
+
+TEST(ikbdSlow, fastMouseMotionIsCoalescedAndButtonsKeepOrder)
+    {
+        system("rm -rf " IKBDTEST_DIR "; mkdir -p " IKBDTEST_DIR);
+        Settings::setDirectory(IKBDTEST_DIR);
+
+        Ikbd ikbd;
+        int fds[2];
+        ASSERT_EQ(0, pipe(fds));
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        ikbd.fdUart = fds[1];                                           // pipe instead of UART, reading end is the ST
+
+        std::vector<BYTE>            rest;
+        std::vector<TMouseTestPoint> out;
+        int badHeaders = 0;
+
+        // motion without SYN_REPORT is not sent yet, even when the line is free
+        ikbdTestEvent(ikbd, EV_REL, REL_X, 5);
+        EXPECT_EQ(-1, ikbd.getOutputWaitUs());
+        ikbd.processOutput();
+        ikbdTestReadPackets(fds[0], rest, 0, out, badHeaders);
+        EXPECT_EQ(0, (int) out.size());
+
+        ikbdTestEvent(ikbd, EV_SYN, SYN_REPORT, 0);                    // frame complete, line free - sent right away
+        ikbdTestReadPackets(fds[0], rest, 0, out, badHeaders);
+        ASSERT_EQ(1, (int) out.size());
+        EXPECT_EQ(5, out[0].cumX);
+
+        usleep(10000);                                                  // let the line get free
+        out.clear();
+
+        // 1000 Hz mouse for 1 second, with some big jumps and a click every 250 ms
+        const int frames = 1000;
+        std::vector<TMouseTestPoint> in;
+        int sumX = 0, sumY = 0, buttons = 0, eventsIn = 0;
+        int frame = 0;
+
+        DWORD start = Utils::getCurrentUs();
+
+        while(true) {
+            DWORD now = Utils::getCurrentUs() - start;
+
+            if(frame < frames && now >= (DWORD) frame * 1000) {
+                int dx = ((frame % 100) ==  0) ?  400 : 3 + (frame % 5);
+                int dy = ((frame % 100) == 50) ? -350 : -(frame % 4);
+
+                ikbdTestEvent(ikbd, EV_REL, REL_X, dx);
+                ikbdTestEvent(ikbd, EV_REL, REL_Y, dy);
+                ikbdTestEvent(ikbd, EV_SYN, SYN_REPORT, 0);
+                eventsIn += 2;
+                sumX += dx;
+                sumY += dy;
+
+                if((frame % 250) == 125) {                              // button in its own frame, after the motion
+                    buttons ^= 2;
+                    ikbdTestEvent(ikbd, EV_KEY, BTN_LEFT, buttons ? 1 : 0);
+                    ikbdTestEvent(ikbd, EV_SYN, SYN_REPORT, 0);
+                }
+
+                TMouseTestPoint p = { now, sumX, sumY, buttons };
+                in.push_back(p);
+                frame++;
+            }
+
+            ikbd.processOutput();                                       // what ikbdThreadCode does after each select()
+            ikbdTestReadPackets(fds[0], rest, now, out, badHeaders);
+
+            int waitUs = ikbd.getOutputWaitUs();
+            if(frame >= frames && waitUs < 0) {
+                break;
+            }
+
+            int nextFrameUs = (frame < frames) ? (int) ((DWORD) frame * 1000 - now) : 1000000;
+            int sleepUs = (waitUs >= 0 && waitUs < nextFrameUs) ? waitUs : nextFrameUs;
+            if(sleepUs > 0) {
+                usleep(sleepUs);
+            }
+        }
+
+        DWORD elapsed = Utils::getCurrentUs() - start;
+        ikbdTestReadPackets(fds[0], rest, elapsed, out, badHeaders);
+        close(fds[0]);
+        close(fds[1]);
+
+        ASSERT_FALSE(out.empty());
+        EXPECT_EQ(0, badHeaders);
+        EXPECT_EQ(0, (int) rest.size());
+
+        // nothing lost, nothing wrapped around
+        EXPECT_EQ(sumX, out.back().cumX);
+        EXPECT_EQ(sumY, out.back().cumY);
+
+        for(size_t i=1; i<out.size(); i++) {
+            int dx = out[i].cumX - out[i-1].cumX;
+            int dy = out[i].cumY - out[i-1].cumY;
+            EXPECT_TRUE(dx >= -127 && dx <= 127 && dy >= -127 && dy <= 127);
+        }
+
+        // every click is there, in order, and comes after all the motion made before it
+        int clicks = 0, outButtons = 0;
+        for(size_t i=0; i<out.size(); i++) {
+            if(out[i].buttons == outButtons) {
+                continue;
+            }
+            outButtons = out[i].buttons;
+
+            int clickFrame = 125 + (clicks * 250);
+            ASSERT_LT(clickFrame, (int) in.size());
+            EXPECT_EQ(in[clickFrame].buttons, out[i].buttons);
+            EXPECT_EQ(in[clickFrame].cumX, out[i].cumX);
+            EXPECT_EQ(in[clickFrame].cumY, out[i].cumY);
+            clicks++;
+        }
+        EXPECT_EQ(4, clicks);
+
+        // the line is not overfilled - packets are sent only when previous ones left it
+        int bytesOut = out.size() * 3;
+        EXPECT_LE((DWORD) bytesOut * IKBD_BYTE_US, elapsed + 10000);
+
+        // queueing delay - from the frame until the ST got all of its motion
+        std::vector<DWORD> delays;
+        size_t o = 0;
+        for(size_t f=0; f<in.size(); f++) {
+            while(o < out.size() && (out[o].cumX < in[f].cumX || out[o].cumY > in[f].cumY)) {
+                o++;
+            }
+            ASSERT_LT(o, out.size());
+            delays.push_back(out[o].time - in[f].time);
+        }
+        std::sort(delays.begin(), delays.end());
+
+        DWORD sum = 0;
+        for(size_t i=0; i<delays.size(); i++) {
+            sum += delays[i];
+        }
+
+        printf("ikbd: %d REL events in %d ms -> %d packets, delay avg %d us, 99%% %d us, max %d us\n", eventsIn, (int) (elapsed / 1000),
+               (int) out.size(), (int) (sum / delays.size()), (int) delays[(delays.size() * 99) / 100], (int) delays.back());
+        printf("ikbd: packet per REL event would need %d ms of line time for this 1 s of movement\n", (eventsIn * 3 * IKBD_BYTE_US) / 1000);
+
+        EXPECT_GT(100000, (int) delays[(delays.size() * 99) / 100]);    // lenient - test machine may be busy, coalesced is ~4 ms
+
+        Settings::setDirectory("/ce/settings");
+        system("rm -rf " IKBDTEST_DIR);
+    }
+
+//--------------------------------------------------------
+// IKBD output scheduler - joystick and mouse flood the line, key presses must still go out right away
+
+static int openRawPty(int &master, int &slave)
+    {
+        if(openpty(&master, &slave, NULL, NULL, NULL) != 0) {
+            return -1;
+        }
+
+        struct termios ts;
+        tcgetattr(slave, &ts);
+        cfmakeraw(&ts);
+        tcsetattr(slave, TCSANOW, &ts);
+
+        fcntl(master, F_SETFL, O_NONBLOCK);
+        fcntl(slave,  F_SETFL, O_NONBLOCK);
+        return 0;
+    }
+
+TEST(ikbdOutputSlow, keysGoFirstAndStaleStateIsReplaced)
+    {
+        int master, slave;
+        ASSERT_EQ(0, openRawPty(master, slave));                        // slave is the UART, master is the ST
+
+        IkbdOutput output;
+
+        const int durationMs = 1000;
+        std::vector<BYTE>  keysIn, keysOut, firesOut;
+        std::vector<DWORD> keyTimes, keyDelays;
+        BYTE  joyState = 0, lastJoyOut = 0;
+        int   fireChanges = 0, bytesOffered = 0, ms = 0, drainLoops = 0;
+        std::vector<BYTE> stream;
+
+        DWORD start = Utils::getCurrentUs();
+
+        while(true) {
+            DWORD now = Utils::getCurrentUs() - start;
+
+            if(ms < durationMs && now >= (DWORD) ms * 1000) {
+                // joystick direction changes every ms, fire every 100 ms
+                joyState = (joyState & JOYDIR_BUTTON) | (1 << (ms % 4));
+                if((ms % 100) == 50) {
+                    joyState ^= JOYDIR_BUTTON;
+                    fireChanges++;
+                }
+                BYTE joy[2] = { KEYBDATA_JOY0, joyState };
+                output.add(IKBDOUT_STATE, joy, 2, KEYBDATA_JOY0, JOYDIR_BUTTON);
+
+                BYTE motion[3] = { KEYBDATA_MOUSE_REL8, (BYTE) (ms & 0x3f), 0 };   // stands for absolute value, latest one is enough
+                output.add(IKBDOUT_MOTION, motion, 3);
+                bytesOffered += 5;
+
+                if((ms % 50) == 0) {                                    // key press every 50 ms
+                    BYTE key = 0x10 + (keysIn.size() % 0x40);
+                    output.add(IKBDOUT_KEY, &key, 1);
+                    keysIn.push_back(key);
+                    keyTimes.push_back(now);
+                    bytesOffered++;
+                }
+
+                ms++;
+            }
+
+            int waitUs = output.service(slave);
+
+            // what the ST got - keys are single bytes, joystick packets have 2 bytes, mouse packets 3 bytes
+            BYTE bfr[256];
+            int res;
+            while((res = read(master, bfr, sizeof(bfr))) > 0) {
+                stream.insert(stream.end(), bfr, bfr + res);
+            }
+
+            DWORD gotTime = Utils::getCurrentUs() - start;
+            size_t pos = 0;
+            while(pos < stream.size()) {
+                BYTE b = stream[pos];
+
+                if(b == KEYBDATA_JOY0) {
+                    if(pos + 2 > stream.size()) break;
+                    BYTE state = stream[pos + 1];
+                    if((state & JOYDIR_BUTTON) != (lastJoyOut & JOYDIR_BUTTON)) {
+                        firesOut.push_back(state & JOYDIR_BUTTON);
+                    }
+                    lastJoyOut = state;
+                    pos += 2;
+                } else if(b == KEYBDATA_MOUSE_REL8) {
+                    if(pos + 3 > stream.size()) break;
+                    pos += 3;
+                } else {
+                    keysOut.push_back(b);
+                    if(keysOut.size() <= keyTimes.size()) {
+                        keyDelays.push_back(gotTime - keyTimes[keysOut.size() - 1]);
+                    }
+                    pos++;
+                }
+            }
+            stream.erase(stream.begin(), stream.begin() + pos);
+
+            if(ms >= durationMs && waitUs < 0) {                        // all written, give the pty few ms to pass the rest
+                if(++drainLoops > 10) {
+                    break;
+                }
+                usleep(1000);
+                continue;
+            }
+
+            int nextMsUs = (ms < durationMs) ? (int) ((DWORD) ms * 1000 - now) : 1000000;
+            int sleepUs  = (waitUs >= 0 && waitUs < nextMsUs) ? waitUs : nextMsUs;
+            if(sleepUs > 0) {
+                usleep(sleepUs);
+            }
+        }
+
+        DWORD elapsed = Utils::getCurrentUs() - start;
+        EXPECT_EQ(0, (int) stream.size());
+
+        close(master);
+        close(slave);
+
+        TIkbdOutStats st;
+        output.getStats(st);
+
+        // keys - all of them, in order, quickly
+        EXPECT_TRUE(keysIn == keysOut);
+
+        // joystick - every fire change is there, and the final state is the latest one
+        EXPECT_EQ(fireChanges, (int) firesOut.size());
+        for(size_t i=0; i<firesOut.size(); i++) {
+            EXPECT_EQ((i % 2) == 0 ? JOYDIR_BUTTON : 0, firesOut[i]);
+        }
+        EXPECT_EQ(joyState, lastJoyOut);
+
+        // stale state and motion were replaced, so the queues stayed short
+        EXPECT_LT(0, (int) st.replaced[IKBDOUT_STATE]);
+        EXPECT_LT(0, (int) st.replaced[IKBDOUT_MOTION]);
+        EXPECT_GE(3, st.maxDepth[IKBDOUT_STATE]);
+        EXPECT_GE(1, st.maxDepth[IKBDOUT_MOTION]);
+        EXPECT_EQ(0, st.depth[IKBDOUT_KEY] + st.depth[IKBDOUT_STATE] + st.depth[IKBDOUT_MOTION]);
+        EXPECT_LE(st.bytesSent * IKBD_BYTE_US, elapsed + 10000);      // not more than the line can take
+
+        ASSERT_EQ(keysIn.size(), keyDelays.size());
+        std::sort(keyDelays.begin(), keyDelays.end());
+
+        printf("ikbdOutput: %d bytes offered in %d ms (%d ms of line time), %d bytes sent\n", bytesOffered, durationMs,
+               (bytesOffered * IKBD_BYTE_US) / 1000, (int) st.bytesSent);
+        printf("ikbdOutput: replaced %d joystick states, %d motions, max queue depth key %d, state %d, motion %d\n",
+               (int) st.replaced[IKBDOUT_STATE], (int) st.replaced[IKBDOUT_MOTION],
+               st.maxDepth[IKBDOUT_KEY], st.maxDepth[IKBDOUT_STATE], st.maxDepth[IKBDOUT_MOTION]);
+        printf("ikbdOutput: key delay median %d us, max %d us (queue max wait %d us)\n", (int) keyDelays[keyDelays.size() / 2],
+               (int) keyDelays.back(), (int) st.maxWaitUs[IKBDOUT_KEY]);
+
+        EXPECT_GT(50000, (int) keyDelays[keyDelays.size() / 2]);       // lenient - test machine may be busy, it's few ms
+    }
+
+//--------------------------------------------------------
+// IKBD replay harness - recorded (or made up) input events go through pipes into the same code which runs in ikbd thread,
+// pty stands for the UART. Set IKBD_REPLAY_FILE to ikbd_record.bin from a real device (web UI, log level ikbdlogs) to replay it.
+
+typedef struct {
+    Ikbd            *ikbd;
+    int             wakeFd;                                             // written to stop the thread
+    volatile bool   shouldStop;
+    pthread_t       thread;
+} TIkbdReplayThread;
+
+static void *ikbdReplayThreadCode(void *ptr)                            // ikbdThreadCode() loop without inotify and settings reload
+    {
+        TIkbdReplayThread *t = (TIkbdReplayThread *) ptr;
+        fd_set readfds;
+
+        while(!t->shouldStop) {
+            if(t->ikbd->waitForInput(t->wakeFd, readfds) < 0) {
+                continue;
+            }
+            t->ikbd->processInput(readfds, false);
+        }
+        return NULL;
+    }
+
+// what the ST got, decoded
+typedef struct {
+    std::vector<BYTE>   keys;                                           // key codes, in order
+    std::vector<BYTE>   buttons;                                        // buttons in mouse packets without motion - clicks
+    int                 mouseX, mouseY;                                 // sum of relative motion
+    BYTE                joyLast[2];
+    int                 packets;
+} TIkbdDecoded;
+
+static void ikbdDecodeOutput(const std::vector<BYTE> &out, TIkbdDecoded &d)
+    {
+        d.keys.clear();
+        d.buttons.clear();
+        d.mouseX = d.mouseY = d.packets = 0;
+        d.joyLast[0] = d.joyLast[1] = 0;
+
+        size_t pos = 0;
+        while(pos < out.size()) {
+            BYTE b = out[pos];
+            int len = 1;
+
+            if(b >= KEYBDATA_MOUSE_REL8 && b <= 0xfb)   len = 3;
+            else if(b == KEYBDATA_JOY0 || b == KEYBDATA_JOY1) len = 2;
+            else if(b == 0xfd)                          len = 3;    // both joysticks
+            else if(b == 0xf7)                          len = 6;    // absolute mouse
+            else if(b == 0xf6)                          len = 8;    // status report
+            else if(b == 0xfc)                          len = 7;    // time of day
+
+            if(pos + len > out.size()) {
+                break;
+            }
+
+            if(len == 3 && b != 0xfd) {
+                signed char dx = out[pos + 1], dy = out[pos + 2];
+                if(dx == 0 && dy == 0) {
+                    d.buttons.push_back(b & 3);
+                }
+                d.mouseX += dx;
+                d.mouseY += dy;
+            } else if(len == 2) {
+                d.joyLast[b - KEYBDATA_JOY0] = out[pos + 1];
+            } else if(len == 1) {
+                d.keys.push_back(b);
+            }
+
+            d.packets++;
+            pos += len;
+        }
+    }
+
+static void ikbdAddRecord(std::vector<TIkbdRecord> &recs, DWORD us, int kind, const void *data, int len)
+    {
+        TIkbdRecord rec;
+        rec.us   = us;
+        rec.kind = kind;
+        rec.data.assign((const BYTE *) data, (const BYTE *) data + len);
+        recs.push_back(rec);
+    }
+
+static void ikbdAddFrame(std::vector<TIkbdRecord> &recs, DWORD us, int kind, int type, int code, int value, int code2=-1, int value2=0)
+    {
+        input_event ev[3];
+        memset(ev, 0, sizeof(ev));
+        int cnt = 0;
+
+        ev[cnt].type = type; ev[cnt].code = code;  ev[cnt].value = value;  cnt++;
+        if(code2 >= 0) {
+            ev[cnt].type = type; ev[cnt].code = code2; ev[cnt].value = value2; cnt++;
+        }
+        ev[cnt].type = EV_SYN; ev[cnt].code = SYN_REPORT; cnt++;
+
+        ikbdAddRecord(recs, us, kind, ev, cnt * sizeof(input_event));
+    }
+
+static bool ikbdRecordLess(const TIkbdRecord &a, const TIkbdRecord &b)
+    {
+        return a.us < b.us;
+    }
+
+// feeds the records into Ikbd at their times, returns what went out of UART
+static void ikbdReplay(const std::vector<TIkbdRecord> &records, std::vector<BYTE> &out, const char *recordPath=NULL)
+    {
+        out.clear();
+
+        Ikbd ikbd;                                                      // this also closes all the devices
+        int inPipes[INTYPE_MAX + 1];
+
+        for(int i=0; i<=INTYPE_MAX; i++) {                              // pipes instead of the devices which are in the records
+            inPipes[i] = -1;
+
+            for(size_t r=0; r<records.size(); r++) {
+                if(records[r].kind == i) {
+                    int fds[2];
+                    pipe(fds);
+                    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+                    ikbdDevs[i].fd = fds[0];
+                    strcpy(ikbdDevs[i].devPath, "replay");
+                    inPipes[i] = fds[1];
+                    break;
+                }
+            }
+        }
+
+        int master, slave, wake[2];
+        openRawPty(master, slave);
+        pipe(wake);
+        ikbd.fdUart = slave;
+
+        if(recordPath) {
+            ikbd.startRecording(recordPath);
+        }
+
+        TIkbdReplayThread t;
+        t.ikbd       = &ikbd;
+        t.wakeFd     = wake[0];
+        t.shouldStop = false;
+        pthread_create(&t.thread, NULL, ikbdReplayThreadCode, &t);
+
+        BYTE bfr[256];
+        int res;
+        DWORD start = Utils::getCurrentUs();
+
+        for(size_t r=0; r<records.size(); r++) {
+            const TIkbdRecord &rec = records[r];
+
+            while(true) {                                               // read what ST got till it's time for this record
+                while((res = read(master, bfr, sizeof(bfr))) > 0) {
+                    out.insert(out.end(), bfr, bfr + res);
+                }
+
+                int waitUs = (int) (rec.us - (Utils::getCurrentUs() - start));
+                if(waitUs <= 0) {
+                    break;
+                }
+                usleep(MIN(waitUs, 1000));
+            }
+
+            if(rec.kind <= INTYPE_MAX && inPipes[rec.kind] >= 0) {
+                write(inPipes[rec.kind], &rec.data[0], rec.data.size());
+            } else if(rec.kind == IKBDREC_UART_IN) {
+                write(master, &rec.data[0], rec.data.size());          // as if it came from Franz
+            }
+        }
+
+        DWORD lastGot = Utils::getCurrentUs();                          // the rest, till nothing comes for 100 ms
+        while(Utils::getCurrentUs() - lastGot < 100000) {
+            while((res = read(master, bfr, sizeof(bfr))) > 0) {
+                out.insert(out.end(), bfr, bfr + res);
+                lastGot = Utils::getCurrentUs();
+            }
+            usleep(1000);
+        }
+
+        t.shouldStop = true;
+        write(wake[1], "x", 1);
+        pthread_join(t.thread, NULL);
+
+        ikbd.stopRecording();
+        ikbd.closeDevs();
+
+        for(int i=0; i<=INTYPE_MAX; i++) {
+            if(inPipes[i] >= 0) {
+                close(inPipes[i]);
+            }
+        }
+        close(wake[0]);
+        close(wake[1]);
+        close(master);
+        close(slave);
+    }
+
+static void printIkbdLatency(void)
+    {
+        const char *names[IKBDLAT_SOURCES] = { "mouse", "keyboard", "joy1", "joy2", "vmouse", "vkeyboard" };
+
+        for(int s=0; s<IKBDLAT_SOURCES; s++) {
+            TIkbdLatHistogram h;
+            ikbdLatency.get(s, h);
+
+            if(h.count > 0) {
+                printf("ikbdHarness: %-9s %4u packets, avg %5u us, 50%% < %5u us, 99%% < %5u us, max %5u us\n", names[s], h.count,
+                       (DWORD) (h.sumUs / h.count), IkbdLatency::percentileUs(h, 50), IkbdLatency::percentileUs(h, 99), h.maxUs);
+            }
+        }
+    }
+
+TEST(ikbdHarnessSlow, replayMadeUpTraceAndItsRecording)
+    {
+        system("rm -rf " IKBDTEST_DIR "; mkdir -p " IKBDTEST_DIR);
+        Settings::setDirectory(IKBDTEST_DIR);
+
+        // 1.5 s of typing, 500 Hz mouse with clicks and joystick 2 waggling, with the expected results
+        std::vector<TIkbdRecord> recs;
+        std::vector<BYTE> expKeys, expButtons;
+        int expX = 0, expY = 0;
+        BYTE expJoy = 0;
+        KeyTranslator kt;
+
+        BYTE stCmd[2] = { UARTMARK_STCMD, STCMD_SET_REL_MOUSE_POS_REPORTING };
+        ikbdAddRecord(recs, 0, IKBDREC_UART_IN, stCmd, 2);
+
+        for(int ms=10; ms<1500; ms++) {
+            if((ms % 100) == 10) {                                      // key down, up after 30 ms
+                int key = KEY_A + ((ms / 100) % 9);
+                ikbdAddFrame(recs, ms * 1000, INTYPE_KEYBOARD, EV_KEY, key, 1);
+                ikbdAddFrame(recs, (ms + 30) * 1000, INTYPE_KEYBOARD, EV_KEY, key, 0);
+                expKeys.push_back(kt.pcKeyToSt(key));
+                expKeys.push_back(kt.pcKeyToSt(key) | 0x80);
+            }
+
+            if((ms % 2) == 0) {
+                ikbdAddFrame(recs, ms * 1000, INTYPE_MOUSE, EV_REL, REL_X, 3, REL_Y, -2);
+                expX += 3;
+                expY -= 2;
+            }
+
+            if((ms % 400) == 200) {                                     // click, released after 100 ms
+                ikbdAddFrame(recs, ms * 1000 + 500, INTYPE_MOUSE, EV_KEY, BTN_LEFT, 1);
+                ikbdAddFrame(recs, (ms + 100) * 1000 + 500, INTYPE_MOUSE, EV_KEY, BTN_LEFT, 0);
+            }
+
+            if((ms % 20) == 0) {                                        // joystick left, center, right, center...
+                js_event js;
+                memset(&js, 0, sizeof(js));
+                js.type   = JS_EVENT_AXIS;
+                js.number = 0;
+                js.value  = ((ms / 20) % 2) ? 0 : (((ms / 40) % 2) ? 32767 : -32767);
+                ikbdAddRecord(recs, ms * 1000, INTYPE_JOYSTICK2, &js, sizeof(js));
+                expJoy = (expJoy & JOYDIR_BUTTON) | ((js.value < 0) ? JOYDIR_LEFT : (js.value > 0) ? JOYDIR_RIGHT : 0);
+            }
+
+            if((ms % 300) == 150) {                                     // fire, released after 100 ms - as mouse button in this mode
+                js_event js;
+                memset(&js, 0, sizeof(js));
+                js.type   = JS_EVENT_BUTTON;
+                js.value  = 1;
+                ikbdAddRecord(recs, ms * 1000 + 700, INTYPE_JOYSTICK2, &js, sizeof(js));
+                js.value  = 0;
+                ikbdAddRecord(recs, (ms + 100) * 1000 + 700, INTYPE_JOYSTICK2, &js, sizeof(js));
+            }
+        }
+        std::stable_sort(recs.begin(), recs.end(), ikbdRecordLess);
+
+        // clicks in time order - mouse button packets carry mouse buttons, joystick ones the joystick fire as right button
+        int mouseBtn = 0;
+        for(size_t r=0; r<recs.size(); r++) {
+            if(recs[r].kind == INTYPE_MOUSE && ((input_event *) &recs[r].data[0])->type == EV_KEY) {
+                mouseBtn = ((input_event *) &recs[r].data[0])->value ? 2 : 0;
+                expButtons.push_back(mouseBtn);
+            }
+            if(recs[r].kind == INTYPE_JOYSTICK2 && ((js_event *) &recs[r].data[0])->type == JS_EVENT_BUTTON) {
+                expButtons.push_back(((js_event *) &recs[r].data[0])->value ? 1 : 0);
+            }
+        }
+
+        // replay it and record it
+        std::vector<BYTE> out;
+        ikbdLatency.reset();
+        ikbdReplay(recs, out, IKBDTEST_DIR "/record.bin");
+
+        TIkbdDecoded d;
+        ikbdDecodeOutput(out, d);
+
+        EXPECT_TRUE(expKeys == d.keys);
+        EXPECT_TRUE(expButtons == d.buttons);
+        EXPECT_EQ(expX, d.mouseX);
+        EXPECT_EQ(expY, d.mouseY);
+        EXPECT_EQ(expJoy, d.joyLast[1] & ~JOYDIR_BUTTON);
+
+        printf("ikbdHarness: made up trace - %d records in, %d bytes / %d packets out\n", (int) recs.size(), (int) out.size(), d.packets);
+        printIkbdLatency();
+
+        TIkbdLatHistogram kbd;
+        ikbdLatency.get(INTYPE_KEYBOARD, kbd);
+        EXPECT_EQ(expKeys.size(), kbd.count);
+        EXPECT_GT(50000, (int) IkbdLatency::percentileUs(kbd, 50));    // lenient - test machine may be busy
+
+        // the recording has all the input, and the output is what the ST got
+        std::vector<TIkbdRecord> recorded;
+        ASSERT_TRUE(IkbdRecorder::load(IKBDTEST_DIR "/record.bin", recorded));
+
+        std::vector<BYTE> recordedOut;
+        int inputRecords = 0;
+        for(size_t r=0; r<recorded.size(); r++) {
+            if(recorded[r].kind == IKBDREC_UART_OUT) {
+                recordedOut.insert(recordedOut.end(), recorded[r].data.begin(), recorded[r].data.end());
+            } else {
+                inputRecords++;
+            }
+        }
+        EXPECT_TRUE(recordedOut == out);
+        EXPECT_LT(0, inputRecords);
+
+        // replay of the recording gives the same keys, clicks and motion
+        std::vector<BYTE> out2;
+        ikbdLatency.reset();
+        ikbdReplay(recorded, out2);
+
+        TIkbdDecoded d2;
+        ikbdDecodeOutput(out2, d2);
+        EXPECT_TRUE(d.keys == d2.keys);
+        EXPECT_TRUE(d.buttons == d2.buttons);
+        EXPECT_EQ(d.mouseX, d2.mouseX);
+        EXPECT_EQ(d.mouseY, d2.mouseY);
+
+        printf("ikbdHarness: replay of its recording - %d records in, %d bytes / %d packets out\n", (int) recorded.size(), (int) out2.size(), d2.packets);
+
+        Settings::setDirectory("/ce/settings");
+        system("rm -rf " IKBDTEST_DIR);
+    }
+
+TEST(ikbdRecorderSlow, inputEventsHaveFixedLayoutAndFileIsRotated)
+    {
+        system("rm -rf " IKBDTEST_DIR "; mkdir -p " IKBDTEST_DIR);
+        const char *path = IKBDTEST_DIR "/fixed.bin";
+
+        input_event ev[2];
+        memset(ev, 0, sizeof(ev));
+        ev[0].time.tv_sec = 1234; ev[0].time.tv_usec = 5678; ev[0].type = EV_REL; ev[0].code = REL_X; ev[0].value = -3;
+        ev[1].type = EV_SYN; ev[1].code = SYN_REPORT;
+
+        IkbdRecorder rec;
+        ASSERT_TRUE(rec.start(path));
+        rec.addInputEvents(INTYPE_MOUSE, ev, 2);
+        rec.stop();
+
+        // 16 bytes per event in the file, no matter how big input_event is here
+        struct stat st;
+        ASSERT_EQ(0, stat(path, &st));
+        EXPECT_EQ(8 + (int) sizeof(TIkbdRecordHeader) + 2 * 16, (int) st.st_size);
+
+        std::vector<TIkbdRecord> loaded;
+        ASSERT_TRUE(IkbdRecorder::load(path, loaded));
+        ASSERT_EQ(1, (int) loaded.size());
+        ASSERT_EQ(2 * sizeof(input_event), loaded[0].data.size());
+
+        const input_event *back = (const input_event *) &loaded[0].data[0];
+        EXPECT_EQ(1234, (int) back[0].time.tv_sec);
+        EXPECT_EQ(5678, (int) back[0].time.tv_usec);
+        EXPECT_EQ(EV_REL, back[0].type);
+        EXPECT_EQ(REL_X,  back[0].code);
+        EXPECT_EQ(-3,     back[0].value);
+        EXPECT_EQ(EV_SYN, back[1].type);
+
+        // recording doesn't grow without limit
+        BYTE data[100];
+        memset(data, 0x11, sizeof(data));
+
+        ASSERT_TRUE(rec.start(path));
+        rec.setMaxSize(10000);
+        for(int i=0; i<500; i++) {
+            rec.add(IKBDREC_UART_OUT, data, sizeof(data));
+        }
+        rec.stop();
+
+        struct stat stOld;
+        ASSERT_EQ(0, stat(path, &st));
+        ASSERT_EQ(0, stat(IKBDTEST_DIR "/fixed.bin.1", &stOld));
+        EXPECT_GE(10000, (int) st.st_size);
+        EXPECT_GE(10000 + (int) sizeof(TIkbdRecordHeader) + 100, (int) stOld.st_size);
+
+        ASSERT_TRUE(IkbdRecorder::load(path, loaded));                 // the new file is a whole recording too
+        EXPECT_LT(0, (int) loaded.size());
+
+        system("rm -rf " IKBDTEST_DIR);
+    }
+
+TEST(ikbdHarnessSlow, replayRecordingFromDevice)
+    {
+        const char *path = getenv("IKBD_REPLAY_FILE");
+
+        if(!path) {
+            printf("ikbdHarness: set IKBD_REPLAY_FILE to replay a recording from device\n");
+            return;
+        }
+
+        std::vector<TIkbdRecord> recorded;
+        ASSERT_TRUE(IkbdRecorder::load(path, recorded));
+
+        std::vector<BYTE> recordedOut, out;
+        for(size_t r=0; r<recorded.size(); r++) {
+            if(recorded[r].kind == IKBDREC_UART_OUT) {
+                recordedOut.insert(recordedOut.end(), recorded[r].data.begin(), recorded[r].data.end());
+            }
+        }
+
+        ikbdLatency.reset();
+        ikbdReplay(recorded, out);
+
+        TIkbdDecoded then, now;
+        ikbdDecodeOutput(recordedOut, then);
+        ikbdDecodeOutput(out, now);
+
+        EXPECT_TRUE(then.keys == now.keys);
+        EXPECT_TRUE(then.buttons == now.buttons);
+        EXPECT_EQ(then.mouseX, now.mouseX);
+        EXPECT_EQ(then.mouseY, now.mouseY);
+
+        printf("ikbdHarness: %s - %d records, %d bytes out on device, %d bytes out now\n", path, (int) recorded.size(), (int) recordedOut.size(), (int) out.size());
+        printIkbdLatency();
+    }
+
+//--------------------------------------------------------
+// screencast - full frames vs. deltas against the previous frame. Set SCREENCAST_FRAMES_FILE to a file with recorded
+// frames (32000 bytes of screen + 32 bytes of palette each) to run it on real footage.
+
+#define SCTEST_FRAMES       200
+
+static DWORD screencastTestRandom(DWORD seed)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+static void screencastTestBackground(BYTE *screen, DWORD seed)        // 'busy' picture - no two neighbouring words the same
+    {
+        for(int i=0; i<SCREEN_WORDS; i++) {
+            seed = screencastTestRandom(seed + i);
+            Utils::storeWord(screen + i * 2, (WORD) seed);
+        }
+    }
+
+static void screencastTestSprite(BYTE *screen, int x, int y, int height, DWORD seed)   // 16 pixels wide, 4 low res planes
+    {
+        for(int row=y; row<y+height && row<200; row++) {
+            for(int group=x/16; group<=(x+15)/16 && group<20; group++) {
+                for(int plane=0; plane<4; plane++) {
+                    seed = screencastTestRandom(seed + row + plane);
+                    Utils::storeWord(screen + row * 160 + group * 8 + plane * 2, (WORD) seed);
+                }
+            }
+        }
+    }
+
+static void screencastDesktopFrame(int n, BYTE *screen, BYTE *palette) // mouse moves, text is typed, window opens now and then
+    {
+        screencastTestBackground(screen, 1);
+
+        int windows = n / 50;                                           // every 50 frames one more window
+        for(int w=0; w<windows; w++) {
+            for(int row=20 + w*10; row<120 + w*10; row++) {
+                memset(screen + row * 160 + 16 + w*8, 0x55 + w, 64);
+            }
+        }
+
+        int typed = n / 4;                                              // 8x8 char each 4 frames, 40 chars per line
+        for(int c=0; c<typed && c<40*20; c++) {
+            for(int row=0; row<8; row++) {
+                screen[(c / 40) * 8 * 160 + row * 160 + (c % 40) / 2 * 8 + (c & 1)] = (BYTE) (c + row);
+            }
+        }
+
+        screencastTestSprite(screen, (n * 5) % 304, (n * 3) % 184, 16, 99); // mouse pointer
+
+        for(int i=0; i<16; i++) {
+            Utils::storeWord(palette + i * 2, i * 0x111);
+        }
+    }
+
+static void screencastGameFrame(int n, BYTE *screen, BYTE *palette)    // playfield scrolls 16 pixels per frame, sprites, fixed status bar
+    {
+        for(int row=0; row<160; row++) {
+            for(int group=0; group<20; group++) {
+                DWORD seed = screencastTestRandom((group + n) * 1000 + row);
+                for(int plane=0; plane<4; plane++) {
+                    Utils::storeWord(screen + row * 160 + group * 8 + plane * 2, (WORD) (seed >> plane));
+                }
+            }
+        }
+
+        for(int row=160; row<200; row++) {
+            memset(screen + row * 160, row, 160);
+        }
+        screen[170 * 160] = (BYTE) n;                                   // score
+
+        for(int s=0; s<4; s++) {
+            screencastTestSprite(screen, (n * (s + 2) * 3) % 304, 20 + s * 30, 24, s);
+        }
+
+        for(int i=0; i<16; i++) {                                       // fades once a while
+            Utils::storeWord(palette + i * 2, ((i + n / 64) & 7) * 0x111);
+        }
+    }
+
+static BYTE screencastCommand(ScreencastAcsiCommand &sac, FakeDataTrans &dt, BYTE tranCmd, const BYTE *data, int len)
+    {
+        BYTE cmd[ACSI_CMD_SIZE];
+        memset(cmd, 0, ACSI_CMD_SIZE);
+        cmd[1] = 'C';
+        cmd[2] = 'E';
+        cmd[3] = HOSTMOD_TRANSLATED_DISK;
+        cmd[4] = tranCmd;
+        cmd[5] = 0;                                                     // low res
+        cmd[6] = len >> 16;
+        cmd[7] = len >>  8;
+        cmd[8] = len;
+
+        dt.dataFromSt.assign(data, data + len);
+        sac.processCommand(cmd);
+        dt.sendDataAndStatus();                                         // what translated disk does after each command
+        return dt.statusToSt;
+    }
+
+static int screencastTestTransfer(int len)                              // bytes which really go over ACSI
+    {
+        return (len + 15) & ~15;
+    }
+
+typedef void (*TScreencastFrameMaker)(int n, BYTE *screen, BYTE *palette);
+
+static void screencastCompareTransfers(const char *name, std::vector<BYTE> &frames, int frameCount)
+    {
+        ScreencastService scs;
+        scs.start();
+
+        FakeDataTrans dt;
+        ScreencastAcsiCommand sac(&dt, &scs);
+        ScreencastDeltaEncoder encoder;
+
+        BYTE *payload = new BYTE[SCDELTA_MAX_PAYLOAD];
+        BYTE got[SCREEN_BYTES], gotPalette[PALETTE_BYTES];
+        int fullBytes = 0, deltaBytes = 0, keyframes = 0, maxDelta = 0;
+
+        for(int f=0; f<frameCount; f++) {
+            const BYTE *screen  = &frames[f * (SCREEN_BYTES + PALETTE_BYTES)];
+            const BYTE *palette = screen + SCREEN_BYTES;
+
+            // existing clients: whole screen and palette in two commands
+            ASSERT_EQ(RW_ALL_TRANSFERED, screencastCommand(sac, dt, TRAN_CMD_SENDSCREENCAST,    screen,  SCREEN_BYTES));
+            ASSERT_EQ(RW_ALL_TRANSFERED, screencastCommand(sac, dt, TRAN_CMD_SCREENCASTPALETTE, palette, PALETTE_BYTES));
+            fullBytes += screencastTestTransfer(SCREEN_BYTES) + screencastTestTransfer(PALETTE_BYTES);
+
+            scs.getScreen(got);
+            ASSERT_EQ(0, memcmp(got, screen, SCREEN_BYTES));
+
+            // delta client: one command with keyframe or changes
+            int len = encoder.encode(screen, palette, payload);
+            ASSERT_EQ(RW_ALL_TRANSFERED, screencastCommand(sac, dt, TRAN_CMD_SENDSCREENCAST_DELTA, payload, len)) << "frame " << f;
+            deltaBytes += screencastTestTransfer(len);
+            keyframes  += (payload[0] == SCDELTA_TYPE_KEYFRAME) ? 1 : 0;
+            maxDelta    = std::max(maxDelta, len);
+
+            scs.getScreen(got);
+            scs.getPalette(gotPalette);
+            ASSERT_EQ(0, memcmp(got, screen, SCREEN_BYTES)) << "frame " << f;
+            ASSERT_EQ(0, memcmp(gotPalette, palette, PALETTE_BYTES)) << "frame " << f;
+        }
+
+        printf("screencast %-8s: %d frames, full %d B/frame, delta %d B/frame (%d keyframes, biggest %d B) - %.1f%% of full\n",
+            name, frameCount, fullBytes / frameCount, deltaBytes / frameCount, keyframes, maxDelta, 100.0 * deltaBytes / fullBytes);
+
+        delete []payload;
+        scs.stop();
+    }
+
+static void screencastMakeFrames(TScreencastFrameMaker maker, std::vector<BYTE> &frames)
+    {
+        frames.resize(SCTEST_FRAMES * (SCREEN_BYTES + PALETTE_BYTES));
+
+        for(int f=0; f<SCTEST_FRAMES; f++) {
+            BYTE *screen = &frames[f * (SCREEN_BYTES + PALETTE_BYTES)];
+            maker(f, screen, screen + SCREEN_BYTES);
+        }
+    }
+
+TEST(screencastSlow, deltaFramesMatchFullFrames)
+    {
+        std::vector<BYTE> frames;
+
+        screencastMakeFrames(screencastDesktopFrame, frames);
+        screencastCompareTransfers("desktop", frames, SCTEST_FRAMES);
+
+        screencastMakeFrames(screencastGameFrame, frames);
+        screencastCompareTransfers("game", frames, SCTEST_FRAMES);
+
+        const char *path = getenv("SCREENCAST_FRAMES_FILE");
+        if(!path) {
+            printf("screencast: set SCREENCAST_FRAMES_FILE to compare on recorded frames\n");
+            return;
+        }
+
+        FILE *f = fopen(path, "rb");
+        ASSERT_TRUE(f != NULL);
+        frames.assign(SCTEST_FRAMES * 10 * (SCREEN_BYTES + PALETTE_BYTES), 0);
+        int frameCount = fread(&frames[0], SCREEN_BYTES + PALETTE_BYTES, SCTEST_FRAMES * 10, f);
+        fclose(f);
+
+        ASSERT_GT(frameCount, 0);
+        screencastCompareTransfers(path, frames, frameCount);
+    }
+
+TEST(screencast, lostDeltaAsksForKeyframe)
+    {
+        ScreencastService scs;
+        scs.start();
+
+        FakeDataTrans dt;
+        ScreencastAcsiCommand sac(&dt, &scs);
+        ScreencastDeltaEncoder encoder;
+
+        BYTE *payload = new BYTE[SCDELTA_MAX_PAYLOAD];
+        BYTE screen[SCREEN_BYTES], palette[PALETTE_BYTES], got[SCREEN_BYTES];
+
+        screencastDesktopFrame(0, screen, palette);                     // delta before any keyframe
+        encoder.encode(screen, palette, payload);
+        screencastDesktopFrame(1, screen, palette);
+        int len = encoder.encode(screen, palette, payload);
+        ASSERT_EQ(SCDELTA_TYPE_DELTA, payload[0]);
+        EXPECT_EQ((BYTE) E_CHNG, screencastCommand(sac, dt, TRAN_CMD_SENDSCREENCAST_DELTA, payload, len));
+
+        encoder.reset();                                                // ST reacts with keyframe
+        len = encoder.encode(screen, palette, payload);
+        ASSERT_EQ(SCDELTA_TYPE_KEYFRAME, payload[0]);
+        EXPECT_EQ(RW_ALL_TRANSFERED, screencastCommand(sac, dt, TRAN_CMD_SENDSCREENCAST_DELTA, payload, len));
+
+        screencastDesktopFrame(2, screen, palette);                     // this one gets lost
+        encoder.encode(screen, palette, payload);
+
+        screencastDesktopFrame(3, screen, palette);
+        len = encoder.encode(screen, palette, payload);
+        EXPECT_EQ((BYTE) E_CHNG, screencastCommand(sac, dt, TRAN_CMD_SENDSCREENCAST_DELTA, payload, len));
+
+        scs.getScreen(got);                                             // still shows the last good frame
+        screencastDesktopFrame(1, screen, palette);
+        EXPECT_EQ(0, memcmp(got, screen, SCREEN_BYTES));
+
+        payload[0] = SCDELTA_TYPE_DELTA;                                // next frame after the good one, but run past the end of screen
+        payload[1] = 0;
+        Utils::storeWord(payload + 2, 4);
+        Utils::storeWord(payload + 4, SCREEN_WORDS);
+        Utils::storeWord(payload + 6, 1);
+        EXPECT_EQ((BYTE) EBADRQ, screencastCommand(sac, dt, TRAN_CMD_SENDSCREENCAST_DELTA, payload, 10));
+
+        delete []payload;
+        scs.stop();
+    }
+
+//--------------------------------------------------------
+// screencast frames - one writer (ACSI thread), several readers (web clients), no locks between them
+
+#define SCTEST_PUBLISH_FRAMES   2000
+#define SCTEST_READERS          4
+
+typedef struct {
+    ScreencastService   *scs;
+    bool                waitForFrames;                                  // true: waitForFrame() and measure latency, false: poll as fast as possible
+    volatile bool       shouldStop;
+    pthread_t           thread;
+
+    DWORD               framesSeen;
+    DWORD               tornFrames;
+    DWORD               seqWentBack;
+    DWORD               latencySumUs;
+    DWORD               latencyMaxUs;
+} TScreencastReader;
+
+static bool screencastFrameIsWhole(const TScreencastFrame *frame)      // writer puts frame number into first 4 bytes and its low byte everywhere else
+    {
+        DWORD n = Utils::getDword((BYTE *) frame->screen);
+        BYTE  b = (BYTE) n;
+
+        for(int i=4; i<32000; i++) {
+            if(frame->screen[i] != b) {
+                return false;
+            }
+        }
+
+        for(int i=0; i<32; i++) {
+            if(frame->palette[i] != (BYTE) (n * 7)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+static void *screencastReaderCode(void *ptr)
+    {
+        TScreencastReader *r = (TScreencastReader *) ptr;
+        DWORD lastSeq = 0;
+
+        while(!r->shouldStop) {
+            if(r->waitForFrames && r->scs->waitForFrame(lastSeq, 100) == lastSeq) {
+                continue;                                               // timeout
+            }
+
+            const TScreencastFrame *frame = r->scs->acquireFrame();
+
+            if(frame->seq != lastSeq) {
+                if(r->waitForFrames) {
+                    DWORD latencyUs = Utils::getCurrentUs() - frame->publishedUs;
+                    r->latencySumUs += latencyUs;
+                    r->latencyMaxUs  = std::max(r->latencyMaxUs, latencyUs);
+                }
+
+                if(frame->seq < lastSeq) {
+                    r->seqWentBack++;
+                }
+
+                if(frame->seq != 0 && !screencastFrameIsWhole(frame)) {
+                    r->tornFrames++;
+                }
+
+                r->framesSeen++;
+                lastSeq = frame->seq;
+            }
+
+            r->scs->releaseFrame(frame);
+        }
+
+        return NULL;
+    }
+
+TEST(screencastFramesSlow, readersNeverSeeTornFrames)
+    {
+        ScreencastService scs;
+        scs.start();
+
+        TScreencastReader readers[SCTEST_READERS];
+
+        for(int i=0; i<SCTEST_READERS; i++) {
+            memset(&readers[i], 0, sizeof(TScreencastReader));
+            readers[i].scs           = &scs;
+            readers[i].waitForFrames = (i % 2) == 0;
+            pthread_create(&readers[i].thread, NULL, screencastReaderCode, &readers[i]);
+        }
+
+        BYTE screen[32000], palette[32];
+        DWORD writerMaxUs = 0, writerSumUs = 0;
+
+        for(DWORD n=1; n<=SCTEST_PUBLISH_FRAMES; n++) {
+            memset(screen, (BYTE) n, 32000);
+            Utils::storeDword(screen, n);
+            memset(palette, (BYTE) (n * 7), 32);
+
+            DWORD start = Utils::getCurrentUs();
+            scs.setFrame(screen, palette);
+            DWORD took = Utils::getCurrentUs() - start;
+
+            writerSumUs += took;
+            writerMaxUs  = std::max(writerMaxUs, took);
+
+            if((n % 4) == 0) {
+                usleep(500);                                            // let the readers run, ST sends frames in intervals too
+            }
+        }
+
+        usleep(200000);                                                 // readers pick up the last frame
+
+        DWORD waitedFrames = 0, latencySumUs = 0, latencyMaxUs = 0;
+
+        for(int i=0; i<SCTEST_READERS; i++) {
+            readers[i].shouldStop = true;
+            pthread_join(readers[i].thread, NULL);
+
+            EXPECT_EQ(0u, readers[i].tornFrames)   << "reader " << i;
+            EXPECT_EQ(0u, readers[i].seqWentBack)  << "reader " << i;
+            EXPECT_GT(readers[i].framesSeen, 0u)   << "reader " << i;
+
+            if(readers[i].waitForFrames) {
+                waitedFrames += readers[i].framesSeen;
+                latencySumUs += readers[i].latencySumUs;
+                latencyMaxUs  = std::max(latencyMaxUs, readers[i].latencyMaxUs);
+            }
+        }
+
+        TScreencastStats st;
+        scs.getStats(st);
+        EXPECT_EQ((DWORD) SCTEST_PUBLISH_FRAMES, st.published);        // readers hold at most SCTEST_READERS slots, there's always a free one
+        EXPECT_EQ(0u, st.dropped);
+        EXPECT_EQ((DWORD) SCTEST_PUBLISH_FRAMES, scs.getFrameSeq());
+
+        BYTE got[32000];                                                // the old copying interface still works
+        scs.getScreen(got);
+        EXPECT_EQ((DWORD) SCTEST_PUBLISH_FRAMES, Utils::getDword(got));
+
+        printf("screencastFrames: %d frames, writer avg %u us max %u us; waiting readers saw %u frames, publish to reader avg %u us max %u us\n",
+            SCTEST_PUBLISH_FRAMES, writerSumUs / SCTEST_PUBLISH_FRAMES, writerMaxUs,
+            waitedFrames, waitedFrames ? latencySumUs / waitedFrames : 0, latencyMaxUs);
+        for(int i=0; i<SCTEST_READERS; i++) {
+            printf("screencastFrames: reader %d (%s) saw %u frames\n", i, readers[i].waitForFrames ? "waiting" : "polling", readers[i].framesSeen);
+        }
+
+        scs.stop();
+    }
+
+TEST(screencastFrames, samePaletteIsNotPublishedAgain)
+    {
+        ScreencastService scs;
+        scs.start();
+
+        BYTE screen[32000], palette[32];
+        memset(screen,  0x11, sizeof(screen));
+        memset(palette, 0x22, sizeof(palette));
+
+        scs.setScreen(screen);                                          // old client: screen, then palette - every time
+        scs.setPalette(palette);
+        EXPECT_EQ(2u, scs.getFrameSeq());
+
+        scs.setScreen(screen);
+        scs.setPalette(palette);
+        EXPECT_EQ(3u, scs.getFrameSeq());
+
+        EXPECT_EQ(3u, scs.waitForFrame(2, 1000));                       // newer one is there, no waiting
+        DWORD start = Utils::getCurrentMs();
+        EXPECT_EQ(3u, scs.waitForFrame(3, 50));                         // nothing new, times out
+        EXPECT_GE(Utils::getCurrentMs() - start, 40u);
+
+        const TScreencastFrame *frame = scs.acquireFrame();
+        EXPECT_EQ(0, memcmp(frame->palette, palette, 32));
+        EXPECT_EQ(0, memcmp(frame->screen,  screen,  32000));
+        scs.releaseFrame(frame);
+
+        scs.stop();
+    }
+
+//--------------------------------------------------------
+// screencast over WebSocket - the stream runs on a loopback socket, the test is the browser
+
+#define SCSTREAM_TEST_FRAMES        75
+#define SCSTREAM_TEST_INTERVAL_MS   40                                  // ST sends 25 frames per second
+#define SCSTREAM_TEST_SOCKBUF       32768                               // socket buffers on both sides, like on a real network path
+
+class FdWebSocketConn: public IWebSocketConn
+{
+public:
+    FdWebSocketConn(int fd):fd(fd) { }
+
+    virtual int write(const void *bfr, int len) {
+        int sent = 0;
+        while(sent < len) {
+            int res = send(fd, (const char *) bfr + sent, len - sent, MSG_NOSIGNAL);
+            if(res <= 0) {
+                return res;
+            }
+            sent += res;
+        }
+        return sent;
+    }
+
+    virtual int read(void *bfr, int len) {
+        return recv(fd, bfr, len, 0);
+    }
+
+private:
+    int fd;
+};
+
+typedef struct {
+    ScreencastService       *scs;
+    int                     listenFd;
+    int                     maxFps;
+    TScreencastStreamStats  stats;
+    volatile bool           done;
+    pthread_t               thread;
+} TScreencastStreamServer;
+
+static void *screencastStreamServerCode(void *ptr)                     // what civetweb worker + ScreencastController::streamAction() do
+    {
+        TScreencastStreamServer *srv = (TScreencastStreamServer *) ptr;
+        int fd = accept(srv->listenFd, NULL, NULL);
+
+        int bufSize = SCSTREAM_TEST_SOCKBUF;                            // loopback buffers would hide a slow client for many frames
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+
+        std::string request;
+        char c;
+        while(request.find("\r\n\r\n") == std::string::npos && recv(fd, &c, 1, 0) == 1) {
+            request += c;
+        }
+
+        size_t keyPos = request.find("Sec-WebSocket-Key: ");
+        if(keyPos != std::string::npos) {
+            std::string key = request.substr(keyPos + 19, request.find("\r\n", keyPos) - keyPos - 19);
+
+            FdWebSocketConn conn(fd);
+            WebSocket::writeHandshake(conn, key.c_str());
+
+            ScreencastStream stream(srv->scs, &conn, srv->maxFps);
+            stream.run();
+            stream.getStats(srv->stats);
+        }
+
+        close(fd);
+        srv->done = true;
+        return NULL;
+    }
+
+typedef struct {
+    ScreencastService       *scs;
+    std::vector<BYTE>       *frames;
+    pthread_t               thread;
+} TScreencastPublisher;
+
+static void *screencastPublisherCode(void *ptr)                        // the ACSI side
+    {
+        TScreencastPublisher *pub = (TScreencastPublisher *) ptr;
+        int count = pub->frames->size() / (SCREEN_BYTES + PALETTE_BYTES);
+
+        for(int f=0; f<count; f++) {
+            BYTE *screen = &(*pub->frames)[f * (SCREEN_BYTES + PALETTE_BYTES)];
+            pub->scs->setFrame(screen, screen + SCREEN_BYTES);
+            Utils::sleepMs(SCSTREAM_TEST_INTERVAL_MS);
+        }
+
+        return NULL;
+    }
+
+static void screencastStreamFootage(const char *name, TScreencastFrameMaker maker, int showDelayMs)
+    {
+        std::vector<BYTE> frames(SCSTREAM_TEST_FRAMES * (SCREEN_BYTES + PALETTE_BYTES));
+        for(int f=0; f<SCSTREAM_TEST_FRAMES; f++) {
+            BYTE *screen = &frames[f * (SCREEN_BYTES + PALETTE_BYTES)];
+            maker(f, screen, screen + SCREEN_BYTES);
+        }
+
+        ScreencastService scs;
+        scs.start();
+        scs.setFrame(&frames[0], &frames[SCREEN_BYTES]);
+
+        TScreencastStreamServer srv;
+        memset(&srv, 0, sizeof(srv));
+        srv.scs      = &scs;
+        srv.maxFps   = SCSTREAM_MAX_FPS;
+        srv.listenFd = socket(AF_INET, SOCK_STREAM, 0);
+
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ASSERT_EQ(0, bind(srv.listenFd, (struct sockaddr *) &addr, sizeof(addr)));
+        ASSERT_EQ(0, listen(srv.listenFd, 1));
+        getsockname(srv.listenFd, (struct sockaddr *) &addr, &addrLen);
+        pthread_create(&srv.thread, NULL, screencastStreamServerCode, &srv);
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int bufSize = SCSTREAM_TEST_SOCKBUF;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(bufSize));
+        ASSERT_EQ(0, connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+
+        const char *request = "GET /app/screencast/stream HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+        send(fd, request, strlen(request), 0);
+
+        std::string response;
+        char c;
+        while(response.find("\r\n\r\n") == std::string::npos && recv(fd, &c, 1, 0) == 1) {
+            response += c;
+        }
+        EXPECT_EQ(0u, response.find("HTTP/1.1 101"));
+        EXPECT_NE(std::string::npos, response.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"));
+
+        TScreencastPublisher pub;
+        pub.scs    = &scs;
+        pub.frames = &frames;
+        pthread_create(&pub.thread, NULL, screencastPublisherCode, &pub);
+
+        FdWebSocketConn conn(fd);
+        ScreencastDeltaDecoder decoder;
+        std::vector<BYTE> msg;
+        BYTE *raw = new BYTE[1 + SCDELTA_MAX_PAYLOAD];
+
+        int   matched = -1, received = 0, notMatching = 0;
+        DWORD startMs = Utils::getCurrentMs();
+
+        while(matched < SCSTREAM_TEST_FRAMES - 1 && Utils::getCurrentMs() - startMs < 10000) {
+            int opcode = WebSocket::readMessage(conn, msg, 128 * 1024);      // our frames are much bigger than what server accepts
+            ASSERT_EQ(WS_OPCODE_BINARY, opcode);
+
+            uLongf rawLen = 1 + SCDELTA_MAX_PAYLOAD;
+            ASSERT_EQ(Z_OK, uncompress(raw, &rawLen, &msg[0], msg.size()));
+            ASSERT_EQ(SCDELTA_OK, decoder.apply(raw + 1, rawLen - 1));
+            received++;
+
+            int f;                                                      // which published frame is this? they come in order, some skipped
+            for(f=std::max(matched, 0); f<SCSTREAM_TEST_FRAMES; f++) {
+                const BYTE *screen = &frames[f * (SCREEN_BYTES + PALETTE_BYTES)];
+                if(memcmp(decoder.getScreen(), screen, SCREEN_BYTES) == 0 && memcmp(decoder.getPalette(), screen + SCREEN_BYTES, PALETTE_BYTES) == 0) {
+                    break;
+                }
+            }
+
+            if(f < SCSTREAM_TEST_FRAMES) {
+                matched = f;
+            } else {
+                notMatching++;
+            }
+
+            if(showDelayMs > 0) {                                       // slow client - takes a while to show the frame
+                Utils::sleepMs(showDelayMs);
+            }
+        }
+        DWORD durationMs = Utils::getCurrentMs() - startMs;
+
+        pthread_join(pub.thread, NULL);
+        close(fd);
+
+        for(int f=0; !srv.done && f<100; f++) {                        // server finds out the client is gone on the next write
+            BYTE *screen = &frames[(f % SCSTREAM_TEST_FRAMES) * (SCREEN_BYTES + PALETTE_BYTES)];
+            scs.setFrame(screen, screen + SCREEN_BYTES);
+            Utils::sleepMs(SCSTREAM_TEST_INTERVAL_MS);
+        }
+        pthread_join(srv.thread, NULL);
+        close(srv.listenFd);
+
+        EXPECT_EQ(SCSTREAM_TEST_FRAMES - 1, matched) << name;          // the last frame always gets there
+        EXPECT_EQ(0, notMatching) << name;
+        EXPECT_LE((DWORD) received, srv.stats.framesSent) << name;     // the last ones went to the closed socket
+
+        printf("screencastStream %-12s: %d frames published, %d received (%d skipped), %u keyframes, %u B/frame raw, %u B/frame on wire, %u B/s\n",
+            name, SCSTREAM_TEST_FRAMES, received, srv.stats.framesSkipped, srv.stats.keyframes,
+            srv.stats.rawBytes / std::max(received, 1), srv.stats.bytesSent / std::max(received, 1),
+            (DWORD) (((unsigned long long) srv.stats.bytesSent * 1000) / std::max(durationMs, (DWORD) 1)));
+
+        delete []raw;
+        scs.stop();
+    }
+
+TEST(webSocket, handshakeKeyAndSha1)
+    {
+        BYTE digest[20];
+        WebSocket::sha1((const BYTE *) "abc", 3, digest);
+        EXPECT_EQ("qZk+NkcGgWq6PiVxeFDCbJzQ2J0=", WebSocket::base64(digest, 20));
+
+        EXPECT_EQ("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", WebSocket::acceptKey("dGhlIHNhbXBsZSBub25jZQ=="));   // example from RFC 6455
+    }
+
+TEST(screencastStreamSlow, localClientRebuildsFrames)
+    {
+        screencastStreamFootage("desktop",      screencastDesktopFrame, 0);
+        screencastStreamFootage("game",         screencastGameFrame,    0);
+        screencastStreamFootage("game, slow",   screencastGameFrame,    150);  // client shows ~6 fps, gets fewer frames instead of a backlog
+    }
+
+TEST(screencastStreamSlow, clientsAreLimited)
+    {
+        for(int i=0; i<SCSTREAM_MAX_CLIENTS; i++) {
+            EXPECT_TRUE(ScreencastStream::addClient());
+        }
+        EXPECT_FALSE(ScreencastStream::addClient());                   // would hold one more civetweb worker
+
+        ScreencastStream::removeClient();
+        EXPECT_TRUE(ScreencastStream::addClient());
+
+        for(int i=0; i<SCSTREAM_MAX_CLIENTS; i++) {
+            ScreencastStream::removeClient();
+        }
+    }
+
+//--------------------------------------------------------
+// screencast image - planar to RGB and PNG on the CE side, once per frame for all the clients
+
+#define SCIMAGE_BENCH_ROUNDS    50
+
+static void screencastSetPixel(BYTE *screen, int planes, int x, int y, int color)    // ST planar: 16 pixels in 'planes' words
+    {
+        int lineBytes = planes == 4 ? 160 : (planes == 2 ? 160 : 80);
+        BYTE *group   = screen + y * lineBytes + (x / 16) * planes * 2;
+        WORD bit      = 0x8000 >> (x % 16);
+
+        for(int p=0; p<planes; p++) {
+            WORD w = Utils::getWord(group + p * 2);
+            w = (color & (1 << p)) ? (w | bit) : (w & ~bit);
+            Utils::storeWord(group + p * 2, w);
+        }
+    }
+
+static void screencastCheckPng(const std::vector<BYTE> &png, const BYTE *rgb, int width, int height)
+    {
+        static const BYTE signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        ASSERT_GT(png.size(), 8u);
+        ASSERT_EQ(0, memcmp(&png[0], signature, 8));
+
+        std::vector<BYTE> idat;
+        size_t pos = 8;
+
+        while(pos + 12 <= png.size()) {
+            DWORD len = Utils::getDword((BYTE *) &png[pos]);
+            std::string type((const char *) &png[pos + 4], 4);
+            ASSERT_LE(pos + 12 + len, png.size());
+
+            DWORD crc = crc32(0, &png[pos + 4], 4 + len);
+            EXPECT_EQ(crc, Utils::getDword((BYTE *) &png[pos + 8 + len])) << type;
+
+            if(type == "IHDR") {
+                EXPECT_EQ((DWORD) width,  Utils::getDword((BYTE *) &png[pos + 8]));
+                EXPECT_EQ((DWORD) height, Utils::getDword((BYTE *) &png[pos + 12]));
+            } else if(type == "IDAT") {
+                idat.insert(idat.end(), png.begin() + pos + 8, png.begin() + pos + 8 + len);
+            }
+
+            pos += 12 + len;
+        }
+        EXPECT_EQ(png.size(), pos);
+
+        std::vector<BYTE> raw(height * (1 + width * 3));
+        uLongf rawLen = raw.size();
+        ASSERT_EQ(Z_OK, uncompress(&raw[0], &rawLen, &idat[0], idat.size()));
+        ASSERT_EQ(raw.size(), rawLen);
+
+        for(int y=0; y<height; y++) {
+            ASSERT_EQ(0, raw[y * (1 + width * 3)]);
+            ASSERT_EQ(0, memcmp(&raw[y * (1 + width * 3) + 1], rgb + y * width * 3, width * 3)) << "line " << y;
+        }
+    }
+
+TEST(screencastImage, planarFramesBecomeRgbAndPng)
+    {
+        TScreencastFrame *frame = new TScreencastFrame;
+        BYTE *rgb = new BYTE[SCIMAGE_RGB_SIZE];
+        int width, height;
+
+        // low res - 16 colors, pixel x has color x % 16
+        memset(frame, 0, sizeof(TScreencastFrame));
+        frame->resolution = 0;
+        for(int i=0; i<16; i++) {
+            Utils::storeWord(frame->palette + i * 2, (i & 7) << 8 | (7 - (i & 7)) << 4 | (i >> 3) * 0x0f);  // STE bit on colors 8..15
+        }
+        for(int x=0; x<320; x++) {
+            screencastSetPixel(frame->screen, 4, x, 5, x % 16);
+        }
+
+        ScreencastImage::toRgb(frame, rgb, width, height);
+        EXPECT_EQ(320, width);
+        EXPECT_EQ(200, height);
+        for(int x=0; x<320; x++) {
+            int i = x % 16;
+            BYTE *px = rgb + (5 * 320 + x) * 3;
+            EXPECT_EQ(((i & 7) << 1) * 17,       px[0]) << x;
+            EXPECT_EQ(((7 - (i & 7)) << 1) * 17, px[1]) << x;
+            EXPECT_EQ((i >> 3) ? 0xff : 0,       px[2]) << x;      // 0xf is 0x7 with STE bit - full brightness
+        }
+        EXPECT_EQ(0, rgb[0]);                                           // line 0 is color 0, black
+
+        std::vector<BYTE> png;
+        ScreencastImage::encodePng(rgb, width, height, png);
+        screencastCheckPng(png, rgb, width, height);
+
+        // medium res - 4 colors, lines doubled
+        memset(frame->screen, 0, 32000);
+        frame->resolution = 1;
+        for(int x=0; x<640; x++) {
+            screencastSetPixel(frame->screen, 2, x, 199, x % 4);
+        }
+        ScreencastImage::toRgb(frame, rgb, width, height);
+        EXPECT_EQ(640, width);
+        EXPECT_EQ(400, height);
+        EXPECT_EQ(0, memcmp(rgb + 398 * 640 * 3, rgb + 399 * 640 * 3, 640 * 3));
+        EXPECT_EQ(((3 & 7) << 1) * 17, rgb[(398 * 640 + 3) * 3]);
+
+        // high res - mono, bit set is black
+        memset(frame->screen, 0, 32000);
+        frame->resolution = 2;
+        Utils::storeWord(frame->palette, 0xffff);
+        Utils::storeWord(frame->palette + 2, 0);
+        screencastSetPixel(frame->screen, 1, 639, 399, 1);
+        ScreencastImage::toRgb(frame, rgb, width, height);
+        EXPECT_EQ(640, width);
+        EXPECT_EQ(400, height);
+        EXPECT_EQ(0xff, rgb[(399 * 640 + 638) * 3]);
+        EXPECT_EQ(0x00, rgb[(399 * 640 + 639) * 3]);
+
+        ScreencastImage::encodePng(rgb, width, height, png);
+        screencastCheckPng(png, rgb, width, height);
+
+        // service converts once per frame, no matter how many clients ask
+        ScreencastService scs;
+        scs.start();
+
+        BYTE screen[32000], palette[32];
+        screencastDesktopFrame(10, screen, palette);
+        scs.setFrame(screen, palette);
+
+        std::vector<BYTE> png1, png2;
+        EXPECT_EQ(scs.getFrameSeq(), scs.getPng(png1));
+        EXPECT_EQ(scs.getFrameSeq(), scs.getPng(png2));
+        EXPECT_TRUE(png1 == png2);
+
+        TScreencastStats st;
+        scs.getStats(st);
+        EXPECT_EQ(1u, st.imagesEncoded);
+
+        screencastDesktopFrame(11, screen, palette);
+        scs.setFrame(screen, palette);
+        scs.getPng(png2);
+        scs.getStats(st);
+        EXPECT_EQ(2u, st.imagesEncoded);
+        EXPECT_FALSE(png1 == png2);
+
+        scs.stop();
+        delete []rgb;
+        delete frame;
+    }
+
+TEST(screencastImageSlow, benchmarkConversionAndEncoding)
+    {
+        TScreencastFrame *frame = new TScreencastFrame;
+        BYTE *rgb = new BYTE[SCIMAGE_RGB_SIZE];
+        memset(frame, 0, sizeof(TScreencastFrame));
+
+        struct {
+            const char              *name;
+            TScreencastFrameMaker   maker;
+            int                     resolution;
+        } cases[] = {
+            { "low, desktop",       screencastDesktopFrame, 0 },
+            { "low, game",          screencastGameFrame,    0 },
+            { "medium, desktop",    screencastDesktopFrame, 1 },
+            { "high, desktop",      screencastDesktopFrame, 2 },
+        };
+
+        for(size_t c=0; c<sizeof(cases) / sizeof(cases[0]); c++) {
+            cases[c].maker(120, frame->screen, frame->palette);
+            frame->resolution = cases[c].resolution;
+
+            int width = 0, height = 0;
+            DWORD start = Utils::getCurrentUs();
+            for(int r=0; r<SCIMAGE_BENCH_ROUNDS; r++) {
+                ScreencastImage::toRgb(frame, rgb, width, height);
+            }
+            DWORD convertUs = (Utils::getCurrentUs() - start) / SCIMAGE_BENCH_ROUNDS;
+
+            int levels[2] = { SCIMAGE_ZLIB_LEVEL, 6 };
+            for(int l=0; l<2; l++) {
+                std::vector<BYTE> png;
+                start = Utils::getCurrentUs();
+                for(int r=0; r<SCIMAGE_BENCH_ROUNDS / 5; r++) {
+                    ScreencastImage::encodePng(rgb, width, height, png, levels[l]);
+                }
+                DWORD encodeUs = (Utils::getCurrentUs() - start) / (SCIMAGE_BENCH_ROUNDS / 5);
+
+                printf("screencastImage %-16s %dx%d: planar to RGB %5u us, PNG (zlib %d) %6u us, %6d bytes\n",
+                    cases[c].name, width, height, convertUs, levels[l], encodeUs, (int) png.size());
+            }
+        }
+
+        delete []rgb;
+        delete frame;
+    }
 
 int main(int argc, char *argv[])
 {
@@ -239,6 +4958,13 @@ int main(int argc, char *argv[])
 
     ::testing::InitGoogleTest(&argc, argv);
     ::testing::InitGoogleMock(&argc, argv);
+
+    if(flags.slowTests) {                                       // tests with threads, sockets, timing and benchmarks - only on request
+        ::testing::GTEST_FLAG(filter) = "*Slow.*";
+        return RUN_ALL_TESTS();
+    }
+
+    ::testing::GTEST_FLAG(filter) = "-*Slow.*";                 // on start just the quick ones
     RUN_ALL_TESTS();
 
     //------------------------------------
@@ -251,6 +4977,8 @@ int main(int argc, char *argv[])
         if(signal(SIGHUP, sigint_handler) == SIG_ERR) {         // register SIGHUP handler
             printf("Cannot register SIGHUP handler!\n");
         }
+
+        Trace::installCrashHandler();                           // on crash dump the trace ring to TRACE_CRASH_FILE
     }
 
     //------------------------------------
@@ -495,6 +5223,7 @@ void initializeFlags(void)
     flags.ikbdLogs     = false;         // no ikbd logs by default
     flags.fakeOldApp   = false;         // don't fake old app by default
     flags.display      = false;         // if set to true, show string on front display, if possible
+    flags.slowTests    = false;         // slow tests only on request
 
     flags.gotHansFwVersion  = false;
     flags.gotFranzFwVersion = false;
@@ -638,6 +5367,12 @@ void parseCmdLineArguments(int argc, char *argv[])
             flags.display       = true;
         }
 
+        // run the slow tests and benchmarks, then quit
+        if(strcmp(argv[i], "slowtests") == 0) {
+            isKnownTag          = true;                             // this is a known tag
+            flags.slowTests     = true;
+        }
+
         if(!isKnownTag) {                                           // if tag unknown, show warning
             printf(">>> UNKNOWN APP ARGUMENT: '%s' <<<\n", argv[i]);
         }
@@ -656,6 +5391,7 @@ void printfPossibleCmdLineArgs(void)
     printf("ikbdlogs - write IKBD logs to /var/log/ikbdlog.txt\n");
     printf("fakeold  - fake old app version for reinstall tests\n");
     printf("display  - show string on front display, if possible\n");
+    printf("slowtests - run the slow tests and benchmarks, then quit\n");
 }
 
 void handlePthreadCreate(int res, const char *threadName, pthread_t *pThread)
@@ -670,11 +5406,13 @@ void handlePthreadCreate(int res, const char *threadName, pthread_t *pThread)
 
 void sigint_handler(int sig)
 {
-    Debug::out(LOG_DEBUG, "Some SIGNAL received, terminating.");
+    Debug::outSignal(LOG_DEBUG, "Some SIGNAL received, terminating.");    // Debug::out() could wait for the thread this signal interrupted
     sigintReceived = 1;
 
     if(childPid != 0) {             // in case we fork()ed, kill the child
-        Debug::out(LOG_DEBUG, "Killing child with pid %d\n", childPid);
+        char text[64];
+        snprintf(text, sizeof(text), "Killing child with pid %d", childPid);
+        Debug::outSignal(LOG_DEBUG, text);
         kill(childPid, SIGKILL);
     }
 }
@@ -0,0 +1,108 @@
+// vim: shiftwidth=4 tabstop=4 softtabstop=4 expandtab
+#include "../debug.h"
+
+#include "bufferpool.h"
+
+pthread_mutex_t     BufferPool::mutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<BYTE *> BufferPool::freeBuffers[BUFFERPOOL_CLASSES];
+DWORD               BufferPool::bytesAllocated  = 0;
+DWORD               BufferPool::bytesPeak       = 0;
+
+int BufferPool::sizeToClass(DWORD size)
+{
+    for(int i=0; i<BUFFERPOOL_CLASSES; i++) {
+        if(size == (DWORD) (BUFFERPOOL_MIN_SIZE << i)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+BYTE *BufferPool::get(DWORD size)
+{
+    int sizeClass = sizeToClass(size);
+
+    if(sizeClass < 0) {
+        Debug::out(LOG_ERROR, "BufferPool::get() - invalid size %d", size);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    BYTE *bfr;
+    if(!freeBuffers[sizeClass].empty()) {           // got returned buffer of this size? reuse it
+        bfr = freeBuffers[sizeClass].back();
+        freeBuffers[sizeClass].pop_back();
+    } else {                                        // allocate new one
+        bfr = new BYTE[size];
+        bytesAllocated += size;
+
+        if(bytesAllocated > bytesPeak) {
+            bytesPeak = bytesAllocated;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+    return bfr;
+}
+
+void BufferPool::put(BYTE *bfr, DWORD size)
+{
+    int sizeClass = sizeToClass(size);
+
+    if(bfr == NULL || sizeClass < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    if(freeBuffers[sizeClass].size() < BUFFERPOOL_KEEP_FREE) {  // keep it for the next connection
+        freeBuffers[sizeClass].push_back(bfr);
+    } else {                                                    // got enough of free buffers, free this one
+        delete []bfr;
+        bytesAllocated -= size;
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+DWORD BufferPool::getBytesAllocated(void)
+{
+    pthread_mutex_lock(&mutex);
+    DWORD bytes = bytesAllocated;
+    pthread_mutex_unlock(&mutex);
+
+    return bytes;
+}
+
+DWORD BufferPool::getBytesPeak(void)
+{
+    pthread_mutex_lock(&mutex);
+    DWORD bytes = bytesPeak;
+    pthread_mutex_unlock(&mutex);
+
+    return bytes;
+}
+
+void BufferPool::resetPeak(void)
+{
+    pthread_mutex_lock(&mutex);
+    bytesPeak = bytesAllocated;
+    pthread_mutex_unlock(&mutex);
+}
+
+void BufferPool::freeUnused(void)
+{
+    pthread_mutex_lock(&mutex);
+
+    for(int i=0; i<BUFFERPOOL_CLASSES; i++) {
+        for(size_t j=0; j<freeBuffers[i].size(); j++) {
+            delete []freeBuffers[i][j];
+            bytesAllocated -= (BUFFERPOOL_MIN_SIZE << i);
+        }
+        freeBuffers[i].clear();
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,38 @@
+// vim: tabstop=4 softtabstop=4 shiftwidth=4 expandtab
+#ifndef _BUFFERPOOL_H_
+#define _BUFFERPOOL_H_
+
+#include <pthread.h>
+#include <vector>
+
+#include "../datatypes.h"
+
+#define BUFFERPOOL_MIN_SIZE     (16 * 1024)         // smallest buffer, all sizes are this times power of 2
+#define BUFFERPOOL_CLASSES      5                   // 16, 32, 64, 128 and 256 kB
+#define BUFFERPOOL_MAX_SIZE     (BUFFERPOOL_MIN_SIZE << (BUFFERPOOL_CLASSES - 1))
+#define BUFFERPOOL_KEEP_FREE    4                   // how many free buffers of each size are kept for reuse, the others are freed
+
+// Buffers for connections, shared by all the connections. Connection gets the buffer when it needs it,
+// a bigger one when it needs more space, and returns it when it's closed - so idle and closed connections
+// don't hold any memory, and a few returned buffers are kept for the next connections.
+class BufferPool
+{
+public:
+    static BYTE *get(DWORD size);                   // size must be one of the sizes above
+    static void  put(BYTE *bfr, DWORD size);
+
+    static DWORD getBytesAllocated  (void);         // buffers in use and free buffers kept for reuse
+    static DWORD getBytesPeak       (void);         // highest getBytesAllocated() since resetPeak()
+    static void  resetPeak          (void);
+    static void  freeUnused         (void);         // free all the buffers kept for reuse
+
+private:
+    static int   sizeToClass(DWORD size);
+
+    static pthread_mutex_t      mutex;
+    static std::vector<BYTE *>  freeBuffers[BUFFERPOOL_CLASSES];
+    static DWORD                bytesAllocated;
+    static DWORD                bytesPeak;
+};
+
+#endif
@@ -28,92 +28,98 @@
 
 extern   DWORD localIp;
 
-IcmpWrapper::IcmpWrapper(void)
+IcmpWrapper::IcmpWrapper(void) : batch(ICMP_RECV_SLOT)
 {
-    recvBfr = new BYTE[RECV_BFR_SIZE];
     rawSock = new TNetConnection();
+    clearQueue();
 }
 
 IcmpWrapper::~IcmpWrapper(void)
 {
-    delete []recvBfr;
     delete rawSock;
 }
 
 void IcmpWrapper::closeAndClean(void)
 {
     rawSock->closeIt();                         // close raw / icmp socket
-    
-    for(int i=0; i<MAX_STING_DGRAMS; i++) {     // clear received icmp dgrams
-        dgrams[i].clear();
+    clearQueue();                               // clear received icmp dgrams
+}
+
+void IcmpWrapper::clearQueue(void)
+{
+    for(int i=0; i<MAX_STING_DGRAMS; i++) {     // all dgrams are empty and free
+        dgrams[i].count = 0;
+        freeSlots[i]    = i;
     }
+
+    freeCount       = MAX_STING_DGRAMS;
+    queueHead       = 0;
+    queueCount      = 0;
+    icmpDataCount   = 0;
+}
+
+int IcmpWrapper::getFd(void)
+{
+    return rawSock->fd;
 }
 
 void IcmpWrapper::clearOld(void) 
 {
     DWORD now = Utils::getCurrentMs();
-    
-    for(int i=0; i<MAX_STING_DGRAMS; i++) {     // find non-empty slot, and if it's old, clear it
-        if(dgrams[i].isEmpty()) {               // found empty? skip it
-            continue;
-        }
-        
-        DWORD diff = now - dgrams[i].time;      // calculate how old is this dgram
-        if(diff < 10000) {                      // dgram is younger than 10 seconds? skip it
-            continue;
+
+    while(queueCount > 0) {                     // queue is sorted by time, so just look at the oldest ones
+        TStingDgram *d = getOldest();
+
+        DWORD diff = now - d->time;             // calculate how old is this dgram
+        if(diff < 10000) {                      // dgram is younger than 10 seconds? the others are even younger
+            break;
         }
 
-        dgrams[i].clear();                      // it's too old, clear it
-        Debug::out(LOG_DEBUG, "IcmpWrapper::clearOld() - dgram #%d was too old and it was cleared", i);
+        Debug::out(LOG_DEBUG, "IcmpWrapper::clearOld() - dgram #%d was too old and it was cleared", queue[queueHead]);
+        removeOldest();                         // it's too old, clear it
     }
 }
 
 int IcmpWrapper::getEmptyIndex(void) {
-    int i; 
-    DWORD oldestTime    = 0xffffffff;
-    int   oldestIndex   = 0;
-    
-    for(i=0; i<MAX_STING_DGRAMS; i++) {     // try to find empty slot
-        if(dgrams[i].isEmpty()) {           // found empty? return it
-            return i;
-        }
-
-        if(dgrams[i].time < oldestTime) {   // found older item than we had found before? store index
-            oldestTime  = dgrams[i].time;
-            oldestIndex = i;
-        }
+    if(freeCount == 0) {
+        // no empty slot found, clear the oldest - to avoid filling up the dgrams array (at the cost of loosing oldest items)
+        Debug::out(LOG_DEBUG, "IcmpWrapper::getEmptyIndex() - no empty slot, returning oldest slot - #%d", queue[queueHead]);
+        removeOldest();
     }
 
-    // no empty slot found, clear and return the oldest - to avoid filling up the dgrams array (at the cost of loosing oldest items)
-    Debug::out(LOG_DEBUG, "IcmpWrapper::getEmptyIndex() - no empty slot, returning oldest slot - #%d", oldestIndex);
-    
-    dgrams[oldestIndex].clear();
-    return oldestIndex;
+    freeCount--;
+    return freeSlots[freeCount];
 }
 
-int IcmpWrapper::getNonEmptyIndex(void) {
-    int i; 
-    for(i=0; i<MAX_STING_DGRAMS; i++) {
-        if(!dgrams[i].isEmpty()) {
-            return i;
-        }
+TStingDgram *IcmpWrapper::getOldest(void)
+{
+    if(queueCount == 0) {
+        return NULL;
     }
 
-    return -1;
+    return &dgrams[queue[queueHead]];
 }
 
-DWORD IcmpWrapper::calcDataByteCountTotal(void) 
+void IcmpWrapper::removeOldest(void)
 {
-    DWORD sum = 0;
-    int i; 
-
-    for(i=0; i<MAX_STING_DGRAMS; i++) {     // go through received DGRAMs
-        if(!dgrams[i].isEmpty()) {          // not empty?
-            sum += dgrams[i].count;         // add size of this DGRAM
-        }
+    if(queueCount == 0) {
+        return;
     }
 
-    return sum;
+    int index = queue[queueHead];
+    queueHead = (queueHead + 1) % MAX_STING_DGRAMS;
+    queueCount--;
+
+    icmpDataCount -= dgrams[index].count;
+    dgrams[index].count = 0;
+
+    freeSlots[freeCount] = index;               // slot is free again
+    freeCount++;
+}
+
+DWORD IcmpWrapper::calcDataByteCountTotal(void) 
+{
+    return icmpDataCount;                       // updated on each add and remove
 }
 
 int IcmpWrapper::calcHowManyDatagramsFitIntoBuffer(int bufferSizeBytes)
@@ -122,15 +128,15 @@ int IcmpWrapper::calcHowManyDatagramsFitIntoBuffer(int bufferSizeBytes)
     int gotBytes    = 2;
 
     int i; 
-    for(i=0; i<MAX_STING_DGRAMS; i++) {                                 // now count how many dgrams we can send before we run out of sectors
-        if(!dgrams[i].isEmpty()) {
-            if((gotBytes + dgrams[i].count + 2) > bufferSizeBytes) {    // if adding this dgram would cause buffer overflow, quit
-                break;
-            }
-
-            gotCount++;                                                 // will fit into requested sectors, add it
-            gotBytes += 2 + dgrams[i].count;                            // size of a datagram + WORD for its size
+    for(i=0; i<queueCount; i++) {                                       // now count how many dgrams we can send before we run out of sectors
+        TStingDgram *d = &dgrams[queue[(queueHead + i) % MAX_STING_DGRAMS]];
+
+        if((gotBytes + d->count + 2) > bufferSizeBytes) {               // if adding this dgram would cause buffer overflow, quit
+            break;
         }
+
+        gotCount++;                                                     // will fit into requested sectors, add it
+        gotBytes += 2 + d->count;                                       // size of a datagram + WORD for its size
     }
 
     Debug::out(LOG_DEBUG, "IcmpWrapper::calcHowManyDatagramsFitIntoBuffer() -- found %d ICMP Dgrams, they take %d bytes", gotCount, gotBytes);
@@ -142,7 +148,7 @@ void IcmpWrapper::receiveAll(void)
     clearOld();                 // clear old dgrams that are probably stuck in the queue 
 
     while(1) {                  // receive all available ICMP data 
-        bool r = receive();     // this will fail if no data available
+        bool r = receive();     // this will fail if no more data available
         if(!r) {                // if receiving failed, quit; otherwise do another receiving!
             break;
         }
@@ -156,34 +162,39 @@ bool IcmpWrapper::receive(void)
     }
 
     //-----------------------
-    // receive the data
-    // recvfrom will receive only one ICMP packet, even if there are more than 1 packets waiting in socket
-    struct sockaddr_in src_addr;
-    socklen_t addrlen = sizeof(struct sockaddr);
-
-    ssize_t res = recvfrom(rawSock->fd, recvBfr, RECV_BFR_SIZE, MSG_DONTWAIT, (struct sockaddr *) &src_addr, &addrlen);
+    // receive the data - recvmmsg() gets many ICMP packets at once, MSG_TRUNC makes it return real size of truncated packets
+    int count = batch.receive(rawSock->fd, RECVBATCH_COUNT, MSG_TRUNC);
 
-    if(res == -1) {                 // if recvfrom failed, no data
+    if(count == -1) {               // if recvmmsg failed, no data
         if(errno != EAGAIN && errno != EWOULDBLOCK) {
-            Debug::out(LOG_ERROR, "IcmpWrapper::receive() - recvfrom() failed, errno: %d", errno);
+            Debug::out(LOG_ERROR, "IcmpWrapper::receive() - recvmmsg() failed, errno: %d", errno);
         } 
 
-        return false;
-    } else if (res == 0) {
-        Debug::out(LOG_ERROR, "IcmpWrapper::receive() - recvfrom() returned 0");
         return false;
     }
 
-    // res now contains length of ICMP packet (header + data)
-    Debug::out(LOG_DEBUG, "IcmpWrapper::receive() %d bytes from %s", res, inet_ntoa(src_addr.sin_addr));
+    for(int i=0; i<count; i++) {
+        int res = batch.size(i);
+
+        if(res == 0) {
+            Debug::out(LOG_ERROR, "IcmpWrapper::receive() - received empty packet");
+            continue;
+        }
 
+        // res now contains length of ICMP packet (header + data)
+        Debug::out(LOG_DEBUG, "IcmpWrapper::receive() %d bytes from %s", res, inet_ntoa(batch.from(i)->sin_addr));
+        storeDgram(batch.data(i), res, ntohl(batch.from(i)->sin_addr.s_addr));
+    }
+
+    Debug::out(LOG_DEBUG, "IcmpWrapper::receive() - icmpDataCount is now %d bytes", icmpDataCount);
+    return (count == RECVBATCH_COUNT);                      // got full batch? there might be more
+}
+
+void IcmpWrapper::storeDgram(BYTE *packet, int res, DWORD srcAddr)
+{
     //-----------------------
     // parse response to the right structs
     int i = getEmptyIndex();        // now find space for the datagram
-    if(i == -1) {                   // no space? fail, but return that we were able to receive data
-        Debug::out(LOG_DEBUG, "IcmpWrapper::receive() - dgram_getEmpty() returned -1");
-        return true;
-    }
 
     TStingDgram *d = &dgrams[i];
     d->clear();
@@ -196,7 +207,7 @@ bool IcmpWrapper::receive(void)
     d->data[8] = 128;                           // TTL
     d->data[9] = ICMP;                          // protocol
 
-    Utils::storeDword(d->data + 12, ntohl(src_addr.sin_addr.s_addr));     // data[12 .. 15] - source IP
+    Utils::storeDword(d->data + 12, srcAddr);                           // data[12 .. 15] - source IP
     Utils::storeDword(d->data + 16, localIp);                           // data[16 .. 19] - destination IP 
 
     WORD checksum = TRawSocks::checksum((WORD *) d->data, 20);
@@ -210,17 +221,16 @@ bool IcmpWrapper::receive(void)
     // now append ICMP packet
 
     int rest = MIN(STING_DGRAM_MAXSIZE - 48 - 2, res);                  // we can store only (STING_DGRAM_MAXSIZE - 48 - 2) = 462 bytes of ICMP packets to fit 512 B
-    memcpy(d->data + 48, recvBfr, rest);                                // copy whole ICMP packet beyond the IP_DGRAM structure
+    memcpy(d->data + 48, packet, rest);                                 // copy whole ICMP packet beyond the IP_DGRAM structure
 
     Utils::storeWord(d->data + 52, rawSockHeads.echoId);                // fake this ECHO ID, because linux replaced the ECHO ID when sending ECHO packet
     //--------------
-    // epilogue - update stuff, unlock mutex, success!
+    // epilogue - update stuff, add to queue
     d->count = 48 + rest;                                               // update how many bytes this gram contains all together
 
-    icmpDataCount = calcDataByteCountTotal();                           // update icmpDataCount
-
-    Debug::out(LOG_DEBUG, "IcmpWrapper::receive() - icmpDataCount is now %d bytes", icmpDataCount);
-    return true;
+    queue[(queueHead + queueCount) % MAX_STING_DGRAMS] = i;             // newest goes to the end of queue
+    queueCount++;
+    icmpDataCount += d->count;
 }
 
 BYTE IcmpWrapper::send(DWORD destinIP, int icmpType, int icmpCode, WORD length, BYTE *data)
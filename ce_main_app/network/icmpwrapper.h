@@ -10,6 +10,7 @@
 #include "../utils.h"
 #include "../global.h"
 #include "../debug.h"
+#include "recvbatch.h"
 
 class TNetConnection;
 #define RECV_BFR_SIZE   ( 64 * 1024)
@@ -122,7 +123,10 @@ public:
 //-------------------------------------
 
 #define MAX_STING_DGRAMS    32
+#define ICMP_RECV_SLOT      2048                // only (STING_DGRAM_MAXSIZE - 50) bytes of ICMP packet are stored, so this is enough
 
+// Received ICMP datagrams are kept in dgrams[] - empty slots are in free list, used slots are in FIFO queue,
+// so finding empty slot, oldest datagram and total byte count doesn't need to go through all the slots.
 class IcmpWrapper
 {
 public:
@@ -133,22 +137,33 @@ public:
     BYTE  send         (DWORD destinIP, int icmpType, int icmpCode, WORD length, BYTE *data);
 
     void  closeAndClean(void);
+    int   getFd        (void);
 
     DWORD calcDataByteCountTotal(void);
     int   calcHowManyDatagramsFitIntoBuffer(int bufferSizeBytes);
 
-    int   getNonEmptyIndex(void);
-    TStingDgram      dgrams[MAX_STING_DGRAMS];
+    TStingDgram *getOldest   (void);        // oldest received datagram, or NULL if none
+    void         removeOldest(void);
 
 private:
-    BYTE            *recvBfr;
-    DWORD            icmpDataCount;
+    DWORD            icmpDataCount;         // byte count of all the datagrams in queue
+
+    TStingDgram      dgrams[MAX_STING_DGRAMS];
+    int              freeSlots[MAX_STING_DGRAMS];   // stack of indices of empty dgrams
+    int              freeCount;
+    int              queue[MAX_STING_DGRAMS];       // ring of indices of received dgrams, oldest first
+    int              queueHead;
+    int              queueCount;
+
+    RecvBatch        batch;
 
     TRawSocks        rawSockHeads;      // this holds the headers for RAW socket
     TNetConnection  *rawSock;           // this is info about RAW socket - used for ICMP
 
     bool  receive       (void);
+    void  storeDgram    (BYTE *packet, int size, DWORD srcAddr);
     void  clearOld      (void);
+    void  clearQueue    (void);
     int   getEmptyIndex (void);
 };
 
@@ -13,12 +13,18 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <algorithm>
 
 #include "../utils.h"
 #include "../global.h"
 #include "../debug.h"
+#include "../trace.h"
 #include "../acsidatatrans.h"
 #include "../settings.h"
+#include "../settingsreloadproxy.h"
 
 #include "netadapter.h"
 #include "netadapter_commands.h"
@@ -36,17 +42,76 @@ DWORD localIp;
 
 //--------------------------------------------------------
 
-NetAdapter::NetAdapter(void)
+NetAdapter::NetAdapter(void) : recvBatch(READWRAPPER_MAX_DGRAM)
 {
     dataTrans       = 0;
     dataBuffer      = new BYTE[NET_BUFFER_SIZE];
     localIp         = 0;
+    driverHandles   = NET_HANDLES_COUNT;
 
     loadSettings();
+
+    //--------
+    // start network thread
+    pthread_mutex_init(&netMutex, NULL);
+
+    netThreadShouldStop = false;
+    icmpFdInEpoll       = -1;
+    commandsWaiting     = 0;
+    commandSeq          = 0;
+
+    epollFd = epoll_create(NET_MAX_HANDLES + 2);
+
+    if(pipe(wakePipe) != 0) {
+        wakePipe[0] = -1;
+        wakePipe[1] = -1;
+    } else {                                            // writing to full pipe must not block, it will wake up the thread anyway
+        fcntl(wakePipe[1], F_SETFL, fcntl(wakePipe[1], F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    if(epollFd == -1 || wakePipe[0] == -1) {
+        Debug::out(LOG_ERROR, "NetAdapter::NetAdapter - failed to create epoll or pipe, errno: %d", errno);
+    }
+
+    epollAdd(wakePipe[0], NET_EVENT_WAKE, 0, EPOLLIN);
+
+    //--------
+    // generations for conUpdateInfoDelta() - start in random session, so generation of ST from our previous run is not valid
+    reportGeneration = ((((DWORD) (time(NULL) ^ getpid())) % 255) + 1) << 24;
+
+    for(int i=0; i<NET_MAX_HANDLES; i++) {
+        getReportedState(i, reportState[i]);
+        reportSlotGeneration[i] = reportGeneration;
+    }
+
+    pthread_create(&netThreadInfo, NULL, NetAdapter::networkThreadCode, this);
+
+    Settings::addChangeListener("NET_", this, SETTINGSUSER_NONE);  // NET_MAX_CONNECTIONS or NET_SEND_COALESCE_MS changed? reload them
 }
 
 NetAdapter::~NetAdapter()
 {
+    Settings::removeChangeListener(this);
+
+    netThreadShouldStop = true;                         // tell network thread to quit and wake it up
+    wakeNetworkThread();
+    pthread_join(netThreadInfo, NULL);
+
+    closeAndCleanAll();
+
+    while(!closingSockets.empty()) {                    // what wasn't sent till now won't be
+        finishClosing(closingSockets.size() - 1);
+    }
+
+    close(epollFd);
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    pthread_mutex_destroy(&netMutex);
+
+    for(size_t i=0; i<cons.size(); i++) {
+        delete cons[i];
+    }
+
     delete []dataBuffer;
 }
 
@@ -57,7 +122,9 @@ void NetAdapter::setAcsiDataTrans(AcsiDataTrans *dt)
 
 void NetAdapter::reloadSettings(int type)
 {
+    pthread_mutex_lock(&netMutex);      // called from settings writer thread, ST command might be using the settings now
     loadSettings();
+    pthread_mutex_unlock(&netMutex);
 }
 
 void NetAdapter::loadSettings(void)
@@ -67,6 +134,11 @@ void NetAdapter::loadSettings(void)
     // first read the new settings
     Settings s;
 
+    maxConnections = s.getInt("NET_MAX_CONNECTIONS", NET_DEFAULT_MAX_CONS);
+    maxConnections = MAX(1, MIN(maxConnections, NET_MAX_HANDLES));   // connections which are already open stay open
+
+    sendCoalesceMs = s.getInt("NET_SEND_COALESCE_MS", NET_DEFAULT_COALESCE_MS);
+    sendCoalesceMs = MAX(0, MIN(sendCoalesceMs, NET_MAX_COALESCE_MS));  // used for new connections
 
 }
 
@@ -92,6 +164,11 @@ void NetAdapter::processCommand(BYTE *command)
 
     logFunctionName(pCmd[4]);
 
+    __sync_add_and_fetch(&commandsWaiting, 1);
+    pthread_mutex_lock(&netMutex);      // network thread must not change connections while we handle the command
+    __sync_sub_and_fetch(&commandsWaiting, 1);
+    commandSeq++;
+
     switch(pCmd[4]) {
         case NET_CMD_IDENTIFY:              identify();         break;
 
@@ -126,6 +203,7 @@ void NetAdapter::processCommand(BYTE *command)
         case NET_CMD_CNBYTE_COUNT:          break;                      // currently not used on host
         case NET_CMD_CNGETINFO:             break;                      // currently not used on host
         case NET_CMD_CN_UPDATE_INFO:        conUpdateInfo();    break;
+        case NET_CMD_CN_UPDATE_INFO_DELTA:  conUpdateInfoDelta(); break;
 
         // MISC
         case NET_CMD_RESOLVE:               resolveStart();     break;
@@ -136,15 +214,453 @@ void NetAdapter::processCommand(BYTE *command)
         case NET_CMD_CNTRL_PORT:            break;                      // currently not used on host
     }
 
+    pthread_mutex_unlock(&netMutex);
+
     dataTrans->sendDataAndStatus();     // send all the stuff after handling, if we got any
 }
 //----------------------------------------------
+void *NetAdapter::networkThreadCode(void *ptr)
+{
+    NetAdapter *na = (NetAdapter *) ptr;
+    na->networkThreadLoop();
+    return 0;
+}
+
+void NetAdapter::networkThreadLoop(void)
+{
+    struct epoll_event events[NET_MAX_EVENTS];
+
+    Debug::out(LOG_DEBUG, "NetAdapter::networkThreadLoop starting");
+
+    int   timeoutMs = 1000;
+    DWORD seq       = commandSeq;                       // ST commands done before epoll_wait()
+
+    while(!netThreadShouldStop && !sigintReceived) {
+        int count = epoll_wait(epollFd, events, NET_MAX_EVENTS, timeoutMs);
+
+        if(count < 0 && errno != EINTR) {
+            Debug::out(LOG_ERROR, "NetAdapter::networkThreadLoop - epoll_wait() failed, errno: %d", errno);
+            Utils::sleepMs(100);
+            continue;
+        }
+
+        // lock for each event separately, so ST command waits for one receive at most, not for the whole batch
+        for(int i=0; i<count; i++) {
+            // event data: fd in upper 32 bits, kind in bits 24..31, slot in bits 0..23
+            uint64_t data = events[i].data.u64;
+
+            int   fd    = (int) (data >> 32);
+            int   kind  = (int) ((data >> 24) & 0xff);
+            int   slot  = (int) (data & 0xffffff);
+            DWORD ev    = events[i].events;
+
+            lockForNetworkThread();
+
+            if(commandSeq != seq) {                     // ST command came meanwhile - it might have closed the socket and opened other with the same fd
+                ev = currentEvents(fd);
+            }
+
+            if(ev != 0) {
+                handleSocketEvent(kind, fd, slot, ev);
+            }
+
+            pthread_mutex_unlock(&netMutex);
+        }
+
+        lockForNetworkThread();
+        if(icmpFdInEpoll != -1) {                       // this also throws away ICMP dgrams which ST didn't take for too long
+            icmpWrapper.receiveAll();
+        }
+        pthread_mutex_unlock(&netMutex);
+
+        lockForNetworkThread();
+        timeoutMs = flushHeldData(false);               // wake up in time for the next held back data
+        timeoutMs = MIN(timeoutMs, expireClosingSockets());
+        seq       = commandSeq;
+        pthread_mutex_unlock(&netMutex);
+    }
+
+    Debug::out(LOG_DEBUG, "NetAdapter::networkThreadLoop terminated");
+}
+
+DWORD NetAdapter::currentEvents(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = POLLIN | POLLOUT | POLLRDHUP;
+    pfd.revents = 0;
+
+    if(poll(&pfd, 1, 0) <= 0 || (pfd.revents & POLLNVAL) != 0) {   // nothing now, or fd closed
+        return 0;
+    }
+
+    DWORD ev = 0;                                       // handlers check what the connection needs, extra flags don't hurt
+    if(pfd.revents & POLLIN)    ev |= EPOLLIN;
+    if(pfd.revents & POLLOUT)   ev |= EPOLLOUT;
+    if(pfd.revents & POLLRDHUP) ev |= EPOLLRDHUP;
+    if(pfd.revents & POLLHUP)   ev |= EPOLLHUP;
+    if(pfd.revents & POLLERR)   ev |= EPOLLERR;
+    return ev;
+}
+
+void NetAdapter::lockForNetworkThread(void)
+{
+    while(commandsWaiting > 0) {                        // unlocking doesn't hand the mutex over - we could take it again before ST command gets it
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&netMutex);
+}
+
+void NetAdapter::handleSocketEvent(int kind, int fd, int slot, DWORD events)
+{
+    switch(kind) {
+        case NET_EVENT_WAKE: {
+            char tmp[16];
+            if(read(fd, tmp, sizeof(tmp)) < 0) {        // just empty the pipe
+                Debug::out(LOG_DEBUG, "NetAdapter::handleSocketEvent - read() on wake pipe failed");
+            }
+            break;
+        }
+
+        case NET_EVENT_ICMP:
+            if(icmpWrapper.getFd() != fd) {             // ICMP socket was closed meanwhile?
+                epollRemove(fd);
+                icmpFdInEpoll = -1;
+            }
+            break;                                      // received after handling all the events
+
+        case NET_EVENT_LISTEN:  handleListenEvent(slot, fd);        break;
+        case NET_EVENT_DATA:    handleDataEvent(slot, fd, events);  break;
+        case NET_EVENT_CLOSING: handleClosingEvent(fd, events);     break;
+    }
+}
+
+void NetAdapter::handleListenEvent(int slot, int fd)
+{
+    TNetConnection *nc = cons[slot];
+
+    if(nc->listenFd != fd || nc->fd != -1) {            // connection was closed or already accepted meanwhile? ignore event
+        return;
+    }
+
+    struct sockaddr_storage remoteAddress;              // this struct will receive the remote address if accept() succeeds
+    socklen_t               addrSize;
+    addrSize = sizeof(remoteAddress);
+    memset(&remoteAddress, 0, addrSize);
+
+    int newFd = accept(nc->listenFd, (struct sockaddr*) &remoteAddress, &addrSize);    // try to accept
+
+    if(newFd == -1) {                                   // failed? nothing waiting, or try again on next event
+        return;
+    }
+
+    Debug::out(LOG_DEBUG, "NetAdapter::handleListenEvent() -- connection %d - accept() succeeded, client connected", slot);
+
+    //----------
+    setKeepAliveOptions(newFd);                         // configure keep alive
+
+    // ok, got the connection, store file descriptor and new state
+    nc->fd      = newFd;
+    nc->status  = TESTABLISH;
+
+    nc->readWrapper.init(newFd, nc->type, nc->buff_size);
+    nc->sendWrapper.init(newFd, sendCoalesceMs);
+
+    // also store the remote address that just connected to us
+    if (remoteAddress.ss_family == AF_INET) {           // if it's IPv4
+        struct sockaddr_in *s = (struct sockaddr_in *) &remoteAddress;
+
+        nc->remote_adr.sin_addr.s_addr  = s->sin_addr.s_addr;
+        nc->remote_adr.sin_port         = s->sin_port;
+
+        Debug::out(LOG_DEBUG, "NetAdapter::handleListenEvent() -- connection %d - got IP & port of remote host", slot);
+    }
+
+    epollRemove(nc->listenFd);                          // only one client per listening connection
+    updateDataEvents(slot);
+}
+
+void NetAdapter::handleDataEvent(int slot, int fd, DWORD events)
+{
+    TNetConnection *nc = cons[slot];
+
+    if(nc->fd != fd) {                                  // connection was closed meanwhile? ignore event
+        return;
+    }
+
+    if(nc->status == TSYN_SENT) {                       // non-blocking connect in progress?
+        int res = connect(nc->fd, (struct sockaddr *) &nc->remote_adr, sizeof(nc->remote_adr));   // find out how it went
+
+        if(res == 0 || errno == EISCONN) {              // connected!
+            Debug::out(LOG_DEBUG, "NetAdapter::handleDataEvent() -- connection %d is now TESTABLISH", slot);
+            nc->status = TESTABLISH;
+            events    |= EPOLLOUT;                      // ST might have sent something while connecting, write it now
+        } else if(errno == EALREADY || errno == EINPROGRESS) {  // still trying to connect
+            return;
+        } else {                                        // failed to connect
+            Debug::out(LOG_DEBUG, "NetAdapter::handleDataEvent() -- connection %d failed to connect, errno %d, now TCLOSED", slot, errno);
+            nc->closeIt();
+            return;
+        }
+    }
+
+    if((events & EPOLLOUT) != 0 && nc->sendWrapper.getQueued() > 0) {  // socket can take more of the queued data?
+        if(nc->sendWrapper.flush() < 0) {               // failed? it's reset by remote, receiving will find out
+            nc->sendWrapper.clearAll();
+            events |= EPOLLERR;
+        }
+    }
+
+    if(nc->readPaused || (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) == 0) {
+        updateDataEvents(slot);                         // stop waiting for writable socket if everything was sent
+        return;
+    }
+
+    int res = nc->readWrapper.receive(recvBatch, NET_RECEIVE_STEP);    // receive (some of) what is waiting
+
+    if(res < 0 || (nc->type == TCP && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0 && res == 0)) {
+        nc->remoteClosed = true;                        // remote closed and we got all the data from socket
+    }
+
+    nc->bytesInSocket = nc->readWrapper.getCount();
+
+    if(!nc->remoteClosed && nc->readWrapper.isFull()) { // can't receive more? stop waiting for data until ST reads something
+        Debug::out(LOG_DEBUG, "NetAdapter::handleDataEvent() -- connection %d has full buffer, pausing reading", slot);
+        nc->readPaused = true;
+    }
+
+    updateDataEvents(slot);                             // when remote closed, nothing more will come, stop watching the socket
+
+    if(nc->remoteClosed) {
+        closeIfRemoteClosed(slot);
+    }
+}
+
+void NetAdapter::dataWasRead(int slot)
+{
+    TNetConnection *nc = cons[slot];
+
+    nc->bytesInSocket = nc->readWrapper.getCount();
+
+    if(nc->readPaused && !nc->readWrapper.isFull()) {   // was paused because of full buffer, and now has space? resume
+        nc->readPaused = false;
+        updateDataEvents(slot);
+    }
+
+    closeIfRemoteClosed(slot);
+}
+
+void NetAdapter::closeIfRemoteClosed(int slot)
+{
+    TNetConnection *nc = cons[slot];
+
+    if(nc->remoteClosed && nc->bytesInSocket == 0) {   // remote side closed and ST read all the data? close it
+        Debug::out(LOG_DEBUG, "NetAdapter::closeIfRemoteClosed() -- connection %d closed by remote side, now TCLOSED", slot);
+        nc->closeIt();
+    }
+}
+
+void NetAdapter::closeWhenFlushed(int slot)
+{
+    TNetConnection *nc = cons[slot];
+
+    if(nc->sendWrapper.flush() < 0 || nc->sendWrapper.getQueued() == 0) {  // everything written (or it can't be)? just close it
+        return;
+    }
+
+    if(nc->epollEvents != 0) {                          // from now on it's watched as closing socket
+        epollRemove(nc->fd);
+        nc->epollEvents = 0;
+    }
+
+    TClosingSocket cs;
+    cs.fd           = nc->fd;
+    cs.sendWrapper  = new SendWrapper();
+    cs.sendWrapper->takeOver(nc->sendWrapper);
+    cs.deadline     = Utils::getCurrentMs() + NET_CLOSE_FLUSH_MS;
+    closingSockets.push_back(cs);
+
+    nc->fd = -1;                                        // not connection's socket anymore, closeIt() won't close it
+
+    Debug::out(LOG_DEBUG, "NetAdapter::closeWhenFlushed() -- connection %d closed, %d bytes still to be sent", slot, cs.sendWrapper->getQueued());
+
+    epollAdd(cs.fd, NET_EVENT_CLOSING, 0, EPOLLIN | EPOLLOUT);  // unread incoming data would make close() reset the connection, so read it too
+    wakeNetworkThread();                                // so it wakes up at the deadline
+}
+
+void NetAdapter::handleClosingEvent(int fd, DWORD events)
+{
+    for(int i=0; i<(int) closingSockets.size(); i++) {
+        if(closingSockets[i].fd != fd) {
+            continue;
+        }
+
+        if((events & EPOLLIN) != 0) {                   // nobody wants the incoming data now, throw it away
+            BYTE bfr[1024];
+            int  res;
+
+            do {
+                res = recv(fd, bfr, sizeof(bfr), MSG_DONTWAIT);
+            } while(res > 0);
+
+            if(res == 0) {                              // remote won't send anything more, just wait for writable socket
+                epollModify(fd, NET_EVENT_CLOSING, 0, EPOLLOUT);
+            }
+        }
+
+        SendWrapper *sw = closingSockets[i].sendWrapper;
+
+        if(sw->flush() < 0 || sw->getQueued() == 0) {   // all written, or it can't be
+            finishClosing(i);
+        }
+        return;
+    }
+}
+
+int NetAdapter::expireClosingSockets(void)
+{
+    DWORD now       = Utils::getCurrentMs();
+    int   timeoutMs = 1000;
+
+    for(int i=(int) closingSockets.size() - 1; i>=0; i--) {
+        int left = (int) (closingSockets[i].deadline - now);
+
+        if(left > 0) {
+            timeoutMs = MIN(timeoutMs, left);
+            continue;
+        }
+
+        Debug::out(LOG_DEBUG, "NetAdapter::expireClosingSockets() -- timeout, %d bytes not sent", closingSockets[i].sendWrapper->getQueued());
+        finishClosing(i);
+    }
+
+    return timeoutMs;
+}
+
+void NetAdapter::finishClosing(int index)
+{
+    TClosingSocket &cs = closingSockets[index];
+
+    close(cs.fd);                                       // closing the socket also removes it from epoll
+    delete cs.sendWrapper;                              // gives the buffer back to pool
+
+    closingSockets.erase(closingSockets.begin() + index);
+}
+
+void NetAdapter::epollAdd(int fd, int kind, int slot, DWORD events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.u64 = (((uint64_t) fd) << 32) | (((uint64_t) kind) << 24) | ((uint64_t) slot);
+
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        Debug::out(LOG_ERROR, "NetAdapter::epollAdd - epoll_ctl() failed for fd %d, errno: %d", fd, errno);
+    }
+}
+
+void NetAdapter::epollModify(int fd, int kind, int slot, DWORD events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.u64 = (((uint64_t) fd) << 32) | (((uint64_t) kind) << 24) | ((uint64_t) slot);
+
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void NetAdapter::epollRemove(int fd)
+{
+    struct epoll_event ev;                              // not used, but kernels before 2.6.9 require non-NULL pointer
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int NetAdapter::flushHeldData(bool all)
+{
+    DWORD now       = Utils::getCurrentMs();
+    int   timeoutMs = 1000;
+
+    for(int i=0; i<(int) cons.size(); i++) {
+        SendWrapper *sw = &cons[i]->sendWrapper;
+
+        if(!sw->isHoldingBack()) {
+            continue;
+        }
+
+        int left = (int) (sw->getFlushTime() - now);
+
+        if(!all && left > 0) {                          // not yet? wake up for it
+            timeoutMs = MIN(timeoutMs, left);
+            continue;
+        }
+
+        if(sw->flush() < 0) {                           // failed? it's reset by remote, receiving will find out
+            sw->clearAll();
+        }
+
+        updateDataEvents(i);                            // if the socket didn't take everything, wait for writable socket
+    }
+
+    return timeoutMs;
+}
+
+void NetAdapter::wakeNetworkThread(void)
+{
+    if(write(wakePipe[1], "w", 1) != 1 && errno != EAGAIN) {
+        Debug::out(LOG_ERROR, "NetAdapter::wakeNetworkThread - failed to wake up network thread");
+    }
+}
+
+void NetAdapter::updateDataEvents(int slot)
+{
+    TNetConnection *nc = cons[slot];
+
+    if(nc->fd == -1) {                                  // no data socket? closing it also removed it from epoll
+        nc->epollEvents = 0;
+        return;
+    }
+
+    DWORD events = 0;
+
+    if(nc->remoteClosed) {                              // nothing more will come, don't watch the socket
+        events = 0;
+    } else if(nc->status == TSYN_SENT) {                // connecting? wait for the result
+        events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    } else {
+        if(!nc->readPaused) {                           // have space for data?
+            events |= (nc->type == TCP) ? (EPOLLIN | EPOLLRDHUP) : EPOLLIN;
+        }
+
+        if(nc->sendWrapper.needsWritable()) {           // something waits to be sent? wait for socket to take it (held back data waits for flushHeldData())
+            events |= EPOLLOUT;
+        }
+    }
+
+    if(events == nc->epollEvents) {                     // nothing changed
+        return;
+    }
+
+    if(events == 0) {
+        epollRemove(nc->fd);
+    } else if(nc->epollEvents == 0) {
+        epollAdd(nc->fd, NET_EVENT_DATA, slot, events);
+    } else {
+        epollModify(nc->fd, NET_EVENT_DATA, slot, events);
+    }
+
+    nc->epollEvents = events;
+}
+//----------------------------------------------
 void NetAdapter::identify(void)
 {
     //--------
     // as this happens on the start of fake STiNG driver, do some clean up from previous driver run
 
     closeAndCleanAll();
+
+    driverHandles = cmd[5] ? MIN(cmd[5], NET_MAX_HANDLES) : NET_HANDLES_COUNT;     // older drivers know only the first NET_HANDLES_COUNT handles
+    Debug::out(LOG_DEBUG, "NetAdapter::identify - driver can use %d handles", driverHandles);
     //--------
     dataTrans->addDataBfr("CosmosEx network module", 24, false);   // add 24 bytes which are the identification string
 
@@ -170,6 +686,8 @@ void NetAdapter::identify(void)
         localIp = 0;                                // no local IP
     }
 
+    dataTrans->addDataByte(NET_FEATURE_CONINFO_DELTA);  // offset 38: features, so the driver doesn't try commands we don't know
+
     //--------
     // now finish the data and status byte
     dataTrans->padDataToMul16();                    // make sure the data size is multiple of 16
@@ -181,12 +699,13 @@ void NetAdapter::closeAndCleanAll(void)
 //    pthread_mutex_lock(&networkThreadMutex);        // try to lock the mutex
 
     int i;
-    for(i=0; i<NET_HANDLES_COUNT; i++) {            // close normal sockets
-        cons[i].closeIt();
-        cons[i].cleanIt();
+    for(i=0; i<(int) cons.size(); i++) {            // close normal sockets
+        cons[i]->closeIt();
+        cons[i]->cleanIt();
     }
 
-    icmpWrapper.closeAndClean();
+    icmpWrapper.closeAndClean();                    // closing the socket also removes it from epoll
+    icmpFdInEpoll = -1;
 
 //	pthread_mutex_unlock(&networkThreadMutex);      // unlock the mutex
 }
@@ -304,18 +823,29 @@ void NetAdapter::conOpen_listen(int slot, bool tcpNotUdp, WORD localPort, DWORD
         Debug::out(LOG_DEBUG, "NetAdapter::conOpen_listen - now listening on specified port %d (hex: 0x%04x, dec: %d, %d)",  localPort, localPort, localPort >> 8, localPort & 0xff);
     }
 
-    TNetConnection *nc = &cons[slot];
+    TNetConnection *nc = cons[slot];
     nc->initVars();                                 // init vars
 
     // store the info
     nc->activeNotPassive = false;                   // it's passive (listening) socket
-    nc->listenFd         = fd;
     nc->localPort        = localPort;               // store local port - either the specified one, or the first free which was assigned
     nc->type             = tcpNotUdp ? TCP : UDP;
     nc->bytesInSocket    = 0;
-    nc->status           = TLISTEN;
     nc->buff_size        = buff_size;
 
+    if(tcpNotUdp) {                                 // TCP - wait for client in network thread
+        nc->listenFd     = fd;
+        nc->status       = TLISTEN;
+
+        epollAdd(fd, NET_EVENT_LISTEN, slot, EPOLLIN);
+    } else {                                        // UDP - there's nothing to accept, the bound socket receives the data
+        nc->fd           = fd;
+        nc->status       = TESTABLISH;
+
+        nc->readWrapper.init(fd, nc->type, buff_size);
+        updateDataEvents(slot);
+    }
+
     // return the handle
     BYTE connectionHandle = network_slotToHandle(slot);
     Debug::out(LOG_DEBUG, "NetAdapter::conOpen_listen() - returning %d as handle for slot %d", (int) connectionHandle, slot);
@@ -401,7 +931,7 @@ void NetAdapter::conOpen_connect(int slot, bool tcpNotUdp, WORD localPort, DWORD
         localPort = getLocalPort(fd);
     }
 
-    TNetConnection *nc = &cons[slot];
+    TNetConnection *nc = cons[slot];
     nc->initVars();                             // init vars
 
     // store the info
@@ -415,6 +945,9 @@ void NetAdapter::conOpen_connect(int slot, bool tcpNotUdp, WORD localPort, DWORD
     nc->buff_size         = buff_size;
 
     nc->readWrapper.init(fd, nc->type, buff_size);
+    nc->sendWrapper.init(fd, tcpNotUdp ? sendCoalesceMs : 0);
+
+    updateDataEvents(slot);                     // if connecting, network thread will find out when it's done
 
     // return the handle
     BYTE connectionHandle = network_slotToHandle(slot);
@@ -434,21 +967,25 @@ void NetAdapter::conClose(void)
 
     int handle  = Utils::getWord(dataBuffer);           // retrieve handle
 
-    if(!network_handleIsValid(handle)) {                // handle out of range? fail
+    if(!handleIsValid(handle)) {                // handle out of range? fail
         Debug::out(LOG_DEBUG, "NetAdapter::conClose() -- bad handle: %d", handle);
         dataTrans->setStatus(E_PARAMETER);
         return;
     }
     int slot = network_handleToSlot(handle);
 
-    if(cons[slot].isClosed()) {                         // handle already closed? fail
+    if(cons[slot]->isClosed()) {                         // handle already closed? fail
         Debug::out(LOG_DEBUG, "NetAdapter::conClose() -- slot %d is already closed, pretending that it was closed :)", slot);
         dataTrans->setStatus(E_NORMAL);
         return;
     }
 
     Debug::out(LOG_DEBUG, "NetAdapter::conClose() -- closing connection with handle %d on slot %d", handle, slot);
-    cons[slot].closeIt();                             // handle good, close it
+
+    if(cons[slot]->fd != -1 && cons[slot]->status != TSYN_SENT) {
+        closeWhenFlushed(slot);                         // network thread writes out what the socket didn't take yet
+    }
+    cons[slot]->closeIt();                             // handle good, close it
 
     dataTrans->setStatus(E_NORMAL);
 }
@@ -461,22 +998,22 @@ void NetAdapter::conSend(void)
     bool isOdd      = cmd[8];                           // if the data was send from odd address, this will be non-zero...
     BYTE oddByte    = cmd[9];                           // ...and this will contain the 0th byte
 
-    if(!network_handleIsValid(handle)) {                // handle out of range? fail
+    if(!handleIsValid(handle)) {                // handle out of range? fail
         Debug::out(LOG_DEBUG, "NetAdapter::conSend() -- bad handle: %d", handle);
         dataTrans->setStatus(E_PARAMETER);
         return;
     }
     int slot = network_handleToSlot(handle);
 
-    if(cons[slot].isClosed()) {                         // connection not open? fail
+    if(cons[slot]->isClosed()) {                         // connection not open? fail
         Debug::out(LOG_DEBUG, "NetAdapter::conSend() -- connection %d is closed", slot);
         dataTrans->setStatus(E_BADHANDLE);
         return;
     }
 
     bool good = false;                                  // check if trying to do right type of send over right type of connection (TCP over TCP, UDP over UDP)
-    if( (cmdType == NET_CMD_TCP_SEND && cons[slot].type == TCP) ||
-        (cmdType == NET_CMD_UDP_SEND && cons[slot].type == UDP)) {
+    if( (cmdType == NET_CMD_TCP_SEND && cons[slot]->type == TCP) ||
+        (cmdType == NET_CMD_UDP_SEND && cons[slot]->type == UDP)) {
         good = true;
     }
 
@@ -512,23 +1049,34 @@ void NetAdapter::conSend(void)
     Debug::out(LOG_DEBUG, "NetAdapter::conSend() -- sending %d bytes through connection %d (received %d from ST, isOdd: %d)", length, slot, lenRoundUp, isOdd);
     //Debug::outBfr(dataBuffer, length);
 
-    int written = 0;
-    while(written < length) {
-        int ires = write(cons[slot].fd, dataBuffer + written, length - written);  // try to send the data
-        if(ires < 0) {
-            Debug::out(LOG_ERROR, "NetAdapter::conSend - slot %d : failed to write(). written %d out of %d : %s", slot, written, length, strerror(errno));
-            if(errno == EAGAIN || errno == EWOULDBLOCK) {
-                dataTrans->setStatus(E_OBUFFULL);
-            } else {
-                dataTrans->setStatus(E_RRESET);
-            }
-            return;
-        } else if(ires == 0) {
-            Debug::out(LOG_ERROR, "NetAdapter::conSend - slot %d : write() remote closed connection. written %d out of %d", slot, written, length);
-            dataTrans->setStatus(E_EOF);
-            return;
+    TNetConnection *nc = cons[slot];
+
+    if(nc->type == TCP) {                               // TCP - write straight from dataBuffer, what socket doesn't take waits in send buffer
+        bool wasHolding = nc->sendWrapper.isHoldingBack();
+        BYTE res        = nc->sendWrapper.send(dataBuffer, length, nc->status != TSYN_SENT);
+
+        if(!wasHolding && nc->sendWrapper.isHoldingBack()) {    // small write held back? network thread should flush it in time
+            wakeNetworkThread();
         }
-        written += ires;
+
+        if(res != E_NORMAL) {
+            Debug::out(LOG_DEBUG, "NetAdapter::conSend - slot %d : can't send %d bytes, %d bytes queued, status %02x", slot, length, nc->sendWrapper.getQueued(), res);
+        }
+
+        updateDataEvents(slot);                         // if something was queued, wait for writable socket
+        dataTrans->setStatus(res);
+        return;
+    }
+
+    int ires = write(nc->fd, dataBuffer, length);       // UDP - whole datagram or nothing
+    if(ires < 0) {
+        Debug::out(LOG_ERROR, "NetAdapter::conSend - slot %d : failed to write() %d bytes : %s", slot, length, strerror(errno));
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            dataTrans->setStatus(E_OBUFFULL);
+        } else {
+            dataTrans->setStatus(E_RRESET);
+        }
+        return;
     }
 
     dataTrans->setStatus(E_NORMAL);
@@ -538,50 +1086,178 @@ void NetAdapter::conUpdateInfo(void)
 {
     int i;
 
-    updateCons();                                           // update connections status and bytes to read
+    flushHeldData(true);                                    // ST checks the state - probably waits for reply, so don't hold back what it sent
 
-    int found = 0;
+    // the network thread keeps the state of connections up to date, so here we just return it
+    // only the first NET_HANDLES_COUNT connections fit here, the others are reported only by conUpdateInfoDelta()
+    TConReportedState st[NET_HANDLES_COUNT];
 
-    // fill the buffer
-    for(i=0; i<NET_HANDLES_COUNT; i++) {                    // store how many bytes we can read from connections
-        TNetConnection *ci = &cons[i];
-        dataTrans->addDataDword(ci->bytesInSocket);
+    for(i=0; i<NET_HANDLES_COUNT; i++) {
+        getReportedState(i, st[i]);
 
-        if(ci->bytesInSocket > 0) {                         // something to read?
-            Debug::out(LOG_DEBUG, "NetAdapter::conUpdateInfo [%d] connection has %d bytes waiting to be read", i, ci->bytesInSocket);
-            found++;
+        if(st[i].status != TCLOSED) {                       // not closed?
+            Debug::out(LOG_DEBUG, "NetAdapter::conUpdateInfo [%d] - status: %d, localPort: %d, remote: %08x:%d, bytesInSocket: %d", i, st[i].status, st[i].localPort, st[i].remoteHost, st[i].remotePort, st[i].bytesInSocket);
         }
+    }
 
-        if(ci->status != TCLOSED) {                         // not closed?
-            Debug::out(LOG_DEBUG, "NetAdapter::conUpdateInfo [%d] - status: %d, localPort: %d, remote: %08x:%d, bytesInSocket: %d", i, ci->status, ci->localPort, ntohl(ci->remote_adr.sin_addr.s_addr), ntohs(ci->remote_adr.sin_port), ci->bytesInSocket);
-        }
+    // fill the buffer
+    for(i=0; i<NET_HANDLES_COUNT; i++) {                    // store how many bytes we can read from connections
+        dataTrans->addDataDword(st[i].bytesInSocket);
     }
 
     for(i=0; i<NET_HANDLES_COUNT; i++) {                    // store connection statuses
-        dataTrans->addDataByte(cons[i].status);
+        dataTrans->addDataByte(st[i].status);
     }
 
     for(i=0; i<NET_HANDLES_COUNT; i++) {                    // store local ports (LPort)
-        dataTrans->addDataWord(cons[i].localPort);
+        dataTrans->addDataWord(st[i].localPort);
     }
 
     for(i=0; i<NET_HANDLES_COUNT; i++) {                    // store remote addresses (RHost)
-        dataTrans->addDataDword(ntohl(cons[i].remote_adr.sin_addr.s_addr));
+        dataTrans->addDataDword(st[i].remoteHost);
     }
 
     for(i=0; i<NET_HANDLES_COUNT; i++) {                    // store remote ports (RPort)
-        dataTrans->addDataWord(ntohs(cons[i].remote_adr.sin_port));
+        dataTrans->addDataWord(st[i].remotePort);
     }
 
-    icmpWrapper.receiveAll();
     DWORD imcpCnt = icmpWrapper.calcDataByteCountTotal();
     dataTrans->addDataDword(imcpCnt);                       // fill the data to be read from ICMP sock
 
     Debug::out(LOG_DEBUG, "NetAdapter::conUpdateInfo - imcpCnt: %d", imcpCnt);
 
+    dataTrans->addDataDword(getLinesAvailable());
+
+    for(i=0; i<NET_HANDLES_COUNT; i++) {                    // store how much data waits in send buffer, so ST can pace sending
+        dataTrans->addDataByte(st[i].sendQueuedKb);
+    }
+
     dataTrans->padDataToMul16();
     dataTrans->setStatus(E_NORMAL);
 }
+
+void NetAdapter::conUpdateInfoDelta(void)
+{
+    // Long command
+    // cmd[4] = NET_CMD_CN_UPDATE_INFO_DELTA
+    DWORD stGeneration = Utils::getDword(cmd + 5);          // cmd[6 .. 9] - generation returned last time, or 0 if ST has nothing yet
+
+    flushHeldData(true);                                    // ST checks the state - probably waits for reply, so don't hold back what it sent
+    updateReportGenerations();
+
+    // ST doesn't have anything, or has generation from other session? send all the connections
+    bool full = (stGeneration == 0 || (stGeneration >> 24) != (reportGeneration >> 24) || stGeneration > reportGeneration);
+
+    std::vector< std::pair<DWORD, int> > changed;           // generation and slot of changed connections
+    int i;
+    for(i=0; i<(int) cons.size(); i++) {
+        if(full || reportSlotGeneration[i] > stGeneration) {
+            changed.push_back(std::make_pair(reportSlotGeneration[i], i));
+        }
+    }
+
+    // each change has its own generation, so if not everything fits, send the oldest changes
+    // with generation of the last one sent - ST will ask again and get the rest
+    DWORD generation = reportGeneration;
+    bool  more       = false;
+
+    if(changed.size() > NET_DELTA_MAX_ENTRIES) {
+        std::sort(changed.begin(), changed.end());
+        changed.resize(NET_DELTA_MAX_ENTRIES);
+
+        generation  = changed.back().first;
+        more        = true;
+    }
+
+    dataTrans->addDataDword(generation);                    // ST will send this next time
+    dataTrans->addDataByte(changed.size());                 // count of connection entries
+    dataTrans->addDataByte(full ? 1 : 0);                   // if non-zero, ST should forget what it had
+    dataTrans->addDataByte(more ? 1 : 0);                   // if non-zero, ST should ask again right away
+    dataTrans->addDataByte(0);                              // reserved
+    dataTrans->addDataDword(icmpWrapper.calcDataByteCountTotal());
+    dataTrans->addDataDword(getLinesAvailable());
+
+    for(i=0; i<(int) changed.size(); i++) {                 // now the changed connections
+        int slot = changed[i].second;
+
+        TConReportedState *st = &reportState[slot];
+        dataTrans->addDataByte (slot);
+        dataTrans->addDataByte (st->status);
+        dataTrans->addDataDword(st->bytesInSocket);
+        dataTrans->addDataDword(st->remoteHost);
+        dataTrans->addDataWord (st->localPort);
+        dataTrans->addDataWord (st->remotePort);
+        dataTrans->addDataByte (st->sendQueuedKb);
+    }
+
+    Debug::out(LOG_DEBUG, "NetAdapter::conUpdateInfoDelta - ST generation: %08x, sent: %08x, now: %08x, full: %d, changed connections: %d, more: %d", stGeneration, generation, reportGeneration, full, (int) changed.size(), more);
+
+    dataTrans->padDataToMul16();
+    dataTrans->setStatus(E_NORMAL);
+}
+
+void NetAdapter::getReportedState(int slot, TConReportedState &state)
+{
+    memset(&state, 0, sizeof(state));                       // clear also padding, state is compared by memcmp()
+
+    if(slot >= (int) cons.size()) {                         // connection doesn't exist yet? it's closed
+        state.status = TCLOSED;
+        return;
+    }
+
+    TNetConnection *ci = cons[slot];
+
+    state.bytesInSocket = ci->bytesInSocket;
+    state.remoteHost    = ntohl(ci->remote_adr.sin_addr.s_addr);
+    state.localPort     = ci->localPort;
+    state.remotePort    = ntohs(ci->remote_adr.sin_port);
+    state.status        = ci->status;
+    state.sendQueuedKb  = getSendQueuedKb(slot);
+}
+
+BYTE NetAdapter::getSendQueuedKb(int slot)
+{
+    if(slot >= (int) cons.size()) {
+        return 0;
+    }
+
+    DWORD queuedKb = (cons[slot]->sendWrapper.getQueued() + 1023) / 1024;     // rounded up, so 0 means really empty
+    return MIN(queuedKb, 255);
+}
+
+void NetAdapter::updateReportGenerations(void)
+{
+    for(int i=0; i<(int) cons.size(); i++) {                // connection state changed since last time? it gets new generation
+        TConReportedState now;
+        getReportedState(i, now);
+
+        if(memcmp(&now, &reportState[i], sizeof(now)) == 0) {
+            continue;
+        }
+
+        reportGeneration++;                                 // on overflow of lower 24 bits this also changes the session, so ST will get all
+
+        if((reportGeneration >> 24) == 0) {                 // session 0 would look like generation of old host to ST
+            reportGeneration = 0x01000000;
+        }
+        reportState[i]          = now;
+        reportSlotGeneration[i] = reportGeneration;
+    }
+}
+
+DWORD NetAdapter::getLinesAvailable(void)
+{
+    DWORD linesAvailable = 0;                               // bit for each connection which has a whole line (ending with delimiter from last CNgets) waiting
+    int   count          = MIN((int) cons.size(), NET_HANDLES_COUNT);
+
+    for(int i=0; i<count; i++) {
+        if(cons[i]->readWrapper.hasLine()) {
+            linesAvailable |= ((DWORD) 1) << i;
+        }
+    }
+
+    return linesAvailable;
+}
 //----------------------------------------------
 void NetAdapter::icmpSend(void)
 {
@@ -617,6 +1293,13 @@ void NetAdapter::icmpSend(void)
 
     BYTE result;
     result = icmpWrapper.send(destinIP, icmpType, icmpCode, length, pData);
+
+    int icmpFd = icmpWrapper.getFd();
+    if(icmpFd != -1 && icmpFd != icmpFdInEpoll) {                   // ICMP socket just created? let network thread receive the replies
+        epollAdd(icmpFd, NET_EVENT_ICMP, 0, EPOLLIN);
+        icmpFdInEpoll = icmpFd;
+    }
+
     dataTrans->setStatus(result);
 }
 //----------------------------------------------
@@ -624,7 +1307,6 @@ void NetAdapter::icmpGetDgrams(void)
 {
     //pthread_mutex_lock(&networkThreadMutex);
 
-    icmpWrapper.receiveAll();
     DWORD icmpByteCount = icmpWrapper.calcDataByteCountTotal();
 
     if(icmpByteCount <= 0) {                                        // nothing to read? quit, no data
@@ -647,19 +1329,17 @@ void NetAdapter::icmpGetDgrams(void)
     //------------
     // now fill the data transporter with dgrams
     for(int i=0; i<howManyDgramsWillFit; i++) {
-        int index = icmpWrapper.getNonEmptyIndex();
-        if(index == -1) {                                           // no more dgrams? quit
+        TStingDgram *d = icmpWrapper.getOldest();
+        if(d == NULL) {                                             // no more dgrams? quit
             break;
         }
 
-        TStingDgram *d = &icmpWrapper.dgrams[index];
-
         dataTrans->addDataWord(d->count);                           // add size of this dgram
         dataTrans->addDataBfr(d->data, d->count, false);   // add the dgram
 
         Debug::out(LOG_DEBUG, "NetAdapter::icmpGetDgrams -- stored Dgram of length %d", d->count);
 
-        d->clear();                                                 // empty it
+        icmpWrapper.removeOldest();                                 // empty it
     }
 
     dataTrans->addDataWord(0);                                      // terminate with a zero, that means no other DGRAM
@@ -760,155 +1440,39 @@ void NetAdapter::resolveGetResp(void)
 int NetAdapter::findEmptyConnectionSlot(void)
 {
     int i;
+    int limit = MIN(maxConnections, driverHandles); // slot which the driver can't turn back into handle would leak
+    int used  = MIN((int) cons.size(), limit);
 
-    for(i=0; i<NET_HANDLES_COUNT; i++) {            // try to find closed (empty) slot
-        if(cons[i].isClosed()) {
+    for(i=0; i<used; i++) {                         // try to find closed (empty) slot
+        if(cons[i]->isClosed()) {
             return i;
         }
     }
 
-    return -1;                                      // no empty slot?
-}
-//----------------------------------------------
-
-void NetAdapter::updateCons(void)
-{
-    int i;
-
-    for(i=0; i<NET_HANDLES_COUNT; i++) {            // update connection info
-        if(cons[i].isClosed()) {                    // if connection closed, skip it
-            continue;
-        }
-
-        if(cons[i].activeNotPassive) {              // active?
-            updateCons_active(i);
-        } else {                                    // passive?
-            updateCons_passive(i);
-        }
-    }
-}
-
-//----------------------------------------------
-void NetAdapter::updateCons_passive(int i)
-{
-    if(cons[i].fd == -1 && cons[i].listenFd == -1) {                        // both sockets closed? quit
-        return;
+    if((int) cons.size() >= limit) {                // no empty slot, and can't add more?
+        return -1;
     }
 
-    TNetConnection *nc = &cons[i];
-
-    if(nc->fd == -1 && nc->listenFd != -1) {                                // got listening socket, but not normal socket?
-        struct sockaddr_storage remoteAddress;                              // this struct will receive the remote address if accept() succeeds
-        socklen_t               addrSize;
-        addrSize = sizeof(sockaddr);
-        memset(&remoteAddress, 0, addrSize);
-
-        int fd = accept(nc->listenFd, (struct sockaddr*) &remoteAddress, &addrSize);    // try to accept
-
-        if(fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {         // failed, because nothing waiting? quit
-            return;
-        }
-
-        Debug::out(LOG_DEBUG, "NetAdapter::updateCons_passive() -- connection %d - accept() succeeded, client connected", i);
-
-        //----------
-        setKeepAliveOptions(fd);                                // configure keep alive
-
-        // ok, got the connection, store file descriptor and new state
-        nc->fd      = fd;
-        nc->status  = TESTABLISH;
+    int first = cons.size();                        // add some connections, return the 1st new one
+    int count = MIN(NET_CONS_GROW_BY, limit - first);
 
-        nc->readWrapper.init(fd, nc->type, nc->buff_size);
-
-        // also store the remote address that just connected to us
-        if (remoteAddress.ss_family == AF_INET) {               // if it's IPv4
-            struct sockaddr_in *s = (struct sockaddr_in *) &remoteAddress;
-
-            nc->remote_adr.sin_addr.s_addr  = s->sin_addr.s_addr;
-            nc->remote_adr.sin_port         = s->sin_port;
-
-            Debug::out(LOG_DEBUG, "NetAdapter::updateCons_passive() -- connection %d - got IP & port of remote host", i);
-        }
-
-        return;
+    for(i=0; i<count; i++) {
+        cons.push_back(new TNetConnection());
     }
 
-    if(nc->fd != -1) {
-        nc->bytesInSocket = nc->readWrapper.getCount();         // try to get how many bytes can be read
-        Debug::out(LOG_DEBUG, "NetAdapter::updateCons_passive(%d) -- bytesInSocket: %d, status: %d", i, nc->bytesInSocket, nc->status);
-    }
-
-    // ok, so we have both sockets? did the data socket HUP?
-    if(didSocketHangUp(i)) {
-        Debug::out(LOG_DEBUG, "NetAdapter::updateCons_passive() -- connection %d - poll returned POLLRDHUP, so closing", i);
-
-        nc->status = TCLOSED;       // mark the state as TCLOSED
-        nc->closeIt();
-    }
+    Debug::out(LOG_DEBUG, "NetAdapter::findEmptyConnectionSlot() - connection table grew to %d connections", (int) cons.size());
+    return first;
 }
-//----------------------------------------------
-void NetAdapter::updateCons_active(int i)
-{
-    int res;
 
-    TNetConnection *nc = &cons[i];
-
-    //---------
-    // update how many bytes we can read from this sock
-    nc->bytesInSocket = nc->readWrapper.getCount();         // try to get how many bytes can be read
-    Debug::out(LOG_DEBUG, "NetAdapter::updateCons_active(%d) -- bytesInSocket: %d, status: %d", i, nc->bytesInSocket, nc->status);
-
-    //---------
-    // if it's not TCP connection, just pretend the state is 'connected' - it's only used for TCP connections, so it doesn't matter
-    if(nc->type != TCP) {
-        Debug::out(LOG_DEBUG, "NetAdapter::updateCons_active() -- non-TCP connection %d -- now TESTABLISH", i);
-        nc->status = TESTABLISH;
-        return;
+bool NetAdapter::handleIsValid(int handle)
+{
+    if(!network_handleIsValid(handle)) {            // out of range?
+        return false;
     }
 
-    //---------
-    // update connection status of TCP socket
-
-    if(nc->status == TSYN_SENT) {               // if this is TCP connection and it's in the 'connecting' state
-        res = connect(nc->fd, (struct sockaddr *) &nc->remote_adr, sizeof(nc->remote_adr));   // try to connect again
-
-        if(res < 0) {                           // error occured on connect, check what it was
-            switch(errno) {
-                case EISCONN:
-                case EALREADY:      nc->status = TESTABLISH;
-                                    Debug::out(LOG_DEBUG, "NetAdapter::updateCons_active() -- connection %d is now TESTABLISH", i);
-                                    break;  // ok, we're connected!
-
-                case EINPROGRESS:   nc->status = TSYN_SENT;
-                                    Debug::out(LOG_DEBUG, "NetAdapter::updateCons_active() -- connection %d is now TSYN_SENT", i);
-                                    break;  // still trying to connect
-
-                 // on failures
-                case ETIMEDOUT:
-                case ENETUNREACH:
-                case ECONNREFUSED:  nc->status = TCLOSED;
-                                    nc->closeIt();
-                                    Debug::out(LOG_DEBUG, "NetAdapter::updateCons_active() -- connection %d is now TCLOSED", i);
-                                    break;
-
-                default:
-                                    Debug::out(LOG_DEBUG, "NetAdapter::updateCons_active() -- connect() returned error %d", errno);
-                                    break;
-            }
-        } else if(res == 0) {                   // no error occured?
-            nc->status = TESTABLISH;
-            Debug::out(LOG_DEBUG, "NetAdapter::updateCons_active() -- connection %d is now TESTABLISH - because no error", i);
-        }
-    } else {                                            // not connecting state? try to find out the state
-        if(didSocketHangUp(i)) {
-            Debug::out(LOG_DEBUG, "NetAdapter::updateCons_active() -- connection %d - poll returned POLLRDHUP, so closing", i);
-
-            nc->status = TCLOSED;   // mark the state as TCLOSED
-            nc->closeIt();
-        }
-    }
+    return (network_handleToSlot(handle) < (int) cons.size());
 }
-
+//----------------------------------------------
 void NetAdapter::setKeepAliveOptions(int fd)
 {
     // turning on keep alive on TCP socket
@@ -925,30 +1489,6 @@ void NetAdapter::setKeepAliveOptions(int fd)
     setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL,  &keepintvl, sizeof(int));
 }
 
-//----------------------------------------------
-bool NetAdapter::didSocketHangUp(int i)
-{
-    if(cons[i].bytesInSocket != 0) {                // something to read? didn't HUP then!
-        return false;
-    }
-
-    // nothing to read? see if it closed
-    struct pollfd pfd;
-    pfd.fd      = cons[i].fd;
-    pfd.events  = POLLRDHUP | POLLERR | POLLHUP;
-    pfd.revents = 0;
-
-    int ires = poll(&pfd, 1, 0);                    // see if this connection is closed
-
-    if(ires != 0) {
-        if((pfd.revents & POLLRDHUP) != 0) {        // got POLLRDHUP event? it did HUP
-            return true;
-        }
-    }
-
-    return false;
-}
-
 //----------------------------------------------
 void NetAdapter::conGetCharBuffer(void)
 {
@@ -956,19 +1496,20 @@ void NetAdapter::conGetCharBuffer(void)
     // cmd[4] = NET_CMD_CNGET_CHAR
     int handle = cmd[5];                                // get handle
 
-    if(!network_handleIsValid(handle)) {                // handle out of range? fail
+    if(!handleIsValid(handle)) {                // handle out of range? fail
         Debug::out(LOG_DEBUG, "NetAdapter::conGetCharBuffer() -- bad handle: %d", handle);
         dataTrans->setStatus(E_PARAMETER);
         return;
     }
     int slot = network_handleToSlot(handle);
 
-    TNetConnection *nc = &cons[slot];
+    TNetConnection *nc = cons[slot];
 
     int charsUsed = cmd[9];                             // cmd[10] - how many chars were used by calling CNget_char() - we need to remove them first
     if(charsUsed > 0) {                                 // some chars were used, remove them
         Debug::out(LOG_DEBUG, "NetAdapter::conGetCharBuffer() [%d] CNget_char() used %d bytes, removing them from socket", slot, charsUsed);
         nc->readWrapper.removeBlock(charsUsed);
+        dataWasRead(slot);
     }
 
     int gotBytes = nc->readWrapper.peekBlock(dataBuffer, 250);  // peek data from socket - less than 255, because 'charsUsed' is sent as byte (for removing the last used chars from deque)
@@ -994,23 +1535,25 @@ void NetAdapter::conGetNdb(void)
     int handle          = cmd[5];                       // get handle
     int getNdbNotSize   = cmd[6];                       // If zero, returns just size. If non-zero, return data.
 
-    if(!network_handleIsValid(handle)) {                // handle out of range? fail
+    if(!handleIsValid(handle)) {                // handle out of range? fail
         Debug::out(LOG_DEBUG, "NetAdapter::conGetNdb() -- bad handle: %d", handle);
         dataTrans->setStatus(E_PARAMETER);
         return;
     }
     int slot = network_handleToSlot(handle);
 
-    TNetConnection *nc = &cons[slot];
+    TNetConnection *nc = cons[slot];
 
     int charsUsed = cmd[9];                             // cmd[10] - how many chars were used by calling CNget_char() - we need to remove them first
     if(charsUsed > 0) {                                 // some chars were used, remove them
         Debug::out(LOG_DEBUG, "NetAdapter::conGetNdb() -- slot %d CNget_char() used %d bytes, removing them from socket", slot, charsUsed);
         nc->readWrapper.removeBlock(charsUsed);
+        dataWasRead(slot);
     }
 
     if(getNdbNotSize) {
         int ndbSize = nc->readWrapper.getNdb(dataBuffer);   // read data from socket (wrapper)
+        dataWasRead(slot);
 
         Debug::out(LOG_DEBUG, "NetAdapter::conGetNdb() -- slot %d returning NDB data, size %d bytes", slot, ndbSize);
         //Debug::outBfr(dataBuffer, ndbSize);
@@ -1043,19 +1586,20 @@ void NetAdapter::conGetBlock(void)
 
     Debug::out(LOG_DEBUG, "NetAdapter::conGetBlock() -- from handle %d get %d bytes", handle, wantedLength);
 
-    if(!network_handleIsValid(handle)) {                // handle out of range? fail
+    if(!handleIsValid(handle)) {                // handle out of range? fail
         Debug::out(LOG_DEBUG, "NetAdapter::conGetBlock() -- bad handle: %d", handle);
         dataTrans->setStatus(E_PARAMETER);
         return;
     }
     int slot = network_handleToSlot(handle);
 
-    TNetConnection *nc  = &cons[slot];
+    TNetConnection *nc  = cons[slot];
 
     int charsUsed = cmd[9];                             // cmd[10]     - how many chars were used by calling CNget_char() - we need to remove them first
     if(charsUsed > 0) {                                 // some chars were used, remove them
         Debug::out(LOG_DEBUG, "NetAdapter::conGetBlock() -- CNget_char() used %d bytes, removing them from socket", charsUsed);
         nc->readWrapper.removeBlock(charsUsed);
+        dataWasRead(slot);
     }
 
     int gotBytes = nc->readWrapper.getCount();          // find out how many bytes we got for reading
@@ -1070,6 +1614,7 @@ void NetAdapter::conGetBlock(void)
 
     nc->readWrapper.peekBlock(dataBuffer, wantedLength);    // peek   data from socket
     nc->readWrapper.removeBlock(wantedLength);              // remove data from socket
+    dataWasRead(slot);
 
     //Debug::outBfr(dataBuffer, wantedLength);
     dataTrans->addDataBfr(dataBuffer, wantedLength, true);  // add data buffer, pad to mul 16
@@ -1085,32 +1630,23 @@ void NetAdapter::conGetString(void)
     int maxLength   = Utils::getWord(cmd + 6);      // cmd[7 .. 8] - max length
     BYTE delim      = cmd[8];                       // cmd[9]      - string delimiter / terminator
 
-    if(!network_handleIsValid(handle)) {                // handle out of range? fail
+    if(!handleIsValid(handle)) {                // handle out of range? fail
         Debug::out(LOG_DEBUG, "NetAdapter::conGetString() -- bad handle: %d", handle);
         dataTrans->setStatus(E_PARAMETER);
         return;
     }
     int slot = network_handleToSlot(handle);
 
-    TNetConnection *nc  = &cons[slot];
+    TNetConnection *nc  = cons[slot];
 
     int charsUsed = cmd[9];                         // cmd[10]     - how many chars were used by calling CNget_char() - we need to remove them first
     if(charsUsed > 0) {                             // some chars were used, remove them
         Debug::out(LOG_DEBUG, "NetAdapter::conGetString() -- CNget_char() used %d bytes, removing them from socket", charsUsed);
         nc->readWrapper.removeBlock(charsUsed);
+        dataWasRead(slot);
     }
 
-    int streamLength    = nc->readWrapper.getCount();       // find out how many bytes we have
-
-    nc->readWrapper.peekBlock(dataBuffer, streamLength);    // peek the whole stream
-
-    int i, foundIndex = -1;
-    for(i=0; i<streamLength; i++) {                         // now search the whole stream for the delimiter
-        if(dataBuffer[i] == delim) {
-            foundIndex = i;
-            break;
-        }
-    }
+    int foundIndex = nc->readWrapper.findDelimiter(delim);     // find delimiter, continues where the previous call stopped
 
     if(foundIndex == -1) {                          // if delimiter not found, E_NODATA
         Debug::out(LOG_DEBUG, "NetAdapter::conGetString() -- delimiter not found");
@@ -1124,12 +1660,14 @@ void NetAdapter::conGetString(void)
         return;
     }
 
+    nc->readWrapper.peekBlock(dataBuffer, foundIndex + 1);      // peek the string with the delimiter
     dataBuffer[foundIndex] = 0;                                 // remove the delimiter
     dataTrans->addDataBfr(dataBuffer, foundIndex + 1, true);    // add data buffer (including terminating zero), pad to mul 16
 
     Debug::out(LOG_DEBUG, "NetAdapter::conGetString() -- delimiter found at index %d, returning string '%s'", foundIndex, dataBuffer);
 
     nc->readWrapper.removeBlock(foundIndex + 1);            // remove the string from stream (and remove the delimiter)
+    dataWasRead(slot);
     dataTrans->setStatus(E_NORMAL);
 }
 
@@ -1140,43 +1678,44 @@ void NetAdapter::logFunctionName(BYTE cmd)
         case NET_CMD_IDENTIFY:
 
         // TCP functions
-        case NET_CMD_TCP_OPEN:              Debug::out(LOG_DEBUG, "NET_CMD_TCP_OPEN");              break;
-        case NET_CMD_TCP_CLOSE:             Debug::out(LOG_DEBUG, "NET_CMD_TCP_CLOSE");             break;
-        case NET_CMD_TCP_SEND:              Debug::out(LOG_DEBUG, "NET_CMD_TCP_SEND");              break;
-        case NET_CMD_TCP_WAIT_STATE:        Debug::out(LOG_DEBUG, "NET_CMD_TCP_WAIT_STATE");        break;
-        case NET_CMD_TCP_ACK_WAIT:          Debug::out(LOG_DEBUG, "NET_CMD_TCP_ACK_WAIT");          break;
-        case NET_CMD_TCP_INFO:              Debug::out(LOG_DEBUG, "NET_CMD_TCP_INFO");              break;
+        case NET_CMD_TCP_OPEN:              TRACE(LOG_DEBUG, "NET_CMD_TCP_OPEN");              break;
+        case NET_CMD_TCP_CLOSE:             TRACE(LOG_DEBUG, "NET_CMD_TCP_CLOSE");             break;
+        case NET_CMD_TCP_SEND:              TRACE(LOG_DEBUG, "NET_CMD_TCP_SEND");              break;
+        case NET_CMD_TCP_WAIT_STATE:        TRACE(LOG_DEBUG, "NET_CMD_TCP_WAIT_STATE");        break;
+        case NET_CMD_TCP_ACK_WAIT:          TRACE(LOG_DEBUG, "NET_CMD_TCP_ACK_WAIT");          break;
+        case NET_CMD_TCP_INFO:              TRACE(LOG_DEBUG, "NET_CMD_TCP_INFO");              break;
 
         // UDP FUNCTION
-        case NET_CMD_UDP_OPEN:              Debug::out(LOG_DEBUG, "NET_CMD_UDP_OPEN");              break;
-        case NET_CMD_UDP_CLOSE:             Debug::out(LOG_DEBUG, "NET_CMD_UDP_CLOSE");             break;
-        case NET_CMD_UDP_SEND:              Debug::out(LOG_DEBUG, "NET_CMD_UDP_SEND");              break;
+        case NET_CMD_UDP_OPEN:              TRACE(LOG_DEBUG, "NET_CMD_UDP_OPEN");              break;
+        case NET_CMD_UDP_CLOSE:             TRACE(LOG_DEBUG, "NET_CMD_UDP_CLOSE");             break;
+        case NET_CMD_UDP_SEND:              TRACE(LOG_DEBUG, "NET_CMD_UDP_SEND");              break;
 
         // ICMP FUNCTIONS
-        case NET_CMD_ICMP_SEND_EVEN:        Debug::out(LOG_DEBUG, "NET_CMD_ICMP_SEND_EVEN");        break;
-        case NET_CMD_ICMP_SEND_ODD:         Debug::out(LOG_DEBUG, "NET_CMD_ICMP_SEND_ODD");         break;
-        case NET_CMD_ICMP_HANDLER:          Debug::out(LOG_DEBUG, "NET_CMD_ICMP_HANDLER");          break;
-        case NET_CMD_ICMP_DISCARD:          Debug::out(LOG_DEBUG, "NET_CMD_ICMP_DISCARD");          break;
-        case NET_CMD_ICMP_GET_DGRAMS:       Debug::out(LOG_DEBUG, "NET_CMD_ICMP_GET_DGRAMS");       break;
+        case NET_CMD_ICMP_SEND_EVEN:        TRACE(LOG_DEBUG, "NET_CMD_ICMP_SEND_EVEN");        break;
+        case NET_CMD_ICMP_SEND_ODD:         TRACE(LOG_DEBUG, "NET_CMD_ICMP_SEND_ODD");         break;
+        case NET_CMD_ICMP_HANDLER:          TRACE(LOG_DEBUG, "NET_CMD_ICMP_HANDLER");          break;
+        case NET_CMD_ICMP_DISCARD:          TRACE(LOG_DEBUG, "NET_CMD_ICMP_DISCARD");          break;
+        case NET_CMD_ICMP_GET_DGRAMS:       TRACE(LOG_DEBUG, "NET_CMD_ICMP_GET_DGRAMS");       break;
 
         // CONNECTION MANAGER
-        case NET_CMD_CNKICK:                Debug::out(LOG_DEBUG, "NET_CMD_CNKICK");                break;
-        case NET_CMD_CNBYTE_COUNT:          Debug::out(LOG_DEBUG, "NET_CMD_CNBYTE_COUNT");          break;
-        case NET_CMD_CNGET_CHAR:            Debug::out(LOG_DEBUG, "NET_CMD_CNGET_CHAR");            break;
-        case NET_CMD_CNGET_NDB:             Debug::out(LOG_DEBUG, "NET_CMD_CNGET_NDB");             break;
-        case NET_CMD_CNGET_BLOCK:           Debug::out(LOG_DEBUG, "NET_CMD_CNGET_BLOCK");           break;
-        case NET_CMD_CNGETINFO:             Debug::out(LOG_DEBUG, "NET_CMD_CNGETINFO");             break;
-        case NET_CMD_CNGETS:                Debug::out(LOG_DEBUG, "NET_CMD_CNGETS");                break;
-        case NET_CMD_CN_UPDATE_INFO:        Debug::out(LOG_DEBUG, "NET_CMD_CN_UPDATE_INFO");        break;
+        case NET_CMD_CNKICK:                TRACE(LOG_DEBUG, "NET_CMD_CNKICK");                break;
+        case NET_CMD_CNBYTE_COUNT:          TRACE(LOG_DEBUG, "NET_CMD_CNBYTE_COUNT");          break;
+        case NET_CMD_CNGET_CHAR:            TRACE(LOG_DEBUG, "NET_CMD_CNGET_CHAR");            break;
+        case NET_CMD_CNGET_NDB:             TRACE(LOG_DEBUG, "NET_CMD_CNGET_NDB");             break;
+        case NET_CMD_CNGET_BLOCK:           TRACE(LOG_DEBUG, "NET_CMD_CNGET_BLOCK");           break;
+        case NET_CMD_CNGETINFO:             TRACE(LOG_DEBUG, "NET_CMD_CNGETINFO");             break;
+        case NET_CMD_CNGETS:                TRACE(LOG_DEBUG, "NET_CMD_CNGETS");                break;
+        case NET_CMD_CN_UPDATE_INFO:        TRACE(LOG_DEBUG, "NET_CMD_CN_UPDATE_INFO");        break;
+        case NET_CMD_CN_UPDATE_INFO_DELTA:  TRACE(LOG_DEBUG, "NET_CMD_CN_UPDATE_INFO_DELTA"); break;
 
         // MISC
-        case NET_CMD_RESOLVE:               Debug::out(LOG_DEBUG, "NET_CMD_RESOLVE");               break;
-        case NET_CMD_RESOLVE_GET_RESPONSE:  Debug::out(LOG_DEBUG, "NET_CMD_RESOLVE_GET_RESPONSE");  break;
-        case NET_CMD_ON_PORT:               Debug::out(LOG_DEBUG, "NET_CMD_ON_PORT");               break;
-        case NET_CMD_OFF_PORT:              Debug::out(LOG_DEBUG, "NET_CMD_OFF_PORT");              break;
-        case NET_CMD_QUERY_PORT:            Debug::out(LOG_DEBUG, "NET_CMD_QUERY_PORT");            break;
-        case NET_CMD_CNTRL_PORT:            Debug::out(LOG_DEBUG, "NET_CMD_CNTRL_PORT");            break;
-
-        default:                            Debug::out(LOG_DEBUG, "NET_CMD - unknown command!");    break;
+        case NET_CMD_RESOLVE:               TRACE(LOG_DEBUG, "NET_CMD_RESOLVE");               break;
+        case NET_CMD_RESOLVE_GET_RESPONSE:  TRACE(LOG_DEBUG, "NET_CMD_RESOLVE_GET_RESPONSE");  break;
+        case NET_CMD_ON_PORT:               TRACE(LOG_DEBUG, "NET_CMD_ON_PORT");               break;
+        case NET_CMD_OFF_PORT:              TRACE(LOG_DEBUG, "NET_CMD_OFF_PORT");              break;
+        case NET_CMD_QUERY_PORT:            TRACE(LOG_DEBUG, "NET_CMD_QUERY_PORT");            break;
+        case NET_CMD_CNTRL_PORT:            TRACE(LOG_DEBUG, "NET_CMD_CNTRL_PORT");            break;
+
+        default:                            TRACE(LOG_DEBUG, "NET_CMD - unknown command!");    break;
     }
 }
@@ -3,21 +3,31 @@
 #define _NETADAPTER_H_
 
 #include <unistd.h>
+#include <pthread.h>
+#include <vector>
 
 #include "../isettingsuser.h"
 #include "resolver.h"
 #include "readwrapper.h"
+#include "sendwrapper.h"
 #include "icmpwrapper.h"
 
 #include "sting.h"
 
 class AcsiDataTrans;
 
-#define NET_HANDLES_COUNT       32
+#define NET_HANDLES_COUNT       32              // connections reported by NET_CMD_CN_UPDATE_INFO - its layout is fixed
+#define NET_MAX_HANDLES         128             // handles 0x50 .. 0xcf - higher status bytes are STiNG error codes
 #define NET_STARTING_HANDLE     0x50
 
-#define network_handleIsValid(X)    ((X >= NET_STARTING_HANDLE) && (X < (NET_STARTING_HANDLE + NET_HANDLES_COUNT)))
-#define network_slotIsValid(X)      ((X >= 0) && (X < (NET_STARTING_HANDLE + NET_HANDLES_COUNT)))
+#define NET_DEFAULT_MAX_CONS    NET_MAX_HANDLES // default for setting NET_MAX_CONNECTIONS
+#define NET_CONS_GROW_BY        8               // connection table grows by this many connections
+
+#define NET_DEFAULT_COALESCE_MS 5               // default for setting NET_SEND_COALESCE_MS - how long small TCP writes can wait for more
+#define NET_MAX_COALESCE_MS     100
+
+#define network_handleIsValid(X)    ((X >= NET_STARTING_HANDLE) && (X < (NET_STARTING_HANDLE + NET_MAX_HANDLES)))
+#define network_slotIsValid(X)      ((X >= 0) && (X < (NET_STARTING_HANDLE + NET_MAX_HANDLES)))
 
 #define network_slotToHandle(X)     (X + NET_STARTING_HANDLE)
 #define network_handleToSlot(X)	    (X - NET_STARTING_HANDLE)
@@ -27,6 +37,18 @@ class AcsiDataTrans;
 #define NET_BUFFER_SIZE     (1024 * 1024)
 #define CON_BFR_SIZE        (100 * 1024)
 
+// what kind of fd is registered in epoll - stored in epoll event data together with fd and slot
+#define NET_EVENT_DATA      1               // data socket of connection
+#define NET_EVENT_LISTEN    2               // listening socket of connection
+#define NET_EVENT_ICMP      3               // ICMP socket
+#define NET_EVENT_WAKE      4               // pipe used to wake up the network thread
+#define NET_EVENT_CLOSING   5               // data socket of connection which ST closed, still writing out what ST sent
+
+#define NET_CLOSE_FLUSH_MS  5000            // how long closed connection can take to write out what ST sent
+
+#define NET_MAX_EVENTS      64
+#define NET_RECEIVE_STEP    (32 * 1024)     // received from one socket under one lock - the rest on the next epoll round, so ST command doesn't wait long
+
 //-------------------------------------
 #define NETREQ_TYPE_RESOLVE     1
 
@@ -47,7 +69,6 @@ public:
 
     ~TNetConnection() {                 // destructor to possibly close connection
         closeIt();
-        readWrapper.clearAll();
     }
 
     void closeIt(void) {                // close the data socket
@@ -59,6 +80,8 @@ public:
             close(listenFd);
         }
 
+        readWrapper.clearAll();         // unread and unsent data is lost now, buffers go back to pool
+        sendWrapper.clearAll();
         initVars();
     }
 
@@ -81,6 +104,10 @@ public:
 
         gotPrevLastByte     = false;
         prevLastByte        = 0;
+
+        remoteClosed        = false;
+        readPaused          = false;
+        epollEvents         = 0;
     }
 
     bool isClosed(void) {                       // check if it's closed
@@ -100,6 +127,7 @@ public:
     int     buff_size;              // for TCP - TX buffer size = maximu packet size that should be sent
 
     ReadWrapper readWrapper;
+    SendWrapper sendWrapper;        // for TCP - data which socket didn't take yet
 
     int bytesInSocket;          // how many bytes are waiting to be read from socket
     int status;                 // status of connection - open, closed, ...
@@ -107,10 +135,33 @@ public:
 
     bool gotPrevLastByte;       // flag that we do have a last byte from the previous transfer
     BYTE prevLastByte;          // this is the last byte from previous transfer
+
+    bool remoteClosed;          // remote side closed TCP connection, close it when ST reads all the data
+    bool readPaused;            // readWrapper is full, don't wait for data until ST reads some data
+    DWORD epollEvents;          // events for which the data socket is registered in epoll, 0 if not registered
 };
 
 //-------------------------------------
 
+typedef struct {                        // TCP connection which ST closed, but its socket didn't take all the data yet
+    int         fd;
+    SendWrapper *sendWrapper;
+    DWORD       deadline;               // in Utils::getCurrentMs() time - then it's closed even if not everything was sent
+} TClosingSocket;
+
+//-------------------------------------
+
+typedef struct {                        // connection state as reported to ST by conUpdateInfo()
+    DWORD   bytesInSocket;
+    DWORD   remoteHost;
+    WORD    localPort;
+    WORD    remotePort;
+    BYTE    status;
+    BYTE    sendQueuedKb;
+} TConReportedState;
+
+//-------------------------------------
+
 class NetAdapter: public ISettingsUser
 {
 public:
@@ -121,15 +172,57 @@ public:
     void setAcsiDataTrans(AcsiDataTrans *dt);
 
     void processCommand(BYTE *command);
+
+    static void *networkThreadCode(void *ptr);
 	
 private:
     BYTE            *cmd;
     AcsiDataTrans   *dataTrans;
     BYTE            *dataBuffer;
 
-    TNetConnection  cons[NET_HANDLES_COUNT];    // for handling of TCP and UDP connections
+    std::vector<TNetConnection *> cons;         // for handling of TCP and UDP connections, grows on demand up to maxConnections
+    int             maxConnections;
+    int             driverHandles;              // handles the ST driver can use, told by NET_CMD_IDENTIFY - connections never go above this
+    int             sendCoalesceMs;             // for new TCP connections, 0 - small writes are not coalesced
     IcmpWrapper     icmpWrapper;                // for handling ICMP sending and receiving
     ResolverRequest resolver;                   // for handling DNS resolve requests
+
+    // network thread - waits for socket events, receives data, accepts and finishes connects, so processCommand() only uses already known state
+    pthread_t       netThreadInfo;
+    pthread_mutex_t netMutex;                   // locked while handling command from ST and while handling each socket event
+    volatile int    commandsWaiting;            // ST commands waiting for netMutex - network thread lets them go first
+    DWORD           commandSeq;                 // +1 for each ST command, so network thread knows its events might be stale
+    int             epollFd;
+    int             wakePipe[2];
+    volatile bool   netThreadShouldStop;
+    int             icmpFdInEpoll;              // ICMP socket registered in epoll, or -1
+    RecvBatch       recvBatch;                  // buffers for receiving UDP datagrams, used only by network thread
+    std::vector<TClosingSocket> closingSockets; // closed by ST, network thread writes out the rest and closes them
+
+    // for conUpdateInfoDelta() - each change of reported state gets new generation, ST asks just for changes since its generation
+    DWORD               reportGeneration;                           // highest byte is session, so ST's generation from other session is not valid
+    DWORD               reportSlotGeneration[NET_MAX_HANDLES];      // generation of last change of each connection
+    TConReportedState   reportState[NET_MAX_HANDLES];               // state of each connection at that generation
+
+    void networkThreadLoop(void);
+    void lockForNetworkThread(void);            // lock netMutex, but only after the waiting ST commands
+    DWORD currentEvents(int fd);                // what epoll would report for the fd now, 0 if nothing or fd was closed
+    void handleSocketEvent(int kind, int fd, int slot, DWORD events);
+    void handleListenEvent(int slot, int fd);
+    void handleDataEvent  (int slot, int fd, DWORD events);
+
+    void epollAdd   (int fd, int kind, int slot, DWORD events);
+    void epollModify(int fd, int kind, int slot, DWORD events);
+    void epollRemove(int fd);
+    void updateDataEvents(int slot);            // register data socket of connection for events it needs now (read, write, connect)
+    void dataWasRead(int slot);                 // ST took some data from connection - update state, resume reading if was paused
+    void closeIfRemoteClosed(int slot);
+    void closeWhenFlushed(int slot);            // hand the data socket with unsent data over to network thread, the connection can be closed right away
+    void handleClosingEvent(int fd, DWORD events);
+    int  expireClosingSockets(void);            // close the sockets which didn't make it in time, returns ms till the next deadline
+    void finishClosing(int index);
+    int  flushHeldData(bool all);               // write held back small writes which waited long enough, returns ms till the next flush
+    void wakeNetworkThread(void);
     
     void loadSettings(void);
     void identify(void);
@@ -143,6 +236,7 @@ private:
     void conGetBlock(void);             // CNget_block() handling
     void conGetString(void);            // CNgets()      handling
     void conUpdateInfo(void);           // CNgetinfo() and CNbyte_count() handling
+    void conUpdateInfoDelta(void);      // the same, but returns just connections changed since generation ST has
 
     void icmpSend(void);                // ICMP_send()   handling
     void icmpGetDgrams(void);           // ICMP datagram retrieving 
@@ -155,14 +249,15 @@ private:
     WORD getLocalPort(int sockFd);
     void setKeepAliveOptions(int fd);
 
-    void updateCons_active (int i);
-    void updateCons_passive(int i);
-    bool didSocketHangUp   (int i);
-    
     //--------------
     // helper functions
     int  findEmptyConnectionSlot(void); // get index of empty connection slot, or -1 if nothing is available
-    void updateCons(void);
+    bool handleIsValid(int handle);     // handle in range and its connection exists
+
+    void  getReportedState(int slot, TConReportedState &state);
+    void  updateReportGenerations(void);
+    DWORD getLinesAvailable(void);
+    BYTE  getSendQueuedKb(int slot);
 
     void logFunctionName(BYTE cmd);
     void closeAndCleanAll(void);
@@ -8,10 +8,14 @@
  */
 
 #define NET_CMD_IDENTIFY                0x00
-/* no argument
+/* cmd[5] = how many handles the driver can take (from NET_STARTING_HANDLE up), 0 from older drivers means NET_HANDLES_COUNT
  * return a buffer with :
  * 32 bytes = identification string + padding
- * 4 bytes = local IP address */
+ * 2 bytes = protocol version
+ * 4 bytes = local IP address
+ * 1 byte  = NET_FEATURE_* bits - what this host supports on top of the protocol version (older hosts send 0) */
+
+#define NET_FEATURE_CONINFO_DELTA       0x01    // host knows NET_CMD_CN_UPDATE_INFO_DELTA
 
 // TCP functions
 #define NET_CMD_TCP_OPEN                0x10
@@ -33,7 +37,9 @@
  * arg4 = isOdd
  * arg5 = oddByte
  * + data buffer
- * returns E_PARAMETER / E_OBUFFULL / E_NORMAL */
+ * returns E_PARAMETER / E_OBUFFULL / E_NORMAL
+ * data which socket doesn't take right away is kept in send buffer of NET_SEND_BUFFER_SIZE bytes,
+ * E_OBUFFULL is returned (and nothing is sent) if the data doesn't fit into free space of send buffer */
 #define NET_CMD_TCP_WAIT_STATE          0x13
 /* not used */
 #define NET_CMD_TCP_ACK_WAIT            0x14
@@ -119,6 +125,24 @@
  * NET_HANDLES_COUNT x 4 = remote host
  * NET_HANDLES_COUNT x 2 = remote port
  * 4 = bytes waiting to be read on ICMP socket
+ * 4 = bit for each connection with a whole line waiting (delimiter from last CNgets)
+ * NET_HANDLES_COUNT x 1 = kB of TCP data waiting in send buffer (rounded up, max 255) - see NET_SEND_BUFFER_SIZE
+ */
+#define NET_CMD_CN_UPDATE_INFO_DELTA    0x48
+/* long command - like NET_CMD_CN_UPDATE_INFO, but returns only connections changed since the generation ST has
+ * arg1..arg4 (Dword) = generation returned by previous call, 0 if ST has nothing yet
+ * return a buffer of data
+ * 4 = generation - send this next time
+ * 1 = count of connection entries which follow
+ * 1 = if non-zero, this is full table (ST's generation was not valid), forget everything
+ * 1 = if non-zero, not all changes fit - call again right away with the returned generation
+ * 1 = reserved
+ * 4 = bytes waiting to be read on ICMP socket
+ * 4 = bit for each connection with a whole line waiting (delimiter from last CNgets)
+ * entries of 15 bytes :
+ *   1 = connection index, 1 = status, 4 = bytes waiting to be read in socket,
+ *   4 = remote host, 2 = local port, 2 = remote port, 1 = kB waiting in send buffer
+ * at most NET_DELTA_MAX_ENTRIES entries, the oldest changes first
  */
 #define NET_CMD_GET_NEXT_NDB_SIZE       0x4E
 
@@ -135,6 +159,9 @@
 
 #define NET_CMD_RESOLVE_GET_RESPONSE    0x55
 
+#define NET_SEND_BUFFER_SIZE    (128 * 1024)    // size of host's send buffer for each TCP connection
+#define NET_DELTA_MAX_ENTRIES   ((512 - 16) / 15)   // entries of NET_CMD_CN_UPDATE_INFO_DELTA which fit in one sector
+
 #define RW_ALL_TRANSFERED   0       // return this is all the required data was read / written
 #define RW_PARTIAL_TRANSFER 1       // return this if not all of the required data was read / written
 
@@ -25,32 +25,18 @@
 #include "sting.h"
 #include "readwrapper.h"
 
-//---------------------------------------------
-NdbItem::NdbItem(int inSize, BYTE *inData, DWORD fromAddr, WORD fromPort)
-{
-    data = new BYTE[inSize];                // allocate RAM
-    memcpy(data, inData, inSize);           // copy in data
-
-    size = inSize;
-    
-    from.addr = fromAddr;                   // store address
-    from.port = fromPort;
-}
-
-NdbItem::~NdbItem(void)
-{
-    delete []data;
-}
-
 //---------------------------------------------
 ReadWrapper::ReadWrapper(void)
 {
+    ring        = NULL;
+    ringSize    = 0;
+    ringMask    = 0;
     init(0, 0, 0);
 }
 
 ReadWrapper::~ReadWrapper(void)
 {
-    clearAll();
+    releaseRing();
 }
 
 void ReadWrapper::init(int inFd, int inType, int inBuffSize)
@@ -64,57 +50,58 @@ void ReadWrapper::init(int inFd, int inType, int inBuffSize)
 
 void ReadWrapper::clearAll(void)
 {
-    while(items.size() > 0) {                           // if there are some items
-        if(items.empty()) {                             // nothing in deque? quit
-            return;
-        }
+    releaseRing();                                      // connection doesn't hold memory until it receives something
 
-        NdbItem *item = (NdbItem *) items.front();      // get item
-        
-        if(item == NULL) {
-            continue;
-        }
 
-        delete item;                                    // delete it
-        items.pop_front();                              // remove it from deque
-    }
+    head        = 0;
+    tail        = 0;
+    dataCount   = 0;
+    frontUsed   = 0;
+
+    scanDelim   = -1;
+    scanCount   = 0;
+    scanFound   = false;
 }
 
-int ReadWrapper::getCount(void)                         // get recv data count - for UDP this is merged count through datagrams
+int ReadWrapper::receive(RecvBatch &batch, int maxBytes)
 {
-    int totalCount = 0;
-
     if(fd < 1) {                                        // invalid handle? nothing to read
-        Debug::out(LOG_DEBUG, "ReadWrapper::getCount() - invalid handle, returned 0");
         return 0;
     }
 
-    //--------------
-    // for TCP
-    if(type == TCP) {                                   // for TCP - use ioctl() to find count of bytes in stream
-        totalCount = tcpBytesWaiting();
-        Debug::out(LOG_DEBUG, "ReadWrapper::getCount() - TCP connection has %d bytes", totalCount);
-        return totalCount;
+    if(type == TCP) {
+        return tcpReceive(maxBytes);
     }
 
-    //--------------
-    // for UDP
     if(type == UDP) {
-        udpTryReceive();                                // try to receive if something is waiting
-
-        totalCount = getItemsTotalSize();               // return how much data we have
-        Debug::out(LOG_DEBUG, "ReadWrapper::getCount() - UDP connection has %d bytes", totalCount);
-        return totalCount;
+        return udpReceive(batch, maxBytes);
     }
 
-    //--------------
-    // otherwise
     return 0;
 }
 
+bool ReadWrapper::isFull(void)
+{
+    if(ringSize < READWRAPPER_MAX_RING) {               // ring can still grow? not full
+        return false;
+    }
+
+    DWORD freeSpace = ringSize - ringUsed();
+
+    if(type == UDP) {                                   // for UDP keep space for the biggest datagram, so we never have to drop one
+        return (freeSpace < (sizeof(TDgramHeader) + READWRAPPER_MAX_DGRAM));
+    }
+
+    return (freeSpace == 0);
+}
+
+int ReadWrapper::getCount(void)                         // get recv data count - for UDP this is merged count through datagrams
+{
+    return dataCount;
+}
+
 int ReadWrapper::getNdb(BYTE *tmpBuffer)                // for UDP get one datagram, for TCP get a block from stream
 {
-    int res;
     int size = getNextNdbSize();                        // find out how much we should get
 
     if(size < 1) {                                      // nothing? quit
@@ -125,31 +112,21 @@ int ReadWrapper::getNdb(BYTE *tmpBuffer)                // for UDP get one datag
     //--------------
     // for TCP
     if(type == TCP) {
-        res = recv(fd, tmpBuffer, size, MSG_DONTWAIT); // read the data
-        Debug::out(LOG_DEBUG, "ReadWrapper::getNdb() - TCP recv: %d", res);
-		//Debug::outBfr(tmpBuffer, res);
-        return res;
+        peekBlock(tmpBuffer, size);                     // get block from stream
+        removeBlock(size);
+
+        Debug::out(LOG_DEBUG, "ReadWrapper::getNdb() - TCP size: %d", size);
+        return size;
     }
 
     //--------------
     // for UDP
     if(type == UDP) {
-        udpTryReceive();                                // try to receive if something is waiting
-
-        if(items.empty()) {                             // nothing in deque? quit
-            return 0;
-        }
-        
-        NdbItem *item = (NdbItem *) items.front();      // get item
-
-        if(item == NULL) {
-            return 0;
-        }
-
-        memcpy(tmpBuffer, item->data, size);            // copy the data
+        ringRead(head + sizeof(TDgramHeader) + frontUsed, tmpBuffer, size); // copy the data
 
-        delete item;                                    // delete it
-        items.pop_front();                              // remove pointer from deque
+        int countBefore = dataCount;
+        dropFrontDgram();                               // and remove the whole datagram
+        scanSkip(countBefore - dataCount);
 
         Debug::out(LOG_DEBUG, "ReadWrapper::getNdb() - UDP size: %d", size);
         return size;
@@ -162,35 +139,22 @@ int ReadWrapper::getNdb(BYTE *tmpBuffer)                // for UDP get one datag
 
 int ReadWrapper::getNextNdbSize(void)
 {
-    int nextSize;
-
     //--------------
     // for TCP
     if(type == TCP) {
-        int totalCount  = tcpBytesWaiting();            // how many bytes are waiting?
-        nextSize        = MIN(totalCount, buff_size);
-
-        return nextSize;
+        return MIN(dataCount, buff_size);
     }
 
     //--------------
     // for UDP
     if(type == UDP) {
-        udpTryReceive();                                // try to receive if something is waiting
-
-        if(items.empty()) {                             // nothing in deque? quit
+        if(head == tail) {                              // no datagram? quit
             return 0;
         }
-        
-        NdbItem *item = (NdbItem *) items.front();      // get item
-        
-        if(item == NULL) {
-            return 0;
-        }
-        
-        nextSize = MIN(item->size, 32*1024);
 
-        return nextSize;
+        TDgramHeader hdr;
+        ringRead(head, (BYTE *) &hdr, sizeof(hdr));
+        return MIN((int) (hdr.size - frontUsed), 32*1024);
     }
 
     //--------------
@@ -198,253 +162,394 @@ int ReadWrapper::getNextNdbSize(void)
     return 0;
 }
 
+int ReadWrapper::peekBlock(BYTE *tmpBuffer, int size)   // merge buffers, return data without removing from queue
+{
+    if(size <= 0 || dataCount == 0) {
+        return 0;   //nothing to do
+    }
+
+    size = MIN(size, dataCount);
 
-int ReadWrapper::peekBlock(BYTE *tmpBuffer, int size)   // for UDP merge buffers, return data without removing from queue
+    if(type != UDP) {                                   // stream - just copy from the ring
+        ringRead(head, tmpBuffer, size);
+        Debug::out(LOG_DEBUG, "ReadWrapper::peekBlock() - peek %d bytes", size);
+        return size;
+    }
+
+    // UDP - merge received datagrams into single block
+    BYTE *p         = tmpBuffer;
+    int remaining   = size;                             // how many bytes we still have to copy
+    int ndbUsed     = 0;
+    DWORD pos       = head;
+    DWORD skip      = frontUsed;                        // part of the 1st datagram which was already removed
+
+    while(remaining > 0 && pos != tail) {
+        TDgramHeader hdr;
+        ringRead(pos, (BYTE *) &hdr, sizeof(hdr));
+
+        int count = MIN((int) (hdr.size - skip), remaining);
+        ringRead(pos + sizeof(hdr) + skip, p, count);
+
+        p           += count;
+        remaining   -= count;
+        pos         += sizeof(hdr) + hdr.size;
+        skip         = 0;
+        ndbUsed++;
+    }
+
+    int returnedCount = size - remaining;
+    Debug::out(LOG_DEBUG, "ReadWrapper::peekBlock() - peek %d bytes, used %d NDBs", returnedCount, ndbUsed);
+    return returnedCount;                               // return how many bytes we got
+}
+
+void ReadWrapper::removeBlock(int size)                 // remove from queue
 {
-    int totalCount, res;
-
-	if(size <= 0) {
-		return 0;	//nothing to do
-	}
-
-    if(type == TCP) {        //-------------- for TCP
-        totalCount = tcpBytesWaiting();                            // how many bytes are waiting?
-		if(totalCount <= 0) {
-	        Debug::out(LOG_DEBUG, "ReadWrapper::peekBlock() - TCP No available byte. asked %d", size);
-			return 0;
-		}
-
-        size = MIN(totalCount, size);
-        res  = recv(fd, tmpBuffer, size, MSG_DONTWAIT | MSG_PEEK); // peek the data (leave it in deque)
-
-		if(res < 0) {
-			if(errno == EAGAIN || errno == EWOULDBLOCK) {
-				return 0;	// nothing available yet
-			}
-			Debug::out(LOG_ERROR, "ReadWrapper::peekBlock() - TCP recv() %d bytes error : %s", size, strerror(errno));
-		} else {
-	        Debug::out(LOG_DEBUG, "ReadWrapper::peekBlock() - TCP peek %d bytes, res: %d", size, res);
-		}
-        return res;
-    } else if(type == UDP) { //-------------- for UDP
-        udpTryReceive();                                // try to receive if something is waiting
-
-        if(items.empty()) {                             // nothing in deque? quit
-            Debug::out(LOG_DEBUG, "ReadWrapper::peekBlock() - UDP peek - nothing in queue");
-            return 0;
-        }
-        
-        BYTE *p       = tmpBuffer;
-        int itemsCnt  = items.size();                   // how many items we have? 
-        int remaining = size;                           // how many bytes we still have to receive
-        int ndbUsed   = 0;        
-        
-        // merge received datagrams into single block
-        for(int i=0; i<itemsCnt; i++) {
-            NdbItem *item = (NdbItem *) items[i];       // get item
-            ndbUsed++;
-            
-            if(item->size <= remaining) {               // if the whole item will fit in the rest of the buffer, use whole item
-                memcpy(p, item->data, item->size);
-
-                remaining   -= item->size;
-                p           += item->size;
-                
-                if(remaining <= 0) {
-                    break;
-                }                
-            } else {                                    // if this item won't fit in the rest of buffer, use just part of the item and quit
-                memcpy(p, item->data, remaining);
+    int remaining = MIN(size, dataCount);               // how many bytes we still need to remove?
+    int toRemove  = remaining;
+
+    if(type != UDP) {                                   // stream - just move the read position
+        head        += remaining;
+        dataCount   -= remaining;
+        remaining    = 0;
+    } else {                                            // UDP - remove whole datagrams, the last one might be removed just partially
+        while(remaining > 0 && head != tail) {
+            TDgramHeader hdr;
+            ringRead(head, (BYTE *) &hdr, sizeof(hdr));
+
+            int rest = hdr.size - frontUsed;            // what is left from this datagram
+
+            if(rest <= remaining) {                     // if the whole datagram needs to be removed, remove it
+                remaining -= rest;
+                dropFrontDgram();
+            } else {                                    // if only part of this datagram needs to be removed, just remember how much
+                frontUsed   += remaining;
+                dataCount   -= remaining;
                 remaining    = 0;
-                break;
             }
         }
+    }
 
-        int returnedCount = size - remaining;
-        Debug::out(LOG_DEBUG, "ReadWrapper::peekBlock() - UDP peek %d bytes, used %d NDBs", returnedCount, ndbUsed);
-        return returnedCount;                       // return how many bytes we got
+    if(head == tail) {                                  // empty? start from the beginning, so the next data is contiguous
+        head = 0;
+        tail = 0;
     }
 
-    //--------------
-    // otherwise
-    return 0;
+    scanSkip(toRemove - remaining);
+
+    Debug::out(LOG_DEBUG, "ReadWrapper::removeBlock(%d) - removed %d bytes, %d bytes left", size, (toRemove - remaining), dataCount);
 }
 
-void ReadWrapper::removeBlock(int size)                 // remove from queue
+int ReadWrapper::findDelimiter(BYTE delim)
 {
-    int totalCount, res;
+    if(scanDelim != delim) {                            // other delimiter than last time? scan from start
+        scanDelim = delim;
+        scanCount = 0;
+        scanFound = false;
+    }
 
-    //--------------
-    // for TCP
-    if(type == TCP) {
-        totalCount = tcpBytesWaiting();                     // how many bytes are waiting?
+    if(scanFound) {                                     // found last time, and it wasn't removed yet
+        return scanCount;
+    }
 
-        int howManyWeWillRemove = MIN(totalCount, size);    // how many we will remove?
+    if(scanCount >= dataCount) {                        // nothing new since last scan
+        return -1;
+    }
 
-        while(howManyWeWillRemove > 0) {                    // remove data in a loop, remove by the size of TMP BUFFER
-            int removeCountSingle = MIN(howManyWeWillRemove, TMP_BFR_SIZE);
+    if(type != UDP) {                                   // stream - scan just the new part
+        int offset = scanRing(head + scanCount, dataCount - scanCount, delim);
 
-            res = recv(fd, tmpBfr, removeCountSingle, MSG_DONTWAIT);    // get the data (remove it)
-            if(res < 0) {
-				Debug::out(LOG_ERROR, "ReadWrapper::removeBlock() TCP recv error : %s", strerror(errno));
-                break;
-            }
-			Debug::out(LOG_DEBUG, "ReadWrapper::removeBlock() TCP removed %d bytes", res);
-            howManyWeWillRemove -= res;       // update count how many we still need to remove
+        if(offset < 0) {
+            scanCount = dataCount;
+            return -1;
         }
 
-        return;
+        scanCount += offset;
+        scanFound  = true;
+        return scanCount;
     }
 
-    //--------------
-    // for UDP
-    if(type == UDP) {
-        udpTryReceive();                                // try to receive if something is waiting
+    // UDP - go through datagrams, skip the already scanned data
+    DWORD pos       = head;
+    DWORD skip      = frontUsed;                        // part of the 1st datagram which was already removed
+    int   dataPos   = 0;                                // position of this datagram in merged data
 
-        if(items.empty()) {                             // nothing in deque? quit
-            return;
-        }
-        
-        int itemsCnt    = items.size();                 // how many items we have? 
-        int remaining   = size;                         // how many bytes we still need to remove?
-        int ndbRemoved  = 0;
-        bool lastPartial = false;
-
-        // merge received datagrams into single block
-        for(int i=0; i<itemsCnt; i++) {
-            if(remaining <= 0) {                        // nothing to remove? quit
-                break;
-            }
-        
-            ndbRemoved++;
-            NdbItem *item = (NdbItem *) items.front();  // get item
+    while(pos != tail) {
+        TDgramHeader hdr;
+        ringRead(pos, (BYTE *) &hdr, sizeof(hdr));
 
-            if(item == NULL) {
-                break;
-            }
-            
-            if(item->size <= remaining) {               // if the whole item needs to be removed, remove it
-                Debug::out(LOG_DEBUG, "ReadWrapper::removeBlock(%d), loop %d - item.size() is %d bytes, removing whole block", size, i, item->size);
-                lastPartial = false;                    // full block remove
-
-                remaining -= item->size;                // subtract size
-
-                delete item;                            // delete item
-                items.pop_front();                
-                
-                if(remaining <= 0) {
-                    break;
-                }
-            } else {                                    // if only part of this item needs to be removed, remove just part and quit
-                Debug::out(LOG_DEBUG, "ReadWrapper::removeBlock(%d), loop %d - item.size() is %d bytes, removing part of the block", size, i, item->size);
-                lastPartial = true;                     // partial block remove
-
-                int restThatStaysAfterRemove = item->size - remaining;
-
-                memcpy(tmpBfr, item->data + remaining,  restThatStaysAfterRemove);      // copy the rest to tmp buffer  
-                memcpy(item->data, tmpBfr,              restThatStaysAfterRemove);      // now back from tmp buffer to item
-                item->size = restThatStaysAfterRemove;                                  // store the new size
-                break;
+        int size = hdr.size - skip;
+
+        if(scanCount < dataPos + size) {                // this datagram wasn't scanned whole yet?
+            int from   = (scanCount > dataPos) ? (scanCount - dataPos) : 0;
+            int offset = scanRing(pos + sizeof(hdr) + skip + from, size - from, delim);
+
+            if(offset >= 0) {
+                scanCount = dataPos + from + offset;
+                scanFound = true;
+                return scanCount;
             }
         }
 
-        Debug::out(LOG_DEBUG, "ReadWrapper::removeBlock(%d) - UDP removed %d bytes (%d remaining), removed %d NDBs, last was %s NDB remove", size, (size - remaining), remaining, ndbRemoved, (lastPartial ? "partial" : "full"));
-        return;
+        dataPos += size;
+        pos     += sizeof(hdr) + hdr.size;
+        skip     = 0;
     }
+
+    scanCount = dataCount;
+    return -1;
 }
 
-//-------------------------------
-int ReadWrapper::tcpBytesWaiting(void)
+bool ReadWrapper::hasLine(void)
 {
-    int res, value;
-
-    res = ioctl(fd, FIONREAD, &value);              // try to get how many bytes can be read
-    if(res < 0) {                                   // ioctl failed? 
-        value = 0;
+    if(scanDelim < 0) {                                 // findDelimiter() not used yet, don't know what line is
+        return false;
     }
 
-    return value;
+    return (findDelimiter(scanDelim) >= 0);
 }
 
 //-------------------------------
-void ReadWrapper::udpTryReceive(void)
+int ReadWrapper::tcpReceive(int maxBytes)
 {
-    int res, readCount;
+    int got = 0;
+
+    while(makeSpace()) {
+        DWORD space = ringSize - ringUsed();
+
+        if(maxBytes > 0) {                              // limited? the rest comes next time
+            if(got >= maxBytes) {
+                return 1;
+            }
+            space = MIN(space, (DWORD) (maxBytes - got));
+        }
+
+        struct iovec iov[2];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+
+        msg.msg_iov     = iov;                          // receive directly into the free part of ring
+        msg.msg_iovlen  = ringSpans(tail, space, iov);
+
+        int res = recvmsg(fd, &msg, MSG_DONTWAIT);
+
+        if(res > 0) {                                   // got some data? store it
+            tail        += res;
+            dataCount   += res;
+            got         += res;
+            continue;
+        }
+
+        if(res == 0) {                                  // remote side closed connection
+            Debug::out(LOG_DEBUG, "ReadWrapper::tcpReceive() - connection closed by remote side");
+            return -1;
+        }
+
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {   // no more data? socket is empty
+            return 0;
+        }
+
+        if(errno == EINTR) {
+            continue;
+        }
+
+        Debug::out(LOG_ERROR, "ReadWrapper::tcpReceive() - recv() error : %s", strerror(errno));
+        return -1;
+    }
 
-    struct sockaddr_in si_other;
-           int         slen = sizeof(si_other);
+    return 1;                                           // ring is full, more might wait in socket
+}
 
-    int loops = 1000;
-    while(loops > 0) {
+int ReadWrapper::udpReceive(RecvBatch &batch, int maxBytes)
+{
+    int loops = 100;
+    int got   = 0;
+
+    while(loops > 0 && makeSpace()) {                   // makeSpace() guarantees space for the biggest datagram
+        if(maxBytes > 0 && got >= maxBytes) {           // limited? the rest comes next time
+            return 1;
+        }
         loops--;
 
-        res = ioctl(fd, FIONREAD, &readCount);  // try to get how many bytes can be read
-        if(res < 0) {                           // ioctl failed? nothing more to receive
-            break;
+        // the 1st datagram always fits into ring, ask for as many others as will fit if they're not bigger than READWRAPPER_BATCH_DGRAM
+        DWORD spareSpace    = ringSize - ringUsed() - (sizeof(TDgramHeader) + READWRAPPER_MAX_DGRAM);
+        int   maxCount      = MIN(RECVBATCH_COUNT, 1 + (spareSpace / (sizeof(TDgramHeader) + READWRAPPER_BATCH_DGRAM)));
+
+        int count = batch.receive(fd, maxCount, 0);
+
+        if(count < 0) {                                 // failed to receive? skip the rest
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {   // no data? socket is empty
+                return 0;
+            }
+            Debug::out(LOG_DEBUG, "ReadWrapper::udpReceive() recvmmsg() error : %s", strerror(errno));
+            continue;                                       // other error (e.g. ICMP port unreachable)? try again
         }
 
-        // limit how much we can receive and receive it
-        readCount = (readCount < TMP_BFR_SIZE) ? readCount : TMP_BFR_SIZE;
+        for(int i=0; i<count; i++) {
+            int size = batch.size(i);
 
-        res = recvfrom(fd, tmpBfr, readCount, MSG_DONTWAIT, (struct sockaddr *) &si_other, (socklen_t *) &slen);
+            if(size == 0 || batch.truncated(i)) {       // empty or truncated datagram? drop it
+                continue;
+            }
 
-        if(res < 0) {                           // failed to receive? skip the rest
-            if(errno == EAGAIN || errno == EWOULDBLOCK) {   // no data? quit loop
-                break;
+            if((ringSize - ringUsed()) < (sizeof(TDgramHeader) + size)) {    // more big datagrams than expected in one batch? drop it
+                Debug::out(LOG_DEBUG, "ReadWrapper::udpReceive() - no space for datagram of %d bytes, dropped", size);
+                continue;
             }
-        	Debug::out(LOG_ERROR, "ReadWrapper::udpTryReceive() recvfrom() %d bytes error : %s", readCount, strerror(errno));
-            continue;                                       // other error? try again
+
+            struct sockaddr_in *from = batch.from(i);
+
+            TDgramHeader hdr;                           // store header and then the data
+            hdr.size        = size;
+            hdr.fromAddr    = (DWORD) from->sin_addr.s_addr;
+            hdr.fromPort    = (WORD)  from->sin_port;
+            hdr.reserved    = 0;
+            ringWrite(tail, (BYTE *) &hdr, sizeof(hdr));
+            ringWrite(tail + sizeof(hdr), batch.data(i), size);
+
+            tail       += sizeof(hdr) + size;
+            dataCount  += size;
+            got        += size;
         }
 
-        Debug::out(LOG_DEBUG, "ReadWrapper::udpTryReceive() - readCount: %d, addr: %08x, port: %d", readCount, ntohl(si_other.sin_addr.s_addr), ntohs(si_other.sin_port));
-        
-        // put it in the deque
-        NdbItem *newItem = new NdbItem(readCount, tmpBfr, (DWORD) si_other.sin_addr.s_addr, (WORD) si_other.sin_port);
-        items.push_back(newItem);
+        if(count < maxCount) {                          // got less than we asked for? socket is empty now
+            return 0;
+        }
     }
 
-    prunItemsIfNeeded();                        // remove items if they take too much place in RAM
+    return 1;                                           // ring is full (or too many loops), more might wait in socket
 }
 
-int ReadWrapper::getItemsTotalSize(void)
+//-------------------------------
+DWORD ReadWrapper::ringUsed(void)
 {
-    if(items.empty()) {                             // nothing in deque? quit
-        return 0;
+    return (tail - head);
+}
+
+bool ReadWrapper::makeSpace(void)
+{
+    DWORD needed = (type == UDP) ? (sizeof(TDgramHeader) + READWRAPPER_MAX_DGRAM) : 1;
+
+    if(ring == NULL) {                                  // nothing received yet? get the smallest ring which will do
+        ringSize    = (type == UDP) ? READWRAPPER_UDP_RING : READWRAPPER_TCP_RING;
+        ringMask    = ringSize - 1;
+        ring        = BufferPool::get(ringSize);
     }
 
-    int totalSize = 0;
-    int count = items.size();
+    if((ringSize - ringUsed()) >= needed) {             // enough space? good
+        return true;
+    }
 
-    int i;
-    for(i=0; i<count; i++) {
-        NdbItem *item;
-        item        = (NdbItem *) items[i];
-        totalSize  += item->size;
+    if(ringSize >= READWRAPPER_MAX_RING) {              // can't grow anymore? full
+        return false;
     }
 
-    return totalSize;
+    DWORD newSize   = ringSize * 2;                     // grow - move the data to start of bigger ring
+    DWORD used      = ringUsed();
+    BYTE *newRing   = BufferPool::get(newSize);
+
+    ringRead(head, newRing, used);
+    BufferPool::put(ring, ringSize);
+
+    ring        = newRing;
+    ringSize    = newSize;
+    ringMask    = newSize - 1;
+    head        = 0;
+    tail        = used;
+
+    return ((ringSize - ringUsed()) >= needed);
 }
 
-void ReadWrapper::prunItemsIfNeeded(void)
+void ReadWrapper::releaseRing(void)
 {
-    while(1) {
-        int totalSize = getItemsTotalSize();        // calculate size of all items
+    if(ring != NULL) {
+        BufferPool::put(ring, ringSize);
+    }
 
-        if(totalSize < MAX_TOTAL_ITEMS_SIZE) {      // if less than allowed, OK, can quit
-            break;
-        }
+    ring        = NULL;
+    ringSize    = 0;
+    ringMask    = 0;
+}
 
-        if(items.empty()) {                         // nothing in deque? quit
-            return;
-        }
+int ReadWrapper::ringSpans(DWORD pos, DWORD len, struct iovec *iov)
+{
+    DWORD offset = pos & ringMask;
+    DWORD first  = MIN(len, ringSize - offset);         // part till the end of ring
+
+    iov[0].iov_base = ring + offset;
+    iov[0].iov_len  = first;
+
+    if(first == len) {                                  // whole area is contiguous
+        return 1;
+    }
+
+    iov[1].iov_base = ring;                             // the rest wraps around to start of ring
+    iov[1].iov_len  = len - first;
+    return 2;
+}
+
+void ReadWrapper::ringRead(DWORD pos, BYTE *dest, DWORD len)
+{
+    struct iovec iov[2];
+    int spans = ringSpans(pos, len, iov);
+
+    for(int i=0; i<spans; i++) {
+        memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+        dest += iov[i].iov_len;
+    }
+}
 
-        NdbItem *item = (NdbItem *) items.back();   // get item
+void ReadWrapper::ringWrite(DWORD pos, const BYTE *src, DWORD len)
+{
+    struct iovec iov[2];
+    int spans = ringSpans(pos, len, iov);
+
+    for(int i=0; i<spans; i++) {
+        memcpy(iov[i].iov_base, src, iov[i].iov_len);
+        src += iov[i].iov_len;
+    }
+}
+
+void ReadWrapper::dropFrontDgram(void)
+{
+    TDgramHeader hdr;
+    ringRead(head, (BYTE *) &hdr, sizeof(hdr));
 
-        if(item == NULL) {
-            break;
+    head        += sizeof(hdr) + hdr.size;
+    dataCount   -= hdr.size - frontUsed;
+    frontUsed    = 0;
+
+    if(head == tail) {                                  // empty? start from the beginning, so the next data is contiguous
+        head = 0;
+        tail = 0;
+    }
+}
+
+int ReadWrapper::scanRing(DWORD pos, DWORD len, BYTE delim)
+{
+    struct iovec iov[2];
+    int spans  = ringSpans(pos, len, iov);
+    int offset = 0;
+
+    for(int i=0; i<spans; i++) {
+        BYTE *found = (BYTE *) memchr(iov[i].iov_base, delim, iov[i].iov_len);
+
+        if(found) {
+            return offset + (found - (BYTE *) iov[i].iov_base);
         }
-        
-        delete item;                                // delete it
-        items.pop_back();                           // remove pointer from deque
+
+        offset += iov[i].iov_len;
+    }
+
+    return -1;
+}
+
+void ReadWrapper::scanSkip(int count)
+{
+    if(count <= scanCount) {                            // removed only already scanned data? just move the scan position
+        scanCount -= count;
+        return;
     }
+
+    scanCount = 0;                                      // removed the delimiter (or more), scan the rest next time
+    scanFound = false;
 }
@@ -2,27 +2,34 @@
 #ifndef _READWRAPPER_H_
 #define _READWRAPPER_H_
 
-#include "../stupidvector.h"
+#include <sys/uio.h>
 
-#define MAX_TOTAL_ITEMS_SIZE    (1024 * 1024)
-#define TMP_BFR_SIZE            (  64 * 1024)
+#include "../datatypes.h"
+#include "recvbatch.h"
+#include "bufferpool.h"
 
-class NdbItem
-{
-public:
-     NdbItem(int inSize, BYTE *inData, DWORD fromAddr, WORD fromPort);
-    ~NdbItem(void);
+#define READWRAPPER_TCP_RING    BUFFERPOOL_MIN_SIZE     // size of the 1st ring - it grows when it's full, up to READWRAPPER_MAX_RING
+#define READWRAPPER_UDP_RING    (128 * 1024)            // UDP ring has to fit at least one biggest datagram
+#define READWRAPPER_MAX_RING    BUFFERPOOL_MAX_SIZE
+#define READWRAPPER_MAX_DGRAM   (64 * 1024)         // biggest UDP datagram we can receive
+#define READWRAPPER_BATCH_DGRAM 2048                // batch size is chosen so that datagrams up to this size surely fit into ring
 
-    int   size;
-    BYTE *data;
+typedef struct {                                    // stored in ring in front of each UDP datagram
+    DWORD size;                                     // size of datagram data
+    DWORD fromAddr;                                 // sender address and port, network byte order
+    WORD  fromPort;
+    WORD  reserved;
+} TDgramHeader;
 
-    struct {
-        DWORD addr;
-        WORD  port;
-    } from;
-};
-
-class ReadWrapper 
+// Holds the data received from socket. The data is received by network thread (receive()),
+// all the other methods just work with the already received data and don't touch the socket.
+//
+// All the data is stored in single ring buffer. TCP stream is stored as it is, each UDP datagram
+// is stored as TDgramHeader followed by datagram data. Data is received from socket directly into
+// the ring, so there is no allocation per received packet. The ring comes from BufferPool when the first
+// data is received, grows when it's full and goes back to the pool when the connection is closed. UDP datagrams are received in batches by
+// recvmmsg() into RecvBatch owned by network thread, and then copied into the ring.
+class ReadWrapper
 {
 public:
     ReadWrapper(void);
@@ -31,31 +38,52 @@ public:
     void init(int inFd, int inType, int inBuffSize);
     void clearAll(void);
 
+    int  receive     (RecvBatch &batch, int maxBytes=0); // receive what is waiting in socket (at most about maxBytes, 0 - no limit), returns
+                                                         // -1 if TCP connection was closed by remote side, 0 if socket is empty now, 1 if something was left there
+    bool isFull      (void);                         // can't receive more, until some data is removed
+
     int  getCount    (void);                         // get recv data count - for UDP this is merged count through datagrams
 
     int  getNdb        (BYTE *tmpBuffer);            // for UDP get one datagram, for TCP get a block from stream
     int  getNextNdbSize(void);
-    
+
     int  peekBlock   (BYTE *tmpBuffer, int size);    // for UDP merge buffers, return data without removing from queue
     void removeBlock (int size);                     // remove from queue
 
+    int  findDelimiter(BYTE delim);                  // index of 1st delim in received data, or -1 if it's not there yet
+    bool hasLine      (void);                        // is there delimiter from the last findDelimiter() call?
+
 private:
     int fd;             // file descriptor of socket
     int type;           // TCP / UDP / ICMP
     int buff_size;
 
-    BYTE tmpBfr[TMP_BFR_SIZE];
+    BYTE  *ring;        // from BufferPool, NULL until something is received
+    DWORD  ringSize;    // power of 2
+    DWORD  ringMask;
+    DWORD  head;        // read position  - free running, use with ringMask
+    DWORD  tail;        // write position - free running, use with ringMask
+
+    int    dataCount;   // count of data bytes in ring (without datagram headers)
+    DWORD  frontUsed;   // for UDP - how many bytes of the 1st datagram were already removed by removeBlock()
+
+    // findDelimiter() state - data scanned once is not scanned again, until it's removed or other delimiter is used
+    int    scanDelim;   // delimiter we're looking for, -1 if none yet
+    int    scanCount;   // count of bytes from start of data which don't contain the delimiter
+    bool   scanFound;   // if true, the delimiter is at scanCount
 
-    //----------------------------
-    // for UDP
-    void udpTryReceive    (void);
-    int  getItemsTotalSize(void);
-    void prunItemsIfNeeded(void);
-    StupidVector          items;
+    int    tcpReceive   (int maxBytes);
+    int    udpReceive   (RecvBatch &batch, int maxBytes);
 
-    //----------------------------
-    // for TCP
-    int  tcpBytesWaiting  (void);
+    DWORD  ringUsed     (void);
+    bool   makeSpace    (void);                                     // get or grow the ring if needed, returns false if it's full
+    void   releaseRing  (void);
+    int    ringSpans    (DWORD pos, DWORD len, struct iovec *iov);  // split ring area to 1 or 2 contiguous spans
+    void   ringRead     (DWORD pos, BYTE *dest, DWORD len);
+    void   ringWrite    (DWORD pos, const BYTE *src, DWORD len);
+    void   dropFrontDgram(void);
+    int    scanRing     (DWORD pos, DWORD len, BYTE delim);         // memchr() over ring area, returns offset or -1
+    void   scanSkip     (int count);                                // update scan state after removing count bytes
 };
 
 #endif
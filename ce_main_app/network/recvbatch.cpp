@@ -0,0 +1,77 @@
+// vim: shiftwidth=4 tabstop=4 softtabstop=4 expandtab
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "../utils.h"
+#include "../debug.h"
+
+#include "recvbatch.h"
+
+RecvBatch::RecvBatch(int inSlotSize)
+{
+    slotSize    = inSlotSize;
+    bfr         = new BYTE[RECVBATCH_COUNT * slotSize];     // big, but pages which are never written to are never really used
+    callCount   = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for(int i=0; i<RECVBATCH_COUNT; i++) {                  // each message gets its own slot in buffer and its own address
+        iovs[i].iov_base            = bfr + (i * slotSize);
+        iovs[i].iov_len             = slotSize;
+
+        msgs[i].msg_hdr.msg_iov     = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+        msgs[i].msg_hdr.msg_name    = &addrs[i];
+    }
+}
+
+RecvBatch::~RecvBatch(void)
+{
+    delete []bfr;
+}
+
+int RecvBatch::receive(int fd, int maxCount, int flags)
+{
+    maxCount = MIN(maxCount, RECVBATCH_COUNT);
+
+    if(maxCount < 1) {
+        return 0;
+    }
+
+    for(int i=0; i<maxCount; i++) {                         // these are overwritten by each call
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_flags   = 0;
+    }
+
+    callCount++;
+    return recvmmsg(fd, msgs, maxCount, MSG_DONTWAIT | flags, NULL);
+}
+
+BYTE *RecvBatch::data(int index)
+{
+    return bfr + (index * slotSize);
+}
+
+int RecvBatch::size(int index)
+{
+    return msgs[index].msg_len;
+}
+
+bool RecvBatch::truncated(int index)
+{
+    return ((msgs[index].msg_hdr.msg_flags & MSG_TRUNC) != 0);
+}
+
+struct sockaddr_in *RecvBatch::from(int index)
+{
+    return &addrs[index];
+}
+
+DWORD RecvBatch::getCallCount(void)
+{
+    return callCount;
+}
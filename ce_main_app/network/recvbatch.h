@@ -0,0 +1,41 @@
+// vim: tabstop=4 softtabstop=4 shiftwidth=4 expandtab
+#ifndef _RECVBATCH_H_
+#define _RECVBATCH_H_
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../datatypes.h"
+
+#define RECVBATCH_COUNT     32                      // max datagrams received by single recvmmsg() call
+
+// Preallocated buffers for receiving up to RECVBATCH_COUNT datagrams with single recvmmsg() call.
+// The buffers are allocated once and reused, so there is no allocation per received datagram.
+// Not thread safe - each thread which receives datagrams should have its own RecvBatch.
+class RecvBatch
+{
+public:
+    RecvBatch(int inSlotSize);                      // slotSize - biggest datagram that can be received without truncating
+    ~RecvBatch(void);
+
+    int   receive   (int fd, int maxCount, int flags);  // returns count of received datagrams, or -1 on error (see errno)
+
+    BYTE *data      (int index);
+    int   size      (int index);                    // received size, or real size when receive() was called with MSG_TRUNC
+    bool  truncated (int index);                    // datagram didn't fit into slot
+    struct sockaddr_in *from(int index);
+
+    DWORD getCallCount(void);                       // how many times was recvmmsg() called - for statistics
+
+private:
+    int     slotSize;
+    BYTE   *bfr;
+
+    struct mmsghdr      msgs [RECVBATCH_COUNT];
+    struct iovec        iovs [RECVBATCH_COUNT];
+    struct sockaddr_in  addrs[RECVBATCH_COUNT];
+
+    DWORD   callCount;
+};
+
+#endif
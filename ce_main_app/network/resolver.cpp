@@ -13,13 +13,18 @@
 #include <arpa/inet.h> 
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #include <poll.h>
 #include <signal.h>
 #include <pthread.h>
 
 #include <stdint.h>
+#include <ctype.h>
+#include <resolv.h>
+#include <arpa/nameser.h>
 #include <string>
+#include <vector>
 
 #include "../debug.h"
 #include "../utils.h"
@@ -27,13 +32,64 @@
 
 #define IS_VALID_IP_NUMBER(X)  (X >= 0 && X <= 255)
 
+//---------------------------------
+ResolverRequest::ResolverRequest(void)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&lookupAdded, NULL);
+
+    for(int i=0; i<RESOLV_COUNT; i++) {
+        clearSlot(i);
+    }
+
+    nameServerIp    = 0;
+    nameServerPort  = 0;
+    shouldStop      = false;
+
+    for(int i=0; i<RESOLV_THREADS; i++) {
+        pthread_create(&threads[i], NULL, ResolverRequest::lookupThreadCode, this);
+    }
+}
+
+ResolverRequest::~ResolverRequest(void)
+{
+    pthread_mutex_lock(&mutex);
+    shouldStop = true;                                      // tell threads to quit, they will finish the lookup they're doing
+    pthread_cond_broadcast(&lookupAdded);
+    pthread_mutex_unlock(&mutex);
+
+    for(int i=0; i<RESOLV_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&lookupAdded);
+    pthread_mutex_destroy(&mutex);
+}
+
+void ResolverRequest::setNameServer(DWORD ip, WORD port)
+{
+    pthread_mutex_lock(&mutex);
+    nameServerIp    = ip;
+    nameServerPort  = port;
+    pthread_mutex_unlock(&mutex);
+}
+
+void ResolverRequest::clearCache(void)
+{
+    pthread_mutex_lock(&mutex);
+    cache.clear();
+    pthread_mutex_unlock(&mutex);
+}
+
 //---------------------------------
 int ResolverRequest::addRequest(const char *hostName)
 {
     int i, emptyIndex = -1;
 
     DWORD   oldestTime  = 0x7fffffff;
-    int     oldestIndex = -1;
+    int     oldestIndex = 0;
+
+    pthread_mutex_lock(&mutex);
 
     // find usable slot
     for(i=0; i<RESOLV_COUNT; i++) {
@@ -48,34 +104,26 @@ int ResolverRequest::addRequest(const char *hostName)
         }
     }
 
-    // get pointer to that slot
-    Tresolv *r;
-    int      usedIndex;
-
-    if(emptyIndex != -1) {      // if found empty slot, use it
-        r = &requests[emptyIndex];
-        usedIndex = emptyIndex;
-    } else {                    // if not found empty slot, cancel existing and use it
-        gai_cancel(&requests[oldestIndex].req);       // try to cancel
-        r = &requests[oldestIndex];
-        usedIndex = oldestIndex;
-    }
+    // if not found empty slot, reuse the oldest one - its lookup keeps running and its answer will go to cache
+    int      usedIndex  = (emptyIndex != -1) ? emptyIndex : oldestIndex;
+    Tresolv *r          = &requests[usedIndex];
 
-    r->startTime                = Utils::getCurrentMs();    // store start time
-    r->getaddrinfoHasFinished   = 0;                        // mark that we did not finish yet
-    r->count                    = 0;                        // no IPs stored yet
-    r->processed                = 0;                        // not processed yet
-    memset(r->canonName, 0, 256);                           // no canon name yet
+    r->startTime            = Utils::getCurrentMs();    // store start time
+    r->lookupHasFinished    = 0;                        // mark that we did not finish yet
+    r->count                = 0;                        // no IPs stored yet
+    r->processed            = 0;                        // not processed yet
+    r->error                = 0;
+    memset(r->canonName, 0, 256);                       // no canon name yet
 
     memset (r->hostName, 0, 256);
-    strncpy(r->hostName, hostName, 255);                    // copy host name to our array
-    r->req.ar_name      = r->hostName;                      // store pointer to that array
+    strncpy(r->hostName, hostName, 255);                // copy host name to our array
+    r->lookupName = normalizeName(hostName);
 
     //-------------------
     // check and possibly resolve dotted IP
     int a,b,c,d;
     int iRes = sscanf(hostName, "%d.%d.%d.%d", &a, &b, &c, &d);
-    
+
     if(iRes == 4) {         // succeeded to get IP parts
         if(IS_VALID_IP_NUMBER(a) && IS_VALID_IP_NUMBER(b) && IS_VALID_IP_NUMBER(c) && IS_VALID_IP_NUMBER(d)) {
 
@@ -84,210 +132,481 @@ int ResolverRequest::addRequest(const char *hostName)
             pIps[1]     = b;
             pIps[2]     = c;
             pIps[3]     = d;
-            
+
             r->count    = 1;    // store count
-            
+
             strcpy(r->canonName, r->hostName);                          // pretend that the string is canonical name
-            
-            r->getaddrinfoHasFinished   = 1;                            // resolve finished
-            r->processed                = 1;
-            
+
+            r->lookupHasFinished    = 1;                                // resolve finished
+            r->processed            = 1;
+
+            pthread_mutex_unlock(&mutex);
             return usedIndex;
         }
     }
     //-------------------
-    
-    r->hints.ai_flags   = AI_CANONNAME;                     // get the official name of the host
-    r->req.ar_request   = &r->hints;
-
-    gaicb *pReq = &r->req;
-    int ret = getaddrinfo_a(GAI_NOWAIT, &pReq, 1, NULL);
 
-    if (ret) {
-        Debug::out(LOG_DEBUG, "addRequest() failed");
-        return -1;
+    TresolvAnswer answer;
+    if(findInCache(r->lookupName, answer)) {                            // got valid answer in cache? use it
+        fillSlot(r, answer);
+        Debug::out(LOG_DEBUG, "addRequest() - %s found in cache, index %d", hostName, usedIndex);
+    } else if(inFlight.count(r->lookupName) > 0) {                      // this name is already being looked up? just wait for that answer
+        Debug::out(LOG_DEBUG, "addRequest() - %s is already being resolved, index %d will get that answer", hostName, usedIndex);
+    } else {                                                            // start new lookup
+        inFlight.insert(r->lookupName);
+        lookupQueue.push_back(r->lookupName);
+        pthread_cond_signal(&lookupAdded);
+
+        Debug::out(LOG_DEBUG, "addRequest() - resolving %s under index %d", hostName, usedIndex);
     }
 
-    Debug::out(LOG_DEBUG, "addRequest() - resolving %s under index %d", hostName, usedIndex);
+    pthread_mutex_unlock(&mutex);
     return usedIndex;           // return index under which this request runs
 }
 
 //---------------------------------
-bool ResolverRequest::getaddrinfoHasFinished(int index)    // returns true if request has finished
+void ResolverRequest::showSlot(int index)
 {
-    if(!slotIndexValid(index)) {                // out of bounds? false
-        return false;
+    if(!slotIndexValid(index)) {        // out of bounds? false
+        Debug::out(LOG_DEBUG, "resolveRequestShow - bad index");
+        return;
     }
 
-    if(requests[index].startTime == 0) {        // not used? false
-        return false;
+    Tresolv *r = &requests[index];
+
+    if(!r->lookupHasFinished) {         // if not done, or there is some error, fail
+        Debug::out(LOG_DEBUG, "resolveRequestShow - request not done yet");
+        return;
     }
 
-    Tresolv *r = &requests[index];
+    if(!r->processed) {                 // not processed?
+        Debug::out(LOG_DEBUG, "resolveRequestShow - not processed yet");
+        return;
+    }
+
+    if(r->count > 0) {
+        Debug::out(LOG_DEBUG, "[%d] host: %s (%s) resolved to %d IPs:", index, r->hostName, r->canonName, r->count);
 
-    if(r->getaddrinfoHasFinished) {             // if the request already finished, good
-        return true;
+        DWORD *pip = (DWORD *) r->data;
+        for(int i=0; i < r->count; i++) {
+            BYTE *ipb = (BYTE *) &pip[i];
+            Debug::out(LOG_DEBUG, "IP %d: %d.%d.%d.%d", i, ipb[0], ipb[1], ipb[2], ipb[3]);
+        }
+    } else {
+        Debug::out(LOG_DEBUG, "[%d] host: %s not resolved, error is: %d (%s)", index, r->hostName, r->error, gai_strerror(r->error));
     }
 
-    // if we don't know if it finished yet, let's check it out
-    r->error = gai_error(&r->req);
+    Debug::out(LOG_DEBUG, "\n");
+}
 
-    if(r->error == EAI_INPROGRESS) {            // if still in progress, false
+bool ResolverRequest::checkAndhandleSlot(int index)
+{
+    if(!slotIndexValid(index)) {                // out of bounds? false
         return false;
     }
 
-    r->getaddrinfoHasFinished = 1;              // ok, we're done
-    return true;
-}
+    pthread_mutex_lock(&mutex);                 // slot is filled by lookup thread, so check it with lock
+    bool done = (requests[index].startTime != 0 && requests[index].lookupHasFinished);
+    pthread_mutex_unlock(&mutex);
 
-//---------------------------------
+    return done;
+}
 
-bool ResolverRequest::isProcessed(int index)                // see if the reqest is processed
+void ResolverRequest::clearSlot(int index)
 {
-    if(!slotIndexValid(index)) {                            // out of bounds? pretend it's processed
-        return true;
+    if(!slotIndexValid(index)) {                // out of bounds? false
+        return;
     }
 
     Tresolv *r = &requests[index];
 
-    if(!r->getaddrinfoHasFinished) {                        // if not done, then it's not processed
+    pthread_mutex_lock(&mutex);                 // lookup thread might be looking for slots waiting for its answer
+    r->startTime            = 0;                // no start time
+    r->lookupHasFinished    = 0;                // mark that we did not finish yet
+    r->count                = 0;                // no IPs stored yet
+    r->processed            = 0;                // not processed yet
+    memset(r->canonName, 0, 256);               // no canon name yet
+    r->lookupName.clear();
+    pthread_mutex_unlock(&mutex);
+}
+
+bool ResolverRequest::slotIndexValid(int index)
+{
+    if(index < 0 || index >= RESOLV_COUNT) {    // out of bounds? false
         return false;
     }
 
-    return (r->processed == 1);                             // return if it's processed
+    return true;
 }
-//---------------------------------
 
-bool ResolverRequest::processSlot(int index)                // process the request into Sting format
+//---------------------------------
+bool ResolverRequest::findInCache(const std::string &name, TresolvAnswer &answer)
 {
-    if(!slotIndexValid(index)) {                            // out of bounds? false
+    std::map<std::string, TresolvAnswer>::iterator it = cache.find(name);
+
+    if(it == cache.end()) {                                 // not in cache
         return false;
     }
 
-    Tresolv *r = &requests[index];
-
-    if(!r->getaddrinfoHasFinished) {                        // if not done, or there is some error, fail
+    if((int) (it->second.expireTime - Utils::getCurrentMs()) <= 0) {  // expired? remove it
+        cache.erase(it);
         return false;
     }
 
-    if(r->error != EAI_INPROGRESS && r->error != 0) {       // if it's done, but there's some error, there's nothing to do here
-        r->processed = 1;
-        return true;
+    answer = it->second;
+    return true;
+}
+
+void ResolverRequest::storeInCache(const std::string &name, TresolvAnswer &answer)
+{
+    if(answer.ttl == 0) {                                   // shouldn't be cached? (e.g. server failure)
+        return;
     }
 
-    addrinfo *ai = r->req.ar_result;                        // get pointer to 1st result
+    DWORD now = Utils::getCurrentMs();
+    answer.expireTime = now + answer.ttl * 1000;
+
+    if(cache.size() >= RESOLV_CACHE_MAX && cache.count(name) == 0) {     // cache full? remove expired answers first
+        std::map<std::string, TresolvAnswer>::iterator it, soonest = cache.end();
+
+        for(it = cache.begin(); it != cache.end(); ) {
+            if((int) (it->second.expireTime - now) <= 0) {
+                cache.erase(it++);
+                continue;
+            }
+
+            if(soonest == cache.end() || (int) (it->second.expireTime - soonest->second.expireTime) < 0) {
+                soonest = it;
+            }
+            ++it;
+        }
 
-    if(ai != NULL && ai->ai_canonname != NULL) {            // got adress info, and got cannonname? store it
-        memset(r->canonName, 0, 256);
-        strncpy(r->canonName, ai->ai_canonname, 255);
+        if(cache.size() >= RESOLV_CACHE_MAX && soonest != cache.end()) {  // still full? remove the one which would expire first
+            cache.erase(soonest);
+        }
     }
 
-    r->count = 0;   
+    cache[name] = answer;
+}
 
-    while(1) {
-        if(ai == NULL) {
-            break;
+void ResolverRequest::answerWaitingSlots(const std::string &name, const TresolvAnswer &answer)
+{
+    for(int i=0; i<RESOLV_COUNT; i++) {                     // all the slots waiting for this name get this answer
+        Tresolv *r = &requests[i];
+
+        if(r->startTime != 0 && !r->lookupHasFinished && r->lookupName == name) {
+            fillSlot(r, answer);
         }
+    }
+}
 
-        struct sockaddr *ai_addr = ai->ai_addr;             // treat as sockaddr struct
+void ResolverRequest::fillSlot(Tresolv *r, const TresolvAnswer &answer)
+{
+    r->error    = answer.error;
+    r->count    = answer.count;
+    memcpy(r->canonName, answer.canonName, 256);
+    memcpy(r->data, answer.data, answer.count * 4);
 
-        if(ai_addr->sa_family == AF_INET) {                 // it's IPv4 addres? process it
-            sockaddr_in * sa_in = (sockaddr_in *) ai_addr;  // cast to sockaddr_in
-            DWORD ip            = sa_in->sin_addr.s_addr;   // get IP
+    r->lookupHasFinished    = 1;
+    r->processed            = 1;
+}
 
-            DWORD *pip = (DWORD *) r->data;
-            bool foundIt = false;
-            for(int i = 0; i < r->count; i++) {             // check if we don't have that IP stored already
-                if(pip[i] == ip) {
-                    foundIt = true;
-                    break;
-                }
-            }
+std::string ResolverRequest::normalizeName(const char *hostName)
+{
+    std::string name(hostName);
 
-            if(!foundIt) {                                  // this IP not stored yet, store it
-                pip[r->count] = ip;
-                r->count++;
-            }
+    for(size_t i=0; i<name.size(); i++) {                   // DNS names are case insensitive
+        name[i] = tolower(name[i]);
+    }
+
+    if(!name.empty() && name[name.size() - 1] == '.') {     // 'host.com.' is the same as 'host.com'
+        name.resize(name.size() - 1);
+    }
+
+    return name;
+}
+
+void ResolverRequest::addIp(TresolvAnswer &answer, DWORD ip)
+{
+    DWORD *pip = (DWORD *) answer.data;
+
+    for(int i = 0; i < answer.count; i++) {                 // check if we don't have that IP stored already
+        if(pip[i] == ip) {
+            return;
         }
+    }
 
-        ai = ai->ai_next;                                   // go to next result
+    if(answer.count < RESOLV_MAX_IPS) {                     // this IP not stored yet, store it
+        pip[answer.count] = ip;
+        answer.count++;
     }
+}
 
-    r->processed = 1;
-    return true;
+//---------------------------------
+void *ResolverRequest::lookupThreadCode(void *ptr)
+{
+    ResolverRequest *resolver = (ResolverRequest *) ptr;
+    resolver->lookupThreadLoop();
+    return 0;
 }
 
-void ResolverRequest::showSlot(int index)
+// DHCP often writes /etc/resolv.conf after the app started - load it again when it changes, like getaddrinfo() does
+static void reloadResolvConfIfChanged(struct __res_state *state, time_t &confTime, ino_t &confIno)
 {
-    if(!slotIndexValid(index)) {        // out of bounds? false
-        Debug::out(LOG_DEBUG, "resolveRequestShow - bad index");
+    struct stat st;
+    if(stat(_PATH_RESCONF, &st) != 0) {                     // not there (yet)? keep what we have
         return;
     }
 
-    Tresolv *r = &requests[index];
-
-    if(!r->getaddrinfoHasFinished) {    // if not done, or there is some error, fail
-        Debug::out(LOG_DEBUG, "resolveRequestShow - request not done yet");
+    if(st.st_mtime == confTime && st.st_ino == confIno) {
         return;
     }
 
-    if(!r->processed) {                 // not processed?
-        Debug::out(LOG_DEBUG, "resolveRequestShow - not processed yet");
+    confTime = st.st_mtime;
+    confIno  = st.st_ino;
+
+    res_nclose(state);
+    memset(state, 0, sizeof(*state));
+    res_ninit(state);
+    Debug::out(LOG_DEBUG, "ResolverRequest - %s changed, %d name servers now", _PATH_RESCONF, state->nscount);
+}
+
+void ResolverRequest::lookupThreadLoop(void)
+{
+    struct __res_state state;                               // each thread needs its own resolver state
+    memset(&state, 0, sizeof(state));
+    res_ninit(&state);
+
+    time_t confTime = 0;
+    ino_t  confIno  = 0;
+    struct stat st;
+    if(stat(_PATH_RESCONF, &st) == 0) {                     // what res_ninit() just read
+        confTime = st.st_mtime;
+        confIno  = st.st_ino;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    while(!shouldStop) {
+        if(lookupQueue.empty()) {                           // nothing to do? wait
+            pthread_cond_wait(&lookupAdded, &mutex);
+            continue;
+        }
+
+        std::string name = lookupQueue.front();
+        lookupQueue.pop_front();
+
+        DWORD nsIp   = nameServerIp;
+        WORD  nsPort = nameServerPort;
+
+        pthread_mutex_unlock(&mutex);                       // lookup without lock, it takes time
+
+        reloadResolvConfIfChanged(&state, confTime, confIno);
+
+        if(nsIp != 0) {                                     // should use specific name server?
+            state.nsaddr_list[0].sin_family         = AF_INET;
+            state.nsaddr_list[0].sin_addr.s_addr    = htonl(nsIp);
+            state.nsaddr_list[0].sin_port           = htons(nsPort);
+            state.nscount                           = 1;
+        }
+
+        TresolvAnswer answer;
+        lookup(&state, name, answer);
+
+        pthread_mutex_lock(&mutex);
+
+        storeInCache(name, answer);
+        answerWaitingSlots(name, answer);
+        inFlight.erase(name);
+    }
+
+    pthread_mutex_unlock(&mutex);
+    res_nclose(&state);
+}
+
+void ResolverRequest::lookup(struct __res_state *state, const std::string &name, TresolvAnswer &answer)
+{
+    memset(&answer, 0, sizeof(answer));
+
+    if(lookupHostsFile(name, answer)) {                     // /etc/hosts goes first, like for getaddrinfo()
         return;
     }
 
-    if(r->count > 0) {
-        Debug::out(LOG_DEBUG, "[%d] host: %s (%s) resolved to %d IPs:", index, r->hostName, r->canonName, r->count);
+    // names without dot are tried with search domains first, then as they are
+    std::vector<std::string> names;
 
-        DWORD *pip = (DWORD *) r->data;
-        for(int i=0; i < r->count; i++) {
-            BYTE *ipb = (BYTE *) &pip[i];
-            Debug::out(LOG_DEBUG, "IP %d: %d.%d.%d.%d", i, ipb[0], ipb[1], ipb[2], ipb[3]);
+    if(name.find('.') == std::string::npos) {
+        for(int i=0; i<MAXDNSRCH && state->dnsrch[i] != NULL; i++) {
+            names.push_back(name + "." + state->dnsrch[i]);
         }
-    } else {
-        Debug::out(LOG_DEBUG, "[%d] host: %s not resolved, error is: %d (%s)", index, r->hostName, r->error, gai_strerror(r->error));
     }
+    names.push_back(name);
 
-    Debug::out(LOG_DEBUG, "\n");
+    DWORD negTtl = RESOLV_MAX_NEG_TTL;
+
+    for(size_t i=0; i<names.size(); i++) {
+        memset(&answer, 0, sizeof(answer));
+        DWORD thisNegTtl = RESOLV_DEFAULT_NEG_TTL;
+
+        int res = lookupDns(state, names[i], answer, thisNegTtl);
+
+        if(res == 0) {                                      // got the IPs
+            Debug::out(LOG_DEBUG, "ResolverRequest::lookup - %s (%s) resolved to %d IPs, TTL %d s", name.c_str(), answer.canonName, answer.count, answer.ttl);
+            return;
+        }
+
+        if(res < 0) {                                       // failed to ask - don't cache, try again next time
+            Debug::out(LOG_DEBUG, "ResolverRequest::lookup - %s failed", names[i].c_str());
+            answer.error    = EAI_AGAIN;
+            answer.ttl      = 0;
+            return;
+        }
+
+        negTtl = MIN(negTtl, thisNegTtl);                   // name doesn't exist, remember for how long we may cache that
+    }
+
+    Debug::out(LOG_DEBUG, "ResolverRequest::lookup - %s doesn't exist, caching that for %d s", name.c_str(), negTtl);
+    answer.error    = EAI_NONAME;
+    answer.count    = 0;
+    answer.ttl      = negTtl;
 }
 
-bool ResolverRequest::checkAndhandleSlot(int index)
+bool ResolverRequest::lookupHostsFile(const std::string &name, TresolvAnswer &answer)
 {
-    bool done = getaddrinfoHasFinished(index);  // check if the request is done
-    
-    if(!done) {
+    FILE *f = fopen("/etc/hosts", "rt");
+
+    if(!f) {
         return false;
     }
 
-    if(!isProcessed(index)) {                   // if it's done, check if it's processed
-        processSlot(index);                     // not processed, process it
+    char line[1024];
+    while(fgets(line, sizeof(line), f)) {
+        char *hash = strchr(line, '#');                     // ignore comments
+        if(hash) {
+            *hash = 0;
+        }
+
+        char *save = NULL;
+        char *ipStr = strtok_r(line, " \t\r\n", &save);     // 1st is IP, then canonical name and aliases
+
+        struct in_addr addr;
+        if(!ipStr || inet_pton(AF_INET, ipStr, &addr) != 1) {  // not IPv4 line? skip it
+            continue;
+        }
+
+        char *canon = strtok_r(NULL, " \t\r\n", &save);
+        for(char *alias = canon; alias != NULL; alias = strtok_r(NULL, " \t\r\n", &save)) {
+            if(normalizeName(alias) != name) {
+                continue;
+            }
+
+            if(answer.count == 0) {
+                strncpy(answer.canonName, canon, 255);
+            }
+            addIp(answer, addr.s_addr);
+            break;
+        }
+    }
+
+    fclose(f);
+
+    if(answer.count == 0) {
+        return false;
     }
-     
+
+    answer.error    = 0;
+    answer.ttl      = RESOLV_HOSTS_TTL;
     return true;
 }
 
-void ResolverRequest::clearSlot(int index)
+int ResolverRequest::lookupDns(struct __res_state *state, const std::string &name, TresolvAnswer &answer, DWORD &negTtl)
 {
-    if(!slotIndexValid(index)) {                // out of bounds? false
-        return;
+    BYTE query[NS_PACKETSZ];
+    BYTE reply[NS_MAXMSG];
+
+    int queryLen = res_nmkquery(state, ns_o_query, name.c_str(), ns_c_in, ns_t_a, NULL, 0, NULL, query, sizeof(query));
+    if(queryLen < 0) {
+        return -1;
     }
 
-    Tresolv *r = &requests[index];
+    int replyLen = res_nsend(state, query, queryLen, reply, sizeof(reply));    // unlike res_nquery() this returns the reply even for NXDOMAIN
+    if(replyLen < 0) {
+        return -1;
+    }
 
-    r->startTime                = 0;            // no start time
-    r->getaddrinfoHasFinished   = 0;            // mark that we did not finish yet
-    r->count                    = 0;            // no IPs stored yet
-    r->processed                = 0;            // not processed yet
-    memset(r->canonName, 0, 256);               // no canon name yet 
-}
+    ns_msg msg;
+    if(ns_initparse(reply, replyLen, &msg) < 0) {
+        return -1;
+    }
 
-bool ResolverRequest::slotIndexValid(int index)
-{
-    if(index < 0 || index >= RESOLV_COUNT) {    // out of bounds? false
-        return false;
+    int rcode = ns_msg_getflag(msg, ns_f_rcode);
+    if(rcode != ns_r_noerror && rcode != ns_r_nxdomain) {   // server failure, refused, ...
+        return -1;
     }
 
-    return true;
+    DWORD ttl = RESOLV_MAX_TTL;
+    int count = ns_msg_count(msg, ns_s_an);
+
+    for(int i=0; i<count; i++) {                            // go through answers - CNAMEs and As
+        ns_rr rr;
+        if(ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+            break;
+        }
+
+        if(ns_rr_type(rr) == ns_t_cname) {                  // TTL of CNAME counts too
+            ttl = MIN(ttl, ns_rr_ttl(rr));
+            continue;
+        }
+
+        if(ns_rr_type(rr) != ns_t_a || ns_rr_class(rr) != ns_c_in || ns_rr_rdlen(rr) != 4) {
+            continue;
+        }
+
+        if(answer.count == 0) {                             // owner of A record is the canonical name
+            strncpy(answer.canonName, ns_rr_name(rr), 255);
+        }
+
+        DWORD ip;
+        memcpy(&ip, ns_rr_rdata(rr), 4);
+        addIp(answer, ip);
+        ttl = MIN(ttl, ns_rr_ttl(rr));
+    }
+
+    if(answer.count > 0) {
+        answer.error    = 0;
+        answer.ttl      = ttl;
+        return 0;
+    }
+
+    // NXDOMAIN or no A record - negative answer is cached for SOA minimum or SOA TTL, whichever is lower (RFC 2308)
+    count = ns_msg_count(msg, ns_s_ns);
+    for(int i=0; i<count; i++) {
+        ns_rr rr;
+        if(ns_parserr(&msg, ns_s_ns, i, &rr) < 0 || ns_rr_type(rr) != ns_t_soa) {
+            continue;
+        }
+
+        const BYTE *rdata   = ns_rr_rdata(rr);
+        const BYTE *end     = rdata + ns_rr_rdlen(rr);
+        char dname[NS_MAXDNAME];
+
+        int len1 = ns_name_uncompress(ns_msg_base(msg), ns_msg_end(msg), rdata, dname, sizeof(dname));          // MNAME
+        if(len1 < 0) {
+            break;
+        }
+
+        int len2 = ns_name_uncompress(ns_msg_base(msg), ns_msg_end(msg), rdata + len1, dname, sizeof(dname));   // RNAME
+        if(len2 < 0 || rdata + len1 + len2 + 20 > end) {
+            break;
+        }
+
+        DWORD minimum = ns_get32(rdata + len1 + len2 + 16); // serial, refresh, retry, expire, minimum
+        negTtl = MIN(ns_rr_ttl(rr), minimum);
+        break;
+    }
+
+    negTtl = MIN(negTtl, (DWORD) RESOLV_MAX_NEG_TTL);
+    return 1;
 }
 
 //---------------------------------
@@ -3,14 +3,36 @@
 #define _RESOLVE_H_
 
 #include <netdb.h>
+#include <pthread.h>
 #include <string>
+#include <map>
+#include <set>
+#include <deque>
 
 #include "../datatypes.h"
 
-#define RESOLV_COUNT    10
-struct Tresolv {
+#define RESOLV_COUNT            10              // handles for ST - drivers treat status 10 and higher as error, so don't make this bigger
+#define RESOLV_THREADS          4               // how many lookups can run at the same time
+#define RESOLV_MAX_IPS          32              // how many IPs fit in Tresolv.data
+
+#define RESOLV_CACHE_MAX        256             // max count of cached answers
+#define RESOLV_MAX_TTL          (60 * 60)       // don't cache positive answer longer than this, even if TTL says so (seconds)
+#define RESOLV_MAX_NEG_TTL      (5 * 60)        // don't cache negative answer longer than this (seconds)
+#define RESOLV_DEFAULT_NEG_TTL  60              // negative answer without SOA is cached this long (seconds)
+#define RESOLV_HOSTS_TTL        60              // names from /etc/hosts are cached this long (seconds)
+
+struct TresolvAnswer {                          // result of single lookup, also stored in cache
+    int             error;                      // 0 on success, otherwise EAI_ error code
+    char            canonName[256];
+    int             count;
+    BYTE            data[RESOLV_MAX_IPS * 4];
+    DWORD           ttl;                        // for how long this answer is valid (seconds), 0 means don't cache
+    DWORD           expireTime;                 // Utils::getCurrentMs() when this cached answer expires
+};
+
+struct Tresolv {                                // request from ST
              DWORD          startTime;
-    volatile BYTE           getaddrinfoHasFinished;
+    volatile BYTE           lookupHasFinished;
     volatile BYTE           processed;
              int            error;
 
@@ -18,27 +40,57 @@ struct Tresolv {
              char           canonName[256];
 
              int            count;
-             BYTE           data[128];
+             BYTE           data[RESOLV_MAX_IPS * 4];
              std::string    h_name;
 
-             gaicb          req;
-             addrinfo       hints;
+             std::string    lookupName;         // normalized hostName - key to cache and in-flight lookups
 };
 
+// Resolves host names for the ST. Answers are cached for as long as their TTL says (negative answers too), and requests
+// for the same name share a single lookup. Lookups are done by worker threads, so the ST just polls checkAndhandleSlot().
 class ResolverRequest {
 public:
+    ResolverRequest(void);
+    ~ResolverRequest(void);
+
     int  addRequest         (const char *hostName);
     bool checkAndhandleSlot (int index);
     void showSlot           (int index);
     void clearSlot          (int index);
     bool slotIndexValid     (int index);
 
+    void setNameServer      (DWORD ip, WORD port);  // use this name server instead of the ones from /etc/resolv.conf (host byte order)
+    void clearCache         (void);
+
     Tresolv requests[RESOLV_COUNT];
 
 private:
-    bool getaddrinfoHasFinished (int index);
-    bool isProcessed            (int index);
-    bool processSlot            (int index);
+    pthread_mutex_t mutex;
+    pthread_cond_t  lookupAdded;
+    pthread_t       threads[RESOLV_THREADS];
+    volatile bool   shouldStop;
+
+    std::map<std::string, TresolvAnswer>    cache;
+    std::set<std::string>                   inFlight;       // names which are waiting for lookup or being looked up
+    std::deque<std::string>                 lookupQueue;    // names waiting for worker thread
+
+    DWORD           nameServerIp;                           // if non-zero, use this name server
+    WORD            nameServerPort;
+
+    static void *lookupThreadCode(void *ptr);
+    void lookupThreadLoop   (void);
+
+    bool findInCache        (const std::string &name, TresolvAnswer &answer);
+    void storeInCache       (const std::string &name, TresolvAnswer &answer);
+    void answerWaitingSlots (const std::string &name, const TresolvAnswer &answer);
+    void fillSlot           (Tresolv *r, const TresolvAnswer &answer);
+
+    static std::string normalizeName(const char *hostName);
+    static void addIp       (TresolvAnswer &answer, DWORD ip);
+
+    void lookup             (struct __res_state *state, const std::string &name, TresolvAnswer &answer);
+    bool lookupHostsFile    (const std::string &name, TresolvAnswer &answer);
+    int  lookupDns          (struct __res_state *state, const std::string &name, TresolvAnswer &answer, DWORD &negTtl);
 };
 
 #endif
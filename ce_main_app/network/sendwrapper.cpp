@@ -0,0 +1,265 @@
+// vim: shiftwidth=4 tabstop=4 softtabstop=4 expandtab
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "../utils.h"
+#include "../debug.h"
+
+#include "sting.h"
+#include "sendwrapper.h"
+
+SendWrapper::SendWrapper(void)
+{
+    ring = NULL;
+    init(-1);
+}
+
+SendWrapper::~SendWrapper(void)
+{
+    clearAll();
+}
+
+void SendWrapper::init(int inFd, int inCoalesceMs)
+{
+    fd          = inFd;
+    coalesceMs  = inCoalesceMs;
+    lastSendMs  = Utils::getCurrentMs() - coalesceMs;   // first write is not a part of burst
+    noDelaySet  = false;
+    clearAll();
+}
+
+void SendWrapper::clearAll(void)
+{
+    if(ring != NULL) {                                  // return the buffer, it's not needed now
+        BufferPool::put(ring, SENDWRAPPER_SIZE);
+        ring = NULL;
+    }
+
+    head = 0;
+    tail = 0;
+
+    holding     = false;
+    flushTime   = 0;
+}
+
+void SendWrapper::takeOver(SendWrapper &from)
+{
+    clearAll();
+
+    fd          = from.fd;
+    ring        = from.ring;
+    head        = from.head;
+    tail        = from.tail;
+    coalesceMs  = from.coalesceMs;
+    lastSendMs  = from.lastSendMs;
+    holding     = from.holding;
+    flushTime   = from.flushTime;
+    noDelaySet  = from.noDelaySet;
+
+    from.ring   = NULL;                                 // the buffer is ours now
+    from.init(-1);
+}
+
+DWORD SendWrapper::getQueued(void)
+{
+    return (tail - head);
+}
+
+DWORD SendWrapper::getFreeSpace(void)
+{
+    return (SENDWRAPPER_SIZE - getQueued());
+}
+
+BYTE SendWrapper::send(const BYTE *data, int length, bool canWrite)
+{
+    if((DWORD) length > getFreeSpace()) {               // like TCP_send() in STiNG - send all or nothing
+        return E_OBUFFULL;
+    }
+
+    if(shouldHoldBack(length, canWrite)) {              // small write in a burst? just add it to the queue
+        canWrite = false;
+    } else {
+        holding = false;                                // written now together with the new data
+    }
+
+    int written = 0;
+
+    if(canWrite) {                                      // socket is connected? write queued data and the new data at once
+        struct iovec iov[3];
+        int count = ringSpans(head, getQueued(), iov);
+
+        iov[count].iov_base = (void *) data;
+        iov[count].iov_len  = length;
+        count++;
+
+        int res = writeVector(iov, count);
+
+        if(res < 0) {
+            return E_RRESET;
+        }
+
+        DWORD fromQueue = MIN((DWORD) res, getQueued());    // queued data went out first
+        consume(fromQueue);
+        written = res - fromQueue;
+    }
+
+    if(written < length) {                              // socket didn't take everything? queue the rest
+        if(ring == NULL) {
+            ring = BufferPool::get(SENDWRAPPER_SIZE);
+        }
+
+        int rest = length - written;
+
+        struct iovec iov[2];
+        int spans = ringSpans(tail, rest, iov);
+
+        for(int i=0; i<spans; i++) {
+            memcpy(iov[i].iov_base, data + written, iov[i].iov_len);
+            written += iov[i].iov_len;
+        }
+
+        tail += rest;
+    }
+
+    return E_NORMAL;
+}
+
+bool SendWrapper::shouldHoldBack(int length, bool canWrite)
+{
+    if(coalesceMs <= 0 || !canWrite) {                  // not coalescing, or can't write anyway?
+        return false;
+    }
+
+    DWORD now   = Utils::getCurrentMs();
+    bool  burst = (now - lastSendMs) < (DWORD) coalesceMs;  // previous write was just now? more will probably follow
+    lastSendMs  = now;
+
+    if(holding) {                                       // already holding? until there's enough data
+        return ((getQueued() + length) < SENDWRAPPER_SMALL_WRITE);
+    }
+
+    if(!burst || getQueued() > 0 || length >= SENDWRAPPER_SMALL_WRITE) {   // not small write in burst, or socket is full
+        return false;
+    }
+
+    if(!noDelaySet) {                                   // we do the coalescing now, so Nagle would only delay the flushed data
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+        noDelaySet = true;
+    }
+
+    holding     = true;
+    flushTime   = now + coalesceMs;
+    return true;
+}
+
+bool SendWrapper::isHoldingBack(void)
+{
+    return holding;
+}
+
+DWORD SendWrapper::getFlushTime(void)
+{
+    return flushTime;
+}
+
+bool SendWrapper::needsWritable(void)
+{
+    return (!holding && getQueued() > 0);
+}
+
+int SendWrapper::flush(void)
+{
+    holding = false;                                    // whatever the socket doesn't take now waits just for the socket
+
+    if(getQueued() == 0) {                              // nothing to write? good
+        return 0;
+    }
+
+    struct iovec iov[2];
+    int count = ringSpans(head, getQueued(), iov);
+    int res   = writeVector(iov, count);
+
+    if(res < 0) {
+        return -1;
+    }
+
+    consume(res);
+    return res;
+}
+
+void SendWrapper::flushBeforeClose(int timeoutMs)
+{
+    DWORD start = Utils::getCurrentMs();
+
+    while(getQueued() > 0) {
+        int elapsed = Utils::getCurrentMs() - start;
+
+        if(elapsed >= timeoutMs) {
+            Debug::out(LOG_DEBUG, "SendWrapper::flushBeforeClose() - timeout, %d bytes not sent", getQueued());
+            break;
+        }
+
+        struct pollfd pfd;
+        pfd.fd      = fd;
+        pfd.events  = POLLOUT;
+        poll(&pfd, 1, timeoutMs - elapsed);
+
+        if(flush() < 0) {                               // socket error? nothing more can be sent
+            break;
+        }
+    }
+}
+
+int SendWrapper::writeVector(struct iovec *iov, int count)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = count;
+
+    int res = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if(res < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN) {  // socket full (or still connecting)? try later
+            return 0;
+        }
+
+        Debug::out(LOG_ERROR, "SendWrapper::writeVector() - sendmsg() failed : %s", strerror(errno));
+        return -1;
+    }
+
+    return res;
+}
+
+void SendWrapper::consume(DWORD count)
+{
+    head += count;
+
+    if(head == tail) {                                  // everything sent? the buffer is not needed now
+        clearAll();
+    }
+}
+
+int SendWrapper::ringSpans(DWORD pos, DWORD len, struct iovec *iov)
+{
+    DWORD offset = pos & SENDWRAPPER_MASK;
+    DWORD first  = MIN(len, SENDWRAPPER_SIZE - offset);     // part till the end of ring
+
+    iov[0].iov_base = ring + offset;
+    iov[0].iov_len  = first;
+
+    if(first == len) {                                  // whole area is contiguous (or empty)
+        return (len > 0) ? 1 : 0;
+    }
+
+    iov[1].iov_base = ring;                             // the rest wraps around to start of ring
+    iov[1].iov_len  = len - first;
+    return 2;
+}
@@ -0,0 +1,64 @@
+// vim: tabstop=4 softtabstop=4 shiftwidth=4 expandtab
+#ifndef _SENDWRAPPER_H_
+#define _SENDWRAPPER_H_
+
+#include <sys/uio.h>
+
+#include "../datatypes.h"
+#include "netadapter_commands.h"
+#include "bufferpool.h"
+
+#define SENDWRAPPER_SIZE    NET_SEND_BUFFER_SIZE        // must be power of 2 and one of BufferPool sizes
+#define SENDWRAPPER_MASK    (SENDWRAPPER_SIZE - 1)
+
+#define SENDWRAPPER_SMALL_WRITE     1400                // writes smaller than about one segment can be held back and coalesced
+
+// Holds the TCP data which ST sent, but the socket didn't take yet. send() writes the queued data
+// together with the new data by single sendmsg() straight from the caller's buffer, and queues only
+// what the socket didn't take. Network thread calls flush() when the socket becomes writable.
+//
+// If coalescing is enabled, small writes which come quickly one after another are held back until
+// there's about a segment of them, or until coalesceMs from the first one passes - network thread
+// calls flush() at getFlushTime(). The first small write after a pause is written right away.
+class SendWrapper
+{
+public:
+    SendWrapper(void);
+    ~SendWrapper(void);
+
+    void  init      (int inFd, int inCoalesceMs=0);      // inCoalesceMs - how long small writes can wait, 0 to write immediately
+    void  clearAll  (void);
+    void  takeOver  (SendWrapper &from);                // move socket and queued data from other wrapper, that one is left empty
+
+    BYTE  send      (const BYTE *data, int length, bool canWrite);  // returns E_NORMAL (sent or queued), E_OBUFFULL (nothing done) or E_RRESET
+    int   flush     (void);                             // write queued data, returns -1 on socket error
+    void  flushBeforeClose(int timeoutMs);              // try to write out queued data, wait at most timeoutMs
+
+    bool  isHoldingBack (void);                         // small writes are held back, flush() them at getFlushTime()
+    DWORD getFlushTime  (void);                         // in Utils::getCurrentMs() time
+    bool  needsWritable (void);                         // queued data waits for the socket to take it
+
+    DWORD getQueued     (void);
+    DWORD getFreeSpace  (void);
+
+private:
+    int    fd;
+
+    BYTE  *ring;        // from BufferPool, only while something is queued
+    DWORD  head;        // free running positions, use with SENDWRAPPER_MASK
+    DWORD  tail;
+
+    int    coalesceMs;
+    DWORD  lastSendMs;  // when ST sent something last time
+    bool   holding;     // queued data is held back on purpose, not because socket is full
+    DWORD  flushTime;
+    bool   noDelaySet;
+
+    bool   shouldHoldBack(int length, bool canWrite);
+
+    int    ringSpans    (DWORD pos, DWORD len, struct iovec *iov);
+    int    writeVector  (struct iovec *iov, int count);     // returns written count, 0 if socket is full, -1 on error
+    void   consume      (DWORD count);
+};
+
+#endif
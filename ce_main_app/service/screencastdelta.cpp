@@ -0,0 +1,218 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#include <string.h>
+
+#include "utils.h"
+#include "screencastdelta.h"
+
+static inline WORD getWordBE(const BYTE *bfr)
+{
+    return (((WORD) bfr[0]) << 8) | bfr[1];
+}
+
+//--------------------------------------------------------
+ScreencastDeltaEncoder::ScreencastDeltaEncoder()
+{
+    frameNo = 0;
+    reset();
+}
+
+void ScreencastDeltaEncoder::reset(void)
+{
+    havePrev        = false;
+    sinceKeyframe   = 0;
+    memset(prevScreen,  0, SCREEN_BYTES);
+    memset(prevPalette, 0, PALETTE_BYTES);
+}
+
+int ScreencastDeltaEncoder::encode(const BYTE *screen, const BYTE *palette, BYTE *out)
+{
+    frameNo++;
+
+    bool keyframe    = !havePrev || sinceKeyframe >= SCDELTA_KEYFRAME_EVERY - 1;
+    bool withPalette = keyframe  || memcmp(palette, prevPalette, PALETTE_BYTES) != 0;  // keyframe must be enough to show the frame
+
+    out[1] = withPalette ? SCDELTA_FLAG_PALETTE : 0;
+    Utils::storeWord(out + 2, frameNo);
+
+    int len = SCDELTA_HEADER_SIZE;
+
+    if(withPalette) {
+        memcpy(out + len, palette, PALETTE_BYTES);
+        len += PALETTE_BYTES;
+    }
+
+    int deltaLen = -1;
+
+    if(!keyframe) {
+        deltaLen = encodeDelta(screen, out + len, SCREEN_BYTES);
+    }
+
+    if(deltaLen >= 0) {                                 // delta fits, send it
+        out[0] = SCDELTA_TYPE_DELTA;
+        len += deltaLen;
+        sinceKeyframe++;
+    } else {                                            // first frame, time for keyframe, or delta would be bigger than whole screen
+        out[0] = SCDELTA_TYPE_KEYFRAME;
+        memcpy(out + len, screen, SCREEN_BYTES);
+        len += SCREEN_BYTES;
+        sinceKeyframe = 0;
+    }
+
+    memcpy(prevScreen,  screen,  SCREEN_BYTES);
+    memcpy(prevPalette, palette, PALETTE_BYTES);
+    havePrev = true;
+
+    return len;
+}
+
+// returns length of runs, or -1 when they wouldn't fit in maxLen
+int ScreencastDeltaEncoder::encodeDelta(const BYTE *screen, BYTE *out, int maxLen)
+{
+    const WORD *cur  = (const WORD *) screen;
+    const WORD *prev = (const WORD *) prevScreen;
+
+    int len      = 0;
+    int runEnd   = 0;                                   // word after the last run
+    int i        = 0;
+
+    while(i < SCREEN_WORDS) {
+        if(cur[i] == prev[i]) {                         // find next changed word
+            i++;
+            continue;
+        }
+
+        int start = i;
+        int end   = i + 1;                              // run is start..end-1, extend it while the gaps are short
+
+        while(end < SCREEN_WORDS) {
+            if(cur[end] != prev[end]) {
+                end++;
+                continue;
+            }
+
+            int gap = 0;
+            while(end + gap < SCREEN_WORDS && cur[end + gap] == prev[end + gap] && gap <= SCDELTA_MERGE_GAP) {
+                gap++;
+            }
+
+            if(gap > SCDELTA_MERGE_GAP || end + gap >= SCREEN_WORDS) {      // long gap or end of screen - run ends here
+                break;
+            }
+
+            end += gap;
+        }
+
+        int copyWords = end - start;
+        int runLen    = SCDELTA_RUN_HEADER + copyWords * 2;
+
+        if(len + runLen > maxLen) {
+            return -1;
+        }
+
+        Utils::storeWord(out + len,     start - runEnd);
+        Utils::storeWord(out + len + 2, copyWords);
+        memcpy(out + len + SCDELTA_RUN_HEADER, screen + start * 2, copyWords * 2);
+        len += runLen;
+
+        runEnd = end;
+        i      = end;
+    }
+
+    return len;
+}
+
+//--------------------------------------------------------
+ScreencastDeltaDecoder::ScreencastDeltaDecoder()
+{
+    memset(screen,  0, SCREEN_BYTES);
+    memset(palette, 0, PALETTE_BYTES);
+    reset();
+}
+
+void ScreencastDeltaDecoder::reset(void)
+{
+    haveFrame   = false;
+    paletteSet  = false;
+    frameNo     = 0;
+}
+
+int ScreencastDeltaDecoder::apply(const BYTE *data, int len)
+{
+    paletteSet = false;
+
+    if(len < SCDELTA_HEADER_SIZE) {
+        return SCDELTA_ERR_FORMAT;
+    }
+
+    BYTE type       = data[0];
+    bool withPal    = (data[1] & SCDELTA_FLAG_PALETTE) != 0;
+    WORD newFrameNo = getWordBE(data + 2);
+
+    int pos = SCDELTA_HEADER_SIZE;
+
+    if(withPal) {
+        if(len < pos + PALETTE_BYTES) {
+            return SCDELTA_ERR_FORMAT;
+        }
+        pos += PALETTE_BYTES;
+    }
+
+    if(type == SCDELTA_TYPE_KEYFRAME) {
+        if(len < pos + SCREEN_BYTES) {
+            return SCDELTA_ERR_FORMAT;
+        }
+        memcpy(screen, data + pos, SCREEN_BYTES);
+    } else if(type == SCDELTA_TYPE_DELTA) {
+        if(!haveFrame || newFrameNo != (WORD) (frameNo + 1)) {     // missed a frame (or never had one), can't build on it
+            return SCDELTA_ERR_NOBASE;
+        }
+
+        if(!applyRuns(data + pos, len - pos)) {
+            return SCDELTA_ERR_FORMAT;
+        }
+    } else {
+        return SCDELTA_ERR_FORMAT;
+    }
+
+    if(withPal) {
+        memcpy(palette, data + SCDELTA_HEADER_SIZE, PALETTE_BYTES);
+        paletteSet = true;
+    }
+
+    haveFrame   = true;
+    frameNo     = newFrameNo;
+    return SCDELTA_OK;
+}
+
+// runs are checked first, so broken payload leaves the frame as it was
+bool ScreencastDeltaDecoder::applyRuns(const BYTE *data, int len)
+{
+    for(int pass=0; pass<2; pass++) {
+        int pos  = 0;
+        int word = 0;
+
+        while(len - pos >= SCDELTA_RUN_HEADER) {
+            int skipWords = getWordBE(data + pos);
+            int copyWords = getWordBE(data + pos + 2);
+            pos  += SCDELTA_RUN_HEADER;
+            word += skipWords;
+
+            if(pass == 0 && (word + copyWords > SCREEN_WORDS || pos + copyWords * 2 > len)) {
+                return false;
+            }
+
+            if(pass == 1) {
+                memcpy(screen + word * 2, data + pos, copyWords * 2);
+            }
+
+            pos  += copyWords * 2;
+            word += copyWords;
+        }
+
+        if(pass == 0 && pos != len) {                   // trailing garbage
+            return false;
+        }
+    }
+
+    return true;
+}
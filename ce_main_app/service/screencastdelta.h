@@ -0,0 +1,77 @@
+// vim: shiftwidth=4 softtabstop=4 tabstop=4 expandtab
+#ifndef _SCREENCASTDELTA_H_
+#define _SCREENCASTDELTA_H_
+
+#include "datatypes.h"
+
+#define SCREEN_BYTES                32000
+#define SCREEN_WORDS                (SCREEN_BYTES / 2)
+#define PALETTE_BYTES               32
+
+// Payload of TRAN_CMD_SENDSCREENCAST_DELTA, all WORDs big endian (as ST has them):
+//   BYTE type      - SCDELTA_TYPE_KEYFRAME or SCDELTA_TYPE_DELTA
+//   BYTE flags     - SCDELTA_FLAG_PALETTE: 32 bytes of palette follow the header
+//   WORD frameNo   - increments by 1 with each sent frame, delta is accepted only on top of frameNo - 1
+//   [32 bytes palette]
+//   keyframe:  32000 bytes of screen
+//   delta:     runs till the end of payload - WORD skipWords, WORD copyWords, copyWords WORDs of new screen content;
+//              skipWords are unchanged words since the end of previous run
+#define SCDELTA_TYPE_KEYFRAME       'K'
+#define SCDELTA_TYPE_DELTA          'D'
+#define SCDELTA_FLAG_PALETTE        0x01
+
+#define SCDELTA_HEADER_SIZE         4
+#define SCDELTA_RUN_HEADER          4
+#define SCDELTA_MAX_PAYLOAD         (SCDELTA_HEADER_SIZE + PALETTE_BYTES + SCREEN_BYTES)    // encoder sends keyframe instead of bigger delta
+
+#define SCDELTA_MERGE_GAP           2       // unchanged gap this short (in words) costs less as copied words than as new run
+#define SCDELTA_KEYFRAME_EVERY      64      // encoder sends keyframe at least this often, so a lost frame doesn't stay forever
+
+// results of ScreencastDeltaDecoder::apply()
+#define SCDELTA_OK                  0
+#define SCDELTA_ERR_FORMAT          -1      // broken payload, frame not changed
+#define SCDELTA_ERR_NOBASE          -2      // delta not on top of the frame we have - sender should send keyframe
+
+// Builds the payloads from full frames - this is what the ST side does, here it serves the tests and other senders.
+class ScreencastDeltaEncoder
+{
+public:
+    ScreencastDeltaEncoder();
+
+    void reset(void);                       // next frame will be keyframe
+    int  encode(const BYTE *screen, const BYTE *palette, BYTE *out);    // returns payload size, out must hold SCDELTA_MAX_PAYLOAD
+
+private:
+    BYTE    prevScreen [SCREEN_BYTES];
+    BYTE    prevPalette[PALETTE_BYTES];
+    bool    havePrev;
+    WORD    frameNo;
+    int     sinceKeyframe;
+
+    int  encodeDelta(const BYTE *screen, BYTE *out, int maxLen);
+};
+
+// Keeps the last received frame and applies payloads on top of it.
+class ScreencastDeltaDecoder
+{
+public:
+    ScreencastDeltaDecoder();
+
+    void reset(void);                       // forget the frame, only keyframe is accepted next
+    int  apply(const BYTE *data, int len);  // returns SCDELTA_OK or SCDELTA_ERR_*
+
+    const BYTE *getScreen(void)     { return screen;     }
+    const BYTE *getPalette(void)    { return palette;    }
+    bool        gotPalette(void)    { return paletteSet; }     // last applied payload had palette in it
+
+private:
+    BYTE    screen [SCREEN_BYTES];
+    BYTE    palette[PALETTE_BYTES];
+    bool    haveFrame;
+    bool    paletteSet;
+    WORD    frameNo;
+
+    bool applyRuns(const BYTE *data, int len);
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include <string.h>
+#include <zlib.h>
+
+#include "screencastimage.h"
+
+// bit 7 of a plane byte is the leftmost pixel - spread[b] puts bit 7 into the lowest nibble, bit 6 into the next one, ...
+// so OR of (spread[plane N byte] << N) gives color indexes of 8 pixels, first pixel in the lowest nibble
+static DWORD spread[256];
+static bool  spreadReady = false;
+
+static void makeSpread(void)
+{
+    for(int b=0; b<256; b++) {
+        DWORD v = 0;
+        for(int bit=0; bit<8; bit++) {
+            if(b & (0x80 >> bit)) {
+                v |= 1 << (bit * 4);
+            }
+        }
+        spread[b] = v;
+    }
+    spreadReady = true;
+}
+
+// ST: 0x0RGB, 3 bits per color, STE adds the 4th (lowest) bit as bit 3 - the same as atariscreen.js does it
+void ScreencastImage::paletteToRgb(const BYTE *palette, int colors, BYTE rgb[16][3])
+{
+    for(int i=0; i<colors; i++) {
+        WORD c = (palette[i * 2] << 8) | palette[i * 2 + 1];
+
+        for(int comp=0; comp<3; comp++) {
+            int v = (c >> ((2 - comp) * 4)) & 0x0f;
+            v = ((v & 7) << 1) | (v >> 3);
+            rgb[i][comp] = v * 17;
+        }
+    }
+}
+
+void ScreencastImage::toRgb(const TScreencastFrame *frame, BYTE *rgb, int &width, int &height)
+{
+    if(!spreadReady) {
+        makeSpread();
+    }
+
+    int planes, lines, lineRepeat;
+
+    switch(frame->resolution) {
+        case 1:     planes = 2; width = 640; lines = 200; lineRepeat = 2; break;
+        case 2:     planes = 1; width = 640; lines = 400; lineRepeat = 1; break;
+        default:    planes = 4; width = 320; lines = 200; lineRepeat = 1; break;
+    }
+    height = lines * lineRepeat;
+
+    BYTE colors[16][3];
+    memset(colors, 0, sizeof(colors));
+    paletteToRgb(frame->palette, 1 << planes, colors);
+
+    const BYTE *src = frame->screen;
+    BYTE       *dst = rgb;
+    int lineBytes   = width * 3;
+
+    for(int line=0; line<lines; line++) {
+        BYTE *lineStart = dst;
+
+        for(int group=0; group<width / 16; group++) {  // 16 pixels: one word of each plane
+            for(int half=0; half<2; half++) {           // high byte of the words first - the left 8 pixels
+                DWORD idx = 0;
+                for(int p=0; p<planes; p++) {
+                    idx |= spread[src[p * 2 + half]] << p;
+                }
+
+                for(int px=0; px<8; px++) {
+                    const BYTE *c = colors[(idx >> (px * 4)) & 0x0f];
+                    dst[0] = c[0];
+                    dst[1] = c[1];
+                    dst[2] = c[2];
+                    dst += 3;
+                }
+            }
+            src += planes * 2;
+        }
+
+        for(int r=1; r<lineRepeat; r++) {
+            memcpy(dst, lineStart, lineBytes);
+            dst += lineBytes;
+        }
+    }
+}
+
+void ScreencastImage::addChunk(std::vector<BYTE> &png, const char *type, const BYTE *data, DWORD len)
+{
+    BYTE hdr[8] = { (BYTE) (len >> 24), (BYTE) (len >> 16), (BYTE) (len >> 8), (BYTE) len,
+                    (BYTE) type[0], (BYTE) type[1], (BYTE) type[2], (BYTE) type[3] };
+    png.insert(png.end(), hdr, hdr + 8);
+    if(len > 0) {
+        png.insert(png.end(), data, data + len);
+    }
+
+    uLong crc = crc32(0, hdr + 4, 4);                   // CRC covers type and data
+    if(len > 0) {
+        crc = crc32(crc, data, len);
+    }
+
+    BYTE tail[4] = { (BYTE) (crc >> 24), (BYTE) (crc >> 16), (BYTE) (crc >> 8), (BYTE) crc };
+    png.insert(png.end(), tail, tail + 4);
+}
+
+// 8 bit truecolor, no interlace, filter 'none' on each line - zlib finds the flat areas anyway
+void ScreencastImage::encodePng(const BYTE *rgb, int width, int height, std::vector<BYTE> &png, int zlibLevel)
+{
+    static const BYTE signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+    png.assign(signature, signature + 8);
+
+    BYTE ihdr[13] = { (BYTE) (width >> 24), (BYTE) (width >> 16), (BYTE) (width >> 8), (BYTE) width,
+                      (BYTE) (height >> 24), (BYTE) (height >> 16), (BYTE) (height >> 8), (BYTE) height,
+                      8, 2, 0, 0, 0 };          // bit depth, color type RGB, compression, filter, interlace
+    addChunk(png, "IHDR", ihdr, 13);
+
+    int lineBytes = width * 3;
+    std::vector<BYTE> raw(height * (1 + lineBytes));
+    for(int y=0; y<height; y++) {
+        raw[y * (1 + lineBytes)] = 0;                   // filter type
+        memcpy(&raw[y * (1 + lineBytes) + 1], rgb + y * lineBytes, lineBytes);
+    }
+
+    uLongf packedLen = compressBound(raw.size());
+    std::vector<BYTE> packed(packedLen);
+    compress2(&packed[0], &packedLen, &raw[0], raw.size(), zlibLevel);
+    addChunk(png, "IDAT", &packed[0], packedLen);
+
+    addChunk(png, "IEND", NULL, 0);
+}
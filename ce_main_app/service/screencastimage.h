@@ -0,0 +1,27 @@
+#ifndef _SCREENCASTIMAGE_H_
+#define _SCREENCASTIMAGE_H_
+
+#include <vector>
+
+#include "datatypes.h"
+#include "screencastservice.h"
+
+#define SCIMAGE_MAX_WIDTH       640
+#define SCIMAGE_MAX_HEIGHT      400
+#define SCIMAGE_RGB_SIZE        (SCIMAGE_MAX_WIDTH * SCIMAGE_MAX_HEIGHT * 3)
+#define SCIMAGE_ZLIB_LEVEL      1       // 3-4x faster than the default 6, PNG gets bigger - but frames change often and Pi CPU is scarce
+
+// ST planar screen -> packed RGB (3 bytes per pixel) -> PNG, so browsers just show an image.
+// Low res gives 320x200, medium res 640x400 (lines doubled for the right aspect), high res 640x400.
+class ScreencastImage
+{
+public:
+    static void toRgb(const TScreencastFrame *frame, BYTE *rgb, int &width, int &height);     // rgb must hold SCIMAGE_RGB_SIZE
+    static void encodePng(const BYTE *rgb, int width, int height, std::vector<BYTE> &png, int zlibLevel=SCIMAGE_ZLIB_LEVEL);
+
+private:
+    static void paletteToRgb(const BYTE *palette, int colors, BYTE rgb[16][3]);
+    static void addChunk(std::vector<BYTE> &png, const char *type, const BYTE *data, DWORD len);
+};
+
+#endif
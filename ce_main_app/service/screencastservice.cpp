@@ -12,35 +12,57 @@
 #include <ctime>
 
 #include "screencastservice.h"
+#include "screencastimage.h"
 #include "settings.h"
 #include "debug.h"
-
-pthread_mutex_t screencastServicePaletteMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t screencastServiceScreenMutex = PTHREAD_MUTEX_INITIALIZER;
+#include "utils.h"
 
 ScreencastService::ScreencastService() 
 {
+    frames          = NULL;
+    latest          = 0;
+    frameSeq        = 0;
+    waiters         = 0;
+    iSTResolution   = 0;
+    memset((void *) refs, 0, sizeof(refs));
+    memset(&stats, 0, sizeof(stats));
+
+    pthread_mutex_init(&waitMutex, NULL);
+    pthread_cond_init(&waitCond, NULL);
+
+    pthread_mutex_init(&imageMutex, NULL);
+    imageRgb        = NULL;
+    imageSeq        = 0;
+    imageValid      = false;
 }
 
 //get NTP time and set system time accordingly
 void ScreencastService::start() 
 {
-    pxPalette=new unsigned char[16*2];
-    memset(pxPalette,0,32);
-    pxPalette[0]=-1;
-    pxPalette[1]=-1;
-    
-    pxScreen=new unsigned char[32000];
-    memset(pxScreen,0,32000);
+    frames=new TScreencastFrame[SCREENCAST_SLOTS];
+    memset(frames,0,sizeof(TScreencastFrame) * SCREENCAST_SLOTS);
+
+    frames[0].palette[0]=0xff;                      // readers always get some frame, even before ST sends one
+    frames[0].palette[1]=0xff;
+    latest=0;
+
+    imageRgb=new BYTE[SCIMAGE_RGB_SIZE];
+    imageValid=false;
+
     Debug::out(LOG_DEBUG, "ScreencastService: init done.");
 }
 
 void ScreencastService::stop() 
 {
-    delete[] pxScreen;
-    delete[] pxPalette;
-    pxScreen=NULL;
-    pxPalette=NULL;
+    delete[] frames;
+    frames=NULL;
+
+    pthread_mutex_lock(&imageMutex);
+    delete[] imageRgb;
+    imageRgb=NULL;
+    imagePng.clear();
+    imageValid=false;
+    pthread_mutex_unlock(&imageMutex);
 }
 
 int ScreencastService::getFrameSkip()
@@ -63,40 +85,181 @@ unsigned char ScreencastService::getSTResolution()
 
 void ScreencastService::setPalette(void *pxPalette)
 {
-    pthread_mutex_lock(&screencastServicePaletteMutex);
-    //copy given palette
-    memcpy(this->pxPalette,pxPalette,16*2);
-    
-    //special case monochrome palette
-    //ignore inverting for now (have to retest behaviour on real hardware)
-    if( getSTResolution()==2 ){
-        this->pxPalette[0]=this->pxPalette[1]=0xff;        
-        this->pxPalette[2]=this->pxPalette[3]=0x00;        
-    }
-    
-    pthread_mutex_unlock(&screencastServicePaletteMutex);
+    setFrame(NULL, pxPalette);
 }
 
 void ScreencastService::getPalette(void *pxPalette)
 {
-    pthread_mutex_lock(&screencastServiceScreenMutex);
-    //copy current palette out
-    memcpy(pxPalette,this->pxPalette,16*2);
-    pthread_mutex_unlock(&screencastServiceScreenMutex);
+    const TScreencastFrame *frame = acquireFrame();
+    memcpy(pxPalette,frame->palette,16*2);
+    releaseFrame(frame);
 }
 
 void ScreencastService::setScreen(void *pxScreen)
 {
-    pthread_mutex_lock(&screencastServiceScreenMutex);
-    //copy given screen
-    memcpy(this->pxScreen,pxScreen,32000);
-    pthread_mutex_unlock(&screencastServiceScreenMutex);
+    setFrame(pxScreen, NULL);
 }
 
 void ScreencastService::getScreen(void *pxScreen)
 {
-    pthread_mutex_lock(&screencastServiceScreenMutex);
-    //copy current screen out
-    memcpy(pxScreen,this->pxScreen,32000);
-    pthread_mutex_unlock(&screencastServiceScreenMutex);
+    const TScreencastFrame *frame = acquireFrame();
+    memcpy(pxScreen,frame->screen,32000);
+    releaseFrame(frame);
+}
+
+// called only from one thread (ACSI) - the only one which changes latest, so the newest frame can be read here without holding it
+void ScreencastService::setFrame(const void *pxScreen, const void *pxPalette)
+{
+    const TScreencastFrame *cur = &frames[latest];
+    BYTE palette[16*2];
+
+    if(pxPalette) {
+        memcpy(palette, pxPalette, 16*2);
+        fixMonoPalette(palette, iSTResolution);
+    } else {
+        memcpy(palette, cur->palette, 16*2);
+    }
+
+    if(!pxScreen && iSTResolution == cur->resolution && memcmp(palette, cur->palette, 16*2) == 0) {
+        return;                                     // just the same palette again, nothing new to show
+    }
+
+    int slot = claimFreeSlot();
+
+    if(slot < 0) {                                  // all slots held by readers, can't write anywhere without tearing their frame
+        stats.dropped++;
+        return;
+    }
+
+    TScreencastFrame *frame = &frames[slot];
+    memcpy(frame->screen, pxScreen ? pxScreen : cur->screen, 32000);
+    memcpy(frame->palette, palette, 16*2);
+    frame->resolution = iSTResolution;
+
+    publish(slot);
+}
+
+//special case monochrome palette
+//ignore inverting for now (have to retest behaviour on real hardware)
+void ScreencastService::fixMonoPalette(BYTE *palette, BYTE resolution)
+{
+    if( resolution==2 ){
+        palette[0]=palette[1]=0xff;
+        palette[2]=palette[3]=0x00;
+    }
+}
+
+int ScreencastService::claimFreeSlot(void)
+{
+    for(int i=0; i<SCREENCAST_SLOTS; i++) {
+        if(i != latest && refs[i] == 0) {           // reader which takes it from now on will see it's not the latest and let it go
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void ScreencastService::publish(int slot)
+{
+    frames[slot].seq         = frameSeq + 1;
+    frames[slot].publishedUs = Utils::getCurrentUs();
+
+    __sync_synchronize();                           // frame content must be visible before the slot becomes the newest
+    latest = slot;
+    __sync_synchronize();
+    frameSeq = frames[slot].seq;
+    __sync_synchronize();
+
+    stats.published++;
+
+    if(waiters > 0) {                               // a waiter either sees the new frameSeq, or is counted here
+        pthread_mutex_lock(&waitMutex);
+        pthread_cond_broadcast(&waitCond);
+        pthread_mutex_unlock(&waitMutex);
+    }
+}
+
+const TScreencastFrame *ScreencastService::acquireFrame(void)
+{
+    while(true) {
+        int slot = latest;
+        __sync_fetch_and_add(&refs[slot], 1);
+
+        if(slot == latest) {                        // still the newest after we hold it - writer won't touch it now
+            return &frames[slot];
+        }
+
+        __sync_fetch_and_sub(&refs[slot], 1);       // writer moved on meanwhile and may be writing there, try the new one
+    }
+}
+
+void ScreencastService::releaseFrame(const TScreencastFrame *frame)
+{
+    __sync_fetch_and_sub(&refs[frame - frames], 1);
+}
+
+DWORD ScreencastService::getFrameSeq(void)
+{
+    return frameSeq;
+}
+
+DWORD ScreencastService::waitForFrame(DWORD afterSeq, int timeoutMs)
+{
+    if(frameSeq != afterSeq) {
+        return frameSeq;
+    }
+
+    __sync_fetch_and_add(&waiters, 1);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&waitMutex);
+    while(frameSeq == afterSeq) {
+        if(pthread_cond_timedwait(&waitCond, &waitMutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&waitMutex);
+
+    __sync_fetch_and_sub(&waiters, 1);
+    return frameSeq;
+}
+
+// clients asking for the same frame get the same PNG; the one which comes first after a new frame pays for the conversion
+DWORD ScreencastService::getPng(std::vector<BYTE> &png)
+{
+    pthread_mutex_lock(&imageMutex);
+
+    if(!imageValid || imageSeq != frameSeq) {
+        const TScreencastFrame *frame = acquireFrame();
+
+        int width, height;
+        ScreencastImage::toRgb(frame, imageRgb, width, height);
+        ScreencastImage::encodePng(imageRgb, width, height, imagePng);
+
+        imageSeq   = frame->seq;
+        imageValid = true;
+        releaseFrame(frame);
+
+        __sync_fetch_and_add(&stats.imagesEncoded, 1);
+    }
+
+    png = imagePng;
+    DWORD seq = imageSeq;
+
+    pthread_mutex_unlock(&imageMutex);
+    return seq;
+}
+
+void ScreencastService::getStats(TScreencastStats &st)
+{
+    st = stats;
 }
@@ -2,7 +2,30 @@
 #define _SCREENCASTSERVICE_H_
 
 #include <string>
+#include <vector>
+#include <pthread.h>
 
+#include "datatypes.h"
+
+#define SCREENCAST_SLOTS    8       // the newest frame, one being written, the rest can be held by readers at the same time
+
+typedef struct {
+    DWORD   seq;                    // 1 for the first published frame, then +1 for each
+    DWORD   publishedUs;            // Utils::getCurrentUs() when published
+    BYTE    resolution;             // ST resolution 0..2
+    BYTE    palette[16*2];
+    BYTE    screen[32000];
+} TScreencastFrame;
+
+typedef struct {
+    DWORD   published;
+    DWORD   dropped;                // no free slot - all of them held by readers
+    DWORD   imagesEncoded;          // frames converted to PNG - once per frame, no matter how many clients want it
+} TScreencastStats;
+
+// Frames are published through a ring of slots: writer (ACSI thread) fills a slot nobody holds and makes it the newest
+// with one pointer store, readers take the newest slot with a reference count and use it in place. Nobody waits on a lock,
+// only waitForFrame() sleeps until something new is published. Frame, palette and resolution always come together.
 class ScreencastService
 {
 public:
@@ -16,9 +39,39 @@ public:
     void getPalette(void* pxPalette);
     void setScreen(void* pxScreen);
     void getScreen(void* pxScreen);
+
+    void setFrame(const void *pxScreen, const void *pxPalette);    // publish screen together with palette, NULL palette keeps the current
+
+    const TScreencastFrame *acquireFrame(void);                     // newest frame, must be given back by releaseFrame()
+    void  releaseFrame(const TScreencastFrame *frame);
+    DWORD getFrameSeq(void);                                        // seq of the newest frame
+    DWORD waitForFrame(DWORD afterSeq, int timeoutMs);              // wait till frame newer than afterSeq is published, returns newest seq
+
+    DWORD getPng(std::vector<BYTE> &png);                           // PNG of the newest frame (made on the first request), returns its seq
+
+    void getStats(TScreencastStats &st);
+
 private:
-    unsigned char *pxScreen;
-    unsigned char *pxPalette;
-    unsigned char iSTResolution;
+    TScreencastFrame    *frames;
+    volatile int        refs[SCREENCAST_SLOTS];                     // readers holding each slot
+    volatile int        latest;                                     // slot with the newest frame
+    volatile DWORD      frameSeq;
+
+    volatile int        waiters;                                    // threads in waitForFrame() - only then the writer signals
+    pthread_mutex_t     waitMutex;
+    pthread_cond_t      waitCond;
+
+    pthread_mutex_t     imageMutex;                                 // only web clients wait here, never the writer
+    BYTE                *imageRgb;
+    std::vector<BYTE>   imagePng;
+    DWORD               imageSeq;
+    bool                imageValid;
+
+    TScreencastStats    stats;
+    unsigned char       iSTResolution;
+
+    int  claimFreeSlot(void);
+    void publish(int slot);
+    void fixMonoPalette(BYTE *palette, BYTE resolution);
 };
-#endif
\ No newline at end of file
+#endif
@@ -43,15 +43,19 @@ void VirtualMouseService::sendMousePacket(int iX,int iY)
 	ssize_t res;
     pthread_mutex_lock(&virtualMouseServiceMutex);    //we could be accessed from any thread, so better lcok this
 
-    input_event ev[2];
+    input_event ev[3];                      // X, Y and SYN_REPORT like from real mouse - ikbd sends the motion on SYN_REPORT
     gettimeofday(&ev[0].time, NULL);
 	memcpy(&ev[1].time, &ev[0].time, sizeof(ev[0].time));
+	memcpy(&ev[2].time, &ev[0].time, sizeof(ev[0].time));
     ev[0].type = EV_REL;
     ev[0].code = REL_X;
     ev[0].value = iX;
     ev[1].type = EV_REL;
     ev[1].code = REL_Y;
     ev[1].value = iY;
+    ev[2].type = EV_SYN;
+    ev[2].code = SYN_REPORT;
+    ev[2].value = 0;
     Debug::out(LOG_DEBUG, "write mouse X, Y");
     res = write(fd, ev, sizeof(ev));
     Debug::out(LOG_DEBUG, "write mouse X, Y done res=%d", (int)res);
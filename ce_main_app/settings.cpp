@@ -6,28 +6,138 @@
 #include <dirent.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <map>
 
 #define SETTINGS_PATH		"/ce/settings"
+#define SETTINGS_STORE		"settings.store"        // all settings in one file, in SETTINGS_PATH
+#define SETTINGS_STORE_TMP	"settings.store.tmp"    // new store is written here, then renamed to SETTINGS_STORE
+#define SETTINGS_HEADER		"#CESETTINGS 1"         // ce_preinit parses the store too - change its settings.cpp with the format
+#define SETTINGS_EXPORTED	"HW_"                   // these keys are also in per-key files, ce_preinit reads and writes them there
 
 #include "global.h"
 #include "debug.h"
+#include "utils.h"
+#include "isettingsuser.h"
 
 extern TFlags       flags;
 extern THwConfig    hwConfig;
 
+typedef struct {
+    std::string     keyPrefix;
+    ISettingsUser   *su;
+    int             type;
+} TSettingsListener;
+
+char Settings::settingsPath[128] = SETTINGS_PATH;
+
+// the store shared by all Settings objects
+static std::map<std::string, std::string>   values;         // key -> the same text which was in per-key file
+static std::vector<std::string>             changedKeys;    // keys changed since the last write
+static bool                                 dirty;
+static DWORD                                firstDirtyMs;   // when the oldest unwritten change happened
+static std::vector<std::string>             migratedKeys;   // per-key files taken into store - deleted once the store is written
+static pthread_mutex_t  storeMutex      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   storeCond       = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t  persistMutex    = PTHREAD_MUTEX_INITIALIZER;   // one write of store at a time
+
+static volatile bool    loaded;
+static volatile bool    loading;
+static pthread_t        loaderThread;
+static pthread_mutex_t  loadMutex       = PTHREAD_MUTEX_INITIALIZER;
+
+static std::vector<TSettingsListener>   listeners;
+static pthread_mutex_t  listenerMutex   = PTHREAD_MUTEX_INITIALIZER;   // not held while calling listeners - they take their own locks
+static pthread_cond_t   listenerCond    = PTHREAD_COND_INITIALIZER;
+static ISettingsUser    *notifyingSu;                                  // listener being called now, removeChangeListener() waits for it
+static pthread_t        notifyingThread;
+
+static pthread_once_t   writerOnce      = PTHREAD_ONCE_INIT;
+static pthread_t        writerThread;
+
+static void *settingsWriterThreadCode(void *ptr)
+{
+    sigset_t all;                                       // signals are for main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&storeMutex);
+
+    while(true) {
+        if(!dirty) {                                    // nothing to write? wait for change
+            pthread_cond_wait(&storeCond, &storeMutex);
+            continue;
+        }
+
+        int wait = (int) (firstDirtyMs + SETTINGS_FLUSH_DELAY_MS - Utils::getCurrentMs());
+
+        if(wait > 0) {                                  // let more changes come, write them at once
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec  += wait / 1000;
+            ts.tv_nsec += (wait % 1000) * 1000000;
+            if(ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+
+            pthread_cond_timedwait(&storeCond, &storeMutex, &ts);
+            continue;
+        }
+
+        pthread_mutex_unlock(&storeMutex);
+        Settings::flush();
+        pthread_mutex_lock(&storeMutex);
+    }
+
+    return 0;
+}
+
+static void startSettingsWriter(void)
+{
+    pthread_create(&writerThread, NULL, settingsWriterThreadCode, NULL);
+    pthread_detach(writerThread);
+
+    atexit(Settings::flush);                            // don't lose the last changes on normal exit
+}
+
+static std::string escapeValue(const std::string &value)
+{
+    std::string out;
+
+    for(size_t i=0; i<value.size(); i++) {
+        switch(value[i]) {
+            case '\\':  out += "\\\\";      break;
+            case '\n':  out += "\\n";       break;
+            default:    out += value[i];    break;
+        }
+    }
+
+    return out;
+}
+
+static std::string unescapeValue(const char *value)
+{
+    std::string out;
+
+    for(; *value; value++) {
+        if(*value == '\\' && value[1] != 0) {
+            value++;
+            out += (*value == 'n') ? '\n' : *value;
+        } else {
+            out += *value;
+        }
+    }
+
+    return out;
+}
+
 Settings::Settings(void)
 {
-	int res = mkdir(SETTINGS_PATH, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);		// mod: 0x775
-	
-	if(res == 0) {					// dir created
-		Debug::out(LOG_DEBUG, "Settings: directory %s was created.", SETTINGS_PATH);
-		
-		storeDefaultValues();
-	} else {						// dir not created
-		if(errno != EEXIST) {		// and it's not because it already exists...
-			Debug::out(LOG_ERROR, "Settings: failed to create settings directory - %s", strerror(errno));
-		}
-	}
 }
 
 void Settings::storeDefaultValues(void)
@@ -57,108 +167,56 @@ void Settings::storeDefaultValues(void)
 
 bool Settings::getBool(const char *key, bool defValue)
 {
-	FILE *file = sOpen(key, true);
-	if(!file) {											// failed to open settings?
-//		Debug::out(LOG_DEBUG, "Settings::getBool -- returning default value for %s", key);
-		return defValue;
-	}
-
-	int val, res;
-	res = fscanf(file, "%d", &val);						// try to read the value
-	fclose(file);
-	
-	if(res != 1) {										// failed to read value?
-//		Debug::out(LOG_DEBUG, "Settings::getBool -- returning default value for %s", key);
-		return defValue;
-	}
-	
-	bool ret = false;									// convert int to bool
-	if(val == 1) {
-		ret = true;
-	}
-	
-	return ret;											// return
+	return (getInt(key, defValue ? 1 : 0) == 1);		// convert int to bool
 }
 
 void Settings::setBool(const char *key, bool value)
 {
-	FILE *file = sOpen(key, false);
-	if(!file) {											// failed to open settings?
-		Debug::out(LOG_ERROR, "Settings::setBool -- could not write key %s", key);
-		return;
-	}
-
-	if(value) {					// if true, write 1
-		fputs("1\n", file);
-	} else {					// if false, write 0
-		fputs("0\n", file);
-	}
-
-	fclose(file);
+	setValue(key, value ? "1\n" : "0\n");				// if true, write 1, if false, write 0
 }
 	
 //-------------------------	
 int Settings::getInt(const char *key, int defValue)
 {
-	FILE *file = sOpen(key, true);
-	if(!file) {											// failed to open settings?
-//		Debug::out(LOG_DEBUG, "Settings::getInt -- returning default value for %s", key);
+	char value[32];
+	char *end;
+
+	if(!getValue(key, value, sizeof(value))) {			// no such setting?
 		return defValue;
 	}
 
-	int val, res;
-	res = fscanf(file, "%d", &val);						// try to read the value
-	fclose(file);
-	
-	if(res != 1) {										// failed to read value?
-//		Debug::out(LOG_DEBUG, "Settings::getInt -- returning default value for %s", key);
+	int val = strtol(value, &end, 10);
+	if(end == value) {									// failed to read value?
 		return defValue;
 	}
-	
-	return val;											// return
+
+	return val;
 }
 
 void Settings::setInt(const char *key, int value)
 {
-	FILE *file = sOpen(key, false);
-	if(!file) {											// failed to open settings?
-		Debug::out(LOG_ERROR, "Settings::setInt -- could not write key %s", key);
-		return;
-	}
-
-	fprintf(file, "%d\n", value);
-	fclose(file);
+	char text[32];
+	sprintf(text, "%d\n", value);
+	setValue(key, text);
 }
 //-------------------------	
 float Settings::getFloat(const char *key, float defValue)
 {
-	FILE *file = sOpen(key, true);
-	if(!file) {											// failed to open settings?
-		return defValue;
-	}
+	std::string value;
+	float val;
 
-	int res;
-    float val;
-	res = fscanf(file, "%f", &val);						// try to read the value
-	fclose(file);
-	
-	if(res != 1) {										// failed to read value?
+	if(!getValue(key, value) || sscanf(value.c_str(), "%f", &val) != 1) {	// no such setting or failed to read value?
 		return defValue;
 	}
-	
-	return val;											// return
+
+	return val;
 }
 
 void Settings::setFloat(const char *key, float value)
 {
-	FILE *file = sOpen(key, false);
-	if(!file) {											// failed to open settings?
-		Debug::out(LOG_ERROR, "Settings::setFloat -- could not write key %s", key);
-		return;
-	}
-
-	fprintf(file, "%f\n", value);
-	fclose(file);
+	char text[64];
+	snprintf(text, sizeof(text), "%f\n", value);
+	setValue(key, text);
 }
 //-------------------------	
 char *Settings::getString(const char *key, const char *defValue)
@@ -166,69 +224,38 @@ char *Settings::getString(const char *key, const char *defValue)
 	static char buffer[256];
 	memset(buffer, 0, 256);
 
-	FILE *file = sOpen(key, true);
-	if(!file) {											// failed to open settings?
-//		Debug::out(LOG_DEBUG, "Settings::getString -- returning default value for %s", key);
+	std::string value;
+	if(!getValue(key, value) || value.empty()) {		// no such setting or empty value?
 		strcpy(buffer, defValue);
 		return buffer;
 	}
 
-	char *res;
-	res = fgets(buffer, 256, file);						// try to read the value
-	fclose(file);
-	
-	if(res == NULL) {									// failed to read value?
-//		Debug::out(LOG_DEBUG, "Settings::getString -- returning default value for %s", key);
-		strcpy(buffer, defValue);
-		return buffer;
-	}
-	
-	return buffer;											// return
+	size_t len = value.find('\n');						// just the first line, with the new line - like fgets() from per-key file
+	len = (len == std::string::npos) ? value.size() : (len + 1);
+	len = MIN(len, sizeof(buffer) - 1);
+
+	memcpy(buffer, value.c_str(), len);
+	return buffer;
 }
 
 void Settings::setString(const char *key, const char *value)
 {
-	FILE *file = sOpen(key, false);
-	if(!file) {											// failed to open settings?
-		Debug::out(LOG_ERROR, "Settings::setString -- could not write key %s", key);
-		return;
-	}
-
-	fputs(value, file);
-	fclose(file);
+	setValue(key, value);
 }	
 //-------------------------
 char Settings::getChar(const char *key, char defValue)
 {
-    FILE *file = sOpen(key, true);
-    if(!file) {											// failed to open settings?
-//        Debug::out(LOG_DEBUG, "Settings::getChar -- returning default value for %s", key);
-        return defValue;
-    }
-
-    int res;
-    char val;
-    res = fscanf(file, "%c", &val);						// try to read the value
-    fclose(file);
-
-    if(res != 1) {										// failed to read value?
-//        Debug::out(LOG_DEBUG, "Settings::getChar -- returning default value for %s", key);
+    std::string value;
+    if(!getValue(key, value) || value.empty()) {		// no such setting or empty value?
         return defValue;
     }
 
-    return val;											// return
+    return value[0];
 }
 
 void Settings::setChar(const char *key, char value)
 {
-    FILE *file = sOpen(key, false);
-    if(!file) {											// failed to open settings?
-        Debug::out(LOG_ERROR, "Settings::setChar -- could not write key %s", key);
-        return;
-    }
-
-    fputc(value, file);
-    fclose(file);
+    setValue(key, std::string(1, value));
 }
 //-------------------------
 void Settings::loadAcsiIDs(AcsiIDinfo *aii, bool useDefaultsIfNoSettings)
@@ -307,22 +334,458 @@ void Settings::saveFloppyConfig(FloppyConfig *fc)
     setBool("FLOPPYCONF_SOUND_ENABLED",     fc->soundEnabled);
 }
 //-------------------------
-FILE *Settings::sOpen(const char *key, bool readNotWrite)
+bool Settings::getValue(const char *key, char *value, int size)
 {
-	char path[1024];
-	
-	strcpy(path, SETTINGS_PATH);
-	strcat(path, "/");
-	strcat(path, key);
+    ensureLoaded();
+
+    pthread_mutex_lock(&storeMutex);
+
+    std::map<std::string, std::string>::iterator it = values.find(key);
+    bool found = (it != values.end());
+
+    if(found) {                                         // copy just the start, without allocation - it's enough for numbers
+        strncpy(value, it->second.c_str(), size - 1);
+        value[size - 1] = 0;
+    }
+
+    pthread_mutex_unlock(&storeMutex);
+    return found;
+}
+
+bool Settings::getValue(const char *key, std::string &value)
+{
+    ensureLoaded();
+
+    pthread_mutex_lock(&storeMutex);
+
+    std::map<std::string, std::string>::iterator it = values.find(key);
+    bool found = (it != values.end());
+
+    if(found) {
+        value = it->second;
+    }
+
+    pthread_mutex_unlock(&storeMutex);
+    return found;
+}
+
+void Settings::setValue(const char *key, const std::string &value)
+{
+    ensureLoaded();
 
-	FILE *file;
+    pthread_mutex_lock(&storeMutex);
+
+    std::map<std::string, std::string>::iterator it = values.find(key);
+
+    if(it != values.end() && it->second == value) {     // the same value? nothing to write, nobody to notify
+        pthread_mutex_unlock(&storeMutex);
+        return;
+    }
+
+    values[key] = value;
+    changedKeys.push_back(key);
+
+    if(!dirty) {                                        // first change after the last write? writer thread writes it later
+        dirty        = true;
+        firstDirtyMs = Utils::getCurrentMs();
+        pthread_cond_signal(&storeCond);
+    }
+
+    pthread_mutex_unlock(&storeMutex);
+
+    pthread_once(&writerOnce, startSettingsWriter);
+}
+
+void Settings::ensureLoaded(void)
+{
+    if(loaded || (loading && pthread_equal(loaderThread, pthread_self()))) {   // loaded, or it's load() storing default values
+        return;
+    }
+
+    pthread_mutex_lock(&loadMutex);
+
+    if(!loaded) {
+        loaderThread    = pthread_self();
+        loading         = true;
+        load();
+        loading         = false;
+
+        __sync_synchronize();                           // values first, then the flag
+        loaded          = true;
+    }
+
+    pthread_mutex_unlock(&loadMutex);
+}
+
+void Settings::load(void)
+{
+    pthread_mutex_lock(&storeMutex);
+    values.clear();
+    changedKeys.clear();
+    migratedKeys.clear();
+    dirty = false;
+    pthread_mutex_unlock(&storeMutex);
+
+	int res = mkdir(settingsPath, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);		// mod: 0x775
 	
-	if(readNotWrite) {
-		file = fopen(path, "r");				// try to open file for reading
-	} else {
-		file = fopen(path, "w");				// try to open file for writing
+	if(res == 0) {					// dir created
+		Debug::out(LOG_DEBUG, "Settings: directory %s was created.", settingsPath);
+
+        Settings s;
+		s.storeDefaultValues();
+        return;
 	}
-	
-	return file;
+
+    if(errno != EEXIST) {		    // and it's not because it already exists...
+        Debug::out(LOG_ERROR, "Settings: failed to create settings directory - %s", strerror(errno));
+    }
+
+    std::string storePath   = std::string(settingsPath) + "/" + SETTINGS_STORE;
+    std::string tmpPath     = std::string(settingsPath) + "/" + SETTINGS_STORE_TMP;
+    unlink(tmpPath.c_str());        // left there by crash while writing? the store itself is still the previous one
+
+    if(loadStore(storePath.c_str())) {
+        Debug::out(LOG_DEBUG, "Settings: loaded %d settings from %s", (int) values.size(), storePath.c_str());
+        return;
+    }
+
+    int cnt = migrateKeyFiles();    // no store yet? take the settings from per-key files of older versions
+    Debug::out(LOG_DEBUG, "Settings: no valid %s, migrated %d per-key settings files", storePath.c_str(), cnt);
+}
+
+bool Settings::loadStore(const char *path)
+{
+    FILE *f = fopen(path, "rt");
+    if(!f) {
+        return false;
+    }
+
+    std::map<std::string, std::string> loadedValues;
+    bool gotHeader = false, gotEnd = false;
+    char line[1024];
+
+    while(fgets(line, sizeof(line), f)) {
+        char *nl = strchr(line, '\n');
+        if(!nl) {                                       // line without new line - file is cut (or line too long), don't trust it
+            break;
+        }
+        *nl = 0;
+
+        if(!gotHeader) {
+            gotHeader = (strcmp(line, SETTINGS_HEADER) == 0);
+            if(!gotHeader) {
+                break;
+            }
+            continue;
+        }
+
+        int cnt;
+        if(sscanf(line, "#END %d", &cnt) == 1) {        // the store ends with count of settings in it
+            gotEnd = (cnt == (int) loadedValues.size());
+            break;
+        }
+
+        char *eq = strchr(line, '=');
+        if(!eq) {
+            break;
+        }
+        *eq = 0;
+
+        loadedValues[line] = unescapeValue(eq + 1);
+    }
+
+    fclose(f);
+
+    if(!gotEnd) {
+        Debug::out(LOG_ERROR, "Settings: %s is not complete, ignoring it", path);
+        return false;
+    }
+
+    pthread_mutex_lock(&storeMutex);
+    values = loadedValues;
+    pthread_mutex_unlock(&storeMutex);
+    return true;
+}
+
+int Settings::migrateKeyFiles(void)
+{
+    DIR *dir = opendir(settingsPath);
+    if(!dir) {
+        return 0;
+    }
+
+    int cnt = 0;
+    struct dirent *de;
+
+    while((de = readdir(dir)) != NULL) {
+        if(strchr(de->d_name, '.') != NULL) {           // keys don't have dots - skip . and .. and store and temp files
+            continue;
+        }
+
+        std::string path = std::string(settingsPath) + "/" + de->d_name;
+        FILE *f = fopen(path.c_str(), "r");
+        if(!f) {
+            continue;
+        }
+
+        char bfr[256];
+        size_t len = fread(bfr, 1, sizeof(bfr), f);     // the old getters never read more than this
+        fclose(f);
+
+        setValue(de->d_name, std::string(bfr, len));    // marks store dirty, so it gets written
+        cnt++;
+
+        if(strncmp(de->d_name, SETTINGS_EXPORTED, strlen(SETTINGS_EXPORTED)) != 0) {   // exported ones stay, ce_preinit uses them
+            pthread_mutex_lock(&storeMutex);
+            migratedKeys.push_back(de->d_name);
+            pthread_mutex_unlock(&storeMutex);
+        }
+    }
+
+    closedir(dir);
+    return cnt;
+}
+
+bool Settings::writeFileAtomically(const char *path, const std::string &content)
+{
+    std::string tmpPath = std::string(path) + ".tmp";
+
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+
+    const char *p = content.c_str();
+    size_t left = content.size();
+
+    while(left > 0) {
+        ssize_t res = write(fd, p, left);
+        if(res <= 0) {
+            close(fd);
+            unlink(tmpPath.c_str());
+            return false;
+        }
+
+        p    += res;
+        left -= res;
+    }
+
+    bool good = (fsync(fd) == 0);                       // content is on the card...
+    close(fd);
+
+    if(!good || rename(tmpPath.c_str(), path) != 0) {   // ...before it replaces the old file
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool Settings::persist(void)
+{
+    pthread_mutex_lock(&persistMutex);
+    pthread_mutex_lock(&storeMutex);
+
+    if(!dirty) {
+        pthread_mutex_unlock(&storeMutex);
+        pthread_mutex_unlock(&persistMutex);
+        return true;
+    }
+
+    std::string content = SETTINGS_HEADER "\n";
+
+    std::map<std::string, std::string>::iterator it;
+    for(it = values.begin(); it != values.end(); ++it) {
+        content += it->first + "=" + escapeValue(it->second) + "\n";
+    }
+
+    char end[32];
+    sprintf(end, "#END %d\n", (int) values.size());
+    content += end;
+
+    std::vector<std::string> changed;
+    changed.swap(changedKeys);
+
+    std::vector<std::string> exported;                  // path and content of changed keys which other programs read
+    for(size_t i=0; i<changed.size(); i++) {
+        if(changed[i].compare(0, strlen(SETTINGS_EXPORTED), SETTINGS_EXPORTED) == 0 && values.count(changed[i])) {
+            exported.push_back(std::string(settingsPath) + "/" + changed[i]);
+            exported.push_back(values[changed[i]]);
+        }
+    }
+
+    std::vector<std::string> migrated;                  // without them, missing or broken store would bring back their old values
+    migrated.swap(migratedKeys);
+
+    dirty = false;
+    std::string storePath = std::string(settingsPath) + "/" + SETTINGS_STORE;
+
+    pthread_mutex_unlock(&storeMutex);
+
+    bool good = writeFileAtomically(storePath.c_str(), content);
+
+    for(size_t i=0; good && i<exported.size(); i += 2) {
+        good = writeFileAtomically(exported[i].c_str(), exported[i + 1]);
+    }
+
+    if(good) {                                          // new store is in place - make the rename itself durable
+        int dirFd = open(settingsPath, O_RDONLY);
+        if(dirFd >= 0) {
+            fsync(dirFd);
+            close(dirFd);
+        }
+
+        for(size_t i=0; i<migrated.size(); i++) {       // the store has them now
+            std::string path = std::string(settingsPath) + "/" + migrated[i];
+            unlink(path.c_str());
+        }
+    } else {                                            // failed? writer thread will try again later
+        Debug::out(LOG_ERROR, "Settings: failed to write %s - %s", storePath.c_str(), strerror(errno));
+
+        pthread_mutex_lock(&storeMutex);
+        changedKeys.insert(changedKeys.begin(), changed.begin(), changed.end());
+        migratedKeys.insert(migratedKeys.begin(), migrated.begin(), migrated.end());
+        dirty        = true;
+        firstDirtyMs = Utils::getCurrentMs();
+        pthread_mutex_unlock(&storeMutex);
+    }
+
+    pthread_mutex_unlock(&persistMutex);
+
+    if(good) {
+        notifyListeners(changed);
+    }
+
+    return good;
+}
+
+// Listeners are called without listenerMutex - reloadSettings() takes the listener's own lock, and thread holding that lock
+// could be adding or removing a listener just now. removeChangeListener() waits only while its own listener is being called.
+void Settings::notifyListeners(const std::vector<std::string> &changed)
+{
+    pthread_mutex_lock(&listenerMutex);
+    std::vector<TSettingsListener> toCall = listeners;
+    pthread_mutex_unlock(&listenerMutex);
+
+    for(size_t i=0; i<toCall.size(); i++) {
+        TSettingsListener &l = toCall[i];
+
+        bool match = false;
+        for(size_t j=0; j<changed.size(); j++) {
+            if(changed[j].compare(0, l.keyPrefix.size(), l.keyPrefix) == 0) {     // some of its keys changed? reload once
+                match = true;
+                break;
+            }
+        }
+
+        if(!match) {
+            continue;
+        }
+
+        pthread_mutex_lock(&listenerMutex);
+
+        bool stillThere = false;                        // removed since we took the copy? don't call it
+        for(size_t j=0; j<listeners.size(); j++) {
+            if(listeners[j].su == l.su) {
+                stillThere = true;
+                break;
+            }
+        }
+
+        if(stillThere) {
+            notifyingSu     = l.su;
+            notifyingThread = pthread_self();
+        }
+
+        pthread_mutex_unlock(&listenerMutex);
+
+        if(!stillThere) {
+            continue;
+        }
+
+        l.su->reloadSettings(l.type);
+
+        pthread_mutex_lock(&listenerMutex);
+        notifyingSu = NULL;
+        pthread_cond_broadcast(&listenerCond);
+        pthread_mutex_unlock(&listenerMutex);
+    }
+}
+
+void Settings::flush(void)
+{
+    if(loaded) {                                        // nothing loaded, nothing changed
+        persist();
+    }
+}
+
+void Settings::resetAll(void)
+{
+    ensureLoaded();
+
+    pthread_mutex_lock(&persistMutex);                  // no store write in the middle of deleting
+
+    pthread_mutex_lock(&storeMutex);
+    values.clear();
+    changedKeys.clear();
+    migratedKeys.clear();
+    dirty = false;
+    pthread_mutex_unlock(&storeMutex);
+
+    DIR *dir = opendir(settingsPath);                   // the store and per-key files
+    if(dir) {
+        struct dirent *de;
+        while((de = readdir(dir)) != NULL) {
+            if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+                std::string path = std::string(settingsPath) + "/" + de->d_name;
+                unlink(path.c_str());
+            }
+        }
+        closedir(dir);
+    }
+
+    pthread_mutex_unlock(&persistMutex);
+    Debug::out(LOG_DEBUG, "Settings: all settings deleted");
 }
 
+void Settings::setDirectory(const char *path)
+{
+    flush();                                            // pending changes belong to the previous dir
+
+    pthread_mutex_lock(&loadMutex);
+    strncpy(settingsPath, path, sizeof(settingsPath) - 1);
+    settingsPath[sizeof(settingsPath) - 1] = 0;
+    loaded = false;                                     // load it on next use
+    pthread_mutex_unlock(&loadMutex);
+}
+
+void Settings::addChangeListener(const char *keyPrefix, ISettingsUser *su, int type)
+{
+    TSettingsListener l;
+    l.keyPrefix = keyPrefix;
+    l.su        = su;
+    l.type      = type;
+
+    pthread_mutex_lock(&listenerMutex);
+    listeners.push_back(l);
+    pthread_mutex_unlock(&listenerMutex);
+}
+
+void Settings::removeChangeListener(ISettingsUser *su)
+{
+    pthread_mutex_lock(&listenerMutex);
+
+    for(size_t i=0; i<listeners.size(); ) {
+        if(listeners[i].su == su) {
+            listeners.erase(listeners.begin() + i);
+        } else {
+            i++;
+        }
+    }
+
+    while(notifyingSu == su && !pthread_equal(notifyingThread, pthread_self())) {  // being called now? su must live till it returns
+        pthread_cond_wait(&listenerCond, &listenerMutex);
+    }
+
+    pthread_mutex_unlock(&listenerMutex);
+}
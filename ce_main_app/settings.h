@@ -2,8 +2,14 @@
 #define _SETTINGS_H_
 
 #include <stdio.h>
+#include <string>
+#include <vector>
 #include "datatypes.h"
 
+class ISettingsUser;
+
+#define SETTINGS_FLUSH_DELAY_MS     300         // changes are collected for this long, then written to store file at once
+
 typedef struct {
 	BYTE acsiIDdevType[8];								// array of device types for each ACSI ID
 	BYTE sdCardAcsiId;									// ACSI ID assigned to SD card
@@ -22,6 +28,12 @@ typedef struct {
     bool soundEnabled;
 } FloppyConfig;
 
+// All the settings are loaded once into memory and shared by all Settings objects, so get*() never touches the filesystem.
+// set*() changes the memory and the change is written later by settings writer thread (or by flush()) together with other
+// changes - the whole store is written to temp file, synced and renamed over the store file, so it's never half written.
+// The old per-key files in the settings dir are migrated on the first start without the store file, and deleted (except
+// the exported HW_ ones) once the store is written. ce_preinit reads the store too, only the HW_ keys it reads and writes
+// in per-key files.
 class Settings
 {
 public:
@@ -48,9 +60,29 @@ public:
     void loadFloppyConfig(FloppyConfig *fc);
     void saveFloppyConfig(FloppyConfig *fc);
 
-private:
+    static void flush(void);                            // write the pending changes now, returns when they are on the card
+    static void resetAll(void);                         // forget all settings and delete them from the card
+    static void setDirectory(const char *path);         // load settings from other dir (tests), default is /ce/settings
 
-	FILE *sOpen(const char *key, bool readNotWrite);
+    // su->reloadSettings(type) is called (from settings writer thread) once after each written batch of changes
+    // in which value of some key starting with keyPrefix changed
+    static void addChangeListener(const char *keyPrefix, ISettingsUser *su, int type);
+    static void removeChangeListener(ISettingsUser *su);
+
+private:
+    static char settingsPath[128];
+
+    static bool getValue(const char *key, std::string &value);
+    static bool getValue(const char *key, char *value, int size);
+    static void setValue(const char *key, const std::string &value);
+
+    static void ensureLoaded(void);
+    static void load(void);
+    static bool loadStore(const char *path);
+    static int  migrateKeyFiles(void);
+    static bool writeFileAtomically(const char *path, const std::string &content);
+    static bool persist(void);
+    static void notifyListeners(const std::vector<std::string> &changedKeys);
 
 	void storeDefaultValues(void);
 };
@@ -0,0 +1,329 @@
+// vim: tabstop=4 softtabstop=4 shiftwidth=4 expandtab
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "utils.h"
+
+#define TRACE_RING_MASK     (TRACE_RING_EVENTS - 1)
+#define TRACE_DUMP_BATCH    64                          // events written to dump file at once
+
+// flight recorder - any thread can add events, the newest ones overwrite the oldest ones, nobody waits
+static TTraceEvent      traceRing[TRACE_RING_EVENTS];
+static volatile DWORD   traceHead;                      // number of the next event
+
+// format strings and %s strings, index is the id - 0 is 'not registered yet', 1 is TRACE_FMT_BFR_ROW
+static const char      *formatText [TRACE_MAX_FORMATS] = { "", "" };
+static BYTE             formatLevel[TRACE_MAX_FORMATS];
+static volatile DWORD   formatCount = 2;                // entries are read without lock, so count is increased after the entry is set
+static pthread_mutex_t  formatMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile int     dumpInProgress;
+
+static WORD findFormat(const char *text)
+{
+    DWORD cnt = formatCount;
+
+    for(DWORD i=2; i<cnt; i++) {
+        if(formatText[i] == text) {                     // the same pointer - literals and name tables don't move
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static WORD addFormat(int level, const char *text)
+{
+    pthread_mutex_lock(&formatMutex);
+
+    WORD id = findFormat(text);                         // other thread could add it meanwhile
+
+    if(id == 0 && formatCount < TRACE_MAX_FORMATS) {
+        id = formatCount;
+        formatText [id] = text;
+        formatLevel[id] = level;
+
+        __sync_synchronize();                           // entry first, then the count
+        formatCount = id + 1;
+    }
+
+    pthread_mutex_unlock(&formatMutex);
+    return id;                                          // 0 if the table is full - such events are not stored
+}
+
+WORD Trace::registerFormat(int level, const char *format)
+{
+    WORD id = findFormat(format);
+
+    if(id != 0) {
+        return id;
+    }
+
+    return addFormat(level, format);
+}
+
+DWORD Trace::stringId(const char *text)
+{
+    return registerFormat(LOG_OFF, text);
+}
+
+TTraceEvent *Trace::claim(DWORD &eventNo)
+{
+    eventNo = __sync_fetch_and_add(&traceHead, 1);
+    TTraceEvent *ev = &traceRing[eventNo & TRACE_RING_MASK];
+
+    ev->sequence = 0;                                   // dump must not take it while we write it
+    __sync_synchronize();
+
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    ev->ms = (tp.tv_sec * 1000) + (tp.tv_nsec / 1000000);
+    ev->us = (tp.tv_nsec / 1000) % 1000;
+    return ev;
+}
+
+void Trace::publish(TTraceEvent *ev, DWORD eventNo)
+{
+    __sync_synchronize();                               // event content first, then the sequence
+    ev->sequence = eventNo + 1;
+}
+
+void Trace::event(WORD formatId)
+{
+    if(formatId == 0) {
+        return;
+    }
+
+    DWORD eventNo;
+    TTraceEvent *ev = claim(eventNo);
+    ev->formatId = formatId;
+    ev->argCount = 0;
+    publish(ev, eventNo);
+}
+
+void Trace::event(WORD formatId, DWORD a1)
+{
+    if(formatId == 0) {
+        return;
+    }
+
+    DWORD eventNo;
+    TTraceEvent *ev = claim(eventNo);
+    ev->formatId = formatId;
+    ev->argCount = 1;
+    ev->args[0]  = a1;
+    publish(ev, eventNo);
+}
+
+void Trace::event(WORD formatId, DWORD a1, DWORD a2)
+{
+    if(formatId == 0) {
+        return;
+    }
+
+    DWORD eventNo;
+    TTraceEvent *ev = claim(eventNo);
+    ev->formatId = formatId;
+    ev->argCount = 2;
+    ev->args[0]  = a1;
+    ev->args[1]  = a2;
+    publish(ev, eventNo);
+}
+
+void Trace::event(WORD formatId, DWORD a1, DWORD a2, DWORD a3)
+{
+    if(formatId == 0) {
+        return;
+    }
+
+    DWORD eventNo;
+    TTraceEvent *ev = claim(eventNo);
+    ev->formatId = formatId;
+    ev->argCount = 3;
+    ev->args[0]  = a1;
+    ev->args[1]  = a2;
+    ev->args[2]  = a3;
+    publish(ev, eventNo);
+}
+
+void Trace::event(WORD formatId, DWORD a1, DWORD a2, DWORD a3, DWORD a4)
+{
+    if(formatId == 0) {
+        return;
+    }
+
+    DWORD eventNo;
+    TTraceEvent *ev = claim(eventNo);
+    ev->formatId = formatId;
+    ev->argCount = 4;
+    ev->args[0]  = a1;
+    ev->args[1]  = a2;
+    ev->args[2]  = a3;
+    ev->args[3]  = a4;
+    publish(ev, eventNo);
+}
+
+void Trace::bfr(const BYTE *bfr, int count)
+{
+    TRACE(LOG_OFF, "outBfr - %d bytes", count);         // LOG_OFF - the level was already checked by TRACE_BFR()
+
+    int cnt = MIN(count, TRACE_BFR_MAX_BYTES);
+
+    for(int ofs=0; ofs<cnt; ofs += 16) {                // row of up to 16 bytes, the same as in Debug::outBfr()
+        DWORD eventNo;
+        TTraceEvent *ev = claim(eventNo);
+        ev->formatId = TRACE_FMT_BFR_ROW;
+        ev->argCount = MIN(16, cnt - ofs);
+        memcpy(ev->args, bfr + ofs, ev->argCount);
+        publish(ev, eventNo);
+    }
+}
+
+void Trace::clear(void)
+{
+    for(int i=0; i<TRACE_RING_EVENTS; i++) {
+        traceRing[i].sequence = 0;
+    }
+}
+
+static bool writeAll(int fd, const void *data, int len)
+{
+    const BYTE *p = (const BYTE *) data;
+
+    while(len > 0) {
+        int res = write(fd, p, len);
+
+        if(res <= 0) {
+            return false;
+        }
+
+        p   += res;
+        len -= res;
+    }
+
+    return true;
+}
+
+// only open(), write(), close() and clock_gettime() here - this is called from crash handler
+bool Trace::dump(const char *path)
+{
+    if(!__sync_bool_compare_and_swap(&dumpInProgress, 0, 1)) {     // one dump at a time - the batch buffer is static
+        return false;
+    }
+
+    static TTraceEvent batch[TRACE_DUMP_BATCH];
+    bool good = false;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if(fd >= 0) {
+        DWORD head  = traceHead;
+        DWORD first = (head > TRACE_RING_EVENTS) ? (head - TRACE_RING_EVENTS) : 0;
+        DWORD fmts  = formatCount;
+
+        // count the events which are complete now, the header must be written first
+        DWORD events = 0;
+        for(DWORD n=first; n<head; n++) {
+            if(traceRing[n & TRACE_RING_MASK].sequence == n + 1) {
+                events++;
+            }
+        }
+
+        TTraceDumpHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TRACE_MAGIC, 8);
+        hdr.formatCount = fmts;
+        hdr.eventCount  = events;
+
+        struct timespec mono, real;
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        clock_gettime(CLOCK_REALTIME,  &real);
+        hdr.dumpMs   = (mono.tv_sec * 1000) + (mono.tv_nsec / 1000000);
+        hdr.dumpSec  = real.tv_sec;
+        hdr.dumpUsec = real.tv_nsec / 1000;
+
+        // the events which get overwritten between counting and writing are skipped, so remember where the count goes
+        off_t eventCountPos = (BYTE *) &hdr.eventCount - (BYTE *) &hdr;
+        good = writeAll(fd, &hdr, sizeof(hdr));
+
+        for(DWORD i=0; good && i<fmts; i++) {
+            const char *text = formatText[i] ? formatText[i] : "";
+            WORD len = strlen(text);
+
+            BYTE entry[6];
+            WORD id = i;
+            memcpy(&entry[0], &id, 2);
+            entry[2] = formatLevel[i];
+            entry[3] = 0;
+            memcpy(&entry[4], &len, 2);
+
+            good = writeAll(fd, entry, 6) && writeAll(fd, text, len);
+        }
+
+        DWORD written = 0;
+        int   inBatch = 0;
+
+        for(DWORD n=first; good && n<head; n++) {
+            TTraceEvent *ev = &traceRing[n & TRACE_RING_MASK];
+
+            if(ev->sequence != n + 1) {                 // not complete or already overwritten by newer event
+                continue;
+            }
+
+            memcpy(&batch[inBatch], ev, sizeof(TTraceEvent));
+            __sync_synchronize();
+
+            if(ev->sequence != n + 1 || written + inBatch >= events) {     // was overwritten while copying
+                continue;
+            }
+
+            inBatch++;
+            if(inBatch == TRACE_DUMP_BATCH) {
+                good     = writeAll(fd, batch, inBatch * sizeof(TTraceEvent));
+                written += inBatch;
+                inBatch  = 0;
+            }
+        }
+
+        if(good && inBatch > 0) {
+            good     = writeAll(fd, batch, inBatch * sizeof(TTraceEvent));
+            written += inBatch;
+        }
+
+        if(good && written != events) {                 // fix the count in header
+            good = (pwrite(fd, &written, 4, eventCountPos) == 4);
+        }
+
+        close(fd);
+    }
+
+    dumpInProgress = 0;
+    return good;
+}
+
+void Trace::crashHandler(int sig)
+{
+    dump(TRACE_CRASH_FILE);
+    raise(sig);                                         // handler was reset to default, so this really crashes now
+}
+
+void Trace::installCrashHandler(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = crashHandler;
+    sa.sa_flags   = SA_RESETHAND | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+
+    int sigs[5] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+    for(int i=0; i<5; i++) {
+        sigaction(sigs[i], &sa, NULL);
+    }
+}
@@ -0,0 +1,98 @@
+// vim: tabstop=4 softtabstop=4 shiftwidth=4 expandtab
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "datatypes.h"
+#include "debug.h"
+
+// Binary trace for hot paths. TRACE() doesn't format anything, it just stores the id of the format string and up to
+// 4 integer arguments into a memory ring, which keeps the last TRACE_RING_EVENTS events. The ring is dumped to file
+// on crash or on request (web UI: /app/debug/gettrace), and ce_tracedecode turns the dump back into log lines.
+//
+// TRACE levels higher than TRACE_LEVEL are removed at compile time, e.g. build with -DTRACE_LEVEL=LOG_ERROR
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL         LOG_DEBUG
+#endif
+
+#define TRACE_RING_EVENTS   8192                            // must be power of 2
+#define TRACE_MAX_FORMATS   1024                            // different format strings and strings used as %s arguments
+#define TRACE_MAX_ARGS      4
+#define TRACE_BFR_MAX_BYTES 512                             // TRACE_BFR() stores at most this many bytes, the rest is cut
+
+#define TRACE_DUMP_FILE     "/tmp/ce_trace.bin"             // dump requested through web UI
+#define TRACE_CRASH_FILE    "/var/log/ce_trace_crash.bin"   // dump written by crash handler
+
+#define TRACE_MAGIC         "CETRACE1"
+#define TRACE_FMT_BFR_ROW   1                               // reserved format id - row of TRACE_BFR(), args hold the raw bytes
+
+// The format must be a string literal with only integer conversions (%d %u %x %c, ...), at most TRACE_MAX_ARGS of them.
+// For %s use TRACE_STR(text) as argument - the text must stay valid for the whole run (string literal, name table, ...).
+// TRACE_STR() searches the format table, so on hot paths keep the id it returns and pass that.
+#define TRACE(level, format, ...)                                               \
+    do {                                                                        \
+        if((level) <= TRACE_LEVEL) {                                            \
+            static WORD traceFormatId_;                                         \
+            if(traceFormatId_ == 0) {                                           \
+                traceFormatId_ = Trace::registerFormat((level), (format));      \
+            }                                                                   \
+            Trace::event(traceFormatId_, ##__VA_ARGS__);                        \
+        }                                                                       \
+    } while(0)
+
+#define TRACE_STR(text)     Trace::stringId(text)
+
+// replacement for Debug::outBfr() - stores header event and rows of raw bytes
+#define TRACE_BFR(level, data, count)                                           \
+    do {                                                                        \
+        if((level) <= TRACE_LEVEL) {                                            \
+            Trace::bfr((data), (count));                                        \
+        }                                                                       \
+    } while(0)
+
+// one event in ring and in dump file, 32 bytes
+typedef struct {
+    volatile DWORD  sequence;       // event number + 1 when the event is complete, 0 while it's being written
+    DWORD           ms;             // the same clock as Utils::getCurrentMs()
+    WORD            us;             // microseconds within that ms
+    WORD            formatId;
+    BYTE            argCount;
+    BYTE            reserved[3];
+    DWORD           args[TRACE_MAX_ARGS];
+} TTraceEvent;
+
+// dump file: header, then formatCount times (WORD id, BYTE level, BYTE 0, WORD length, text), then eventCount events,
+// oldest first. Everything is in the byte order of the machine which wrote it (little endian on RPi).
+typedef struct {
+    char    magic[8];               // TRACE_MAGIC
+    DWORD   formatCount;
+    DWORD   eventCount;
+    DWORD   dumpMs;                 // Utils::getCurrentMs() when dumped...
+    DWORD   dumpSec;                // ...and the wall clock at the same time, so the decoder can show date and time of events
+    DWORD   dumpUsec;
+} TTraceDumpHeader;
+
+class Trace
+{
+public:
+    static WORD  registerFormat(int level, const char *format);
+    static DWORD stringId(const char *text);
+
+    static void event(WORD formatId);
+    static void event(WORD formatId, DWORD a1);
+    static void event(WORD formatId, DWORD a1, DWORD a2);
+    static void event(WORD formatId, DWORD a1, DWORD a2, DWORD a3);
+    static void event(WORD formatId, DWORD a1, DWORD a2, DWORD a3, DWORD a4);
+    static void bfr(const BYTE *bfr, int count);
+
+    static bool dump(const char *path);         // async-signal-safe, returns false if file couldn't be written
+    static void installCrashHandler(void);      // dump to TRACE_CRASH_FILE on SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT
+    static void clear(void);                    // forget all the events
+
+private:
+    static TTraceEvent *claim(DWORD &eventNo);
+    static void         publish(TTraceEvent *ev, DWORD eventNo);
+    static void         crashHandler(int sig);
+};
+
+#endif
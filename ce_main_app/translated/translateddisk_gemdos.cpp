@@ -17,6 +17,7 @@
 
 #include "../global.h"
 #include "../debug.h"
+#include "../trace.h"
 #include "../utils.h"
 #include "../settings.h"
 #include "../settingsreloadproxy.h"
@@ -1066,7 +1067,7 @@ void TranslatedDisk::onFclose(BYTE *cmd)
     int index = findFileHandleSlot(handle);
 
     if(index == -1) {                                               // handle not found? not handled, try somewhere else
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFclose - handle %d not found, not handled", handle);
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFclose - handle %d not found, not handled", handle);
 
         dataTrans->setStatus(E_NOTHANDLED);
         return;
@@ -1075,12 +1076,12 @@ void TranslatedDisk::onFclose(BYTE *cmd)
     bool res = dataTrans->recvData(dataBuffer, 16);                 // get data from Hans -- this is now here just to tell the whole software chain that this is a DMA WRITE operation (no real data needed)
 
     if(!res) {                                                      // failed to get data? internal error!
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFclose - failed to receive data...");
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFclose - failed to receive data...");
         dataTrans->setStatus(EINTRN);
         return;
     }
 
-    Debug::out(LOG_DEBUG, "TranslatedDisk::onFclose - closing handle %d (index %d)", handle, index);
+    TRACE(LOG_DEBUG, "TranslatedDisk::onFclose - closing handle %d (index %d)", handle, index);
 
     fclose(files[index].hostHandle);                                // close the file
 
@@ -1162,17 +1163,17 @@ void TranslatedDisk::onFread(BYTE *cmd)
     
     int index = findFileHandleSlot(atariHandle);
 
-    Debug::out(LOG_DEBUG, "TranslatedDisk::onFread - atariHandle: %d, byteCount: %d, seekOffset: %d", (int) atariHandle, (int) byteCount, (int) seekOffset);
+    TRACE(LOG_DEBUG, "TranslatedDisk::onFread - atariHandle: %d, byteCount: %d, seekOffset: %d", (int) atariHandle, (int) byteCount, (int) seekOffset);
     
     if(index == -1) {                                               // handle not found? not handled, try somewhere else
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFread - atari handle %d not found, not handling", atariHandle);
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFread - atari handle %d not found, not handling", atariHandle);
 
         dataTrans->setStatus(E_NOTHANDLED);
         return;
     }
 
     if(byteCount > (254 * 512)) {                                   // requesting to transfer more than 254 sectors at once? fail!
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFread - trying to transfer more than MAX SECTORS in one transfer (byteCount: %d)", byteCount);
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFread - trying to transfer more than MAX SECTORS in one transfer (byteCount: %d)", byteCount);
 
         dataTrans->setStatus(EINTRN);
         return;
@@ -1182,7 +1183,7 @@ void TranslatedDisk::onFread(BYTE *cmd)
         int res = fseek(files[index].hostHandle, seekOffset, SEEK_CUR);
 
         if(res != 0) {                                              // if seek failed
-            Debug::out(LOG_DEBUG, "TranslatedDisk::onFread - fseek %d failed", seekOffset);
+            TRACE(LOG_DEBUG, "TranslatedDisk::onFread - fseek %d failed", seekOffset);
 
             dataTrans->setStatus(EINTRN);
             return;
@@ -1205,13 +1206,13 @@ void TranslatedDisk::onFread(BYTE *cmd)
     files[index].lastDataCount = cnt;                       // store how much data was read
 
     if(cnt == byteCount) {                                  // if we read data count as requested
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFread - all %d bytes transfered", byteCount);
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFread - all %d bytes transfered", byteCount);
 
         dataTrans->setStatus(RW_ALL_TRANSFERED);
         return;
     }
 
-    Debug::out(LOG_DEBUG, "TranslatedDisk::onFread - only %d bytes out of %d bytes transfered", cnt, byteCount);
+    TRACE(LOG_DEBUG, "TranslatedDisk::onFread - only %d bytes out of %d bytes transfered", cnt, byteCount);
 
     dataTrans->setStatus(RW_PARTIAL_TRANSFER);
 }
@@ -1224,14 +1225,14 @@ void TranslatedDisk::onFwrite(BYTE *cmd)
     int index = findFileHandleSlot(atariHandle);
 
     if(index == -1) {                                               // handle not found? not handled, try somewhere else
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFwrite - atariHandle %d not found, not handled", atariHandle);
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFwrite - atariHandle %d not found, not handled", atariHandle);
 
         dataTrans->setStatus(E_NOTHANDLED);
         return;
     }
 
     if(byteCount > (254 * 512)) {                                   // requesting to transfer more than 254 sectors at once? fail!
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFwrite - trying to transfer more than MAX SECTORS count of bytes (%d)", byteCount);
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFwrite - trying to transfer more than MAX SECTORS count of bytes (%d)", byteCount);
 
         dataTrans->setStatus(EINTRN);
         return;
@@ -1250,7 +1251,7 @@ void TranslatedDisk::onFwrite(BYTE *cmd)
     res = dataTrans->recvData(dataBuffer, transferSizeBytes);   // get data from Hans
 
     if(!res) {                                                  // failed to get data? internal error!
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFwrite - failed to get data from Hans");
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFwrite - failed to get data from Hans");
 
         dataTrans->setStatus(EINTRN);
         return;
@@ -1261,13 +1262,13 @@ void TranslatedDisk::onFwrite(BYTE *cmd)
     files[index].lastDataCount = bWritten;                      // store data written count
 
     if(bWritten != byteCount) {                                 // when didn't write all the data
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFwrite - didn't write all data - only %d bytes out of %d were written", bWritten, byteCount);
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFwrite - didn't write all data - only %d bytes out of %d were written", bWritten, byteCount);
 
         dataTrans->setStatus(RW_PARTIAL_TRANSFER);
         return;
     }
 
-    Debug::out(LOG_DEBUG, "TranslatedDisk::onFwrite - all %d bytes were written", bWritten);
+    TRACE(LOG_DEBUG, "TranslatedDisk::onFwrite - all %d bytes were written", bWritten);
     dataTrans->setStatus(RW_ALL_TRANSFERED);                    // when all the data was written
 }
 
@@ -1296,10 +1297,10 @@ void TranslatedDisk::onFseek(BYTE *cmd)
 
     int index = findFileHandleSlot(atariHandle);
 
-    Debug::out(LOG_DEBUG, "TranslatedDisk::onFseek - atariHandle: %d, offset: %d, seekMode: %d", (int) atariHandle, (int) offset, (int) seekMode);
+    TRACE(LOG_DEBUG, "TranslatedDisk::onFseek - atariHandle: %d, offset: %d, seekMode: %d", (int) atariHandle, (int) offset, (int) seekMode);
     
     if(index == -1) {                                               // handle not found? not handled, try somewhere else
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFseek - atariHandle %d not found, not handled", atariHandle);
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFseek - atariHandle %d not found, not handled", atariHandle);
 
         dataTrans->setStatus(E_NOTHANDLED);
         return;
@@ -1315,7 +1316,7 @@ void TranslatedDisk::onFseek(BYTE *cmd)
     int iRes = fseek(files[index].hostHandle, offset, hostSeekMode);
 
     if(iRes != 0) {                         // on ERROR
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFseek - fseek %d, %d failed", offset, hostSeekMode);
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFseek - fseek %d, %d failed", offset, hostSeekMode);
 
         dataTrans->setStatus(EINTRN);
         return;
@@ -1325,7 +1326,7 @@ void TranslatedDisk::onFseek(BYTE *cmd)
     int pos = ftell(files[index].hostHandle);                       // get stream position
 
     if(pos == -1) {                                                 // failed to get position?
-        Debug::out(LOG_DEBUG, "TranslatedDisk::onFseek - ftell failed");
+        TRACE(LOG_DEBUG, "TranslatedDisk::onFseek - ftell failed");
 
         dataTrans->setStatus(EINTRN);
         return;
@@ -1333,7 +1334,7 @@ void TranslatedDisk::onFseek(BYTE *cmd)
 
     DWORD bytesToEnd = getByteCountToEOF(files[index].hostHandle);  // get count of bytes to EOF
 
-    Debug::out(LOG_DEBUG, "TranslatedDisk::onFseek - ok, current position is %d, and we got %d bytes to end of file", pos, (int) bytesToEnd);
+    TRACE(LOG_DEBUG, "TranslatedDisk::onFseek - ok, current position is %d, and we got %d bytes to end of file", pos, (int) bytesToEnd);
 
     dataTrans->addDataDword(pos);                                   // return the position in file
     dataTrans->addDataDword(bytesToEnd);                            // also byte count to end of file
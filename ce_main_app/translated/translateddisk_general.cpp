@@ -12,6 +12,7 @@
 
 #include "../global.h"
 #include "../debug.h"
+#include "../trace.h"
 #include "../settings.h"
 #include "../utils.h"
 #include "../mounter.h"
@@ -34,6 +35,8 @@ TranslatedDisk * TranslatedDisk::instance = NULL;
 
 pthread_mutex_t TranslatedDisk::mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static DWORD functionNameTraceId[256];      // TRACE_STR() of each function name, so it's looked up only on the 1st call - 0 if not yet
+
 void TranslatedDisk::mutexLock(void)
 {
     pthread_mutex_lock(&mutex);
@@ -466,8 +469,11 @@ void TranslatedDisk::processCommand(BYTE *cmd)
         return;
     }
 
-    const char *functionName = functionCodeToName(cmd[4]);
-    Debug::out(LOG_DEBUG, "TranslatedDisk function - %s (%02x)", functionName, cmd[4]);
+    DWORD &functionNameId = functionNameTraceId[cmd[4]];
+    if(functionNameId == 0) {
+        functionNameId = TRACE_STR(functionCodeToName(cmd[4]));
+    }
+    TRACE(LOG_DEBUG, "TranslatedDisk function - %s (%02x)", functionNameId, cmd[4]);
     //>dataTrans->dumpDataOnce();
 
     // now do all the command handling
@@ -484,6 +490,7 @@ void TranslatedDisk::processCommand(BYTE *cmd)
 
         case TRAN_CMD_SCREENCASTPALETTE:
         case TRAN_CMD_SENDSCREENCAST:
+        case TRAN_CMD_SENDSCREENCAST_DELTA:
             screencastAcsiCommand->processCommand(cmd);
             break;
 
@@ -1259,6 +1266,7 @@ const char *TranslatedDisk::functionCodeToName(int code)
         case TRAN_CMD_SENDSCREENCAST:       return "TRAN_CMD_SENDSCREENCAST";
         case TRAN_CMD_SCREENCASTPALETTE:    return "TRAN_CMD_SCREENCASTPALETTE";
         case TRAN_CMD_SCREENSHOT_CONFIG:    return "TRAN_CMD_SCREENSHOT_CONFIG";
+        case TRAN_CMD_SENDSCREENCAST_DELTA: return "TRAN_CMD_SENDSCREENCAST_DELTA";
         case ST_LOG_TEXT:                   return "ST_LOG_TEXT";
         case ST_LOG_HTTP:                   return "ST_LOG_HTTP";
 
@@ -49,6 +49,21 @@ DWORD Utils::getCurrentMs(void)
 	return val;
 }
 
+DWORD Utils::getCurrentUs(void)
+{
+	struct timespec tp;
+	int res;
+
+	res = clock_gettime(CLOCK_MONOTONIC, &tp);					// get current time
+
+	if(res != 0) {												// if failed, fail
+		return 0;
+	}
+
+	DWORD val = (tp.tv_sec * 1000000) + (tp.tv_nsec / 1000);	// convert to micro seconds - wraps around, so use only for differences
+	return val;
+}
+
 DWORD Utils::getEndTime(DWORD offsetFromNow)
 {
 	DWORD val;
@@ -380,6 +395,8 @@ void Utils::getIpAdds(BYTE *bfrIPs, BYTE *bfrMasks)
 
 void Utils::forceSync(void)
 {
+    Settings::flush();                                          // settings changed just now are not written yet
+
 	TMounterRequest tmr;			
 	tmr.action	= MOUNTER_ACTION_SYNC;                          // let the mounter thread do filesystem caches sync 						
 	Mounter::add(tmr);
@@ -8,11 +8,14 @@
 #include "datatypes.h"
 
 extern "C" volatile sig_atomic_t sigintReceived;
+#ifndef MIN
 #define MIN(x, y)	(((x) < (y)) ? (x) : (y))
+#endif
 
 class Utils {
 public:
 	static DWORD getCurrentMs(void);
+	static DWORD getCurrentUs(void);
 	static DWORD getEndTime(DWORD offsetFromNow);
 	static void  sleepMs(DWORD ms);
 	
@@ -8,11 +8,9 @@ CosmosEx.Screencast=function(c){
 	//var demoScreen = new AtariScreen(iCurrentRes, element, 'demo');
 	var demoScreen=null;
 	
-	var cnt=new Date().getTime()*10;
 	// ... Any screen manipulation goes here ...
 
-	var onLoad=function(e) {
-			var dv=new DataView(this.response);
+	var showFrame=function(dv) {
 			if( dv.byteLength==32033 ){
 				var iRes=dv.getInt8(0);
 				if( iRes!=iCurrentRes && dv.byteLength>0 ){
@@ -29,7 +27,34 @@ CosmosEx.Screencast=function(c){
 					demoScreen.Display();
 				}
 			}
-			dv=null;
+		};
+
+	// polling: device makes PNG of the frame once for all clients, ETag says which frame it is - the same frame comes back as just 304
+	var image=null;
+	var imageUrl=null;
+	var imageEtag=null;
+
+	var showImage=function(blob) {
+			if( image==null ){							// stream was shown before? replace its canvas
+				$("#demo_placeholder").html("");
+				demoScreen=null;
+				iCurrentRes=-1;
+				image=document.createElement('img');
+				element.appendChild(image);
+			}
+			var oldUrl=imageUrl;
+			imageUrl=URL.createObjectURL(blob);
+			image.src=imageUrl;
+			if( oldUrl!=null ){
+				URL.revokeObjectURL(oldUrl);
+			}
+		};
+
+	var onLoad=function(e) {
+			if( this.status==200 ){
+				imageEtag=this.getResponseHeader('ETag');
+				showImage(this.response);
+			}
 			if( config.reloadms>0 ){
 				setTimeout(loadScreen,config.reloadms);
 			}
@@ -42,16 +67,74 @@ CosmosEx.Screencast=function(c){
 		};
 	var loadScreen=function(){
 		var xhr = new XMLHttpRequest();
-		cnt++;
-		xhr.open('GET', '/app/screencast/getscreen?'+cnt, true);
-		xhr.responseType = 'arraybuffer';
+		xhr.open('GET', '/app/screencast/getimage', true);
+		xhr.responseType = 'blob';
+		if( imageEtag!=null ){
+			xhr.setRequestHeader('If-None-Match', imageEtag);
+		}
 		xhr.onerror = onError; 
 		xhr.onload = onLoad;
 		
 		xhr.send(null);
 	    xhr = null;
 	};
-	loadScreen();
+
+	// frames pushed over WebSocket when they change: zlib compressed resolution + keyframe or delta against previous frame
+	// (format in ce_main_app/service/screencastdelta.h), server paces them by how fast the socket takes them
+	var startStream=function(){
+		if( !window.WebSocket || !window.DecompressionStream ){
+			return false;
+		}
+		var frame=new Uint8Array(1+16*2+32000);		// resolution, palette, screen - the same as getscreen returns
+		var haveFrame=false;
+		var queue=Promise.resolve();
+		var ws=new WebSocket((location.protocol=='https:' ? 'wss://' : 'ws://')+location.host+'/app/screencast/stream?fps='+(config.fps || 25));
+		ws.binaryType='arraybuffer';
+
+		var inflate=function(data){
+			var stream=new Blob([data]).stream().pipeThrough(new DecompressionStream('deflate'));
+			return new Response(stream).arrayBuffer();
+		};
+		var apply=function(buf){
+			var b=new Uint8Array(buf);
+			var pos=5;
+			frame[0]=b[0];
+			if( b[2]&1 ){
+				frame.set(b.subarray(pos,pos+32),1);
+				pos+=32;
+			}
+			if( b[1]==0x4b ){							// 'K' - keyframe
+				frame.set(b.subarray(pos,pos+32000),33);
+				haveFrame=true;
+			} else {									// 'D' - runs of changed words
+				if( !haveFrame ){					// can't be - stream starts with keyframe; poll instead
+					ws.close();
+					return;
+				}
+				var word=0;
+				while( pos+4<=b.length ){
+					var skip=(b[pos]<<8)|b[pos+1], copy=(b[pos+2]<<8)|b[pos+3];
+					pos+=4;
+					word+=skip;
+					frame.set(b.subarray(pos,pos+copy*2),33+word*2);
+					pos+=copy*2;
+					word+=copy;
+				}
+			}
+			showFrame(new DataView(frame.buffer));
+		};
+		ws.onmessage=function(e){
+			queue=queue.then(function(){ return inflate(e.data); }).then(apply);
+		};
+		ws.onclose=function(){						// stream not there (or gone) - poll like before
+			setTimeout(loadScreen,config.reloadms>0 ? config.reloadms : 1000);
+		};
+		return true;
+	};
+
+	if( !startStream() ){
+		loadScreen();
+	}
 	return {
 		loadScreen:loadScreen
 	}
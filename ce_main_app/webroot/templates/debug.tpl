@@ -5,6 +5,10 @@ Download <a href="/app/debug/getconfig">config of your CosmosEx</a> device as te
 <br /><br />
 Download <a href="/app/debug/getlog">app log</a>.
 <br /><br />
+Download <a href="/app/debug/gettrace">binary trace</a> of the latest commands (decode it with ce_tracedecode).
+<br /><br />
+Show <a href="/app/debug/getikbdlatency">keyboard, mouse and joystick latency</a>. With log level ikbdlogs also <a href="/app/debug/getikbdrecord">IKBD recording</a> for replay is made.
+<br /><br />
 <label for="loglevel">Set log level</label>
 <select name="loglevel" id="setloglevel">
 <option value="">none</option>
@@ -7,6 +7,9 @@
 #include "statusreport.h"
 #include "../../../config/configstream.h"
 #include "../../../global.h"
+#include "../../../trace.h"
+#include "../../../ikbd/ikbdlatency.h"
+#include "../../../ikbd/ikbdrecord.h"
 
 DebugController::DebugController(ConfigService* pxDateService, FloppyService* pxFloppyService):pxDateService(pxDateService),pxFloppyService(pxFloppyService)
 {
@@ -73,6 +76,42 @@ bool DebugController::getlogAction(mg_connection *conn, mg_request_info *req_inf
     return getFile(conn, sDownloadedFileName, sFileType, sCeFilePath, false);
 }
 
+bool DebugController::gettraceAction(mg_connection *conn, mg_request_info *req_info)
+{
+    if(!Trace::dump(TRACE_DUMP_FILE)) {     // dump the trace ring now, decode it with ce_tracedecode
+        mg_printf(conn, "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+        return true;
+    }
+
+    std::string sDownloadedFileName = "ce_trace.bin";
+    std::string sFileType           = "application/octet-stream";
+    std::string sCeFilePath         = TRACE_DUMP_FILE;
+    
+    return getFile(conn, sDownloadedFileName, sFileType, sCeFilePath, true);
+}
+
+bool DebugController::getikbdlatencyAction(mg_connection *conn, mg_request_info *req_info)
+{
+    std::string sOutput;
+    ikbdLatency.toText(sOutput);
+
+    mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n");
+    mg_printf(conn, "Cache: no-cache\r\n");
+    mg_printf(conn, "Content-Length: %lu\r\n\r\n",(unsigned long)sOutput.length());
+    mg_write(conn, sOutput.c_str(), sOutput.length());
+    return true;
+}
+
+bool DebugController::getikbdrecordAction(mg_connection *conn, mg_request_info *req_info)
+{
+    std::string sDownloadedFileName = "ikbd_record.bin";
+    std::string sFileType           = "application/octet-stream";
+    std::string sCeFilePath         = IKBDREC_FILE;
+    
+    // don't send content length, file grows while recording
+    return getFile(conn, sDownloadedFileName, sFileType, sCeFilePath, false);
+}
+
 bool DebugController::getConfigAction(mg_connection *conn, mg_request_info *req_info)
 {
     std::string sDownloadedFileName = "ce_config.txt";
@@ -14,6 +14,9 @@ public:
     bool indexAction(mg_connection *conn, mg_request_info *req_info);
 
     bool getlogAction(mg_connection *conn, mg_request_info *req_info);
+    bool gettraceAction(mg_connection *conn, mg_request_info *req_info);
+    bool getikbdlatencyAction(mg_connection *conn, mg_request_info *req_info);
+    bool getikbdrecordAction(mg_connection *conn, mg_request_info *req_info);
     bool getConfigAction(mg_connection *conn, mg_request_info *req_info);
     bool action_get_ceconf_prg(mg_connection *conn, mg_request_info *req_info);
     bool action_get_ceconf_msa(mg_connection *conn, mg_request_info *req_info);
@@ -4,24 +4,40 @@
 #include <fstream>
 #include <streambuf>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 #include "version.h"
 
 #include "service/screencastservice.h"
+#include "../../websocket.h"
+#include "../../screencaststream.h"
+
+class CivetWebSocketConn: public IWebSocketConn
+{
+public:
+    CivetWebSocketConn(mg_connection *conn):conn(conn) { }
+    virtual int write(const void *bfr, int len) { return mg_write(conn, bfr, len); }
+    virtual int read(void *bfr, int len)        { return mg_read(conn, bfr, len);  }
+private:
+    mg_connection *conn;
+};
+
+// once per process - a new controller is made for each request
+DWORD ScreencastController::etagRun = ((DWORD) time(NULL)) ^ (((DWORD) getpid()) << 16);
 
 ScreencastController::ScreencastController(ScreencastService* pxScreencastService):pxScreencastService(pxScreencastService)
 {
-    pxPalette=new unsigned char[16*2];
-    pxScreen=new unsigned char[32000];
-    memset(pxPalette,0,32);
-    memset(pxScreen,0,32000);
+}
+
+void ScreencastController::makeEtag(char *etag, DWORD seq)
+{
+    sprintf(etag, "\"%08x-%u\"", etagRun, seq);
 }
 
 ScreencastController::~ScreencastController() 
 {
-    delete pxScreen;
-    delete pxPalette;
-    pxScreen=NULL;
-    pxPalette=NULL;
 }
 
 bool ScreencastController::getscreenAction(mg_connection *conn, mg_request_info *req_info) 
@@ -34,16 +50,13 @@ bool ScreencastController::getscreenAction(mg_connection *conn, mg_request_info
     //mg_printf(conn, sHeader.c_str());
     mg_printf(conn, "\r\n"); 
 	
-    unsigned char iResolution = pxScreencastService->getSTResolution();
-	mg_write(conn, &iResolution, 1);
+    const TScreencastFrame *frame = pxScreencastService->acquireFrame();     // written straight from the frame, no copy
 
-	//copy palette
-    pxScreencastService->getPalette(pxPalette);
-	mg_write(conn, pxPalette, 16*2);
+    mg_write(conn, &frame->resolution, 1);
+    mg_write(conn, frame->palette, 16*2);
+    mg_write(conn, frame->screen, 32000);
 
-	//copy screen
-    pxScreencastService->getScreen(pxScreen);
-	mg_write(conn, pxScreen, 32000);
+    pxScreencastService->releaseFrame(frame);
 	return true;	
 }
 
@@ -57,9 +70,71 @@ bool ScreencastController::getpaletteAction(mg_connection *conn, mg_request_info
     //mg_printf(conn, sHeader.c_str());
     mg_printf(conn, "\r\n"); 
 	
-	//copy palette
-    pxScreencastService->getPalette(pxPalette);
-    mg_write(conn, pxPalette, 16*2);
+    const TScreencastFrame *frame = pxScreencastService->acquireFrame();
+    mg_write(conn, frame->palette, 16*2);
+    pxScreencastService->releaseFrame(frame);
+
+	return true;	
+}
+
+// WebSocket, the worker thread stays here while the client watches: /app/screencast/stream?fps=25
+// At most SCSTREAM_MAX_CLIENTS at once, so the streams can't take all the workers - others get 503 and poll getimage.
+bool ScreencastController::streamAction(mg_connection *conn, mg_request_info *req_info) 
+{
+    const char *key = mg_get_header(conn, "Sec-WebSocket-Key");
+
+    if( key==NULL ){
+        mg_printf(conn, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+        return true;
+    }
 
+    if( !ScreencastStream::addClient() ){
+        mg_printf(conn, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+        return true;
+    }
+
+    int maxFps = SCSTREAM_DEFAULT_FPS;
+    char fps[8];
+    if( req_info->query_string!=NULL && mg_get_var(req_info->query_string, strlen(req_info->query_string), "fps", fps, sizeof(fps))>0 ){
+        maxFps = atoi(fps);
+    }
+
+    CivetWebSocketConn wsConn(conn);
+    if( WebSocket::writeHandshake(wsConn, key) ){
+        ScreencastStream stream(pxScreencastService, &wsConn, maxFps);
+        stream.run();
+    }
+
+    ScreencastStream::removeClient();
+	return true;	
+}
+
+// PNG of the newest frame; ETag is this run + frame seq, so a client which has it already gets just 304,
+// and one which has a frame from before restart gets the new one
+bool ScreencastController::getimageAction(mg_connection *conn, mg_request_info *req_info) 
+{
+    char etag[32];
+    const char *ifNoneMatch = mg_get_header(conn, "If-None-Match");
+
+    makeEtag(etag, pxScreencastService->getFrameSeq());
+    if( ifNoneMatch!=NULL && strcmp(ifNoneMatch, etag)==0 ){
+        mg_printf(conn, "HTTP/1.1 304 Not Modified\r\n");
+        mg_printf(conn, "ETag: %s\r\n", etag);
+        mg_printf(conn, "Cache-Control: no-cache\r\n");
+        mg_printf(conn, "\r\n");
+        return true;
+    }
+
+    std::vector<BYTE> png;
+    DWORD seq = pxScreencastService->getPng(png);
+    makeEtag(etag, seq);
+
+    mg_printf(conn, "HTTP/1.1 200 OK\r\n");
+    mg_printf(conn, "Content-Type: image/png\r\n");
+    mg_printf(conn, "Cache-Control: no-cache\r\n");       // may be kept, but must be revalidated - new frame comes any time
+    mg_printf(conn, "ETag: %s\r\n", etag);
+    mg_printf(conn, "Content-Length: %d\r\n", (int) png.size());
+    mg_printf(conn, "\r\n");
+    mg_write(conn, &png[0], png.size());
 	return true;	
 }
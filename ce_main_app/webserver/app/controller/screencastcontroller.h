@@ -12,10 +12,13 @@ public:
     virtual ~ScreencastController();
     bool getscreenAction(mg_connection *conn, mg_request_info *req_info);
     bool getpaletteAction(mg_connection *conn, mg_request_info *req_info);
+    bool streamAction(mg_connection *conn, mg_request_info *req_info);
+    bool getimageAction(mg_connection *conn, mg_request_info *req_info);
 private:
     ScreencastService* pxScreencastService;
-    unsigned char *pxScreen;
-    unsigned char *pxPalette;
+    static DWORD etagRun;                           // frame seq starts from 1 on each run, so ETag has this in front of it
+
+    void makeEtag(char *etag, DWORD seq);
 };
 
 #endif
@@ -53,6 +53,27 @@ bool ControllerRouter::handleGet(CivetServer *server, struct mg_connection *conn
         delete pxController;
         return processed;
     }
+    if( controllerAction=="debug/gettrace" )
+    {
+        DebugController *pxController=new DebugController(pxDateService,pxFloppyService);
+        bool processed=pxController->gettraceAction(conn,req_info);
+        delete pxController;
+        return processed;
+    }
+    if( controllerAction=="debug/getikbdlatency" )
+    {
+        DebugController *pxController=new DebugController(pxDateService,pxFloppyService);
+        bool processed=pxController->getikbdlatencyAction(conn,req_info);
+        delete pxController;
+        return processed;
+    }
+    if( controllerAction=="debug/getikbdrecord" )
+    {
+        DebugController *pxController=new DebugController(pxDateService,pxFloppyService);
+        bool processed=pxController->getikbdrecordAction(conn,req_info);
+        delete pxController;
+        return processed;
+    }
     if( controllerAction=="debug/getconfig" )
     {
         ConfigStream cs(CONFIGSTREAM_THROUGH_WEB);
@@ -145,6 +166,20 @@ bool ControllerRouter::handleGet(CivetServer *server, struct mg_connection *conn
         delete pxController;
         return processed;
     }
+    if( controllerAction=="screencast/stream" )
+    {
+        ScreencastController *pxController=new ScreencastController(pxScreencastService);
+        bool processed=pxController->streamAction(conn,req_info);
+        delete pxController;
+        return processed;
+    }
+    if( controllerAction=="screencast/getimage" )
+    {
+        ScreencastController *pxController=new ScreencastController(pxScreencastService);
+        bool processed=pxController->getimageAction(conn,req_info);
+        delete pxController;
+        return processed;
+    }
     return false;
 
     mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n");
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "screencaststream.h"
+#include "../debug.h"
+#include "../utils.h"
+
+volatile int ScreencastStream::clients = 0;
+
+ScreencastStream::ScreencastStream(ScreencastService *scs, IWebSocketConn *conn, int maxFps):scs(scs),conn(conn)
+{
+    if(maxFps < 1 || maxFps > SCSTREAM_MAX_FPS) {
+        maxFps = SCSTREAM_DEFAULT_FPS;
+    }
+    minIntervalUs = 1000000 / maxFps;
+
+    message     = new BYTE[1 + SCDELTA_MAX_PAYLOAD];
+    packedSize  = compressBound(1 + SCDELTA_MAX_PAYLOAD);
+    packed      = new BYTE[packedSize];
+
+    lastResolution  = -1;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.intervalUs = minIntervalUs;
+}
+
+ScreencastStream::~ScreencastStream()
+{
+    delete []message;
+    delete []packed;
+}
+
+bool ScreencastStream::addClient(void)
+{
+    if(__sync_add_and_fetch(&clients, 1) > SCSTREAM_MAX_CLIENTS) {
+        __sync_sub_and_fetch(&clients, 1);
+        return false;
+    }
+
+    return true;
+}
+
+void ScreencastStream::removeClient(void)
+{
+    __sync_sub_and_fetch(&clients, 1);
+}
+
+void ScreencastStream::run(void)
+{
+    DWORD lastSeq     = 0;
+    bool  first       = true;
+    DWORD lastSendUs  = Utils::getCurrentUs() - minIntervalUs;
+    DWORD lastWriteMs = Utils::getCurrentMs();
+
+    while(true) {
+        DWORD seq = scs->waitForFrame(lastSeq, 100);
+
+        if(seq == lastSeq && !first) {                  // nothing new
+            if(Utils::getCurrentMs() - lastWriteMs >= SCSTREAM_PING_MS) {
+                if(!WebSocket::writeMessage(*conn, WS_OPCODE_PING, NULL, 0)) {
+                    break;
+                }
+                lastWriteMs = Utils::getCurrentMs();
+            }
+            continue;
+        }
+
+        DWORD sinceUs = Utils::getCurrentUs() - lastSendUs;
+
+        if(sinceUs < stats.intervalUs) {                // too early, newer frame may come meanwhile and replace this one
+            usleep(MIN(stats.intervalUs - sinceUs, 20000));
+            continue;
+        }
+
+        const TScreencastFrame *frame = scs->acquireFrame();
+
+        if(!first && frame->seq - lastSeq > 1) {
+            stats.framesSkipped += frame->seq - lastSeq - 1;
+        }
+        lastSeq = frame->seq;
+        first   = false;
+
+        DWORD start = Utils::getCurrentUs();
+        bool  ok    = sendFrame(frame);
+        DWORD took  = Utils::getCurrentUs() - start;
+
+        scs->releaseFrame(frame);
+
+        if(!ok) {
+            break;
+        }
+
+        lastSendUs  = start;
+        lastWriteMs = Utils::getCurrentMs();
+
+        // blocked writes mean full socket buffer - slow down, speed up again slowly
+        DWORD want = MIN(took * 4, (DWORD) SCSTREAM_SLOWEST_US);
+        if(want < minIntervalUs) {
+            want = minIntervalUs;
+        }
+        stats.intervalUs = (stats.intervalUs * 3 + want) / 4;
+    }
+
+    Debug::out(LOG_DEBUG, "ScreencastStream - client gone after %d frames, %d bytes", stats.framesSent, stats.bytesSent);
+}
+
+bool ScreencastStream::sendFrame(const TScreencastFrame *frame)
+{
+    if(frame->resolution != lastResolution) {           // new resolution - keyframe with palette
+        encoder.reset();
+        lastResolution = frame->resolution;
+    }
+
+    message[0] = frame->resolution;
+    int len = 1 + encoder.encode(frame->screen, frame->palette, message + 1);
+
+    uLongf packedLen = packedSize;
+    if(compress2(packed, &packedLen, message, len, SCSTREAM_ZLIB_LEVEL) != Z_OK) {
+        Debug::out(LOG_ERROR, "ScreencastStream - compress2 failed");
+        return false;
+    }
+
+    if(!WebSocket::writeMessage(*conn, WS_OPCODE_BINARY, packed, packedLen)) {
+        return false;
+    }
+
+    stats.framesSent++;
+    stats.keyframes += (message[1] == SCDELTA_TYPE_KEYFRAME) ? 1 : 0;
+    stats.rawBytes  += len;
+    stats.bytesSent += packedLen + (packedLen < 126 ? 2 : (packedLen < 65536 ? 4 : 10));
+    return true;
+}
+
+void ScreencastStream::getStats(TScreencastStreamStats &st)
+{
+    st = stats;
+}
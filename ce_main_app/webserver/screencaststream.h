@@ -0,0 +1,61 @@
+#ifndef _SCREENCASTSTREAM_H_
+#define _SCREENCASTSTREAM_H_
+
+#include "../datatypes.h"
+#include "websocket.h"
+#include "service/screencastservice.h"
+#include "service/screencastdelta.h"
+
+#define SCSTREAM_DEFAULT_FPS        25
+#define SCSTREAM_MAX_FPS            50
+#define SCSTREAM_MAX_CLIENTS        4       // each stream holds a civetweb worker thread for as long as the client watches
+#define SCSTREAM_SLOWEST_US         1000000 // pacing never gets slower than this
+#define SCSTREAM_PING_MS            5000    // ping idle client this often, so we find out when it's gone
+#define SCSTREAM_ZLIB_LEVEL         1       // higher levels cost a lot of Pi CPU and save only a little on these frames
+
+typedef struct {
+    DWORD   framesSent;
+    DWORD   keyframes;
+    DWORD   framesSkipped;                  // published, but never sent - client (or pacing) was too slow for them
+    DWORD   bytesSent;                      // on the wire, with WebSocket headers
+    DWORD   rawBytes;                       // before compression
+    DWORD   intervalUs;                     // current pacing
+} TScreencastStreamStats;
+
+// Pushes frames to one WebSocket client, only when they change. Each binary message is zlib compressed
+// BYTE resolution + ScreencastDeltaEncoder payload (keyframe or delta against the previous sent frame, palette inline).
+// Nothing is read from the client - civetweb's mg_read() gives nothing after the upgrade, as our civetweb is built without
+// USE_WEBSOCKET. So the pacing comes only from the writes: when they block, the socket buffer is full and the client (or
+// the network) is slow, so frames are sent less often and the ones in between are skipped instead of queued.
+// A client which is gone is found by failed write - of a frame, or of a ping when the screen doesn't change.
+class ScreencastStream
+{
+public:
+    ScreencastStream(ScreencastService *scs, IWebSocketConn *conn, int maxFps=SCSTREAM_DEFAULT_FPS);
+    ~ScreencastStream();
+
+    void run(void);                         // returns when the client is gone
+    void getStats(TScreencastStreamStats &st);
+
+    static bool addClient(void);            // false when SCSTREAM_MAX_CLIENTS streams run already
+    static void removeClient(void);
+
+private:
+    ScreencastService       *scs;
+    IWebSocketConn          *conn;
+    ScreencastDeltaEncoder  encoder;
+
+    BYTE                    *message;
+    BYTE                    *packed;
+    DWORD                   packedSize;
+    int                     lastResolution;
+
+    DWORD                   minIntervalUs;
+    TScreencastStreamStats  stats;
+
+    static volatile int     clients;
+
+    bool sendFrame(const TScreencastFrame *frame);
+};
+
+#endif
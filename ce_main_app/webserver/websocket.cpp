@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "websocket.h"
+
+#define WS_GUID     "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+std::string WebSocket::acceptKey(const char *clientKey)
+{
+    std::string s = std::string(clientKey) + WS_GUID;
+
+    BYTE digest[20];
+    sha1((const BYTE *) s.c_str(), s.length(), digest);
+    return base64(digest, 20);
+}
+
+bool WebSocket::writeHandshake(IWebSocketConn &conn, const char *clientKey)
+{
+    std::string resp = "HTTP/1.1 101 Switching Protocols\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: " + acceptKey(clientKey) + "\r\n\r\n";
+
+    return conn.write(resp.c_str(), resp.length()) == (int) resp.length();
+}
+
+// server messages are never masked and always sent as one frame
+bool WebSocket::writeMessage(IWebSocketConn &conn, int opcode, const BYTE *data, int len)
+{
+    BYTE hdr[10];
+    int  hdrLen;
+
+    hdr[0] = 0x80 | (opcode & 0x0f);                    // FIN + opcode
+
+    if(len < 126) {
+        hdr[1] = len;
+        hdrLen = 2;
+    } else if(len < 65536) {
+        hdr[1] = 126;
+        hdr[2] = len >> 8;
+        hdr[3] = len;
+        hdrLen = 4;
+    } else {
+        hdr[1] = 127;
+        memset(hdr + 2, 0, 4);                          // we never send more than 4 GB
+        hdr[6] = len >> 24;
+        hdr[7] = len >> 16;
+        hdr[8] = len >>  8;
+        hdr[9] = len;
+        hdrLen = 10;
+    }
+
+    if(conn.write(hdr, hdrLen) != hdrLen) {
+        return false;
+    }
+
+    return len == 0 || conn.write(data, len) == len;
+}
+
+bool WebSocket::readAll(IWebSocketConn &conn, BYTE *bfr, int len)
+{
+    while(len > 0) {
+        int res = conn.read(bfr, len);
+
+        if(res <= 0) {
+            return false;
+        }
+
+        bfr += res;
+        len -= res;
+    }
+
+    return true;
+}
+
+// client frames are masked; fragmented messages are joined, pings are answered here
+int WebSocket::readMessage(IWebSocketConn &conn, std::vector<BYTE> &payload, DWORD maxLen)
+{
+    payload.clear();
+    int msgOpcode = -1;
+
+    while(true) {
+        BYTE hdr[2];
+        if(!readAll(conn, hdr, 2)) {
+            return -1;
+        }
+
+        bool fin    = (hdr[0] & 0x80) != 0;
+        int  opcode = hdr[0] & 0x0f;
+        bool masked = (hdr[1] & 0x80) != 0;
+        DWORD len   = hdr[1] & 0x7f;
+
+        if(len == 126) {
+            BYTE ext[2];
+            if(!readAll(conn, ext, 2)) {
+                return -1;
+            }
+            len = (ext[0] << 8) | ext[1];
+        } else if(len == 127) {
+            BYTE ext[8];
+            if(!readAll(conn, ext, 8)) {
+                return -1;
+            }
+            if(ext[0] | ext[1] | ext[2] | ext[3]) {     // more than 4 GB - certainly not for us
+                return -1;
+            }
+            len = (ext[4] << 24) | (ext[5] << 16) | (ext[6] << 8) | ext[7];
+        }
+
+        if(len > maxLen || payload.size() + len > maxLen) {
+            return -1;
+        }
+
+        BYTE mask[4] = {0, 0, 0, 0};
+        if(masked && !readAll(conn, mask, 4)) {
+            return -1;
+        }
+
+        size_t start = payload.size();                  // control frame payload goes there too, only till it's handled
+        payload.resize(start + len);
+        BYTE *data = payload.empty() ? NULL : &payload[0] + start;
+
+        if(len > 0 && !readAll(conn, data, len)) {
+            return -1;
+        }
+
+        for(DWORD i=0; i<len; i++) {
+            data[i] ^= mask[i & 3];
+        }
+
+        if(opcode >= WS_OPCODE_CLOSE) {                 // control frame - can come between fragments of a message
+            std::vector<BYTE> control(data, data + len);
+            payload.resize(start);
+
+            if(opcode == WS_OPCODE_PING) {
+                writeMessage(conn, WS_OPCODE_PONG, control.empty() ? NULL : &control[0], len);
+                continue;
+            }
+
+            if(opcode == WS_OPCODE_PONG) {
+                continue;
+            }
+
+            payload = control;
+            return opcode;
+        }
+
+        if(opcode != 0) {                               // first fragment (or the only one)
+            msgOpcode = opcode;
+        }
+
+        if(fin) {
+            return msgOpcode;
+        }
+    }
+}
+
+//--------------------------------------------------------
+static inline DWORD rotl(DWORD x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+void WebSocket::sha1(const BYTE *data, int len, BYTE digest[20])
+{
+    DWORD h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    std::vector<BYTE> msg(data, data + len);           // pad: 0x80, zeros, length in bits as 64 bit big endian
+    msg.push_back(0x80);
+    while((msg.size() % 64) != 56) {
+        msg.push_back(0);
+    }
+
+    unsigned long long bits = (unsigned long long) len * 8;
+    for(int i=7; i>=0; i--) {
+        msg.push_back((BYTE) (bits >> (i * 8)));
+    }
+
+    for(size_t chunk=0; chunk<msg.size(); chunk += 64) {
+        DWORD w[80];
+
+        for(int i=0; i<16; i++) {
+            const BYTE *p = &msg[chunk + i * 4];
+            w[i] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        }
+        for(int i=16; i<80; i++) {
+            w[i] = rotl(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+        }
+
+        DWORD a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+        for(int i=0; i<80; i++) {
+            DWORD f, k;
+
+            if(i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if(i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if(i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            DWORD tmp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = tmp;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for(int i=0; i<5; i++) {
+        digest[i*4 + 0] = h[i] >> 24;
+        digest[i*4 + 1] = h[i] >> 16;
+        digest[i*4 + 2] = h[i] >>  8;
+        digest[i*4 + 3] = h[i];
+    }
+}
+
+std::string WebSocket::base64(const BYTE *data, int len)
+{
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+
+    for(int i=0; i<len; i += 3) {
+        DWORD v = data[i] << 16;
+        if(i + 1 < len) v |= data[i + 1] << 8;
+        if(i + 2 < len) v |= data[i + 2];
+
+        out += chars[(v >> 18) & 0x3f];
+        out += chars[(v >> 12) & 0x3f];
+        out += (i + 1 < len) ? chars[(v >> 6) & 0x3f] : '=';
+        out += (i + 2 < len) ? chars[v & 0x3f]        : '=';
+    }
+
+    return out;
+}
@@ -0,0 +1,43 @@
+#ifndef _WEBSOCKET_H_
+#define _WEBSOCKET_H_
+
+#include <string>
+#include <vector>
+
+#include "../datatypes.h"
+
+#define WS_OPCODE_TEXT          0x1
+#define WS_OPCODE_BINARY        0x2
+#define WS_OPCODE_CLOSE         0x8
+#define WS_OPCODE_PING          0x9
+#define WS_OPCODE_PONG          0xa
+
+#define WS_MAX_INCOMING         4096        // longer messages from client are refused - we expect just short commands
+
+// Byte stream under the WebSocket - civetweb connection on the device, plain socket in tests.
+class IWebSocketConn
+{
+public:
+    virtual ~IWebSocketConn() { };
+    virtual int write(const void *bfr, int len) = 0;    // returns len, or <= 0 when the connection is gone
+    virtual int read(void *bfr, int len) = 0;           // blocks till something comes, <= 0 when the connection is gone
+};
+
+// RFC 6455 server side, done by hand because our civetweb libs are built without USE_WEBSOCKET: the request handler
+// answers the upgrade itself and then keeps the connection (and its worker thread) for as long as the client stays.
+class WebSocket
+{
+public:
+    static std::string acceptKey(const char *clientKey);                     // Sec-WebSocket-Accept for Sec-WebSocket-Key
+    static bool writeHandshake(IWebSocketConn &conn, const char *clientKey);
+    static bool writeMessage(IWebSocketConn &conn, int opcode, const BYTE *data, int len);
+    static int  readMessage(IWebSocketConn &conn, std::vector<BYTE> &payload, DWORD maxLen=WS_MAX_INCOMING); // returns opcode, -1 when gone or broken
+
+    static void sha1(const BYTE *data, int len, BYTE digest[20]);
+    static std::string base64(const BYTE *data, int len);
+
+private:
+    static bool readAll(IWebSocketConn &conn, BYTE *bfr, int len);
+};
+
+#endif
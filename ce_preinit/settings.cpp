@@ -8,6 +8,9 @@
 #include <stdlib.h>
 
 #define SETTINGS_PATH		"/ce/settings"
+#define SETTINGS_STORE		"/ce/settings/settings.store"   // written by ce_main_app, has all the settings
+#define SETTINGS_HEADER		"#CESETTINGS 1"
+#define SETTINGS_EXPORTED	"HW_"                           // ce_main_app writes these also to per-key files, and so do we
 
 #include "global.h"
 #include "debug.h"
@@ -15,6 +18,10 @@
 extern TFlags       flags;
 extern THwConfig    hwConfig;
 
+std::map<std::string, std::string>  Settings::storeValues;
+bool                                Settings::storeLoaded   = false;
+bool                                Settings::storeValid    = false;
+
 Settings::Settings(void)
 {
 	int res = mkdir(SETTINGS_PATH, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);		// mod: 0x775
@@ -37,12 +44,7 @@ void Settings::storeDefaultValues(void)
     char key[32];
     for(int id=0; id<8; id++) {							// read the list of device types from settings
         sprintf(key, "ACSI_DEVTYPE_%d", id);			// create settings KEY, e.g. ACSI_DEVTYPE_0
-		
-		if(id == 1) {									// ACSI id 0 enaled by defaul
-			setInt(key, DEVTYPE_TRANSLATED);
-		} else {										// other ACSI id's disabled
-			setInt(key, DEVTYPE_OFF);
-		}
+		setInt(key, defaultAcsiDevType(id));
 	}
 	
 	setChar((char *) "DRIVELETTER_FIRST",      'C');
@@ -231,7 +233,35 @@ void Settings::setChar(char *key, char value)
     fclose(file);
 }
 //-------------------------
+int Settings::defaultAcsiDevType(int id)
+{
+    if(id == 1) {                                       // ACSI id 1 enabled by default
+        return DEVTYPE_TRANSLATED;
+    }
+
+    return DEVTYPE_OFF;                                 // other ACSI id's disabled
+}
+
 void Settings::loadAcsiIDs(AcsiIDinfo *aii, bool useDefaultsIfNoSettings)
+{
+    fillAcsiIDs(aii, false);
+
+	// no ACSI ID was enabled? enable ACSI ID 0
+	if(!aii->gotDevTypeRaw && !aii->gotDevTypeTranslated && !aii->gotDevTypeSd) {
+        if(useDefaultsIfNoSettings) {
+            loadStore();
+
+            if(storeValid) {                            // only ce_main_app writes the store - use defaults now, it will store them
+                fillAcsiIDs(aii, true);
+            } else {                                    // if should use defaults if no settings found, store those defaults and call this function again
+                storeDefaultValues();
+                loadAcsiIDs(aii, false);                // ...but call this function without storing defaults next time - to avoid endless loop in some weird case
+            }
+        }     
+	}
+}
+
+void Settings::fillAcsiIDs(AcsiIDinfo *aii, bool useDefaultTypes)
 {
     aii->enabledIDbits = 0;									// no bits / IDs enabled yet
 
@@ -245,7 +275,7 @@ void Settings::loadAcsiIDs(AcsiIDinfo *aii, bool useDefaultsIfNoSettings)
     for(int id=0; id<8; id++) {							// read the list of device types from settings
         sprintf(key, "ACSI_DEVTYPE_%d", id);			// create settings KEY, e.g. ACSI_DEVTYPE_0
         
-		int devType = getInt(key, DEVTYPE_OFF);
+		int devType = useDefaultTypes ? defaultAcsiDevType(id) : getInt(key, DEVTYPE_OFF);
 
         if(devType < 0) {
             devType = DEVTYPE_OFF;
@@ -281,14 +311,6 @@ void Settings::loadAcsiIDs(AcsiIDinfo *aii, bool useDefaultsIfNoSettings)
 			aii->gotDevTypeTranslated = true;
 		}
     }
-
-	// no ACSI ID was enabled? enable ACSI ID 0
-	if(!aii->gotDevTypeRaw && !aii->gotDevTypeTranslated && !aii->gotDevTypeSd) {
-        if(useDefaultsIfNoSettings) {                   // if should use defaults if no settings found, store those defaults and call this function again
-            storeDefaultValues();
-            loadAcsiIDs(aii, false);                    // ...but call this function without storing defaults next time - to avoid endless loop in some weird case
-        }     
-	}
 }
 //-------------------------
 void Settings::loadFloppyConfig(FloppyConfig *fc)
@@ -305,8 +327,85 @@ void Settings::saveFloppyConfig(FloppyConfig *fc)
     setBool((char *)    "FLOPPYCONF_WRITEPROTECTED",    fc->writeProtected);
 }
 //-------------------------
+void Settings::loadStore(void)
+{
+    if(storeLoaded) {
+        return;
+    }
+    storeLoaded = true;
+
+    FILE *f = fopen(SETTINGS_STORE, "rt");
+    if(!f) {                                            // no store? ce_main_app didn't migrate the per-key files yet
+        return;
+    }
+
+    bool gotHeader = false;
+    char line[1024];
+
+    while(fgets(line, sizeof(line), f)) {
+        char *nl = strchr(line, '\n');
+        if(!nl) {                                       // file is cut, don't trust it
+            break;
+        }
+        *nl = 0;
+
+        if(!gotHeader) {
+            gotHeader = (strcmp(line, SETTINGS_HEADER) == 0);
+            if(!gotHeader) {
+                break;
+            }
+            continue;
+        }
+
+        int cnt;
+        if(sscanf(line, "#END %d", &cnt) == 1) {        // the store ends with count of settings in it
+            storeValid = (cnt == (int) storeValues.size());
+            break;
+        }
+
+        char *eq = strchr(line, '=');
+        if(!eq) {
+            break;
+        }
+        *eq = 0;
+
+        std::string value;                              // values are escaped: \\ and \n
+        for(char *p = eq + 1; *p; p++) {
+            if(*p == '\\' && p[1] != 0) {
+                p++;
+                value += (*p == 'n') ? '\n' : *p;
+            } else {
+                value += *p;
+            }
+        }
+
+        storeValues[line] = value;
+    }
+
+    fclose(f);
+
+    if(!storeValid) {
+        Debug::out(LOG_ERROR, "Settings: %s is not complete, using per-key files", SETTINGS_STORE);
+        storeValues.clear();
+    }
+}
+
 FILE *Settings::sOpen(char *key, bool readNotWrite)
 {
+    if(readNotWrite && strncmp(key, SETTINGS_EXPORTED, strlen(SETTINGS_EXPORTED)) != 0) {  // HW_ keys are read from per-key files, we write them there
+        loadStore();
+
+        if(storeValid) {                                // got the store? value from there, the per-key file would be an old one
+            std::map<std::string, std::string>::iterator it = storeValues.find(key);
+
+            if(it == storeValues.end() || it->second.empty()) {
+                return NULL;
+            }
+
+            return fmemopen((void *) it->second.c_str(), it->second.size(), "r");
+        }
+    }
+
 	char path[1024];
 	
 	strcpy(path, SETTINGS_PATH);
@@ -2,6 +2,8 @@
 #define _SETTINGS_H_
 
 #include <stdio.h>
+#include <string>
+#include <map>
 #include "datatypes.h"
 
 typedef struct {
@@ -21,6 +23,8 @@ typedef struct {
     bool writeProtected;
 } FloppyConfig;
 
+// ce_main_app keeps the settings in one store file (settings.store), only the HW_ keys are also written to per-key files.
+// Getters here read the store (once, then keep it in memory) and fall back to the per-key files if there is no store yet.
 class Settings 
 {
 public:
@@ -48,10 +52,17 @@ public:
     void saveFloppyConfig(FloppyConfig *fc);
 	
 private:
+    static std::map<std::string, std::string>   storeValues;
+    static bool storeLoaded;
+    static bool storeValid;
+
+    static void loadStore(void);
 
 	FILE *sOpen(char *key, bool readNotWrite);
 	
 	void storeDefaultValues(void);
+    void fillAcsiIDs(AcsiIDinfo *aii, bool useDefaultTypes);
+    static int defaultAcsiDevType(int id);
 };
 
 #endif
@@ -9,5 +9,6 @@
 #define TRAN_CMD_GETDATETIME        1
 #define TRAN_CMD_SENDSCREENCAST     2
 #define TRAN_CMD_SCREENCASTPALETTE  3
+#define TRAN_CMD_SENDSCREENCAST_DELTA   5   // keyframe or delta since previous frame, format in ce_main_app/service/screencastdelta.h
 // ...other commands are just function codes from gemdos.h
 
@@ -0,0 +1,209 @@
+// vim: tabstop=4 softtabstop=4 shiftwidth=4 expandtab
+// Host tool: decodes binary trace dumped by ce_main_app (Trace::dump()) into the same lines which Debug::out() writes.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+static std::vector<std::string> formats;
+
+static bool readAll(FILE *f, void *data, size_t len)
+{
+    return fread(data, 1, len, f) == len;
+}
+
+static const char *formatById(DWORD id)
+{
+    if(id >= formats.size()) {
+        return "(unknown)";
+    }
+
+    return formats[id].c_str();
+}
+
+// printf-like formatting, but args are the raw DWORDs from the event and %s arg is id of string in format table
+static std::string formatEvent(const TTraceEvent &ev)
+{
+    const char *f = formatById(ev.formatId);
+    std::string out;
+    int argIdx = 0;
+
+    while(*f) {
+        if(*f != '%') {
+            out += *f++;
+            continue;
+        }
+
+        if(f[1] == '%') {
+            out += '%';
+            f += 2;
+            continue;
+        }
+
+        std::string spec = "%";                         // flags, width and precision stay, length modifiers go
+        f++;
+        while(*f && strchr("-+ #0123456789.*", *f)) {
+            spec += *f++;
+        }
+        while(*f && strchr("hlLqjzt", *f)) {
+            f++;
+        }
+
+        char conv = *f;
+        if(conv == 0) {
+            break;
+        }
+        f++;
+
+        if(argIdx >= ev.argCount) {                     // more conversions than stored args
+            out += "?";
+            continue;
+        }
+
+        DWORD arg = ev.args[argIdx++];
+        char bfr[256];
+
+        switch(conv) {
+            case 'd': case 'i': case 'c':
+                spec += conv;
+                snprintf(bfr, sizeof(bfr), spec.c_str(), (int) arg);
+                break;
+
+            case 'u': case 'x': case 'X': case 'o':
+                spec += conv;
+                snprintf(bfr, sizeof(bfr), spec.c_str(), arg);
+                break;
+
+            case 's':
+                spec += conv;
+                snprintf(bfr, sizeof(bfr), spec.c_str(), formatById(arg));
+                break;
+
+            default:
+                snprintf(bfr, sizeof(bfr), "?");
+                break;
+        }
+
+        out += bfr;
+    }
+
+    return out;
+}
+
+// the same layout as Debug::outBfr() row
+static std::string formatBfrRow(const TTraceEvent &ev)
+{
+    const BYTE *b = (const BYTE *) ev.args;
+    char text[128];
+    int len = sprintf(text, "        ");
+
+    for(int j=0; j<16; j++) {
+        if(j < ev.argCount) {
+            len += sprintf(text + len, "%02x ", b[j]);
+        } else {
+            len += sprintf(text + len, "   ");
+        }
+    }
+
+    len += sprintf(text + len, "| ");
+
+    for(int j=0; j<ev.argCount; j++) {
+        char v = b[j];
+        text[len++] = (v >= 32 && v <= 126) ? v : '.';
+    }
+    text[len] = 0;
+
+    return text;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc != 2) {
+        printf("\nUsage: ce_tracedecode trace_dump_file > log.txt\n");
+        return 0;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if(!f) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        return 1;
+    }
+
+    TTraceDumpHeader hdr;
+    if(!readAll(f, &hdr, sizeof(hdr)) || memcmp(hdr.magic, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a trace dump\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+
+    formats.resize(hdr.formatCount);
+
+    for(DWORD i=0; i<hdr.formatCount; i++) {
+        BYTE entry[6];
+        WORD id, len;
+
+        if(!readAll(f, entry, 6)) {
+            fprintf(stderr, "Dump is cut in format table\n");
+            fclose(f);
+            return 1;
+        }
+
+        memcpy(&id,  &entry[0], 2);
+        memcpy(&len, &entry[4], 2);
+
+        std::string text(len, ' ');
+        if(len > 0 && !readAll(f, &text[0], len)) {
+            fprintf(stderr, "Dump is cut in format table\n");
+            fclose(f);
+            return 1;
+        }
+
+        if(id < formats.size()) {
+            formats[id] = text;
+        }
+    }
+
+    // wall clock of event = wall clock of dump - time between the event and the dump
+    long long dumpRealUs = ((long long) hdr.dumpSec * 1000000) + hdr.dumpUsec;
+    long long dumpMonoUs = (long long) hdr.dumpMs * 1000;
+
+    DWORD prevMs = 0;
+    bool  first  = true;
+
+    for(DWORD i=0; i<hdr.eventCount; i++) {
+        TTraceEvent ev;
+
+        if(!readAll(f, &ev, sizeof(ev))) {
+            fprintf(stderr, "Dump is cut after %u events\n", i);
+            break;
+        }
+
+        if(ev.formatId == TRACE_FMT_BFR_ROW) {
+            printf("%s\n", formatBfrRow(ev).c_str());
+            continue;
+        }
+
+        long long evMonoUs  = ((long long) ev.ms * 1000) + ev.us;
+        long long evRealUs  = dumpRealUs - (dumpMonoUs - evMonoUs);
+        time_t    evSec     = evRealUs / 1000000;
+        long      evUsec    = evRealUs % 1000000;
+
+        struct tm tm;
+        localtime_r(&evSec, &tm);
+
+        DWORD diff = first ? 0 : (ev.ms - prevMs);
+        prevMs = ev.ms;
+        first  = false;
+
+        printf("%08d %08d (%04d-%02d-%02d %02d:%02d:%02d.%06ld)\t%s\n", ev.ms, diff,
+               tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, evUsec,
+               formatEvent(ev).c_str());
+    }
+
+    fclose(f);
+    return 0;
+}
@@ -4,6 +4,8 @@
 
 #define NET_CMD_IDENTIFY                0x00
 
+#define NET_FEATURE_CONINFO_DELTA       0x01    // host features from NET_CMD_IDENTIFY: host knows NET_CMD_CN_UPDATE_INFO_DELTA
+
 // TCP functions
 #define NET_CMD_TCP_OPEN                0x10
 #define NET_CMD_TCP_CLOSE               0x11
@@ -34,6 +36,7 @@
 #define NET_CMD_CNGETS                  0x46
 
 #define NET_CMD_CN_UPDATE_INFO          0x47
+#define NET_CMD_CN_UPDATE_INFO_DELTA    0x48
 
 #define NET_CMD_CN_READ_DATA            0x4A
 #define NET_CMD_CN_GET_DATA_COUNT       0x4B
@@ -48,6 +51,8 @@
 
 #define NET_CMD_RESOLVE_GET_RESPONSE    0x55
 
+#define NET_SEND_BUFFER_SIZE    (128 * 1024)    // size of host's send buffer for each TCP connection
+
 #define RW_ALL_TRANSFERED   0       // return this is all the required data was read / written
 #define RW_PARTIAL_TRANSFER 1       // return this if not all of the required data was read / written
 
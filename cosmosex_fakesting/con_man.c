@@ -26,6 +26,15 @@
 // Functions used for sending / receiving stuff should SET it to true to force update before next socket info retrieval.
 BYTE forceNextUpdateConInfo;
 
+//--------------------------------------
+// update_con_info() asks host just for connections changed since conInfoGeneration, if host supports it
+static DWORD conInfoGeneration      = 0;        // 0 means we don't have anything, host will send all connections
+static BYTE  conInfoDeltaSupported  = TRUE;     // set to FALSE when host answers NET_CMD_CN_UPDATE_INFO_DELTA with generation 0
+
+static BYTE update_con_info_delta(void);        // returns FALSE if the old NET_CMD_CN_UPDATE_INFO should be used
+
+extern BYTE hostFeatures;
+
 //--------------------------------------
 
 extern  uint32  localIP;
@@ -33,7 +42,15 @@ extern  BYTE    FastRAMBuffer[];
 
 TConInfo conInfo[NET_HANDLES_COUNT];        // this holds info about each connection
 
+static BYTE charsPool     [CHARS_BUFFER_COUNT][CHARS_BUFFER_SIZE];  // CNget_char() buffers, shared by all the connections
+static BYTE charsPoolOwner[CHARS_BUFFER_COUNT];                     // slot using the buffer, or 0xff if free
+static BYTE charsPoolNext = 0;                                      // which buffer will be taken when none is free
+
+static BYTE *getCharsBuffer(int slot);
+static void releaseCharsBuffer(int slot);
+
 static void connection_send_block(BYTE netCmd, BYTE handle, WORD length, BYTE *buffer);
+static BYTE sendBufferHasSpace(int slot, int16 length);
 //--------------------------------------
 #define NO_CHANGE_W     0xfffe
 #define NO_CHANGE_DW    0xfffffffe
@@ -145,7 +162,7 @@ int16 CNget_char(int16 handle)
 
         if(hdIf.success && hdIf.statusByte == E_NORMAL) {       // success?
             ci->charsGot = pDmaBuffer[0];                       // store the new count of chars we got
-            memcpy(ci->chars, pDmaBuffer + 1, ci->charsGot);    // copy those bytes
+            memcpy(getCharsBuffer(slot), pDmaBuffer + 1, ci->charsGot);     // copy those bytes
         } else {                                                // fail?
             return E_NODATA;
         }
@@ -157,7 +174,7 @@ int16 CNget_char(int16 handle)
 
     forceNextUpdateConInfo = TRUE;              // force update_con_info() if asked to do it next time.
 
-    int value = ci->chars[ci->charsUsed];       // get the char
+    int value = charsPool[ci->charsBuffer][ci->charsUsed];  // get the char
     ci->charsUsed++;                            // update used count
     return value;                               // return that char
 }
@@ -459,10 +476,17 @@ void update_con_info(BYTE forceUpdate)
     }
     //---------------
 
+    // only hosts which say so in identify know the delta command - older ones wouldn't answer it at all
+    if((hostFeatures & NET_FEATURE_CONINFO_DELTA) && conInfoDeltaSupported && update_con_info_delta()) {    // got just the changes? done
+        return;
+    }
+
     // now do the real update
     commandShort[4] = NET_CMD_CN_UPDATE_INFO;                                // store function number
     commandShort[5] = 0;
 
+    memset(pDmaBuffer, 0, 512);                                             // older host sends less data, the rest should be zeros
+
     hdIf.cmd(ACSI_READ, commandShort, CMD_LENGTH_SHORT, pDmaBuffer, 1);   // send command to host over ACSI
 
     if(!hdIf.success || hdIf.statusByte != E_NORMAL) {                                                            // error?
@@ -477,13 +501,15 @@ void update_con_info(BYTE forceUpdate)
     DWORD   *pRHost             = (DWORD *) (pDmaBuffer + 224);                 // offset 224: 32 * 4 bytes - remote host
     WORD    *pRPort             = (WORD  *) (pDmaBuffer + 352);                 // offset 352: 32 * 2 bytes - remote port
     DWORD   *pBytesToReadIcmp   = (DWORD *) (pDmaBuffer + 416);                 // offset 416:  1 * 1 DWORD - bytes that can be read from ICMP socket(s)
+    BYTE    *pSendQueuedKb      = (BYTE  *) (pDmaBuffer + 424);                 // offset 424: 32 * 1 bytes - kB waiting in send buffer
 
-    for(i=0; i<MAX_HANDLE; i++) {                                               // retrieve all the data and fill the variables
+    for(i=0; i<NET_UPDATE_INFO_COUNT; i++) {                                    // retrieve all the data and fill the variables
         // retrieve and update internal vars
         TConInfo *ci = &conInfo[i];
 
         ci->bytesToRead         = (DWORD)   pBytesToRead[i];
         ci->tcpConnectionState  = (BYTE)    pConnStatus[i];
+        ci->sendQueuedKb        = (BYTE)    pSendQueuedKb[i];
 
         WORD  lPort = (WORD )   pLPort[i];
         DWORD rHost = (DWORD)   pRHost[i];
@@ -502,6 +528,64 @@ void update_con_info(BYTE forceUpdate)
     }
 }
 
+static BYTE update_con_info_delta(void)
+{
+    commandLong[ 5] = NET_CMD_CN_UPDATE_INFO_DELTA;                             // store function number
+    storeDword(commandLong + 6, conInfoGeneration);                             // generation we have, host will send only what changed since then
+    commandLong[10] = 0;
+
+    memset(pDmaBuffer, 0, 16);                                                  // old host doesn't know this command and doesn't send any data, so generation stays 0
+
+    hdIf.cmd(ACSI_READ, commandLong, CMD_LENGTH_LONG, pDmaBuffer, 1);          // send command to host over ACSI
+
+    if(!hdIf.success || hdIf.statusByte != E_NORMAL) {                          // error? try the old command this time
+        return FALSE;
+    }
+
+    DWORD generation = getDword(pDmaBuffer);                                    // offset  0: generation of this info
+
+    if(generation == 0) {                                                       // host doesn't support this, use full update from now on
+        conInfoDeltaSupported = FALSE;
+        return FALSE;
+    }
+
+    int   count             = pDmaBuffer[4];                                    // offset  4: count of changed connections
+    BYTE  more              = pDmaBuffer[6];                                    // offset  6: not all changes fit, ask again
+    DWORD bytesToReadIcmp   = getDword(pDmaBuffer + 8);                         // offset  8: bytes that can be read from ICMP socket(s)
+    BYTE *pEntry            = pDmaBuffer + 16;                                  // offset 16: 15 bytes for each changed connection
+
+    int i;
+    for(i=0; i<count; i++) {
+        int slot = pEntry[0];
+
+        if(slot < NET_HANDLES_COUNT) {
+            TConInfo *ci = &conInfo[slot];
+
+            ci->tcpConnectionState  = pEntry[1];
+            ci->bytesToRead         = getDword(pEntry + 2);
+            ci->sendQueuedKb        = pEntry[14];
+
+            // Update      : local port, remote port, remote host, status
+            // Don't update: protocol, local host
+            setCIB((BYTE *) &ci->cib, NO_CHANGE_W, getWord(pEntry + 10), getWord(pEntry + 12), getDword(pEntry + 6), NO_CHANGE_DW, 0);
+        }
+
+        pEntry += 15;
+    }
+
+    conInfoGeneration = generation;                                             // send this next time
+
+    if(bytesToReadIcmp > 0) {                                                   // if we have something for ICMP to process?
+        icmp_processData(bytesToReadIcmp);
+    }
+
+    if(more) {                                                                  // host has more changes? get them now
+        return update_con_info_delta();
+    }
+
+    return TRUE;
+}
+
 //-------------------------------------------------------------------------------
 
 int16 connection_open(int tcpNotUdp, uint32 rem_host, uint16 rem_port, uint16 tos, uint16 buff_size)
@@ -587,7 +671,7 @@ int16 connection_open(int tcpNotUdp, uint32 rem_host, uint16 rem_port, uint16 to
         return netHandle;                           // return the new handle
     }
 
-    // it's not a CE handle
+    // it's not a CE handle - handles above 0x7f are checked above, so only error codes get here
     return extendByteToWord(hdIf.statusByte);       // extend the BYTE error code to WORD
 }
 
@@ -636,6 +720,15 @@ int16 connection_send(int tcpNotUdp, int16 handle, void *buffer, int16 length)
         if(length > conInfo[slot].buff_size) {      // ...and trying to send more than specified buffer size in TCP_open(), fail
             return E_OBUFFULL;
         }
+
+        // host would refuse data which doesn't fit into its send buffer, so don't transfer it for nothing
+        if(!sendBufferHasSpace(slot, length)) {     // according to last info it doesn't fit? get fresh info and check again
+            update_con_info(TRUE);
+
+            if(!sendBufferHasSpace(slot, length)) {
+                return E_OBUFFULL;
+            }
+        }
     }
 
     // first store command code
@@ -675,6 +768,13 @@ int16 connection_send(int tcpNotUdp, int16 handle, void *buffer, int16 length)
     return extendByteToWord(hdIf.statusByte);           // return the status, possibly extended to int16
 }
 
+static BYTE sendBufferHasSpace(int slot, int16 length)
+{
+    DWORD queued = ((DWORD) conInfo[slot].sendQueuedKb) * 1024;    // host rounds it up, so this is never less than real count
+
+    return ((queued + (WORD) length) <= NET_SEND_BUFFER_SIZE);
+}
+
 void connection_send_block(BYTE netCmd, BYTE handle, WORD length, BYTE *buffer)
 {
     commandLong[5] = netCmd;                        // store command code
@@ -741,20 +841,17 @@ int16 resolve (char *domain, char **real_domain, uint32 *ip_list, int16 ip_num)
     DWORD end = getTicks() + 10 * 200;                                  // 10 second timeout
 
     while(1) {                                                          // repeat this command few times, as it might reply with 'I didn't finish yet'
-        sleepMs(250);                                               // wait 250 ms before trying again
-        if(getTicks() >= end) {                                         // if timeout
-            return E_CANTRESOLVE;
-        }
-
-        hdIf.cmd(ACSI_READ, commandShort, CMD_LENGTH_SHORT, pDmaBuffer, 1);
+        hdIf.cmd(ACSI_READ, commandShort, CMD_LENGTH_SHORT, pDmaBuffer, 1);   // ask right away, cached names are answered immediately
 
         if(hdIf.statusByte == E_NORMAL) {                               // if finished, continue after loop
             break;
         }
 
-        if(hdIf.statusByte == RES_DIDNT_FINISH_YET) {                   // if not finished, try again
-            continue;
+        if(getTicks() >= end) {                                         // if timeout
+            return E_CANTRESOLVE;
         }
+
+        sleepMs(250);                                                   // not finished (or failed)? wait 250 ms before trying again
     }
 
     // now copy the list of IPs to ip_list
@@ -788,7 +885,7 @@ int16 resolve (char *domain, char **real_domain, uint32 *ip_list, int16 ip_num)
 //-------------------------------------------------------------------------------
 static void initConInfoStruct(int i)
 {
-    if(i >= MAX_HANDLE) {
+    if(i >= NET_HANDLES_COUNT) {
         return;
     }
 
@@ -796,21 +893,74 @@ static void initConInfoStruct(int i)
 
     ci->bytesToRead          = 0;
     ci->tcpConnectionState   = TCLOSED;
+    ci->sendQueuedKb         = 0;
     ci->charsUsed            = 0;
     ci->charsGot             = 0;
     setCIB((BYTE *) &ci->cib, 0, 0, 0, 0, 0, 0);    // clear the CIB structure
-    memset(ci->chars, 0, READ_BUFFER_SIZE);
+    releaseCharsBuffer(i);
+
+    conInfoGeneration = 0;                          // we've changed local info, get all the connections on next update
 }
 //-------------------------------------------------------------------------------
 void init_con_info(void)
 {
     int i;
 
-    for(i=0; i<MAX_HANDLE; i++) {
+    for(i=0; i<CHARS_BUFFER_COUNT; i++) {
+        charsPoolOwner[i] = 0xff;
+    }
+
+    for(i=0; i<NET_HANDLES_COUNT; i++) {
+        conInfo[i].charsBuffer = CHARS_BUFFER_NONE;
         initConInfoStruct(i);
     }
 }
 //-------------------------------------------------------------------------------
+// Get the CNget_char() buffer for this slot. If all the buffers are used, take one from other slot - that slot
+// just forgets the chars it got, but keeps charsUsed, so on its next command the host removes only the used chars
+// and the rest will be peeked again.
+static BYTE *getCharsBuffer(int slot)
+{
+    TConInfo *ci = &conInfo[slot];
+
+    if(ci->charsBuffer != CHARS_BUFFER_NONE) {      // already have a buffer? use it
+        return charsPool[ci->charsBuffer];
+    }
+
+    int i;
+    int index = -1;
+
+    for(i=0; i<CHARS_BUFFER_COUNT; i++) {           // find a free buffer
+        if(charsPoolOwner[i] == 0xff) {
+            index = i;
+            break;
+        }
+    }
+
+    if(index == -1) {                               // no free buffer? take the next one from its owner
+        index = charsPoolNext;
+        charsPoolNext = (charsPoolNext + 1) % CHARS_BUFFER_COUNT;
+
+        TConInfo *owner = &conInfo[charsPoolOwner[index]];
+        owner->charsGot     = 0;                    // owner will have to get the chars again, charsUsed stays
+        owner->charsBuffer  = CHARS_BUFFER_NONE;
+    }
+
+    charsPoolOwner[index]   = slot;
+    ci->charsBuffer         = index;
+    return charsPool[index];
+}
+//-------------------------------------------------------------------------------
+static void releaseCharsBuffer(int slot)
+{
+    TConInfo *ci = &conInfo[slot];
+
+    if(ci->charsBuffer != CHARS_BUFFER_NONE) {
+        charsPoolOwner[ci->charsBuffer] = 0xff;
+        ci->charsBuffer = CHARS_BUFFER_NONE;
+    }
+}
+//-------------------------------------------------------------------------------
 void setCIB(BYTE *cib, WORD protocol, WORD lPort, WORD rPort, DWORD rHost, DWORD lHost, WORD status)
 {
     // first create pointers to the right addresses
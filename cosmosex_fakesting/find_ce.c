@@ -28,6 +28,7 @@ BYTE machine;
 
 extern DWORD localIP;
 extern WORD  requiredVersion;
+extern BYTE  hostFeatures;
 //--------------------------------------------------
 
 BYTE findDevice(void)
@@ -107,7 +108,7 @@ BYTE findCE(BYTE hddIf)
 //--------------------------------------------------
 BYTE ce_identify(BYTE id, BYTE hddIf)
 {
-    BYTE cmd[] = {0, 'C', 'E', HOSTMOD_NETWORK_ADAPTER, NET_CMD_IDENTIFY, 0};
+    BYTE cmd[] = {0, 'C', 'E', HOSTMOD_NETWORK_ADAPTER, NET_CMD_IDENTIFY, NET_HANDLES_COUNT};     // tell host how many handles we know, older hosts ignore it
 
     cmd[0] = (id << 5);                             // cmd[0] = ACSI_id + TEST UNIT READY (0)
     memset(pDmaBuffer, 0, 512);                      // clear the buffer
@@ -126,6 +127,7 @@ BYTE ce_identify(BYTE id, BYTE hddIf)
     // if we got here, then this ACSI ID is the CosmosEx network module, so get the configuration (which starts from 32nd byte)
     requiredVersion = getWord (pDmaBuffer + 32);
     localIP         = getDword(pDmaBuffer + 34);
+    hostFeatures    = pDmaBuffer[38];               // older host doesn't send it, the buffer was cleared
 
     //----------------
 
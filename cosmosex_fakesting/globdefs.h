@@ -519,7 +519,8 @@ Error return values:
 // if sign bit is set, extend the sign to whole WORD
 #define extendByteToWord(X)    ( ((X & 0x80)==0) ? X : (0xff00 | X) )
 
-#define NET_HANDLES_COUNT       32
+#define NET_HANDLES_COUNT       128             // handles 0x50 .. 0xcf, host is told this in NET_CMD_IDENTIFY - each costs a TConInfo (32 B)
+#define NET_UPDATE_INFO_COUNT   32              // connections in NET_CMD_CN_UPDATE_INFO reply - its layout is fixed
 #define NET_STARTING_HANDLE     0x50
 
 #define network_handleIsValid(X)    ((X >= NET_STARTING_HANDLE) && (X < (NET_STARTING_HANDLE + NET_HANDLES_COUNT)))
@@ -538,7 +539,11 @@ Error return values:
     #define DWORD 	uint32_t
 #endif
 
-#define READ_BUFFER_SIZE    512
+// CNget_char() buffers are not in TConInfo, but in a small pool shared by all the handles - only few apps read by chars,
+// and host just peeks these chars (removes them on the next command), so a buffer can be taken from other handle any time
+#define CHARS_BUFFER_SIZE   256             // host sends max 250 chars
+#define CHARS_BUFFER_COUNT  8
+#define CHARS_BUFFER_NONE   0xff
 
 typedef struct {
     CIB     cib;                            // connection information block
@@ -546,10 +551,11 @@ typedef struct {
     BYTE    tcpConnectionState;             // TCP connection states -- TCLOSED, TLISTEN, ...
     DWORD   buff_size;                      // send buffer size, valid only for TCP
     BYTE    activeNotPassive;               // zero for passive (incomming) connection, non-zero for active (outgoing) connection
+    BYTE    sendQueuedKb;                   // kB of data waiting in host's send buffer, valid only for TCP
 
     BYTE charsUsed;                         // how many chars from this buffer was used by CNget_char()
     BYTE charsGot;                          // how many chars we have
-    BYTE chars[READ_BUFFER_SIZE];
+    BYTE charsBuffer;                       // index of buffer in chars pool, or CHARS_BUFFER_NONE
 } TConInfo;
 
 /*--------------------------------------------------------------------------*/
@@ -58,6 +58,7 @@ BYTE *pDmaBuffer;
 
 DWORD localIP;
 WORD  requiredVersion;
+BYTE  hostFeatures;                     // NET_FEATURE_* bits from identify - 0 from older hosts
 
 void initJumpTable(void);
 
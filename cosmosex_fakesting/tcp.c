@@ -24,7 +24,7 @@
 
 //---------------------
 
-extern TConInfo conInfo[MAX_HANDLE];                   // this holds info about each connection
+extern TConInfo conInfo[NET_HANDLES_COUNT];            // this holds info about each connection
 
 int tcpUdpGotSomeConnection(void);                      // return TRUE if there is a valid connection (in or out), return FALSE otherwise
 
@@ -114,7 +114,7 @@ int16 TCP_info(int16 handle, TCPIB *tcp_info)
 int tcpUdpGotSomeConnection(void)                // return TRUE if there is a valid connection (in or out), return FALSE otherwise
 {
     int i;
-    for(i=0; i<MAX_HANDLE; i++) {
+    for(i=0; i<NET_HANDLES_COUNT; i++) {
         if(conInfo[i].tcpConnectionState != TCLOSED) {  // if found a connection, which is not closed, return TRUE
             return TRUE;
         }